@@ -9,6 +9,43 @@
 #define false 0
 #define true 1
 
+/*
+ * BEGIN of ufdt_node_pool methods
+ */
+
+/*
+ * Creates an empty pool with one reference.
+ *
+ * @return: a pointer to the pool or
+ *          NULL if dto_malloc failed
+ */
+struct ufdt_node_pool *ufdt_node_pool_construct();
+
+/*
+ * Takes another reference to the pool, e.g. for an overlay tree whose nodes
+ * are merged into the main tree.
+ */
+struct ufdt_node_pool *ufdt_node_pool_get(struct ufdt_node_pool *pool);
+
+/*
+ * Drops a reference, the last one frees every block of the pool.
+ */
+void ufdt_node_pool_put(struct ufdt_node_pool *pool);
+
+/*
+ * Allocates size bytes aligned to 8 from the pool.
+ *
+ * @return: a pointer to the space or
+ *          NULL if dto_malloc failed
+ *
+ * @Time: O(1)
+ */
+void *ufdt_node_pool_alloc(struct ufdt_node_pool *pool, size_t size);
+
+/*
+ * END of ufdt_node_pool methods
+ */
+
 /*
  * BEGIN of ufdt_node_dict methods
  * Since in the current implementation, it's actually a hash table.
@@ -18,14 +55,16 @@
 
 /*
  * Allocates some new spaces and creates a new ufdt_node_dict.
+ * The tables are allocated from pool, or with dto_malloc if pool is NULL.
  *
  * @return: a pointer to the newly created ufdt_node_dict or
  *          NULL if dto_malloc failed
  */
-struct ufdt_node_dict ufdt_node_dict_construct();
+struct ufdt_node_dict ufdt_node_dict_construct(struct ufdt_node_pool *pool);
 
 /*
  * Frees all space dto_malloced, not including ufdt_nodes in the table.
+ * Tables allocated from a pool are left to the pool.
  */
 void ufdt_node_dict_destruct(struct ufdt_node_dict *dict);
 
@@ -90,16 +129,19 @@ void ufdt_node_dict_print(struct ufdt_node_dict *dict);
  * Allocates spaces for new ufdt_node who represents a fdt node at fdt_tag_ptr.
  * In order to get name pointer, it's neccassary to give the pointer to the
  * entire fdt it belongs to.
+ * The node is allocated from pool, or with dto_malloc if pool is NULL.
  *
  *
  * @return: a pointer to the newly created ufdt_node or
  *          NULL if dto_malloc failed
  */
-struct ufdt_node *ufdt_node_construct(void *fdtp, fdt32_t *fdt_tag_ptr);
+struct ufdt_node *ufdt_node_construct(void *fdtp, fdt32_t *fdt_tag_ptr,
+                                      struct ufdt_node_pool *pool);
 
 /*
  * Frees all nodes in the subtree rooted at *node.
  * Also dto_frees those ufdt_node_dicts in each node.
+ * Only for nodes constructed without a pool.
  */
 void ufdt_node_destruct(struct ufdt_node *node);
 
@@ -211,16 +253,19 @@ uint32_t ufdt_node_get_phandle(const struct ufdt_node *node);
 /*
  * Constructs a ufdt whose base fdt is fdtp.
  * Note that this function doesn't construct the entire tree.
- * To get the whole tree please call `fdt_to_ufdt(fdtp, fdt_size)`
+ * To get the whole tree please call `fdt_to_ufdt(fdtp, fdt_size, pool)`
+ * The nodes of the tree are allocated from pool, which is shared with the
+ * caller, or from a new pool if pool is NULL.
  *
  * @return: an empty ufdt with base fdtp = fdtp
  */
-struct ufdt *ufdt_construct(void *fdtp);
+struct ufdt *ufdt_construct(void *fdtp, struct ufdt_node_pool *pool);
 
 /*
  * Frees the space occupied by the ufdt, including all ufdt_nodes and
  * ufdt_node_dicts along
  * with static_phandle_table.
+ * The nodes go with the pool, when no other ufdt shares it.
  */
 void ufdt_destruct(struct ufdt *tree);
 
@@ -334,13 +379,16 @@ int merge_ufdt_into(struct ufdt_node *tree_a, struct ufdt_node *tree_b);
  * This including build all ufdt_nodes and ufdt_node_dicts, and builds the
  * phandle table as
  * well.
+ * Nodes are allocated from pool as in ufdt_construct(). An overlay tree
+ * should share the pool of the main tree it is merged into.
  *
  * @return: the ufdt T representing fdtp or
  *          T with T.fdtp == NULL if fdtp is unvalid.
  *
  * @Time: O(fdt_size + nlogn) where n = # of nodes in fdt.
  */
-struct ufdt *fdt_to_ufdt(void *fdtp, size_t fdt_size);
+struct ufdt *fdt_to_ufdt(void *fdtp, size_t fdt_size,
+                         struct ufdt_node_pool *pool);
 
 /*
  * Sequentially dumps the tree rooted at *node to FDT buffer fdtp.
@@ -432,4 +480,6 @@ void ufdt_node_map(struct ufdt_node *node, struct ufdt_node_closure closure);
 void ufdt_map(struct ufdt *tree, struct ufdt_node_closure closure);
 
 struct static_phandle_table build_phandle_table(struct ufdt *tree);
+
+int phandle_table_entry_cmp(const void *pa, const void *pb);
 #endif /* LIBUFDT_H */
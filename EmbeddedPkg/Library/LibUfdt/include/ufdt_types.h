@@ -49,10 +49,29 @@ struct ufdt_node {
   struct ufdt_node *sibling;
 };
 
+/*
+ * Bump allocator the nodes and dict tables of a ufdt are carved from.
+ * Nothing is freed on its own, all blocks are released together once the
+ * last ufdt using the pool is destructed.
+ */
+#define UFDT_NODE_POOL_BLOCK_SIZE (64 * 1024)
+
+struct ufdt_node_pool_block {
+  struct ufdt_node_pool_block *next;
+};
+
+struct ufdt_node_pool {
+  struct ufdt_node_pool_block *blocks;
+  char *cur;
+  size_t left;
+  int refs;
+};
+
 struct ufdt_node_dict {
   int mem_size;
   int num_used;
   struct ufdt_node **nodes;
+  struct ufdt_node_pool *pool;
 };
 
 struct fdt_prop_ufdt_node {
@@ -80,6 +99,7 @@ struct ufdt {
   void *fdtp;
   struct ufdt_node *root;
   struct static_phandle_table phandle_table;
+  struct ufdt_node_pool *pool;
 };
 
 typedef void func_on_ufdt_node(struct ufdt_node *, void *);
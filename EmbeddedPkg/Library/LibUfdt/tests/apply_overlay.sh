@@ -4,7 +4,7 @@ PROG_NAME=`basename $0`
 
 function usage() {
   echo "Usage:"
-  echo "  $PROG_NAME (--fdt|--ufdt) <Base DTS> <Overlay DTS> <Output DTS>"
+  echo "  $PROG_NAME (--fdt|--ufdt) <Base DTS> <Overlay DTS>... <Output DTS>"
 }
 
 function on_exit() {
@@ -33,8 +33,9 @@ if [[ $# -lt 3 ]]; then
 fi
 
 BASE_DTS=$1
-OVERLAY_DTS=$2
-OUT_DTS=$3
+shift
+OVERLAY_DTS_LIST=("${@:1:$#-1}")
+OUT_DTS="${@: -1}"
 
 TEMP_DIR=`mktemp -d`
 # The script will exit directly if any command fails.
@@ -47,14 +48,27 @@ BASE_DTB="$TEMP_DIR/${BASE_DTS_NAME}-base.dtb"
 dtc -@ -qq -O dtb -o "$BASE_DTB" "$BASE_DTS"
 
 # Compile the *-overlay.dts to make *-overlay.dtb
-OVERLAY_DTS_NAME=`basename "$OVERLAY_DTS"`
-OVERLAY_DTB="$TEMP_DIR/${OVERLAY_DTS_NAME}-overlay.dtb"
-dtc -@ -qq -O dtb -o "$OVERLAY_DTB" "$OVERLAY_DTS"
+OVERLAY_DTB_LIST=()
+for OVERLAY_DTS in "${OVERLAY_DTS_LIST[@]}"; do
+  OVERLAY_DTS_NAME=`basename "$OVERLAY_DTS"`
+  OVERLAY_DTB="$TEMP_DIR/${OVERLAY_DTS_NAME}-overlay.dtb"
+  dtc -@ -qq -O dtb -o "$OVERLAY_DTB" "$OVERLAY_DTS"
+  OVERLAY_DTB_LIST+=("$OVERLAY_DTB")
+done
 
-# Run ufdt_apply_overlay to combine *-base.dtb and *-overlay.dtb
-# into *-merged.dtb
+# Combine *-base.dtb and *-overlay.dtb into *-merged.dtb
 MERGED_DTB="$TEMP_DIR/${BASE_DTS_NAME}-merged.dtb"
-"$OVERLAY" "$BASE_DTB" "$OVERLAY_DTB" "$MERGED_DTB"
+if [ "$OVERLAY" == "ufdt_apply_overlay" ]; then
+  # ufdt_apply_overlay takes all overlays at once
+  "$OVERLAY" "$BASE_DTB" "${OVERLAY_DTB_LIST[@]}" "$MERGED_DTB"
+else
+  # fdt_apply_overlay applies one overlay at a time
+  cp "$BASE_DTB" "$MERGED_DTB"
+  for OVERLAY_DTB in "${OVERLAY_DTB_LIST[@]}"; do
+    "$OVERLAY" "$MERGED_DTB" "$OVERLAY_DTB" "$MERGED_DTB.next"
+    mv "$MERGED_DTB.next" "$MERGED_DTB"
+  done
+fi
 
 # Dump
 dtc -s -O dts -o "$OUT_DTS" "$MERGED_DTB"
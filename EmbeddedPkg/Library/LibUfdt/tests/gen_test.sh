@@ -31,12 +31,17 @@ trap on_exit EXIT
 TESTCASE_NAME=$1
 BASE_DTS="$IN_DATA_DIR/${TESTCASE_NAME}-base.dts"
 OVERLAY_DTS="$IN_DATA_DIR/${TESTCASE_NAME}-overlay.dts"
+# Further overlays applied on top, optional
+OVERLAY_DTS_LIST=("$OVERLAY_DTS")
+for EXTRA_DTS in "$IN_DATA_DIR/${TESTCASE_NAME}"-overlay[0-9].dts; do
+  [ -f "$EXTRA_DTS" ] && OVERLAY_DTS_LIST+=("$EXTRA_DTS")
+done
 REF_MERGED_DTS="$TEMP_DIR/${TESTCASE_NAME}-ref-merged.dts"
 OVL_MERGED_DTS="$TEMP_DIR/${TESTCASE_NAME}-ovl-merged.dts"
 
 #
 # Complie and diff
 #
-$SCRIPT_DIR/apply_overlay.sh --fdt "$BASE_DTS" "$OVERLAY_DTS" "$REF_MERGED_DTS"
-$SCRIPT_DIR/apply_overlay.sh --ufdt "$BASE_DTS" "$OVERLAY_DTS" "$OVL_MERGED_DTS"
+$SCRIPT_DIR/apply_overlay.sh --fdt "$BASE_DTS" "${OVERLAY_DTS_LIST[@]}" "$REF_MERGED_DTS"
+$SCRIPT_DIR/apply_overlay.sh --ufdt "$BASE_DTS" "${OVERLAY_DTS_LIST[@]}" "$OVL_MERGED_DTS"
 dts_diff "$REF_MERGED_DTS" "$OVL_MERGED_DTS"
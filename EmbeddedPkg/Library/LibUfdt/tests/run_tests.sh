@@ -11,6 +11,7 @@ source ${SCRIPT_DIR}/common.sh
 #       - ./testdata/${filename}.base_dts
 #       - ./testdata/${filename}.add_dts
 #       - ./testdata/${filename}.add_ov_dts (optional)
+#       - ./testdata/${filename}-overlay[0-9].dts (optional, applied in order)
 #     For more details, check ./gen_test.sh.
 #   description: a description message to be displayed in the terminal
 run_test_case() {
@@ -56,6 +57,9 @@ main() {
   run_test_case \
     "overlay_2_layers" \
     "Run test about dealing with overlay deep tree"
+  run_test_case \
+    "multi_overlay" \
+    "Run test about applying several overlays with phandle update"
   # looks that libfdt doesn't promise the order, the order isn't matched.
   run_test_case \
     "node_ordering" \
@@ -10,11 +10,14 @@
 
 int apply_ovleray_files(const char *out_filename,
                         const char *base_filename,
-                        const char *overlay_filename) {
+                        const char **overlay_filenames,
+                        int overlay_count) {
   int ret = 1;
   char *base_buf = NULL;
-  char *overlay_buf = NULL;
+  char **overlay_bufs = NULL;
+  struct fdt_entry_node *overlay_list = NULL;
   struct fdt_header *new_blob = NULL;
+  int i;
 
   size_t blob_len;
   base_buf = load_file(base_filename, &blob_len);
@@ -23,12 +26,25 @@ int apply_ovleray_files(const char *out_filename,
     goto end;
   }
 
-  size_t overlay_len;
-  overlay_buf = load_file(overlay_filename, &overlay_len);
-  if (!overlay_buf) {
-    fprintf(stderr, "Can not load overlay file: %s\n", overlay_filename);
+  overlay_bufs = dto_malloc(overlay_count * sizeof(char *));
+  overlay_list = dto_malloc(overlay_count * sizeof(struct fdt_entry_node));
+  if (!overlay_bufs || !overlay_list) {
+    fprintf(stderr, "Can not allocate overlay list\n");
     goto end;
   }
+  dto_memset(overlay_bufs, 0, overlay_count * sizeof(char *));
+
+  for (i = 0; i < overlay_count; i++) {
+    size_t overlay_len;
+    overlay_bufs[i] = load_file(overlay_filenames[i], &overlay_len);
+    if (!overlay_bufs[i]) {
+      fprintf(stderr, "Can not load overlay file: %s\n", overlay_filenames[i]);
+      goto end;
+    }
+    overlay_list[i].address = (uintptr_t)overlay_bufs[i];
+    overlay_list[i].size = overlay_len;
+    overlay_list[i].next = (i + 1 < overlay_count) ? &overlay_list[i + 1] : NULL;
+  }
 
   struct fdt_header *blob = ufdt_install_blob(base_buf, blob_len);
   if (!blob) {
@@ -37,7 +53,12 @@ int apply_ovleray_files(const char *out_filename,
   }
 
   clock_t start = clock();
-  new_blob = ufdt_apply_overlay(blob, blob_len, overlay_buf, overlay_len);
+  if (overlay_count == 1) {
+    new_blob = ufdt_apply_overlay(blob, blob_len, overlay_bufs[0],
+                                  overlay_list[0].size);
+  } else {
+    new_blob = ufdt_apply_multi_overlay(blob, blob_len, overlay_list);
+  }
   clock_t end = clock();
 
   if (write_fdt_to_file(out_filename, new_blob) != 0) {
@@ -54,7 +75,13 @@ end:
   // Do not dto_free(blob) - it's the same as base_buf.
 
   if (new_blob) dto_free(new_blob);
-  if (overlay_buf) dto_free(overlay_buf);
+  if (overlay_bufs) {
+    for (i = 0; i < overlay_count; i++) {
+      if (overlay_bufs[i]) dto_free(overlay_bufs[i]);
+    }
+    dto_free(overlay_bufs);
+  }
+  if (overlay_list) dto_free(overlay_list);
   if (base_buf) dto_free(base_buf);
 
   return ret;
@@ -62,14 +89,19 @@ end:
 
 int main(int argc, char **argv) {
   if (argc < 4) {
-    fprintf(stderr, "Usage: %s <base_file> <overlay_file> <out_file>\n", argv[0]);
+    fprintf(stderr,
+            "Usage: %s <base_file> <overlay_file> [<overlay_file>...] "
+            "<out_file>\n",
+            argv[0]);
     return 1;
   }
 
   const char *base_file = argv[1];
-  const char *overlay_file = argv[2];
-  const char *out_file = argv[3];
-  int ret = apply_ovleray_files(out_file, base_file, overlay_file);
+  const char **overlay_files = (const char **)&argv[2];
+  int overlay_count = argc - 3;
+  const char *out_file = argv[argc - 1];
+  int ret =
+      apply_ovleray_files(out_file, base_file, overlay_files, overlay_count);
 
   return ret;
 }
@@ -4,20 +4,36 @@
 #include "ufdt_util.h"
 
 
-struct ufdt *ufdt_construct(void *fdtp) {
+struct ufdt *ufdt_construct(void *fdtp, struct ufdt_node_pool *pool) {
   struct ufdt *res_ufdt = dto_malloc(sizeof(struct ufdt));
+  if (res_ufdt == NULL) return NULL;
   res_ufdt->fdtp = fdtp;
   res_ufdt->root = NULL;
+  res_ufdt->phandle_table.len = 0;
+  res_ufdt->phandle_table.data = NULL;
+
+  if (pool != NULL)
+    res_ufdt->pool = ufdt_node_pool_get(pool);
+  else
+    res_ufdt->pool = ufdt_node_pool_construct();
+  if (res_ufdt->pool == NULL) {
+    dto_free(res_ufdt);
+    return NULL;
+  }
 
   return res_ufdt;
 }
 
 void ufdt_destruct(struct ufdt *tree) {
-  ufdt_node_destruct(tree->root);
+  if (tree == NULL) return;
+  /* The nodes are released with the pool */
+  ufdt_node_pool_put(tree->pool);
   dto_free(tree->phandle_table.data);
+  dto_free(tree);
 }
 
-static struct ufdt_node *ufdt_new_node(void *fdtp, int node_offset) {
+static struct ufdt_node *ufdt_new_node(void *fdtp, int node_offset,
+                                       struct ufdt_node_pool *pool) {
   if (fdtp == NULL) {
     dto_error("Failed to get new_node because tree is NULL\n");
     return NULL;
@@ -25,13 +41,14 @@ static struct ufdt_node *ufdt_new_node(void *fdtp, int node_offset) {
 
   fdt32_t *fdt_tag_ptr =
       (fdt32_t *)fdt_offset_ptr(fdtp, node_offset, sizeof(fdt32_t));
-  struct ufdt_node *res = ufdt_node_construct(fdtp, fdt_tag_ptr);
+  struct ufdt_node *res = ufdt_node_construct(fdtp, fdt_tag_ptr, pool);
   return res;
 }
 
 static struct ufdt_node *fdt_to_ufdt_tree(void *fdtp, int cur_fdt_tag_offset,
                                           int *next_fdt_tag_offset,
-                                          int cur_tag) {
+                                          int cur_tag,
+                                          struct ufdt_node_pool *pool) {
   if (fdtp == NULL) {
     return NULL;
   }
@@ -49,17 +66,17 @@ static struct ufdt_node *fdt_to_ufdt_tree(void *fdtp, int cur_fdt_tag_offset,
       break;
 
     case FDT_PROP:
-      res = ufdt_new_node(fdtp, cur_fdt_tag_offset);
+      res = ufdt_new_node(fdtp, cur_fdt_tag_offset, pool);
       break;
 
     case FDT_BEGIN_NODE:
-      res = ufdt_new_node(fdtp, cur_fdt_tag_offset);
+      res = ufdt_new_node(fdtp, cur_fdt_tag_offset, pool);
 
       do {
         cur_fdt_tag_offset = *next_fdt_tag_offset;
         tag = fdt_next_tag(fdtp, cur_fdt_tag_offset, next_fdt_tag_offset);
         child_node = fdt_to_ufdt_tree(fdtp, cur_fdt_tag_offset,
-                                      next_fdt_tag_offset, tag);
+                                      next_fdt_tag_offset, tag, pool);
         ufdt_node_add_child(res, child_node);
       } while (tag != FDT_END_NODE);
       break;
@@ -238,10 +255,12 @@ struct static_phandle_table build_phandle_table(struct ufdt *tree) {
   return res;
 }
 
-struct ufdt *fdt_to_ufdt(void *fdtp, size_t fdt_size) {
+struct ufdt *fdt_to_ufdt(void *fdtp, size_t fdt_size,
+                         struct ufdt_node_pool *pool) {
   (void)(fdt_size); // unused parameter
 
-  struct ufdt *res_tree = ufdt_construct(fdtp);
+  struct ufdt *res_tree = ufdt_construct(fdtp, pool);
+  if (res_tree == NULL) return NULL;
 
   int start_offset = fdt_path_offset(fdtp, "/");
   if (start_offset < 0) {
@@ -251,7 +270,8 @@ struct ufdt *fdt_to_ufdt(void *fdtp, size_t fdt_size) {
 
   int end_offset;
   int start_tag = fdt_next_tag(fdtp, start_offset, &end_offset);
-  res_tree->root = fdt_to_ufdt_tree(fdtp, start_offset, &end_offset, start_tag);
+  res_tree->root = fdt_to_ufdt_tree(fdtp, start_offset, &end_offset, start_tag,
+                                    res_tree->pool);
 
   res_tree->phandle_table = build_phandle_table(res_tree);
 
@@ -277,7 +297,7 @@ int ufdt_to_fdt(struct ufdt *tree, void *buf, int buf_size) {
    * Obtains all props for later use because getting them from
    * FDT requires complicated manipulation.
   */
-  struct ufdt_node_dict all_props = ufdt_node_dict_construct();
+  struct ufdt_node_dict all_props = ufdt_node_dict_construct(tree->pool);
   err = output_ufdt_node_to_fdt(tree->root, buf, &all_props);
   if (err < 0) return -1;
 
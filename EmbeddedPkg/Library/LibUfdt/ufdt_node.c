@@ -20,17 +20,25 @@ bool node_name_eq(const struct ufdt_node *node, const char *name, int len) {
  * ufdt_node methods.
  */
 
-struct ufdt_node *ufdt_node_construct(void *fdtp, fdt32_t *fdt_tag_ptr) {
+static void *ufdt_node_alloc(struct ufdt_node_pool *pool, size_t size) {
+  if (pool != NULL) return ufdt_node_pool_alloc(pool, size);
+  return dto_malloc(size);
+}
+
+struct ufdt_node *ufdt_node_construct(void *fdtp, fdt32_t *fdt_tag_ptr,
+                                      struct ufdt_node_pool *pool) {
   uint32_t tag = fdt32_to_cpu(*fdt_tag_ptr);
   if (tag == FDT_PROP) {
-    struct fdt_prop_ufdt_node *res = dto_malloc(sizeof(struct fdt_prop_ufdt_node));
+    struct fdt_prop_ufdt_node *res =
+        ufdt_node_alloc(pool, sizeof(struct fdt_prop_ufdt_node));
     if (res == NULL) return NULL;
     res->parent.fdt_tag_ptr = fdt_tag_ptr;
     res->parent.sibling = NULL;
     res->name = get_name(fdtp, (struct ufdt_node *)res);
     return (struct ufdt_node *)res;
   } else {
-    struct fdt_node_ufdt_node *res = dto_malloc(sizeof(struct fdt_node_ufdt_node));
+    struct fdt_node_ufdt_node *res =
+        ufdt_node_alloc(pool, sizeof(struct fdt_node_ufdt_node));
     if (res == NULL) return NULL;
     res->parent.fdt_tag_ptr = fdt_tag_ptr;
     res->parent.sibling = NULL;
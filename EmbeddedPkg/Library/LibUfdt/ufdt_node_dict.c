@@ -59,11 +59,25 @@ static int _ufdt_node_dict_find_index_in_ht(struct ufdt_node **hash_table,
  * ufdt_node_dict methods.
  */
 
-struct ufdt_node_dict ufdt_node_dict_construct() {
+static struct ufdt_node **ufdt_node_dict_alloc_table(
+    struct ufdt_node_pool *pool, int size) {
+  if (pool != NULL)
+    return ufdt_node_pool_alloc(pool, size * sizeof(struct ufdt_node *));
+  return dto_malloc(size * sizeof(struct ufdt_node *));
+}
+
+static void ufdt_node_dict_free_table(struct ufdt_node_dict *dict,
+                                      struct ufdt_node **nodes) {
+  /* Tables from a pool go when the pool does */
+  if (dict->pool == NULL) dto_free(nodes);
+}
+
+struct ufdt_node_dict ufdt_node_dict_construct(struct ufdt_node_pool *pool) {
   struct ufdt_node_dict res;
   res.mem_size = DTNL_INIT_SZ;
   res.num_used = 0;
-  res.nodes = dto_malloc(DTNL_INIT_SZ * sizeof(struct ufdt_node *));
+  res.pool = pool;
+  res.nodes = ufdt_node_dict_alloc_table(pool, DTNL_INIT_SZ);
   if (res.nodes == NULL) {
     res.mem_size = 0;
     return res;
@@ -74,7 +88,7 @@ struct ufdt_node_dict ufdt_node_dict_construct() {
 
 void ufdt_node_dict_destruct(struct ufdt_node_dict *dict) {
   if (dict == NULL) return;
-  dto_free(dict->nodes);
+  ufdt_node_dict_free_table(dict, dict->nodes);
   dict->mem_size = dict->num_used = 0;
 }
 
@@ -84,7 +98,8 @@ static int ufdt_node_dict_resize(struct ufdt_node_dict *dict) {
   int new_size = dict->mem_size << 1;
 
   struct ufdt_node **new_nodes =
-      dto_malloc(new_size * sizeof(struct ufdt_node *));
+      ufdt_node_dict_alloc_table(dict->pool, new_size);
+  if (new_nodes == NULL) return -1;
 
   dto_memset(new_nodes, 0, new_size * sizeof(struct ufdt_node *));
 
@@ -96,13 +111,13 @@ static int ufdt_node_dict_resize(struct ufdt_node_dict *dict) {
       dto_error(
           "failed to find new index in ufdt_node_dict resize for entry :%s:\n",
           name_of(node));
-      dto_free(new_nodes);
+      ufdt_node_dict_free_table(dict, new_nodes);
       return -1;
     }
     new_nodes[idx] = node;
   }
 
-  dto_free(dict->nodes);
+  ufdt_node_dict_free_table(dict, dict->nodes);
 
   dict->mem_size = new_size;
   dict->nodes = new_nodes;
@@ -0,0 +1,89 @@
+#include "libufdt.h"
+#include "ufdt_util.h"
+
+
+/*
+ * Building a ufdt allocates one small object per node and property. For a
+ * board which applies several overlays that are thousands of dto_malloc()
+ * calls, and as many dto_free() calls to walk the trees again at the end.
+ * The pool hands out the space from large blocks and releases them together.
+ */
+
+#define POOL_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+/* Space in front of the data of a block */
+#define POOL_BLOCK_HDR_SIZE POOL_ALIGN(sizeof(struct ufdt_node_pool_block))
+
+/* Larger requests get a block of their own */
+#define POOL_LARGE_SIZE (UFDT_NODE_POOL_BLOCK_SIZE / 4)
+
+struct ufdt_node_pool *ufdt_node_pool_construct() {
+  struct ufdt_node_pool *pool = dto_malloc(sizeof(struct ufdt_node_pool));
+  if (pool == NULL) return NULL;
+
+  pool->blocks = NULL;
+  pool->cur = NULL;
+  pool->left = 0;
+  pool->refs = 1;
+
+  return pool;
+}
+
+struct ufdt_node_pool *ufdt_node_pool_get(struct ufdt_node_pool *pool) {
+  if (pool != NULL) pool->refs++;
+  return pool;
+}
+
+void ufdt_node_pool_put(struct ufdt_node_pool *pool) {
+  if (pool == NULL) return;
+  if (--pool->refs > 0) return;
+
+  struct ufdt_node_pool_block *block = pool->blocks;
+  while (block != NULL) {
+    struct ufdt_node_pool_block *next = block->next;
+    dto_free(block);
+    block = next;
+  }
+  dto_free(pool);
+}
+
+void *ufdt_node_pool_alloc(struct ufdt_node_pool *pool, size_t size) {
+  if (pool == NULL) return NULL;
+
+  size = POOL_ALIGN(size);
+  if (size <= pool->left) {
+    void *res = pool->cur;
+    pool->cur += size;
+    pool->left -= size;
+    return res;
+  }
+
+  if (size > POOL_LARGE_SIZE) {
+    struct ufdt_node_pool_block *block =
+        dto_malloc(POOL_BLOCK_HDR_SIZE + size);
+    if (block == NULL) return NULL;
+
+    /*
+     * Keep the block being carved at the head of the list, the remaining
+     * space of it is still used by later requests.
+     */
+    if (pool->blocks != NULL) {
+      block->next = pool->blocks->next;
+      pool->blocks->next = block;
+    } else {
+      block->next = NULL;
+      pool->blocks = block;
+    }
+    return (char *)block + POOL_BLOCK_HDR_SIZE;
+  }
+
+  struct ufdt_node_pool_block *block =
+      dto_malloc(POOL_BLOCK_HDR_SIZE + UFDT_NODE_POOL_BLOCK_SIZE);
+  if (block == NULL) return NULL;
+  block->next = pool->blocks;
+  pool->blocks = block;
+
+  pool->cur = (char *)block + POOL_BLOCK_HDR_SIZE + size;
+  pool->left = UFDT_NODE_POOL_BLOCK_SIZE - size;
+  return (char *)block + POOL_BLOCK_HDR_SIZE;
+}
@@ -107,6 +107,160 @@ static void ufdt_try_increase_phandle(struct ufdt *tree, uint32_t offset) {
   }
 }
 
+/*
+ * Phandles the fragments of an overlay bring into the main tree. Instead of
+ * building the phandle table of the main tree again for every overlay, the
+ * nodes which may carry a new phandle are noted while the fragments are
+ * merged and folded into the sorted table once the overlay is applied.
+ */
+struct phandle_table_update {
+  struct phandle_table_entry *added;
+  int added_len;
+  int added_size;
+  /* Phandles of main tree nodes whose phandle property was overlaid */
+  uint32_t *removed;
+  int removed_len;
+  int removed_size;
+};
+
+static int phandle_update_grow(void **data, int *size, int len,
+                               size_t elem_size) {
+  if (len < *size) return 0;
+
+  int new_size = *size ? *size << 1 : DTNL_INIT_SZ;
+  void *new_data = dto_malloc(new_size * elem_size);
+  if (new_data == NULL) return -1;
+
+  if (*data) {
+    dto_memcpy(new_data, *data, len * elem_size);
+    dto_free(*data);
+  }
+  *data = new_data;
+  *size = new_size;
+  return 0;
+}
+
+static void phandle_update_destruct(struct phandle_table_update *update) {
+  dto_free(update->added);
+  dto_free(update->removed);
+}
+
+/*
+ * Notes the phandles of overlay_node and its subnodes. target_node is the
+ * node of the main tree overlay_node is going to be merged into, NULL if
+ * overlay_node is added to the main tree as is.
+ */
+static int ufdt_overlay_note_phandles(struct phandle_table_update *update,
+                                      struct ufdt_node *target_node,
+                                      struct ufdt_node *overlay_node) {
+  uint32_t phandle = ufdt_node_get_phandle(overlay_node);
+  if (phandle > 0) {
+    uint32_t old_phandle = ufdt_node_get_phandle(target_node);
+    if (old_phandle > 0 && old_phandle != phandle) {
+      if (phandle_update_grow((void **)&update->removed,
+                              &update->removed_size, update->removed_len,
+                              sizeof(uint32_t)) < 0)
+        return -1;
+      update->removed[update->removed_len++] = old_phandle;
+    }
+
+    if (phandle_update_grow((void **)&update->added, &update->added_size,
+                            update->added_len,
+                            sizeof(struct phandle_table_entry)) < 0)
+      return -1;
+    update->added[update->added_len].phandle = phandle;
+    update->added[update->added_len].node =
+        target_node ? target_node : overlay_node;
+    update->added_len++;
+  }
+
+  struct ufdt_node **it;
+  for_each_node(it, overlay_node) {
+    struct ufdt_node *sub_target_node = NULL;
+    if (target_node != NULL)
+      sub_target_node =
+          ufdt_node_get_subnode_by_name(target_node, name_of(*it));
+    if (ufdt_overlay_note_phandles(update, sub_target_node, *it) < 0)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int phandle_table_find(struct static_phandle_table *table,
+                              uint32_t phandle) {
+  int s = 0, e = table->len;
+  while (e - s > 1) {
+    int mid = s + ((e - s) >> 1);
+    if (phandle < table->data[mid].phandle)
+      e = mid;
+    else
+      s = mid;
+  }
+  if (e - s > 0 && table->data[s].phandle == phandle) return s;
+  return -1;
+}
+
+/*
+ * Folds the noted phandles into the phandle table of tree. The result is
+ * the table build_phandle_table() would return for the merged tree.
+ *
+ * @Time: O(n + mlogm) where n = # of entries in the table and
+ *        m = # of noted phandles.
+ */
+static int ufdt_phandle_table_update(struct ufdt *tree,
+                                     struct phandle_table_update *update) {
+  struct static_phandle_table *table = &tree->phandle_table;
+  int i;
+
+  if (update->added_len == 0 && update->removed_len == 0) return 0;
+
+  /* Entries whose node was given another phandle by the overlay */
+  for (i = 0; i < update->removed_len; i++) {
+    int idx = phandle_table_find(table, update->removed[i]);
+    if (idx >= 0 &&
+        ufdt_node_get_phandle(table->data[idx].node) != update->removed[i])
+      table->data[idx].node = NULL;
+  }
+
+  /* A later fragment may have overlaid the phandle of a noted node again */
+  int added_len = 0;
+  for (i = 0; i < update->added_len; i++) {
+    if (ufdt_node_get_phandle(update->added[i].node) ==
+        update->added[i].phandle)
+      update->added[added_len++] = update->added[i];
+  }
+  dto_qsort(update->added, added_len, sizeof(struct phandle_table_entry),
+            phandle_table_entry_cmp);
+
+  struct phandle_table_entry *data =
+      dto_malloc(sizeof(struct phandle_table_entry) * (table->len + added_len));
+  if (data == NULL) return -1;
+
+  int a = 0, b = 0, len = 0;
+  while (a < table->len || b < added_len) {
+    struct phandle_table_entry *next;
+    if (a < table->len &&
+        (b == added_len ||
+         table->data[a].phandle <= update->added[b].phandle)) {
+      next = &table->data[a++];
+      if (next->node == NULL) continue;
+    } else {
+      next = &update->added[b++];
+    }
+    /* The node may already be in the table with the same phandle */
+    if (len > 0 && data[len - 1].phandle == next->phandle &&
+        data[len - 1].node == next->node)
+      continue;
+    data[len++] = *next;
+  }
+
+  dto_free(table->data);
+  table->data = data;
+  table->len = len;
+  return 0;
+}
+
 /* END of operations about phandles in ufdt. */
 
 /*
@@ -321,8 +475,9 @@ enum overlay_result {
 /*
  * Apply one overlay fragment (subtree).
  */
-static enum overlay_result ufdt_apply_fragment(struct ufdt *tree,
-                                               struct ufdt_node *frag_node) {
+static enum overlay_result ufdt_apply_fragment(
+    struct ufdt *tree, struct ufdt_node *frag_node,
+    struct phandle_table_update *update) {
   uint32_t target;
   const char *target_path;
   const void *val;
@@ -360,6 +515,11 @@ static enum overlay_result ufdt_apply_fragment(struct ufdt *tree,
     return OVERLAY_RESULT_MISSING_OVERLAY;
   }
 
+  if (ufdt_overlay_note_phandles(update, target_node, overlay_node) < 0) {
+    dto_error("failed to note phandles of %s\n", name_of(overlay_node));
+    return OVERLAY_RESULT_MERGE_FAIL;
+  }
+
   int err = ufdt_overlay_node(target_node, overlay_node);
 
   if (err < 0) {
@@ -378,16 +538,26 @@ static int ufdt_overlay_apply_fragments(struct ufdt *main_tree,
                                         struct ufdt *overlay_tree) {
   enum overlay_result err;
   struct ufdt_node **it;
+  struct phandle_table_update update = {0};
   /*
    * This loop may iterate to subnodes that's not a fragment node.
    * In such case, ufdt_apply_fragment would fail with return value = -1.
    */
   for_each_node(it, overlay_tree->root) {
-    err = ufdt_apply_fragment(main_tree, *it);
+    err = ufdt_apply_fragment(main_tree, *it, &update);
     if (err == OVERLAY_RESULT_MERGE_FAIL) {
+      phandle_update_destruct(&update);
       return -1;
     }
   }
+
+  /* Keep the phandle table valid for the next overlay */
+  if (ufdt_phandle_table_update(main_tree, &update) < 0) {
+    dto_error("failed to update the phandle table\n");
+    phandle_update_destruct(&update);
+    return -1;
+  }
+  phandle_update_destruct(&update);
   return 0;
 }
 
@@ -648,9 +818,19 @@ struct fdt_header *ufdt_apply_overlay(struct fdt_header *main_fdt_header,
 
   struct ufdt *main_tree, *overlay_tree;
 
-  main_tree = fdt_to_ufdt(main_fdt_header, main_fdt_size);
+  main_tree = fdt_to_ufdt(main_fdt_header, main_fdt_size, NULL);
+  if (main_tree == NULL) {
+    dto_free(out_fdt_header);
+    return NULL;
+  }
 
-  overlay_tree = fdt_to_ufdt(overlay_fdtp, overlay_size);
+  /* The overlay nodes are merged into main_tree, allocate them together */
+  overlay_tree = fdt_to_ufdt(overlay_fdtp, overlay_size, main_tree->pool);
+  if (overlay_tree == NULL) {
+    ufdt_destruct(main_tree);
+    dto_free(out_fdt_header);
+    return NULL;
+  }
 
   int err = ufdt_overlay_apply(main_tree, overlay_tree, overlay_size);
   if (err < 0) {
@@ -717,30 +897,27 @@ struct fdt_header *ufdt_apply_multi_overlay(struct fdt_header *main_fdt_header,
     return NULL;
   }
 
-  main_tree = fdt_to_ufdt((void *)main_fdt_header, main_fdt_size);
-
-  /* Apply overlay with first dts from the list, and iterate the loop from
-     index 1 to avoid unnecessary rebuilding of phandle table
-   */
+  main_tree = fdt_to_ufdt((void *)main_fdt_header, main_fdt_size, NULL);
+  if (main_tree == NULL) {
+    dto_free(out_fdt_header);
+    return NULL;
+  }
 
   /* Recover list from saved copy */
   overlay_dt_list = temp;
-  i=1;
-  overlay_tree = fdt_to_ufdt((void *)overlay_dt_list->address,
-                             overlay_dt_list->size);
-  err = ufdt_overlay_apply(main_tree, overlay_tree, overlay_dt_list->size);
-  ufdt_destruct(overlay_tree);
-  if (err < 0) {
-    dto_error("Failed to apply devie tree\n");
-    goto fail;
-  }
-
-  overlay_dt_list = overlay_dt_list->next;
+  i=0;
   while (overlay_dt_list != NULL) {
+    /*
+     * The overlay nodes are merged into main_tree, allocate them from its
+     * pool. Applying an overlay keeps the phandle table of main_tree up to
+     * date for the next one.
+     */
     overlay_tree = fdt_to_ufdt((void *)overlay_dt_list->address,
-                               overlay_dt_list->size);
-    /* Rebuild the phandle_table for the combined tree.*/
-    main_tree->phandle_table = build_phandle_table(main_tree);
+                               overlay_dt_list->size, main_tree->pool);
+    if (overlay_tree == NULL) {
+      dto_error("Failed to unflatten device tree, index: %d\n", i);
+      goto fail;
+    }
 
     err = ufdt_overlay_apply(main_tree, overlay_tree, overlay_dt_list->size);
     ufdt_destruct(overlay_tree);
@@ -282,6 +282,7 @@ LinuxLoaderEntry (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
   UINT32 i; /*board_index,*/  //bug400055 add board id info to uefi,gouji@wt,20181023
   /* MultiSlot Boot */
   BOOLEAN MultiSlotBoot;
+  UINT32 TraceSpan;
 
   DEBUG ((EFI_D_INFO, "Loader Build Info: %a %a\n", __DATE__, __TIME__));
   DEBUG ((EFI_D_VERBOSE, "LinuxLoader Load Address to debug ABL: 0x%llx\n",
@@ -333,7 +334,9 @@ LinuxLoaderEntry (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     goto stack_guard_update_default;
   }
 
+  TraceSpan = BootTraceBegin ("partition-enum", NULL);
   Status = EnumeratePartitions ();
+  BootTraceEnd (TraceSpan);
 
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "LinuxLoader: Could not enumerate partitions: %r\n",
@@ -341,7 +344,9 @@ LinuxLoaderEntry (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable)
     goto stack_guard_update_default;
   }
 
+  TraceSpan = BootTraceBegin ("partition-update", NULL);
   UpdatePartitionEntries ();
+  BootTraceEnd (TraceSpan);
   /*Check for multislot boot support*/
   MultiSlotBoot = PartitionHasMultiSlot ((CONST CHAR16 *)L"boot");
   if (MultiSlotBoot) {
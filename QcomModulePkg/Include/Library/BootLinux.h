@@ -125,6 +125,15 @@ typedef struct BootInfo {
   UINT32 VBCmdLineFilledLen;
   VOID *VBData;
   UINT32 HeaderVersion;
+  /* Ramdisk that verified boot already loaded at its load address */
+  UINT64 RamdiskLoadAddr;
+  UINT32 RamdiskOffset;
+  UINT32 RamdiskSize;
+  /* Kernel that verified boot already inflated at its load address */
+  UINT64 KernelLoadAddr;
+  UINT32 KernelSize;
+  UINT32 KernelOutLen;
+  UINT32 KernelDtbOffset;
 } BootInfo;
 
 typedef struct BootLinuxParamlist {
@@ -138,6 +147,10 @@ typedef struct BootLinuxParamlist {
   UINT32 RamdiskSize;
   UINT32 RamdiskOffset;
   UINT32 PatchedKernelHdrSize;
+  BOOLEAN RamdiskLoaded;
+  BOOLEAN KernelInflated;
+  UINT32 KernelOutLen;
+  UINT32 KernelDtbOffset;
   CHAR8 *FinalCmdLine;
   CHAR8 *CmdLine;
   BOOLEAN BootingWith32BitKernel;
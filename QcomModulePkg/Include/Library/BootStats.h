@@ -42,4 +42,48 @@ typedef enum {
 
 void
 BootStatsSetTimeStamp (BS_ENTRY BootStatId);
+
+/* Boot phase tracer. Named spans are recorded into a ring buffer in reserved
+ * memory, which is handed to the kernel through the
+ * /reserved-memory/boot_trace node and can be dumped with
+ * "fastboot oem boot-trace".
+ */
+#define BOOT_TRACE_MAGIC SIGNATURE_32 ('B', 'T', 'R', 'C')
+#define BOOT_TRACE_VERSION 1
+#define BOOT_TRACE_ENTRIES 256
+#define BOOT_TRACE_NAME_LEN 24
+#define BOOT_TRACE_NONE MAX_UINT32
+
+typedef struct {
+  CHAR8 Name[BOOT_TRACE_NAME_LEN];
+  UINT32 Depth;
+  UINT32 Reserved;
+  UINT64 StartUs;
+  UINT64 EndUs; /* 0 while the span is open */
+} BootTraceEntry;
+
+typedef struct {
+  UINT32 Magic;
+  UINT32 Version;
+  UINT32 EntrySize;
+  UINT32 MaxEntries;
+  UINT32 Count; /* Spans begun, the ring keeps the last MaxEntries */
+  UINT32 Depth;
+  BootTraceEntry Entries[BOOT_TRACE_ENTRIES];
+} BootTraceBuffer;
+
+/* Opens a span named Name, or "Name:Arg" if Arg is not NULL, and returns
+ * the id to close it with.
+ */
+UINT32
+BootTraceBegin (CONST CHAR8 *Name, CONST CHAR8 *Arg);
+VOID
+BootTraceEnd (UINT32 Span);
+/* Returns the trace buffer, NULL if nothing was traced */
+BootTraceBuffer *
+BootTraceGet (VOID);
+struct _FDT_FIXUPS;
+/* Queues the reserved-memory node of the trace buffer */
+EFI_STATUS
+BootTraceUpdateDt (struct _FDT_FIXUPS *Fixups);
 #endif
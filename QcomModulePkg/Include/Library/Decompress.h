@@ -39,4 +39,33 @@ decompress (unsigned char *,
             unsigned int,
             unsigned int *,
             unsigned int *);
+
+int
+is_compressed_package (unsigned char *, unsigned int);
+
+int
+decompress_package (unsigned char *,
+                    unsigned int,
+                    unsigned char *,
+                    unsigned int,
+                    unsigned int *,
+                    unsigned int *);
+
+struct decompress_stream;
+
+struct decompress_stream *
+decompress_stream_start (unsigned char *,
+                         unsigned int,
+                         unsigned char *,
+                         unsigned int);
+
+int
+decompress_stream_feed (struct decompress_stream *,
+                        unsigned char *,
+                        unsigned int);
+
+int
+decompress_stream_finish (struct decompress_stream *,
+                          unsigned int *,
+                          unsigned int *);
 #endif /* __PLATFORM_MSM_SHARED_DECOMPRESS_H */
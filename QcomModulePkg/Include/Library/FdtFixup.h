@@ -0,0 +1,166 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __FDTFIXUP_H__
+#define __FDTFIXUP_H__
+
+#include "libfdt.h"
+#include <Uefi.h>
+
+/* Collects the property edits of the boot time device tree update and
+ * writes the updated tree in a single pass. The edits are queued against
+ * the offsets of the unmodified tree, which stay valid until the batch is
+ * applied.
+ */
+
+#define FDT_FIXUP_MAX_PROPS 128
+#define FDT_FIXUP_MAX_NODES 4
+#define FDT_FIXUP_MAX_PATHS 16
+
+/* Handles of the nodes added by the batch start here, offsets of the
+ * existing nodes are below.
+ */
+#define FDT_FIXUP_NEW_NODE 0x40000000
+
+typedef struct {
+  INT32 Node;
+  CONST CHAR8 *Name;
+  UINT8 *Data;
+  UINT32 Len;
+  BOOLEAN Keep; /* Data follows the value in the tree */
+  BOOLEAN Join; /* string append, the NUL in between becomes a space */
+  /* Filled in when the batch is applied */
+  INT32 OldOffset;
+  UINT32 OldLen;
+  UINT32 FinalLen;
+  UINT32 NameOff;
+} FDT_FIXUP_PROP;
+
+typedef struct {
+  INT32 Parent;
+  CHAR8 *Name;
+} FDT_FIXUP_NODE;
+
+typedef struct {
+  CONST CHAR8 *Path;
+  INT32 Offset;
+} FDT_FIXUP_PATH;
+
+typedef struct _FDT_FIXUPS {
+  VOID *Fdt;
+  FDT_FIXUP_PROP Props[FDT_FIXUP_MAX_PROPS];
+  UINT32 PropCount;
+  FDT_FIXUP_NODE Nodes[FDT_FIXUP_MAX_NODES];
+  UINT32 NodeCount;
+  FDT_FIXUP_PATH Paths[FDT_FIXUP_MAX_PATHS];
+  UINT32 PathCount;
+  /* Filled in when the batch is applied: the edits of existing properties
+   * in structure block order, and the properties added to existing nodes
+   * in node order.
+   */
+  UINT32 EditOrder[FDT_FIXUP_MAX_PROPS];
+  UINT32 EditCount;
+  UINT32 AddOrder[FDT_FIXUP_MAX_PROPS];
+  UINT32 AddCount;
+} FDT_FIXUPS;
+
+VOID
+FdtFixupInit (FDT_FIXUPS *Fixups, VOID *Fdt);
+
+/* Drops the queued edits */
+VOID
+FdtFixupFree (FDT_FIXUPS *Fixups);
+
+/* fdt_path_offset () with the result kept for later lookups of the same
+ * path. Path has to stay valid until the batch is applied.
+ */
+INT32
+FdtFixupPathOffset (FDT_FIXUPS *Fixups, CONST CHAR8 *Path);
+
+/* Queues a new subnode of Parent. Returns the handle to pass as Node to
+ * the property edits of the new node, or a negative libfdt error.
+ */
+INT32
+FdtFixupAddNode (FDT_FIXUPS *Fixups, INT32 Parent, CONST CHAR8 *Name);
+
+/* Queue a property edit. The value is copied, Name has to stay valid until
+ * the batch is applied. A set replaces the edits queued before for the same
+ * property, appends are concatenated. Like fdt_appendprop_str (), the string
+ * appends separate the strings with a space.
+ */
+INT32
+FdtFixupSetProp (FDT_FIXUPS *Fixups,
+                 INT32 Node,
+                 CONST CHAR8 *Name,
+                 CONST VOID *Val,
+                 UINT32 Len);
+INT32
+FdtFixupAppendProp (FDT_FIXUPS *Fixups,
+                    INT32 Node,
+                    CONST CHAR8 *Name,
+                    CONST VOID *Val,
+                    UINT32 Len);
+INT32
+FdtFixupSetPropU32 (FDT_FIXUPS *Fixups,
+                    INT32 Node,
+                    CONST CHAR8 *Name,
+                    UINT32 Val);
+INT32
+FdtFixupSetPropU64 (FDT_FIXUPS *Fixups,
+                    INT32 Node,
+                    CONST CHAR8 *Name,
+                    UINT64 Val);
+INT32
+FdtFixupAppendPropU32 (FDT_FIXUPS *Fixups,
+                       INT32 Node,
+                       CONST CHAR8 *Name,
+                       UINT32 Val);
+INT32
+FdtFixupAppendPropU64 (FDT_FIXUPS *Fixups,
+                       INT32 Node,
+                       CONST CHAR8 *Name,
+                       UINT64 Val);
+INT32
+FdtFixupSetPropString (FDT_FIXUPS *Fixups,
+                       INT32 Node,
+                       CONST CHAR8 *Name,
+                       CONST CHAR8 *Str);
+INT32
+FdtFixupAppendPropString (FDT_FIXUPS *Fixups,
+                          INT32 Node,
+                          CONST CHAR8 *Name,
+                          CONST CHAR8 *Str);
+
+/* Writes the tree with all queued edits applied back to its buffer of
+ * BufSize bytes, the result is packed. The batch is empty afterwards.
+ * Returns 0 or a negative libfdt error, the tree is unchanged on error.
+ */
+INT32
+FdtFixupApply (FDT_FIXUPS *Fixups, UINT32 BufSize);
+
+#endif /* __FDTFIXUP_H__ */
@@ -51,6 +51,7 @@
 #include <Library/UefiRuntimeServicesTableLib.h>
 #include <PiDxe.h>
 #include <Protocol/BlockIo.h>
+#include <Protocol/BlockIo2.h>
 #include <Protocol/DevicePath.h>
 #include <Protocol/EFIEraseBlock.h>
 #include <Protocol/EFIMdtp.h>
@@ -167,15 +168,38 @@ GetBlkIOHandles (IN UINT32 SelectionAttrib,
                  OUT HandleInfo *HandleInfoPtr,
                  IN OUT UINT32 *MaxBlkIopCnt);
 
+/* Drop the partition handle index used by GetBlkIOHandles, it is rebuilt
+ * on the next lookup. Call it when the partition tables have changed.
+ */
+VOID
+InvalidatePartitionIndex (VOID);
+
 VOID
 ToLower (CHAR8 *Str);
 UINT64 GetTimerCountms (VOID);
+UINT64 GetTimerCountUs (VOID);
 EFI_STATUS
 WriteToPartition (EFI_GUID *Ptype, VOID *Msg, UINT32 MsgSize);
 BOOLEAN IsSecureBootEnabled (VOID);
 EFI_STATUS ResetDeviceState (VOID);
 EFI_STATUS
 ErasePartition (EFI_BLOCK_IO_PROTOCOL *BlockIo, EFI_HANDLE *Handle);
+/* Queue the erase of Size bytes from Lba. The erase protocol discards the
+ * range (UFS UNMAP, eMMC discard). With Token->Event set the call returns
+ * once the request is queued, the event is signaled when it completes and
+ * TransactionStatus holds the result.
+ */
+EFI_STATUS
+EraseBlockRangeAsync (EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                      EFI_HANDLE *Handle,
+                      UINT64 Lba,
+                      UINT64 Size,
+                      EFI_ERASE_BLOCK_TOKEN *Token);
+EFI_STATUS
+EraseBlockRange (EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                 EFI_HANDLE *Handle,
+                 UINT64 Lba,
+                 UINT64 Size);
 EFI_STATUS
 GetBootDevice (CHAR8 *BootDevBuf, UINT32 Len);
 
@@ -191,4 +215,25 @@ WriteBlockToPartition (EFI_BLOCK_IO_PROTOCOL *BlockIo,
                    IN UINT64 Offset,
                    IN UINT64 Size,
                    IN VOID *Image);
+
+/* Storage write counters kept by WriteBlockToPartition. SizeHist[i] counts
+ * the writes smaller than 4 KB << (2 * i), the last bucket the bigger ones.
+ */
+#define WRITE_STATS_HIST_BUCKETS 7
+
+typedef struct {
+  UINT64 Calls;
+  UINT64 Bytes;
+  UINT64 BlockedUs; /* time spent waiting for the storage to finish */
+  UINT64 SizeHist[WRITE_STATS_HIST_BUCKETS];
+} WriteBlockStats;
+
+/* Account a WriteBlocks or WriteBlocksEx call issued outside of
+ * WriteBlockToPartition and the time it blocked the caller.
+ */
+VOID
+WriteStatsAddCall (IN UINT64 Size, IN UINT64 BlockedUs);
+
+VOID
+WriteStatsGet (OUT WriteBlockStats *Stats);
 #endif
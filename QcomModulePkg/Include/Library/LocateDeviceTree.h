@@ -138,6 +138,38 @@ typedef struct DtInfo {
   VOID *Dtb;
 } DtInfo;
 
+/* Board properties the DTB selection depends on */
+typedef struct DtbSelKey {
+  UINT32 ChipId;
+  UINT32 ChipVersion;
+  UINT32 FoundryId;
+  UINT32 PlatformType;
+  UINT32 TargetId;
+  UINT32 PlatformSubType;
+  UINT32 PmicModel[MAX_PMIC_IDX];
+  UINT32 PmicTarget[MAX_PMIC_IDX];
+} DtbSelKey;
+
+/* DTB and DTBO chosen on a previous boot, kept in the DtbSelectionCache
+ * variable. An entry is used when the board key and the hash of the
+ * matching properties of all the candidate DTBs are unchanged.
+ */
+#define DTB_SEL_CACHE_VERSION 1
+#define DTB_SEL_NONE MAX_UINT32
+
+typedef struct DtbSelCache {
+  UINT32 Version;
+  DtbSelKey Key;
+  UINT64 SocHash;
+  UINT32 SocCount;
+  UINT32 SocIdx;
+  UINT32 RticIdx;
+  UINT32 DtboNeeded;
+  UINT64 DtboHash;
+  UINT32 DtboCount;
+  UINT32 DtboIdx;
+} DtbSelCache;
+
 /*
  * For DTB V1: The DTB entries would be of the format
  * qcom,msm-id = <msm8974, CDP, rev_1>; (3 * sizeof(uint32_t))
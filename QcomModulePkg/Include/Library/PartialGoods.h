@@ -30,6 +30,7 @@
 #define __PARTIALGOODS_H__
 
 #include <Library/Board.h>
+#include <Library/FdtFixup.h>
 #define MAX_CPU_CLUSTER 2
 
 struct SubNodeListNew {
@@ -45,7 +46,8 @@ struct PartialGoods {
   struct SubNodeListNew SubNode; /* Sub node name list*/
 };
 
+/* Queues the status updates of the defective parts */
 EFI_STATUS
-UpdatePartialGoodsNode (VOID *fdt);
+UpdatePartialGoodsNode (FDT_FIXUPS *Fixups);
 
 #endif
@@ -32,7 +32,6 @@
 
 #include <Library/DeviceInfo.h>
 #include <Library/DrawUI.h>
-#include <Library/PartialGoods.h>
 #include <Library/PartitionTableUpdate.h>
 #include <Library/ShutdownServices.h>
 #include <Library/VerifiedBootMenu.h>
@@ -233,6 +232,7 @@ DTBImgCheckAndAppendDT (BootInfo *Info,
   BOOLEAN DtboImgInvalid = FALSE;
   struct fdt_entry_node *DtsList = NULL;
   EFI_STATUS Status;
+  UINT32 TraceSpan;
 
   if (Info == NULL ||
       BootParamlistPtr == NULL) {
@@ -289,6 +289,7 @@ DTBImgCheckAndAppendDT (BootInfo *Info,
     }
   } else {
     /*It is the case of DTB overlay Get the Soc specific dtb */
+    TraceSpan = BootTraceBegin ("dt-select", "soc");
     SocDtb =
     GetSocDtb ((VOID *)(BootParamlistPtr->ImageBuffer +
                BootParamlistPtr->PageSize +
@@ -296,6 +297,7 @@ DTBImgCheckAndAppendDT (BootInfo *Info,
                BootParamlistPtr->KernelSize,
                DtbOffset,
                (VOID *)BootParamlistPtr->DeviceTreeLoadAddr);
+    BootTraceEnd (TraceSpan);
     if (!SocDtb) {
       DEBUG ((EFI_D_ERROR,
                   "Error: Appended Soc Device Tree blob not found\n"));
@@ -305,7 +307,9 @@ DTBImgCheckAndAppendDT (BootInfo *Info,
     /*Check do we really need to gothrough DTBO or not*/
     DtboCheckNeeded = GetDtboNeeded ();
     if (DtboCheckNeeded == TRUE) {
+      TraceSpan = BootTraceBegin ("dt-select", "board");
       BoardDtb = GetBoardDtb (Info, BootParamlistPtr->DtboImgBuffer);
+      BootTraceEnd (TraceSpan);
       if (!BoardDtb) {
         DEBUG ((EFI_D_ERROR, "Error: Board Dtbo blob not found\n"));
         return EFI_NOT_FOUND;
@@ -337,9 +341,11 @@ DTBImgCheckAndAppendDT (BootInfo *Info,
       }
     }
 
+    TraceSpan = BootTraceBegin ("dt-overlay", NULL);
     Status = ApplyOverlay (BootParamlistPtr,
                            SocDtb,
                            DtsList);
+    BootTraceEnd (TraceSpan);
     if (Status != EFI_SUCCESS) {
       DEBUG ((EFI_D_ERROR, "Error: Dtb overlay failed\n"));
       return Status;
@@ -357,6 +363,8 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr,
   UINT32 OutLen = 0;
   UINT64 OutAvaiLen = 0;
   struct kernel64_hdr *Kptr = NULL;
+  UINT32 TraceSpan;
+  INT32 Ret;
 
   if (BootParamlistPtr == NULL ||
       DtbOffset == NULL ||
@@ -367,9 +375,9 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr,
     return EFI_INVALID_PARAMETER;
   }
 
-  if (is_gzip_package ((BootParamlistPtr->ImageBuffer +
-                        BootParamlistPtr->PageSize),
-                        BootParamlistPtr->KernelSize)) {
+  if (is_compressed_package ((BootParamlistPtr->ImageBuffer +
+                              BootParamlistPtr->PageSize),
+                              BootParamlistPtr->KernelSize)) {
 
     OutAvaiLen = BootParamlistPtr->DeviceTreeLoadAddr -
                                      *KernelLoadAddr;
@@ -381,15 +389,25 @@ GZipPkgCheck (BootParamlist *BootParamlistPtr,
       return EFI_BAD_BUFFER_SIZE;
     }
 
-    DEBUG ((EFI_D_INFO, "Decompressing kernel image start: %lu ms\n",
-                         GetTimerCountms ()));
-    if (decompress (
-        (UINT8 *)(BootParamlistPtr->ImageBuffer +
-        BootParamlistPtr->PageSize),      // Read blob using BlockIo
-        BootParamlistPtr->KernelSize,    // Blob size
-        (UINT8 *)*KernelLoadAddr,       // Load address, allocated
-        (UINT32)OutAvaiLen,   // Allocated Size
-        DtbOffset, &OutLen)) {
+    if (BootParamlistPtr->KernelInflated) {
+      /* Inflated while verified boot read the image */
+      *DtbOffset = BootParamlistPtr->KernelDtbOffset;
+      OutLen = BootParamlistPtr->KernelOutLen;
+      Ret = 0;
+    } else {
+      DEBUG ((EFI_D_INFO, "Decompressing kernel image start: %lu ms\n",
+                           GetTimerCountms ()));
+      TraceSpan = BootTraceBegin ("decompress", NULL);
+      Ret = decompress_package (
+          (UINT8 *)(BootParamlistPtr->ImageBuffer +
+          BootParamlistPtr->PageSize),      // Read blob using BlockIo
+          BootParamlistPtr->KernelSize,    // Blob size
+          (UINT8 *)*KernelLoadAddr,       // Load address, allocated
+          (UINT32)OutAvaiLen,   // Allocated Size
+          DtbOffset, &OutLen);
+      BootTraceEnd (TraceSpan);
+    }
+    if (Ret) {
           DEBUG ((EFI_D_ERROR, "Decompressing kernel image failed!!!\n"));
           return RETURN_OUT_OF_RESOURCES;
     }
@@ -460,6 +478,7 @@ LoadAddrAndDTUpdate (BootParamlist *BootParamlistPtr)
 {
   EFI_STATUS Status;
   UINT64 RamdiskEndAddr = 0;
+  UINT32 TraceSpan;
 
   if (BootParamlistPtr == NULL) {
     DEBUG ((EFI_D_ERROR, "Invalid input parameters\n"));
@@ -485,20 +504,24 @@ LoadAddrAndDTUpdate (BootParamlist *BootParamlistPtr)
     return EFI_BAD_BUFFER_SIZE;
   }
 
+  TraceSpan = BootTraceBegin ("dt-update", NULL);
   Status = UpdateDeviceTree ((VOID *)BootParamlistPtr->DeviceTreeLoadAddr,
                              BootParamlistPtr->FinalCmdLine,
                              (VOID *)BootParamlistPtr->RamdiskLoadAddr,
                              BootParamlistPtr->RamdiskSize,
                              BootParamlistPtr->BootingWith32BitKernel);
+  BootTraceEnd (TraceSpan);
   if (Status != EFI_SUCCESS) {
     DEBUG ((EFI_D_ERROR, "Device Tree update failed Status:%r\n", Status));
     return Status;
   }
 
-  gBS->CopyMem ((CHAR8 *)BootParamlistPtr->RamdiskLoadAddr,
-                BootParamlistPtr->ImageBuffer +
-                BootParamlistPtr->RamdiskOffset,
-                BootParamlistPtr->RamdiskSize);
+  if (!BootParamlistPtr->RamdiskLoaded) {
+    gBS->CopyMem ((CHAR8 *)BootParamlistPtr->RamdiskLoadAddr,
+                  BootParamlistPtr->ImageBuffer +
+                  BootParamlistPtr->RamdiskOffset,
+                  BootParamlistPtr->RamdiskSize);
+  }
 
   if (BootParamlistPtr->BootingWith32BitKernel) {
     if (CHECK_ADD64 (BootParamlistPtr->KernelLoadAddr,
@@ -518,16 +541,6 @@ LoadAddrAndDTUpdate (BootParamlist *BootParamlistPtr)
                   BootParamlistPtr->KernelSizeActual);
   }
 
-  if (FixedPcdGetBool (EnablePartialGoods)) {
-    Status = UpdatePartialGoodsNode
-                ((VOID *)BootParamlistPtr->DeviceTreeLoadAddr);
-    if (Status != EFI_SUCCESS) {
-      DEBUG ((EFI_D_ERROR,
-        "Failed to update device tree for partial goods, Status=%r\n",
-           Status));
-      return Status;
-    }
-  }
   return EFI_SUCCESS;
 }
 
@@ -805,6 +818,7 @@ BootLinux (BootInfo *Info)
   BootParamlist CvmBootParamList = {0};
   HypMsg Msg = {0};
   UINT32 RetVal;
+  UINT32 TraceSpan;
 
   //+ ExtB878208, linjiashuo@wt, shutdown device when cable is plug-out quickly after plug-in, 20190301
   EFI_CHARGER_EX_PROTOCOL *ChgDetectProtocol;
@@ -895,6 +909,15 @@ BootLinux (BootInfo *Info)
     BootParamlistPtr.DeviceTreeLoadAddr =
       (EFI_PHYSICAL_ADDRESS) (BootParamlistPtr.BaseMemory |
                               PcdGet32 (TagsAddress));
+
+    /* Verified boot may have inflated the kernel already */
+    if (Info->KernelLoadAddr &&
+        Info->KernelLoadAddr == BootParamlistPtr.KernelLoadAddr &&
+        Info->KernelSize == BootParamlistPtr.KernelSize) {
+      BootParamlistPtr.KernelInflated = TRUE;
+      BootParamlistPtr.KernelOutLen = Info->KernelOutLen;
+      BootParamlistPtr.KernelDtbOffset = Info->KernelDtbOffset;
+    }
   }
   Status = GZipPkgCheck (&BootParamlistPtr, &DtbOffset,
                          &BootParamlistPtr.KernelLoadAddr,
@@ -926,6 +949,18 @@ BootLinux (BootInfo *Info)
     return EFI_BAD_BUFFER_SIZE;
   }
 
+  /* Verified boot may have read the ramdisk straight to its load address,
+   * the image buffer then has a hole where the ramdisk was. */
+  if (Info->RamdiskLoadAddr) {
+    if (Info->RamdiskLoadAddr != BootParamlistPtr.RamdiskLoadAddr ||
+        Info->RamdiskOffset != BootParamlistPtr.RamdiskOffset ||
+        Info->RamdiskSize != BootParamlistPtr.RamdiskSize) {
+      DEBUG ((EFI_D_ERROR, "Loaded ramdisk does not match boot image\n"));
+      return EFI_LOAD_ERROR;
+    }
+    BootParamlistPtr.RamdiskLoaded = TRUE;
+  }
+
   DEBUG ((EFI_D_VERBOSE, "Kernel Load Address: 0x%x\n",
                                         BootParamlistPtr.KernelLoadAddr));
   DEBUG ((EFI_D_VERBOSE, "Kernel Size Actual: 0x%x\n",
@@ -958,8 +993,10 @@ BootLinux (BootInfo *Info)
     return Status;
   }
 
+  TraceSpan = BootTraceBegin ("cmdline", NULL);
   Status = UpdateCmdLine (BootParamlistPtr.CmdLine, FfbmStr, Recovery,
                    AlarmBoot, Info->VBCmdLine, &BootParamlistPtr.FinalCmdLine);
+  BootTraceEnd (TraceSpan);
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "Error updating cmdline. Device Error %r\n", Status));
     return Status;
@@ -1034,7 +1071,9 @@ BootLinux (BootInfo *Info)
   DEBUG ((EFI_D_INFO, "\nShutting Down UEFI Boot Services: %lu ms\n",
           GetTimerCountms ()));
   /*Shut down UEFI boot services*/
+  TraceSpan = BootTraceBegin ("exit-boot-services", NULL);
   Status = ShutdownUefiBootServices ();
+  BootTraceEnd (TraceSpan);
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR,
             "ERROR: Can not shutdown UEFI boot services. Status=0x%X\n",
@@ -31,6 +31,7 @@
 #include "AutoGen.h"
 #include "BootLinux.h"
 #include "Reg.h"
+#include <Library/FdtFixup.h>
 
 #define BS_INFO_OFFSET (0x6B0)
 
@@ -38,6 +39,10 @@ STATIC UINT32 KernelLoadStart;
 STATIC UINT64 SharedImemAddress;
 STATIC UINT64 MpmTimerBase;
 STATIC UINT64 BsImemAddress;
+STATIC BOOLEAN BootStatsLookupDone;
+
+STATIC BootTraceBuffer *BootTrace;
+STATIC BOOLEAN BootTraceAllocFailed;
 
 void
 BootStatsSetTimeStamp (BS_ENTRY BootStatId)
@@ -47,24 +52,26 @@ BootStatsSetTimeStamp (BS_ENTRY BootStatId)
 
   UINTN DataSize = sizeof (SharedImemAddress);
 
-  if (!SharedImemAddress) {
+  /* Look the addresses up once, also when they are not available */
+  if (!BootStatsLookupDone) {
+    BootStatsLookupDone = TRUE;
     Status =
         gRT->GetVariable ((CHAR16 *)L"Shared_IMEM_Base", &gQcomTokenSpaceGuid,
                           NULL, &DataSize, &SharedImemAddress);
     if (Status != EFI_SUCCESS) {
       DEBUG ((EFI_D_ERROR, "Failed to get Shared IMEM base, %r\n", Status));
+      SharedImemAddress = 0;
       return;
     }
-  }
 
-  DataSize = sizeof (MpmTimerBase);
-  if (!MpmTimerBase) {
+    DataSize = sizeof (MpmTimerBase);
     Status =
         gRT->GetVariable ((CHAR16 *)L"MPM2_SLP_CNTR_ADDR", &gQcomTokenSpaceGuid,
                           NULL, &DataSize, &MpmTimerBase);
     if (Status != EFI_SUCCESS) {
       DEBUG (
           (EFI_D_ERROR, "Failed to get MPM Sleep counter base, %r\n", Status));
+      MpmTimerBase = 0;
       return;
     }
   }
@@ -106,3 +113,160 @@ BootStatsSetTimeStamp (BS_ENTRY BootStatId)
     }
   }
 }
+
+STATIC BootTraceBuffer *
+BootTraceAlloc (VOID)
+{
+  if (BootTrace ||
+      BootTraceAllocFailed) {
+    return BootTrace;
+  }
+
+  /* Reserved pages are left alone by UEFI, the kernel is told about them
+   * in UpdateDeviceTree.
+   */
+  BootTrace = AllocateReservedPages (EFI_SIZE_TO_PAGES (sizeof (*BootTrace)));
+  if (!BootTrace) {
+    DEBUG ((EFI_D_ERROR, "Failed to allocate the boot trace buffer\n"));
+    BootTraceAllocFailed = TRUE;
+    return NULL;
+  }
+
+  gBS->SetMem (BootTrace, sizeof (*BootTrace), 0);
+  BootTrace->Magic = BOOT_TRACE_MAGIC;
+  BootTrace->Version = BOOT_TRACE_VERSION;
+  BootTrace->EntrySize = sizeof (BootTraceEntry);
+  BootTrace->MaxEntries = BOOT_TRACE_ENTRIES;
+
+  return BootTrace;
+}
+
+UINT32
+BootTraceBegin (CONST CHAR8 *Name, CONST CHAR8 *Arg)
+{
+  BootTraceEntry *Entry;
+  UINT32 Span;
+  UINT32 Len = 0;
+
+  if (!BootTraceAlloc () ||
+      !Name) {
+    return BOOT_TRACE_NONE;
+  }
+
+  Span = BootTrace->Count++;
+  Entry = &BootTrace->Entries[Span % BOOT_TRACE_ENTRIES];
+
+  while (*Name &&
+         Len < BOOT_TRACE_NAME_LEN - 1) {
+    Entry->Name[Len++] = *Name++;
+  }
+  if (Arg &&
+      Len < BOOT_TRACE_NAME_LEN - 1) {
+    Entry->Name[Len++] = ':';
+    while (*Arg &&
+           Len < BOOT_TRACE_NAME_LEN - 1) {
+      Entry->Name[Len++] = *Arg++;
+    }
+  }
+  Entry->Name[Len] = '\0';
+
+  Entry->Depth = BootTrace->Depth++;
+  Entry->EndUs = 0;
+  Entry->StartUs = GetTimerCountUs ();
+
+  return Span;
+}
+
+VOID
+BootTraceEnd (UINT32 Span)
+{
+  UINT64 EndUs = GetTimerCountUs ();
+
+  if (!BootTrace ||
+      Span == BOOT_TRACE_NONE ||
+      Span >= BootTrace->Count) {
+    return;
+  }
+
+  if (BootTrace->Depth) {
+    BootTrace->Depth--;
+  }
+
+  /* The entry was overwritten by later spans */
+  if (BootTrace->Count - Span > BOOT_TRACE_ENTRIES) {
+    return;
+  }
+
+  BootTrace->Entries[Span % BOOT_TRACE_ENTRIES].EndUs = EndUs;
+}
+
+BootTraceBuffer *
+BootTraceGet (VOID)
+{
+  return BootTrace;
+}
+
+EFI_STATUS
+BootTraceUpdateDt (FDT_FIXUPS *Fixups)
+{
+  CONST fdt32_t *Prop;
+  CHAR8 NodeName[32];
+  UINT64 Addr;
+  UINT64 Size;
+  INT32 ParentOffset;
+  INT32 Offset;
+  INT32 Len;
+  INT32 Ret;
+
+  if (!BootTraceAlloc ()) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  ParentOffset = FdtFixupPathOffset (Fixups, "/reserved-memory");
+  if (ParentOffset < 0) {
+    DEBUG ((EFI_D_VERBOSE, "No reserved-memory node for the boot trace\n"));
+    return EFI_NOT_FOUND;
+  }
+
+  Addr = (UINT64)BootTrace;
+  Size = EFI_PAGES_TO_SIZE (EFI_SIZE_TO_PAGES (sizeof (*BootTrace)));
+  AsciiSPrint (NodeName, sizeof (NodeName), "boot_trace@%lx", Addr);
+  Offset = FdtFixupAddNode (Fixups, ParentOffset, NodeName);
+  if (Offset < 0) {
+    DEBUG ((EFI_D_ERROR, "Failed to add the boot trace node: %d\n", Offset));
+    return EFI_LOAD_ERROR;
+  }
+
+  Ret = FdtFixupSetPropString (Fixups, Offset, "compatible",
+                               "qcom,boot-trace");
+  if (!Ret) {
+    Ret = FdtFixupSetProp (Fixups, Offset, "no-map", NULL, 0);
+  }
+
+  /* reg follows the cell sizes of reserved-memory */
+  Prop = fdt_getprop (Fixups->Fdt, ParentOffset, "#address-cells", &Len);
+  if (!Ret &&
+      Prop &&
+      Len == sizeof (*Prop) &&
+      fdt32_to_cpu (*Prop) == 1) {
+    Ret = FdtFixupSetPropU32 (Fixups, Offset, "reg", (UINT32)Addr);
+  } else if (!Ret) {
+    Ret = FdtFixupSetPropU64 (Fixups, Offset, "reg", Addr);
+  }
+  Prop = fdt_getprop (Fixups->Fdt, ParentOffset, "#size-cells", &Len);
+  if (!Ret &&
+      Prop &&
+      Len == sizeof (*Prop) &&
+      fdt32_to_cpu (*Prop) == 1) {
+    Ret = FdtFixupAppendPropU32 (Fixups, Offset, "reg", (UINT32)Size);
+  } else if (!Ret) {
+    Ret = FdtFixupAppendPropU64 (Fixups, Offset, "reg", Size);
+  }
+
+  if (Ret) {
+    DEBUG ((EFI_D_ERROR, "Failed to update the boot trace node: %d\n", Ret));
+    return EFI_LOAD_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
@@ -44,13 +44,61 @@
 #include "zlib/inftrees.h"
 #include "zlib/inflate.h"
 #include "zlib/inffast.h"
+#include "lz4/lz4.h"
+#include "zstd/zstd.h"
 
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <PiDxe.h>
+#include <Protocol/MpService.h>
 
 #define GZIP_HEADER_LEN 10
+#define GZIP_TRAILER_LEN 8
 #define GZIP_FILENAME_LIMIT 256
 
+/* gzip header flags */
+#define GZIP_FLAG_FHCRC 0x02
+#define GZIP_FLAG_FEXTRA 0x04
+#define GZIP_FLAG_FNAME 0x08
+#define GZIP_FLAG_FCOMMENT 0x10
+
+/* FEXTRA subfield holding the block index of kernels compressed in
+ * independent blocks at build time (see Tools/gzip_index.py). Each block
+ * ends with a full flush, so it can be inflated without the previous one.
+ * Payload, little endian: u32 block count N followed by N + 1 pairs of
+ * u32 (deflate offset, output offset), the last pair being the end of
+ * the stream.
+ */
+#define GZIP_INDEX_SI1 'Q'
+#define GZIP_INDEX_SI2 'Z'
+#define GZIP_INDEX_MAX_BLOCKS 4096
+
+/* Heap for one inflate stream on an AP, which can not call boot services:
+ * the inflate state and its 32K window. */
+#define INFLATE_ARENA_SIZE (sizeof (struct inflate_state) + \
+                            (1U << MAX_WBITS) + 64)
+
+typedef struct {
+  unsigned char *base;
+  unsigned int used;
+  unsigned int size;
+} inflate_arena;
+
+typedef struct {
+  unsigned char *in_buf;  /* start of the deflate data */
+  unsigned char *out_buf;
+  const unsigned char *index;
+  unsigned int num_blocks;
+  UINT32 *block_crcs;
+  inflate_arena *arenas;
+  unsigned int num_arenas;
+  volatile UINT32 next_arena;
+  volatile UINT32 next_block;
+  volatile UINT32 failed;
+} parallel_inflate;
+
 static void
 zlib_free (voidpf qpaque, void *addr)
 {
@@ -65,6 +113,325 @@ zlib_alloc (voidpf qpaque, uInt items, uInt size)
   return AllocateZeroPool (items * size);
 }
 
+static unsigned int
+get_le32 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/* Checks the CRC32 and size in the gzip "trailer" against the output.
+ * Returns 0 if they match.
+ */
+static int
+check_gzip_trailer (const unsigned char *trailer,
+                    unsigned long crc,
+                    unsigned int out_len)
+{
+  if (get_le32 (trailer) != (unsigned int)crc ||
+      get_le32 (trailer + 4) != out_len) {
+    DEBUG ((EFI_D_ERROR, "Error in decompression: gzip CRC or size mismatch\n"));
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Returns the length of the gzip header of "in_buf", or 0 if it is
+ * malformed. The block index subfield is returned in "index" when present.
+ */
+static unsigned int
+gzip_header_len (unsigned char *in_buf,
+                 unsigned int in_len,
+                 const unsigned char **index,
+                 unsigned int *index_len)
+{
+  unsigned int hdr_len = GZIP_HEADER_LEN;
+  unsigned int xlen;
+  unsigned int sub_len;
+  unsigned int i;
+
+  *index = NULL;
+  *index_len = 0;
+
+  if (in_buf[3] & GZIP_FLAG_FEXTRA) {
+    if (in_len - hdr_len < 2) {
+      return 0;
+    }
+    xlen = in_buf[hdr_len] | (in_buf[hdr_len + 1] << 8);
+    hdr_len += 2;
+    if (in_len - hdr_len < xlen) {
+      return 0;
+    }
+    for (i = 0; xlen - i >= 4; i += 4 + sub_len) {
+      sub_len = in_buf[hdr_len + i + 2] | (in_buf[hdr_len + i + 3] << 8);
+      if (xlen - i - 4 < sub_len) {
+        return 0;
+      }
+      if (in_buf[hdr_len + i] == GZIP_INDEX_SI1 &&
+          in_buf[hdr_len + i + 1] == GZIP_INDEX_SI2) {
+        *index = in_buf + hdr_len + i + 4;
+        *index_len = sub_len;
+      }
+    }
+    hdr_len += xlen;
+  }
+
+  /* skip over ascii filename */
+  if (in_buf[3] & GZIP_FLAG_FNAME) {
+    for (i = 0; i < GZIP_FILENAME_LIMIT && hdr_len < in_len &&
+                in_buf[hdr_len]; i++) {
+      hdr_len++;
+    }
+    if (hdr_len >= in_len) {
+      return 0;
+    }
+    hdr_len++;
+  }
+
+  if (in_buf[3] & GZIP_FLAG_FCOMMENT) {
+    while (hdr_len < in_len && in_buf[hdr_len]) {
+      hdr_len++;
+    }
+    if (hdr_len >= in_len) {
+      return 0;
+    }
+    hdr_len++;
+  }
+
+  if (in_buf[3] & GZIP_FLAG_FHCRC) {
+    hdr_len += 2;
+  }
+
+  return hdr_len < in_len ? hdr_len : 0;
+}
+
+static void *
+arena_alloc (voidpf opaque, uInt items, uInt size)
+{
+  inflate_arena *arena = opaque;
+  UINT64 len = ((UINT64)items * size + 7) & ~7ULL;
+  void *addr;
+
+  if (len > arena->size - arena->used) {
+    return NULL;
+  }
+  addr = arena->base + arena->used;
+  arena->used += len;
+  return addr;
+}
+
+static void
+arena_free (voidpf opaque, void *addr)
+{
+}
+
+/* Runs on the BSP and on every AP, each taking blocks until none are left.
+ * Nothing here may call boot services or print.
+ */
+static VOID EFIAPI
+inflate_blocks (VOID *arg)
+{
+  parallel_inflate *ctx = arg;
+  struct z_stream_s stream;
+  const unsigned char *entry;
+  UINT32 slot;
+  UINT32 block;
+  unsigned int in_off;
+  unsigned int out_off;
+  unsigned int out_len;
+  int rc;
+
+  slot = InterlockedIncrement ((UINT32 *)&ctx->next_arena) - 1;
+  if (slot >= ctx->num_arenas) {
+    return;
+  }
+
+  SetMem (&stream, sizeof (stream), 0);
+  stream.zalloc = arena_alloc;
+  stream.zfree = arena_free;
+  stream.opaque = &ctx->arenas[slot];
+  if (inflateInit2 (&stream, -MAX_WBITS) != Z_OK) {
+    ctx->failed = 1;
+    return;
+  }
+
+  while (!ctx->failed) {
+    block = InterlockedIncrement ((UINT32 *)&ctx->next_block) - 1;
+    if (block >= ctx->num_blocks) {
+      break;
+    }
+
+    entry = ctx->index + 4 + block * 8;
+    in_off = get_le32 (entry);
+    out_off = get_le32 (entry + 4);
+    out_len = get_le32 (entry + 12) - out_off;
+
+    inflateReset (&stream);
+    stream.next_in = ctx->in_buf + in_off;
+    stream.avail_in = get_le32 (entry + 8) - in_off;
+    stream.next_out = ctx->out_buf + out_off;
+    stream.avail_out = out_len;
+
+    rc = inflate (&stream, Z_SYNC_FLUSH);
+    if (stream.avail_in != 0 || stream.avail_out != 0 ||
+        rc != ((block == ctx->num_blocks - 1) ? Z_STREAM_END : Z_OK)) {
+      ctx->failed = 1;
+    }
+    ctx->block_crcs[block] = crc32 (0, ctx->out_buf + out_off, out_len);
+  }
+
+  inflateEnd (&stream);
+}
+
+/* Checks the block index against the buffers and returns the length of
+ * the deflate data it covers, 0 if it can not be used.
+ */
+static unsigned int
+check_block_index (const unsigned char *index,
+                   unsigned int index_len,
+                   unsigned int in_len,
+                   unsigned int out_buf_len)
+{
+  unsigned int num_blocks;
+  unsigned int i;
+
+  if (index_len < 4) {
+    return 0;
+  }
+  num_blocks = get_le32 (index);
+  if (num_blocks == 0 || num_blocks > GZIP_INDEX_MAX_BLOCKS ||
+      index_len != 4 + (num_blocks + 1) * 8 ||
+      get_le32 (index + 4) != 0 || get_le32 (index + 8) != 0) {
+    return 0;
+  }
+
+  for (i = 1; i <= num_blocks; i++) {
+    if (get_le32 (index + 4 + i * 8) <= get_le32 (index + 4 + (i - 1) * 8) ||
+        get_le32 (index + 8 + i * 8) <= get_le32 (index + 8 + (i - 1) * 8)) {
+      return 0;
+    }
+  }
+
+  if (get_le32 (index + 4 + num_blocks * 8) > in_len ||
+      get_le32 (index + 8 + num_blocks * 8) > out_buf_len) {
+    return 0;
+  }
+
+  return get_le32 (index + 4 + num_blocks * 8);
+}
+
+/* Inflates the blocks described by "index" on all enabled cores.
+ * Returns 0 on success and -1 if the caller should fall back to a
+ * single stream inflate.
+ */
+static int
+decompress_parallel (unsigned char *in_buf,
+                     unsigned int in_len,
+                     const unsigned char *index,
+                     unsigned int index_len,
+                     unsigned char *out_buf,
+                     unsigned int out_buf_len,
+                     unsigned int *in_used,
+                     unsigned int *out_len)
+{
+  EFI_MP_SERVICES_PROTOCOL *MpServices = NULL;
+  EFI_EVENT ApsDone = NULL;
+  EFI_STATUS Status;
+  UINTN NumProcessors = 0;
+  UINTN NumEnabled = 0;
+  BOOLEAN ApsStarted = FALSE;
+  parallel_inflate ctx;
+  unsigned long crc;
+  unsigned int i;
+  int rc = -1;
+
+  SetMem (&ctx, sizeof (ctx), 0);
+  *in_used = check_block_index (index, index_len, in_len, out_buf_len);
+  if (*in_used == 0) {
+    DEBUG ((EFI_D_ERROR, "Ignoring invalid gzip block index\n"));
+    return rc;
+  }
+
+  Status = gBS->LocateProtocol (&gEfiMpServiceProtocolGuid, NULL,
+                                (VOID **)&MpServices);
+  if (Status != EFI_SUCCESS) {
+    return rc;
+  }
+  Status = MpServices->GetNumberOfProcessors (MpServices, &NumProcessors,
+                                              &NumEnabled);
+  if (Status != EFI_SUCCESS ||
+      NumEnabled < 2) {
+    return rc;
+  }
+
+  ctx.in_buf = in_buf;
+  ctx.out_buf = out_buf;
+  ctx.index = index;
+  ctx.num_blocks = get_le32 (index);
+  ctx.num_arenas = NumEnabled;
+  ctx.block_crcs = AllocatePool (ctx.num_blocks * sizeof (*ctx.block_crcs));
+  if (ctx.block_crcs == NULL) {
+    return rc;
+  }
+  ctx.arenas = AllocateZeroPool (NumEnabled * sizeof (*ctx.arenas));
+  if (ctx.arenas == NULL) {
+    FreePool (ctx.block_crcs);
+    return rc;
+  }
+  for (i = 0; i < ctx.num_arenas; i++) {
+    ctx.arenas[i].size = INFLATE_ARENA_SIZE;
+    ctx.arenas[i].base = AllocatePool (INFLATE_ARENA_SIZE);
+    if (ctx.arenas[i].base == NULL) {
+      goto out;
+    }
+  }
+
+  Status = gBS->CreateEvent (0, 0, NULL, NULL, &ApsDone);
+  if (Status != EFI_SUCCESS) {
+    goto out;
+  }
+
+  DEBUG ((EFI_D_INFO, "Inflating %u blocks on %u cores\n", ctx.num_blocks,
+          NumEnabled));
+  Status = MpServices->StartupAllAPs (MpServices, inflate_blocks, FALSE,
+                                      ApsDone, 0, &ctx, NULL);
+  ApsStarted = (Status == EFI_SUCCESS);
+  inflate_blocks (&ctx);
+  if (ApsStarted) {
+    while (gBS->CheckEvent (ApsDone) == EFI_NOT_READY);
+  }
+
+  if (!ctx.failed &&
+      ctx.next_block >= ctx.num_blocks) {
+    *out_len = get_le32 (index + 8 + ctx.num_blocks * 8);
+    rc = 0;
+    if (in_len - *in_used >= GZIP_TRAILER_LEN) {
+      crc = ctx.block_crcs[0];
+      for (i = 1; i < ctx.num_blocks; i++) {
+        crc = crc32_combine (crc, ctx.block_crcs[i],
+                             get_le32 (index + 16 + i * 8) -
+                             get_le32 (index + 8 + i * 8));
+      }
+      rc = check_gzip_trailer (in_buf + *in_used, crc, *out_len);
+    }
+  } else {
+    DEBUG ((EFI_D_ERROR, "Parallel inflate failed\n"));
+  }
+
+out:
+  if (ApsDone != NULL) {
+    gBS->CloseEvent (ApsDone);
+  }
+  for (i = 0; i < ctx.num_arenas; i++) {
+    if (ctx.arenas[i].base != NULL) {
+      FreePool (ctx.arenas[i].base);
+    }
+  }
+  FreePool (ctx.arenas);
+  FreePool (ctx.block_crcs);
+  return rc;
+}
+
 /* decompress gzip file "in_buf", return 0 if decompressed successful,
  * return -1 if decompressed failed.
  * in_buf - input gzip file
@@ -83,8 +450,12 @@ decompress (unsigned char *in_buf,
             unsigned int *out_len)
 {
   struct z_stream_s *stream;
+  const unsigned char *index = NULL;
+  unsigned int index_len = 0;
+  unsigned int hdr_len;
+  unsigned int in_used = 0;
+  unsigned int total_out = 0;
   int rc = -1;
-  int i;
 
   if (in_len <= GZIP_HEADER_LEN) {
     DEBUG ((EFI_D_ERROR, "the input data is not a gzip package.\n"));
@@ -98,6 +469,23 @@ decompress (unsigned char *in_buf,
     return rc;
   }
 
+  hdr_len = gzip_header_len (in_buf, in_len, &index, &index_len);
+  if (hdr_len == 0) {
+    DEBUG ((EFI_D_ERROR, "header error\n"));
+    return rc;
+  }
+
+  if (index != NULL &&
+      !decompress_parallel (in_buf + hdr_len, in_len - hdr_len, index,
+                            index_len, out_buf, out_buf_len, &in_used,
+                            &total_out)) {
+    if (pos)
+      *pos = hdr_len + in_used + 8;
+    if (out_len)
+      *out_len = total_out;
+    return 0;
+  }
+
   stream = AllocateZeroPool (sizeof (*stream));
   if (stream == NULL) {
     DEBUG ((EFI_D_ERROR, "allocating z_stream failed.\n"));
@@ -110,18 +498,8 @@ decompress (unsigned char *in_buf,
   stream->avail_out = out_buf_len;
 
   /* skip over gzip header */
-  stream->next_in = in_buf + GZIP_HEADER_LEN;
-  stream->avail_in = in_len - GZIP_HEADER_LEN;
-  /* skip over ascii filename */
-  if (in_buf[3] & 0x8) {
-    for (i = 0; i < GZIP_FILENAME_LIMIT && *stream->next_in++; i++) {
-      if (stream->avail_in == 0) {
-        DEBUG ((EFI_D_ERROR, "header error\n"));
-        goto gunzip_end;
-      }
-      --stream->avail_in;
-    }
-  }
+  stream->next_in = in_buf + hdr_len;
+  stream->avail_in = in_len - hdr_len;
 
   rc = inflateInit2 (stream, -MAX_WBITS);
   if (rc != Z_OK) {
@@ -140,6 +518,14 @@ decompress (unsigned char *in_buf,
     goto gunzip_end;
   } else if (rc == Z_STREAM_END) {
     rc = 0;
+    if (stream->avail_in >= GZIP_TRAILER_LEN) {
+      rc = check_gzip_trailer (stream->next_in,
+                               crc32 (0, out_buf, stream->total_out),
+                               stream->total_out);
+      if (rc) {
+        goto gunzip_end;
+      }
+    }
   } else {
     DEBUG (
         (EFI_D_ERROR,
@@ -162,6 +548,128 @@ gunzip_end:
   return rc; /* returns 0 if decompressed successful */
 }
 
+/* gzip package inflated as it is handed in, see decompress_stream_start() */
+struct decompress_stream {
+  struct z_stream_s stream;
+  unsigned int hdr_len;
+  int state; /* 0 running, 1 at the end of the deflate data, -1 failed */
+  unsigned long crc; /* of the output so far */
+  unsigned char trailer[GZIP_TRAILER_LEN];
+  unsigned int trailer_len;
+};
+
+/* Starts inflating the gzip package whose first "in_len" bytes are at
+ * "in_buf" into "out_buf", these bytes must hold the whole gzip header.
+ * Returns NULL if the package can not be inflated in pieces. Block indexed
+ * packages are left to decompress(), which inflates them in parallel.
+ */
+struct decompress_stream *
+decompress_stream_start (unsigned char *in_buf,
+                         unsigned int in_len,
+                         unsigned char *out_buf,
+                         unsigned int out_buf_len)
+{
+  struct decompress_stream *s;
+  const unsigned char *index = NULL;
+  unsigned int index_len = 0;
+  unsigned int hdr_len;
+
+  if (!is_gzip_package (in_buf, in_len)) {
+    return NULL;
+  }
+
+  hdr_len = gzip_header_len (in_buf, in_len, &index, &index_len);
+  if (hdr_len == 0 ||
+      index != NULL) {
+    return NULL;
+  }
+
+  s = AllocateZeroPool (sizeof (*s));
+  if (s == NULL) {
+    return NULL;
+  }
+
+  s->stream.zalloc = zlib_alloc;
+  s->stream.zfree = zlib_free;
+  s->stream.next_out = out_buf;
+  s->stream.avail_out = out_buf_len;
+  s->hdr_len = hdr_len;
+  if (inflateInit2 (&s->stream, -MAX_WBITS) != Z_OK) {
+    FreePool (s);
+    return NULL;
+  }
+
+  decompress_stream_feed (s, in_buf + hdr_len, in_len - hdr_len);
+  return s;
+}
+
+/* Inflates the next "in_len" bytes of the package. Data behind the end of
+ * the deflate stream is ignored. Returns -1 once the stream failed.
+ */
+int
+decompress_stream_feed (struct decompress_stream *s,
+                        unsigned char *in_buf,
+                        unsigned int in_len)
+{
+  unsigned char *out = s->stream.next_out;
+  unsigned int len;
+  int rc;
+
+  if (s->state == 0 &&
+      in_len != 0) {
+    s->stream.next_in = in_buf;
+    s->stream.avail_in = in_len;
+    rc = inflate (&s->stream, Z_NO_FLUSH);
+    if (rc == Z_STREAM_END) {
+      s->state = 1;
+    } else if (rc != Z_OK ||
+               s->stream.avail_out == 0) {
+      /* Corrupt data, or the output buffer is full */
+      s->state = -1;
+    }
+    s->crc = crc32 (s->crc, out, s->stream.next_out - out);
+    in_buf = s->stream.next_in;
+    in_len = s->stream.avail_in;
+  }
+
+  /* Keep the trailer, it may come in several pieces */
+  if (s->state > 0) {
+    len = MIN (in_len, GZIP_TRAILER_LEN - s->trailer_len);
+    CopyMem (s->trailer + s->trailer_len, in_buf, len);
+    s->trailer_len += len;
+  }
+
+  return s->state < 0 ? -1 : 0;
+}
+
+/* Frees "s". Returns 0 with "pos" and "out_len" as for decompress() if the
+ * whole deflate stream was inflated and matches the gzip trailer, -1
+ * otherwise.
+ */
+int
+decompress_stream_finish (struct decompress_stream *s,
+                          unsigned int *pos,
+                          unsigned int *out_len)
+{
+  int rc = s->state > 0 ? 0 : -1;
+
+  if (!rc &&
+      s->trailer_len == GZIP_TRAILER_LEN) {
+    rc = check_gzip_trailer (s->trailer, s->crc, s->stream.total_out);
+  }
+
+  if (!rc) {
+    if (pos)
+      *pos = s->hdr_len + s->stream.total_in + 8;
+    if (out_len)
+      *out_len = s->stream.total_out;
+  }
+
+  inflateEnd (&s->stream);
+  FreePool (s);
+  return rc;
+}
+
 /* check if the input "buf" file was a gzip package.
  * Return true if the input "buf" is a gzip package.
  */
@@ -174,3 +682,56 @@ is_gzip_package (unsigned char *buf, unsigned int len)
 
   return true;
 }
+
+/* Returns true if "buf" is a gzip, LZ4 or zstd package */
+int
+is_compressed_package (unsigned char *buf, unsigned int len)
+{
+  return is_gzip_package (buf, len) ||
+         is_lz4_package (buf, len) ||
+         is_zstd_package (buf, len);
+}
+
+/* decompress() for any package is_compressed_package() accepts, the format
+ * is picked by its magic. Arguments and return value are as for
+ * decompress().
+ */
+int
+decompress_package (unsigned char *in_buf,
+                    unsigned int in_len,
+                    unsigned char *out_buf,
+                    unsigned int out_buf_len,
+                    unsigned int *pos,
+                    unsigned int *out_len)
+{
+  UINTN in_used = 0;
+  UINTN total_out = 0;
+  int rc;
+
+  if (is_gzip_package (in_buf, in_len)) {
+    return decompress (in_buf, in_len, out_buf, out_buf_len, pos, out_len);
+  }
+
+  if (is_lz4_package (in_buf, in_len)) {
+    rc = lz4_decompress (in_buf, in_len, out_buf, out_buf_len, &in_used,
+                         &total_out);
+  } else if (is_zstd_package (in_buf, in_len)) {
+    rc = zstd_decompress (in_buf, in_len, out_buf, out_buf_len, &in_used,
+                          &total_out);
+  } else {
+    DEBUG ((EFI_D_ERROR, "Unknown compression format\n"));
+    return -1;
+  }
+
+  if (rc) {
+    DEBUG ((EFI_D_ERROR, "Error in decompression: corrupt %a data\n",
+            is_lz4_package (in_buf, in_len) ? "lz4" : "zstd"));
+    return -1;
+  }
+
+  if (pos)
+    *pos = in_used;
+  if (out_len)
+    *out_len = total_out;
+  return 0;
+}
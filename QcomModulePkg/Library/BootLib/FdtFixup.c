@@ -0,0 +1,716 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DebugLib.h>
+#include <Library/FdtFixup.h>
+#include <Library/MemoryAllocationLib.h>
+
+/* Each libfdt edit moves the rest of the blob. The batch works out the
+ * final size first, then copies the structure block once and splices the
+ * edited properties and the new nodes in on the way.
+ */
+
+#define FDT_FIXUP_ALIGN(x) (((x) + FDT_TAGSIZE - 1) & ~(FDT_TAGSIZE - 1))
+#define FDT_FIXUP_MAX_DEPTH 32
+
+typedef struct {
+  INT32 Node;
+  BOOLEAN Flushed; /* new properties of the node are written */
+} FDT_FIXUP_LEVEL;
+
+VOID
+FdtFixupInit (FDT_FIXUPS *Fixups, VOID *Fdt)
+{
+  SetMem (Fixups, sizeof (*Fixups), 0);
+  Fixups->Fdt = Fdt;
+}
+
+VOID
+FdtFixupFree (FDT_FIXUPS *Fixups)
+{
+  UINT32 i;
+
+  for (i = 0; i < Fixups->PropCount; i++) {
+    if (Fixups->Props[i].Data) {
+      FreePool (Fixups->Props[i].Data);
+    }
+  }
+  for (i = 0; i < Fixups->NodeCount; i++) {
+    FreePool (Fixups->Nodes[i].Name);
+  }
+
+  Fixups->PropCount = 0;
+  Fixups->NodeCount = 0;
+  Fixups->PathCount = 0;
+}
+
+INT32
+FdtFixupPathOffset (FDT_FIXUPS *Fixups, CONST CHAR8 *Path)
+{
+  FDT_FIXUP_PATH *Entry;
+  INT32 Offset;
+  UINT32 i;
+
+  for (i = 0; i < Fixups->PathCount; i++) {
+    Entry = &Fixups->Paths[i];
+    if (Entry->Path == Path ||
+        !AsciiStrCmp (Entry->Path, Path)) {
+      return Entry->Offset;
+    }
+  }
+
+  Offset = fdt_path_offset (Fixups->Fdt, Path);
+  if (Fixups->PathCount < FDT_FIXUP_MAX_PATHS) {
+    Entry = &Fixups->Paths[Fixups->PathCount++];
+    Entry->Path = Path;
+    Entry->Offset = Offset;
+  }
+
+  return Offset;
+}
+
+INT32
+FdtFixupAddNode (FDT_FIXUPS *Fixups, INT32 Parent, CONST CHAR8 *Name)
+{
+  FDT_FIXUP_NODE *Node;
+  INT32 Ret;
+  UINT32 i;
+
+  if (Parent < 0 ||
+      Parent >= FDT_FIXUP_NEW_NODE) {
+    return -FDT_ERR_BADOFFSET;
+  }
+
+  Ret = fdt_subnode_offset (Fixups->Fdt, Parent, Name);
+  if (Ret >= 0) {
+    return -FDT_ERR_EXISTS;
+  } else if (Ret != -FDT_ERR_NOTFOUND) {
+    return Ret;
+  }
+
+  for (i = 0; i < Fixups->NodeCount; i++) {
+    if (Fixups->Nodes[i].Parent == Parent &&
+        !AsciiStrCmp (Fixups->Nodes[i].Name, Name)) {
+      return -FDT_ERR_EXISTS;
+    }
+  }
+
+  if (Fixups->NodeCount >= FDT_FIXUP_MAX_NODES) {
+    return -FDT_ERR_NOSPACE;
+  }
+
+  Node = &Fixups->Nodes[Fixups->NodeCount];
+  Node->Name = AllocateCopyPool (AsciiStrSize (Name), Name);
+  if (!Node->Name) {
+    return -FDT_ERR_NOSPACE;
+  }
+  Node->Parent = Parent;
+
+  return FDT_FIXUP_NEW_NODE + Fixups->NodeCount++;
+}
+
+STATIC INT32
+FdtFixupAddProp (FDT_FIXUPS *Fixups,
+                 INT32 Node,
+                 CONST CHAR8 *Name,
+                 CONST VOID *Val,
+                 UINT32 Len,
+                 BOOLEAN Append,
+                 BOOLEAN Join)
+{
+  FDT_FIXUP_PROP *Prop = NULL;
+  UINT8 *Data = NULL;
+  UINT32 Keep;
+  UINT32 i;
+
+  if (Node < 0 ||
+      (Node >= FDT_FIXUP_NEW_NODE &&
+       Node - FDT_FIXUP_NEW_NODE >= (INT32)Fixups->NodeCount)) {
+    return -FDT_ERR_BADOFFSET;
+  }
+
+  for (i = 0; i < Fixups->PropCount; i++) {
+    if (Fixups->Props[i].Node == Node &&
+        !AsciiStrCmp (Fixups->Props[i].Name, Name)) {
+      Prop = &Fixups->Props[i];
+      break;
+    }
+  }
+
+  if (!Prop &&
+      Fixups->PropCount >= FDT_FIXUP_MAX_PROPS) {
+    return -FDT_ERR_NOSPACE;
+  }
+
+  /* Queued value that stays in front of the new one */
+  Keep = (Prop && Append) ? Prop->Len : 0;
+  if (Keep + Len < Keep) {
+    return -FDT_ERR_NOSPACE;
+  }
+
+  if (Keep + Len) {
+    Data = AllocatePool (Keep + Len);
+    if (!Data) {
+      return -FDT_ERR_NOSPACE;
+    }
+    if (Keep) {
+      CopyMem (Data, Prop->Data, Keep);
+      if (Join) {
+        Data[Keep - 1] = ' ';
+      }
+    }
+    if (Len) {
+      CopyMem (Data + Keep, Val, Len);
+    }
+  }
+
+  if (!Prop) {
+    Prop = &Fixups->Props[Fixups->PropCount++];
+    Prop->Node = Node;
+    Prop->Name = Name;
+    Prop->Keep = Append;
+    Prop->Join = Join;
+  } else {
+    if (Prop->Data) {
+      FreePool (Prop->Data);
+    }
+    if (!Append) {
+      Prop->Keep = FALSE;
+      Prop->Join = FALSE;
+    }
+  }
+  Prop->Data = Data;
+  Prop->Len = Keep + Len;
+
+  return 0;
+}
+
+INT32
+FdtFixupSetProp (FDT_FIXUPS *Fixups,
+                 INT32 Node,
+                 CONST CHAR8 *Name,
+                 CONST VOID *Val,
+                 UINT32 Len)
+{
+  return FdtFixupAddProp (Fixups, Node, Name, Val, Len, FALSE, FALSE);
+}
+
+INT32
+FdtFixupAppendProp (FDT_FIXUPS *Fixups,
+                    INT32 Node,
+                    CONST CHAR8 *Name,
+                    CONST VOID *Val,
+                    UINT32 Len)
+{
+  return FdtFixupAddProp (Fixups, Node, Name, Val, Len, TRUE, FALSE);
+}
+
+INT32
+FdtFixupSetPropU32 (FDT_FIXUPS *Fixups,
+                    INT32 Node,
+                    CONST CHAR8 *Name,
+                    UINT32 Val)
+{
+  fdt32_t Tmp = cpu_to_fdt32 (Val);
+
+  return FdtFixupAddProp (Fixups, Node, Name, &Tmp, sizeof (Tmp), FALSE,
+                          FALSE);
+}
+
+INT32
+FdtFixupSetPropU64 (FDT_FIXUPS *Fixups,
+                    INT32 Node,
+                    CONST CHAR8 *Name,
+                    UINT64 Val)
+{
+  fdt64_t Tmp = cpu_to_fdt64 (Val);
+
+  return FdtFixupAddProp (Fixups, Node, Name, &Tmp, sizeof (Tmp), FALSE,
+                          FALSE);
+}
+
+INT32
+FdtFixupAppendPropU32 (FDT_FIXUPS *Fixups,
+                       INT32 Node,
+                       CONST CHAR8 *Name,
+                       UINT32 Val)
+{
+  fdt32_t Tmp = cpu_to_fdt32 (Val);
+
+  return FdtFixupAddProp (Fixups, Node, Name, &Tmp, sizeof (Tmp), TRUE,
+                          FALSE);
+}
+
+INT32
+FdtFixupAppendPropU64 (FDT_FIXUPS *Fixups,
+                       INT32 Node,
+                       CONST CHAR8 *Name,
+                       UINT64 Val)
+{
+  fdt64_t Tmp = cpu_to_fdt64 (Val);
+
+  return FdtFixupAddProp (Fixups, Node, Name, &Tmp, sizeof (Tmp), TRUE,
+                          FALSE);
+}
+
+INT32
+FdtFixupSetPropString (FDT_FIXUPS *Fixups,
+                       INT32 Node,
+                       CONST CHAR8 *Name,
+                       CONST CHAR8 *Str)
+{
+  return FdtFixupAddProp (Fixups, Node, Name, Str, AsciiStrSize (Str), FALSE,
+                          FALSE);
+}
+
+INT32
+FdtFixupAppendPropString (FDT_FIXUPS *Fixups,
+                          INT32 Node,
+                          CONST CHAR8 *Name,
+                          CONST CHAR8 *Str)
+{
+  return FdtFixupAddProp (Fixups, Node, Name, Str, AsciiStrSize (Str), TRUE,
+                          TRUE);
+}
+
+/* Offset of Name in the strings block, or -1 */
+STATIC INT32
+FdtFixupFindString (CONST CHAR8 *Strings, UINT32 Size, CONST CHAR8 *Name)
+{
+  UINT32 Len = AsciiStrSize (Name);
+  UINT32 Off;
+
+  for (Off = 0; Off + Len <= Size; Off++) {
+    if (Strings[Off] == Name[0] &&
+        !CompareMem (Strings + Off, Name, Len)) {
+      return Off;
+    }
+  }
+
+  return -1;
+}
+
+/* Edits of existing properties sort by their place in the structure
+ * block, added properties by the node they go to.
+ */
+STATIC INT32
+FdtFixupSortKey (CONST FDT_FIXUP_PROP *Prop)
+{
+  return Prop->OldOffset >= 0 ? Prop->OldOffset : Prop->Node;
+}
+
+/* Inserts Props[Index] into Order, after the entries with the same key so
+ * the queue order is kept. Returns the new count.
+ */
+STATIC UINT32
+FdtFixupInsertOrder (FDT_FIXUPS *Fixups,
+                     UINT32 *Order,
+                     UINT32 Count,
+                     UINT32 Index)
+{
+  INT32 Key = FdtFixupSortKey (&Fixups->Props[Index]);
+  UINT32 j = Count;
+
+  while (j &&
+         FdtFixupSortKey (&Fixups->Props[Order[j - 1]]) > Key) {
+    Order[j] = Order[j - 1];
+    j--;
+  }
+  Order[j] = Index;
+
+  return Count + 1;
+}
+
+/* Works out where the edits go and how much the blocks grow */
+STATIC INT32
+FdtFixupPrepare (FDT_FIXUPS *Fixups, UINT32 *StructGrow, UINT32 *StringsGrow)
+{
+  VOID *Fdt = Fixups->Fdt;
+  CONST CHAR8 *Strings = (CONST CHAR8 *)Fdt + fdt_off_dt_strings (Fdt);
+  UINT32 StringsSize = fdt_size_dt_strings (Fdt);
+  CONST struct fdt_property *Old;
+  FDT_FIXUP_PROP *Prop;
+  UINT32 StructAdd = 0;
+  UINT32 StructDrop = 0;
+  UINT32 NewStrings = 0;
+  INT32 Len;
+  INT32 Off;
+  UINT32 i;
+  UINT32 j;
+
+  Fixups->EditCount = 0;
+  Fixups->AddCount = 0;
+  for (i = 0; i < Fixups->PropCount; i++) {
+    Prop = &Fixups->Props[i];
+    Prop->OldOffset = -1;
+    Prop->OldLen = 0;
+
+    if (Prop->Node < FDT_FIXUP_NEW_NODE) {
+      Old = fdt_get_property (Fdt, Prop->Node, Prop->Name, &Len);
+      if (Old) {
+        Prop->OldOffset = (CONST CHAR8 *)Old - (CONST CHAR8 *)Fdt -
+                          fdt_off_dt_struct (Fdt);
+        Prop->OldLen = Len;
+        Prop->FinalLen = (Prop->Keep ? Prop->OldLen : 0) + Prop->Len;
+        Prop->NameOff = fdt32_to_cpu (Old->nameoff);
+        StructDrop += FDT_FIXUP_ALIGN (Prop->OldLen);
+        StructAdd += FDT_FIXUP_ALIGN (Prop->FinalLen);
+        Fixups->EditCount = FdtFixupInsertOrder (Fixups, Fixups->EditOrder,
+                                                 Fixups->EditCount, i);
+        continue;
+      } else if (Len != -FDT_ERR_NOTFOUND) {
+        return Len;
+      }
+
+      Fixups->AddCount = FdtFixupInsertOrder (Fixups, Fixups->AddOrder,
+                                              Fixups->AddCount, i);
+    }
+
+    Prop->FinalLen = Prop->Len;
+    StructAdd += sizeof (struct fdt_property) + FDT_FIXUP_ALIGN (Prop->Len);
+
+    Off = FdtFixupFindString (Strings, StringsSize, Prop->Name);
+    if (Off >= 0) {
+      Prop->NameOff = Off;
+      continue;
+    }
+
+    /* Names new to the tree are added once */
+    for (j = 0; j < i; j++) {
+      if (Fixups->Props[j].OldOffset < 0 &&
+          Fixups->Props[j].NameOff >= StringsSize &&
+          !AsciiStrCmp (Fixups->Props[j].Name, Prop->Name)) {
+        break;
+      }
+    }
+    if (j < i) {
+      Prop->NameOff = Fixups->Props[j].NameOff;
+    } else {
+      Prop->NameOff = StringsSize + NewStrings;
+      NewStrings += AsciiStrSize (Prop->Name);
+    }
+  }
+
+  for (i = 0; i < Fixups->NodeCount; i++) {
+    StructAdd += 2 * FDT_TAGSIZE +
+                 FDT_FIXUP_ALIGN (AsciiStrSize (Fixups->Nodes[i].Name));
+  }
+
+  *StructGrow = StructAdd - StructDrop;
+  *StringsGrow = NewStrings;
+  if (StructAdd < StructDrop) {
+    *StructGrow = 0;
+  }
+
+  return 0;
+}
+
+STATIC UINT32
+FdtFixupWriteProp (FDT_FIXUP_PROP *Prop, CHAR8 *Out, CONST CHAR8 *OldData)
+{
+  struct fdt_property *Hdr = (struct fdt_property *)Out;
+  UINT32 Pos = sizeof (*Hdr);
+
+  Hdr->tag = cpu_to_fdt32 (FDT_PROP);
+  Hdr->len = cpu_to_fdt32 (Prop->FinalLen);
+  Hdr->nameoff = cpu_to_fdt32 (Prop->NameOff);
+  if (OldData &&
+      Prop->Keep &&
+      Prop->OldLen) {
+    CopyMem (Out + Pos, OldData, Prop->OldLen);
+    Pos += Prop->OldLen;
+    if (Prop->Join) {
+      Out[Pos - 1] = ' ';
+    }
+  }
+  if (Prop->Len) {
+    CopyMem (Out + Pos, Prop->Data, Prop->Len);
+    Pos += Prop->Len;
+  }
+  while (Pos & (FDT_TAGSIZE - 1)) {
+    Out[Pos++] = 0;
+  }
+
+  return Pos;
+}
+
+/* Writes the properties the batch adds to the existing Node. The nodes
+ * are flushed in structure block order, Cursor walks AddOrder along.
+ */
+STATIC UINT32
+FdtFixupWriteAddedProps (FDT_FIXUPS *Fixups,
+                         INT32 Node,
+                         CHAR8 *Out,
+                         UINT32 *Cursor)
+{
+  FDT_FIXUP_PROP *Prop;
+  UINT32 Pos = 0;
+
+  while (*Cursor < Fixups->AddCount) {
+    Prop = &Fixups->Props[Fixups->AddOrder[*Cursor]];
+    if (Prop->Node > Node) {
+      break;
+    }
+    if (Prop->Node == Node) {
+      Pos += FdtFixupWriteProp (Prop, Out + Pos, NULL);
+    }
+    (*Cursor)++;
+  }
+
+  return Pos;
+}
+
+/* Writes the properties of a node added by the batch */
+STATIC UINT32
+FdtFixupWriteNewProps (FDT_FIXUPS *Fixups, INT32 Node, CHAR8 *Out)
+{
+  UINT32 Pos = 0;
+  UINT32 i;
+
+  for (i = 0; i < Fixups->PropCount; i++) {
+    if (Fixups->Props[i].Node == Node &&
+        Fixups->Props[i].OldOffset < 0) {
+      Pos += FdtFixupWriteProp (&Fixups->Props[i], Out + Pos, NULL);
+    }
+  }
+
+  return Pos;
+}
+
+/* Writes the subnodes the batch adds to Parent */
+STATIC UINT32
+FdtFixupWriteNewNodes (FDT_FIXUPS *Fixups, INT32 Parent, CHAR8 *Out)
+{
+  UINT32 Pos = 0;
+  UINT32 Len;
+  UINT32 i;
+
+  for (i = 0; i < Fixups->NodeCount; i++) {
+    if (Fixups->Nodes[i].Parent != Parent) {
+      continue;
+    }
+
+    *(fdt32_t *)(Out + Pos) = cpu_to_fdt32 (FDT_BEGIN_NODE);
+    Pos += FDT_TAGSIZE;
+    Len = AsciiStrSize (Fixups->Nodes[i].Name);
+    CopyMem (Out + Pos, Fixups->Nodes[i].Name, Len);
+    Pos += Len;
+    while (Pos & (FDT_TAGSIZE - 1)) {
+      Out[Pos++] = 0;
+    }
+
+    Pos += FdtFixupWriteNewProps (Fixups, FDT_FIXUP_NEW_NODE + i, Out + Pos);
+
+    *(fdt32_t *)(Out + Pos) = cpu_to_fdt32 (FDT_END_NODE);
+    Pos += FDT_TAGSIZE;
+  }
+
+  return Pos;
+}
+
+/* Copies the structure block to Out with the edits spliced in */
+STATIC INT32
+FdtFixupWriteStruct (FDT_FIXUPS *Fixups, CHAR8 *Out, UINT32 *OutLen)
+{
+  VOID *Fdt = Fixups->Fdt;
+  CONST CHAR8 *Struct = (CONST CHAR8 *)Fdt + fdt_off_dt_struct (Fdt);
+  FDT_FIXUP_LEVEL Stack[FDT_FIXUP_MAX_DEPTH];
+  FDT_FIXUP_LEVEL *Top;
+  FDT_FIXUP_PROP *Prop;
+  UINT32 Depth = 0;
+  UINT32 Pos = 0;
+  UINT32 Tag;
+  INT32 Offset = 0;
+  INT32 Next;
+  UINT32 Edit = 0;
+  UINT32 Add = 0;
+
+  do {
+    Tag = fdt_next_tag (Fdt, Offset, &Next);
+    if (Next < 0) {
+      return Next;
+    }
+
+    switch (Tag) {
+    case FDT_BEGIN_NODE:
+      /* Properties come before the subnodes */
+      if (Depth) {
+        Top = &Stack[Depth - 1];
+        if (!Top->Flushed) {
+          Pos += FdtFixupWriteAddedProps (Fixups, Top->Node, Out + Pos, &Add);
+          Top->Flushed = TRUE;
+        }
+      }
+      if (Depth >= FDT_FIXUP_MAX_DEPTH) {
+        return -FDT_ERR_BADSTRUCTURE;
+      }
+      Stack[Depth].Node = Offset;
+      Stack[Depth].Flushed = FALSE;
+      Depth++;
+      break;
+
+    case FDT_PROP:
+      /* The edits are met in the order they were sorted in */
+      if (Edit < Fixups->EditCount &&
+          Fixups->Props[Fixups->EditOrder[Edit]].OldOffset == Offset) {
+        Prop = &Fixups->Props[Fixups->EditOrder[Edit++]];
+        Pos += FdtFixupWriteProp (Prop, Out + Pos,
+                  ((CONST struct fdt_property *)(Struct + Offset))->data);
+        Offset = Next;
+        continue;
+      }
+      break;
+
+    case FDT_END_NODE:
+      if (!Depth) {
+        return -FDT_ERR_BADSTRUCTURE;
+      }
+      Top = &Stack[--Depth];
+      if (!Top->Flushed) {
+        Pos += FdtFixupWriteAddedProps (Fixups, Top->Node, Out + Pos, &Add);
+      }
+      Pos += FdtFixupWriteNewNodes (Fixups, Top->Node, Out + Pos);
+      break;
+    }
+
+    CopyMem (Out + Pos, Struct + Offset, Next - Offset);
+    Pos += Next - Offset;
+    Offset = Next;
+  } while (Tag != FDT_END);
+
+  *OutLen = Pos;
+  return 0;
+}
+
+INT32
+FdtFixupApply (FDT_FIXUPS *Fixups, UINT32 BufSize)
+{
+  VOID *Fdt = Fixups->Fdt;
+  VOID *Src = Fdt;
+  VOID *Converted = NULL;
+  CHAR8 *Out = NULL;
+  UINT32 StructGrow = 0;
+  UINT32 StringsGrow = 0;
+  UINT32 RsvOff;
+  UINT32 RsvSize;
+  UINT32 StructOff;
+  UINT32 StructSize = 0;
+  UINT32 StringsOff;
+  UINT32 StringsSize;
+  UINT64 MaxSize;
+  UINT32 i;
+  INT32 Ret;
+
+  /* Old versions are converted in a copy, the tree itself is only written
+   * once everything has been checked
+   */
+  if (fdt_version (Fdt) < 17) {
+    Converted = AllocatePool (BufSize);
+    if (!Converted) {
+      Ret = -FDT_ERR_NOSPACE;
+      goto out;
+    }
+    Ret = fdt_open_into (Fdt, Converted, BufSize);
+    if (Ret) {
+      goto out;
+    }
+    Src = Converted;
+    Fixups->Fdt = Src;
+  }
+
+  if (fdt_size_dt_struct (Src) >= FDT_FIXUP_NEW_NODE) {
+    Ret = -FDT_ERR_BADSTRUCTURE;
+    goto out;
+  }
+
+  Ret = FdtFixupPrepare (Fixups, &StructGrow, &StringsGrow);
+  if (Ret) {
+    goto out;
+  }
+
+  RsvOff = ALIGN_VALUE (sizeof (struct fdt_header), 8);
+  RsvSize = (fdt_num_mem_rsv (Src) + 1) * sizeof (struct fdt_reserve_entry);
+  StructOff = RsvOff + RsvSize;
+  StringsSize = fdt_size_dt_strings (Src);
+  MaxSize = (UINT64)StructOff + fdt_size_dt_struct (Src) + StructGrow +
+            StringsSize + StringsGrow;
+  if (MaxSize > BufSize) {
+    DEBUG ((EFI_D_ERROR, "Device tree fixups need %lu bytes, have %u\n",
+            MaxSize, BufSize));
+    Ret = -FDT_ERR_NOSPACE;
+    goto out;
+  }
+
+  Out = AllocatePool (MaxSize);
+  if (!Out) {
+    Ret = -FDT_ERR_NOSPACE;
+    goto out;
+  }
+
+  SetMem (Out, RsvOff, 0);
+  CopyMem (Out, Src, sizeof (struct fdt_header));
+  CopyMem (Out + RsvOff, (CHAR8 *)Src + fdt_off_mem_rsvmap (Src), RsvSize);
+
+  Ret = FdtFixupWriteStruct (Fixups, Out + StructOff, &StructSize);
+  if (Ret) {
+    goto out;
+  }
+
+  StringsOff = StructOff + StructSize;
+  CopyMem (Out + StringsOff, (CHAR8 *)Src + fdt_off_dt_strings (Src),
+           StringsSize);
+  for (i = 0; i < Fixups->PropCount; i++) {
+    if (Fixups->Props[i].NameOff >= StringsSize) {
+      CopyMem (Out + StringsOff + Fixups->Props[i].NameOff,
+               Fixups->Props[i].Name, AsciiStrSize (Fixups->Props[i].Name));
+    }
+  }
+  StringsSize += StringsGrow;
+
+  fdt_set_off_mem_rsvmap (Out, RsvOff);
+  fdt_set_off_dt_struct (Out, StructOff);
+  fdt_set_size_dt_struct (Out, StructSize);
+  fdt_set_off_dt_strings (Out, StringsOff);
+  fdt_set_size_dt_strings (Out, StringsSize);
+  fdt_set_totalsize (Out, StringsOff + StringsSize);
+
+  CopyMem (Fdt, Out, StringsOff + StringsSize);
+
+out:
+  if (Out) {
+    FreePool (Out);
+  }
+  if (Converted) {
+    FreePool (Converted);
+  }
+  Fixups->Fdt = Fdt;
+  FdtFixupFree (Fixups);
+  return Ret;
+}
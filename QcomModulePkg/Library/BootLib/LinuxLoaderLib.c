@@ -47,6 +47,273 @@
 #define FILE_INFO_SIZE (SIZE_OF_EFI_FILE_INFO + 256)
 
 STATIC UINT32 TimerFreq, FactormS;
+/* Index of the BlockIo handles and the protocols GetBlkIOHandles filters on.
+ * It is built on the first lookup and chained by partition name and type
+ * guid, so a lookup only visits the handles that can match. New BlockIo
+ * handles and ReenumeratePartTable drop it.
+ */
+#define PARTITION_INDEX_BUCKETS 64
+#define PARTITION_INDEX_END MAX_UINT32
+#define PARTITION_NAME_MAX_CHARS 36
+
+typedef struct {
+  EFI_HANDLE Handle;
+  EFI_BLOCK_IO_PROTOCOL *BlkIo;
+  EFI_DEVICE_PATH_PROTOCOL *DevPath;
+  EFI_PARTITION_ENTRY *PartEntry;
+  GUID *PartiType;
+  UINT32 NameNext;
+  UINT32 TypeNext;
+} PartitionIndexEntry;
+
+STATIC PartitionIndexEntry *PartIndex;
+STATIC UINT32 PartIndexCount;
+STATIC BOOLEAN PartIndexValid;
+STATIC UINT32 PartIndexByName[PARTITION_INDEX_BUCKETS];
+STATIC UINT32 PartIndexByType[PARTITION_INDEX_BUCKETS];
+STATIC EFI_EVENT PartIndexNotifyEvent;
+STATIC VOID *PartIndexRegistration;
+
+STATIC UINT32
+PartitionNameHash (CONST CHAR16 *Name)
+{
+  UINT32 Hash = 5381;
+  UINT32 Len;
+
+  for (Len = 0; (Len < PARTITION_NAME_MAX_CHARS) && Name[Len]; Len++) {
+    Hash = (Hash * 33) ^ Name[Len];
+  }
+
+  return Hash % PARTITION_INDEX_BUCKETS;
+}
+
+STATIC UINT32
+PartitionTypeHash (CONST GUID *Type)
+{
+  return (Type->Data1 ^ Type->Data2 ^ Type->Data4[7]) %
+         PARTITION_INDEX_BUCKETS;
+}
+
+STATIC VOID
+EFIAPI
+PartitionIndexNotify (IN EFI_EVENT Event, IN VOID *Context)
+{
+  PartIndexValid = FALSE;
+}
+
+VOID
+InvalidatePartitionIndex (VOID)
+{
+  PartIndexValid = FALSE;
+}
+
+STATIC EFI_STATUS
+BuildPartitionIndex (VOID)
+{
+  EFI_STATUS Status;
+  EFI_HANDLE *BlkIoHandles = NULL;
+  UINTN BlkIoHandleCount = 0;
+  PartitionIndexEntry *Entry;
+  UINT32 Bucket;
+  UINTN i;
+
+  if (PartIndexNotifyEvent == NULL) {
+    Status = gBS->CreateEvent (EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+                               PartitionIndexNotify, NULL,
+                               &PartIndexNotifyEvent);
+    if (Status != EFI_SUCCESS) {
+      return Status;
+    }
+
+    Status = gBS->RegisterProtocolNotify (&gEfiBlockIoProtocolGuid,
+                                          PartIndexNotifyEvent,
+                                          &PartIndexRegistration);
+    if (Status != EFI_SUCCESS) {
+      gBS->CloseEvent (PartIndexNotifyEvent);
+      PartIndexNotifyEvent = NULL;
+      return Status;
+    }
+  }
+
+  if (PartIndex != NULL) {
+    FreePool (PartIndex);
+    PartIndex = NULL;
+  }
+  PartIndexCount = 0;
+  SetMem (PartIndexByName, sizeof (PartIndexByName), 0xFF);
+  SetMem (PartIndexByType, sizeof (PartIndexByType), 0xFF);
+
+  /* Anything installed from here on is picked up by the next build */
+  PartIndexValid = TRUE;
+
+  Status = gBS->LocateHandleBuffer (ByProtocol, &gEfiBlockIoProtocolGuid,
+                                    NULL, &BlkIoHandleCount, &BlkIoHandles);
+  if (Status != EFI_SUCCESS) {
+    PartIndexValid = FALSE;
+    return Status;
+  }
+
+  PartIndex = AllocateZeroPool (BlkIoHandleCount * sizeof (*PartIndex));
+  if (PartIndex == NULL) {
+    FreePool (BlkIoHandles);
+    PartIndexValid = FALSE;
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  /* Walk backwards so that every chain keeps the handle database order */
+  for (i = BlkIoHandleCount; i > 0; i--) {
+    Entry = &PartIndex[i - 1];
+    Entry->Handle = BlkIoHandles[i - 1];
+    Status = gBS->HandleProtocol (Entry->Handle, &gEfiBlockIoProtocolGuid,
+                                  (VOID **)&Entry->BlkIo);
+    if (Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_ERROR, "Unable to get BlkIo protocol %r\n", Status));
+      FreePool (BlkIoHandles);
+      PartIndexValid = FALSE;
+      return Status;
+    }
+
+    gBS->HandleProtocol (Entry->Handle, &gEfiDevicePathProtocolGuid,
+                         (VOID **)&Entry->DevPath);
+    gBS->HandleProtocol (Entry->Handle, &gEfiPartitionRecordGuid,
+                         (VOID **)&Entry->PartEntry);
+    gBS->HandleProtocol (Entry->Handle, &gEfiPartitionTypeGuid,
+                         (VOID **)&Entry->PartiType);
+
+    Entry->NameNext = PARTITION_INDEX_END;
+    if (Entry->PartEntry != NULL) {
+      Bucket = PartitionNameHash (Entry->PartEntry->PartitionName);
+      Entry->NameNext = PartIndexByName[Bucket];
+      PartIndexByName[Bucket] = i - 1;
+    }
+
+    Entry->TypeNext = PARTITION_INDEX_END;
+    if (Entry->PartiType != NULL) {
+      Bucket = PartitionTypeHash (Entry->PartiType);
+      Entry->TypeNext = PartIndexByType[Bucket];
+      PartIndexByType[Bucket] = i - 1;
+    }
+  }
+
+  PartIndexCount = BlkIoHandleCount;
+  FreePool (BlkIoHandles);
+
+  return EFI_SUCCESS;
+}
+
+/* Check the partition related criteria of GetBlkIOHandles against the
+ * device path, partition type and partition record of one handle.
+ */
+STATIC BOOLEAN
+BlkIoHandleMatches (IN UINT32 SelectionAttrib,
+                    IN PartiSelectFilter *FilterData,
+                    IN EFI_BLOCK_IO_PROTOCOL *BlkIo,
+                    IN EFI_DEVICE_PATH_PROTOCOL *DevPathInst,
+                    IN GUID *PartiType,
+                    IN EFI_PARTITION_ENTRY *PartEntry,
+                    OUT HARDDRIVE_DEVICE_PATH **PartitionOut)
+{
+  UINTN DevicePathDepth;
+  HARDDRIVE_DEVICE_PATH *Partition;
+  EFI_DEVICE_PATH_PROTOCOL *TempDevicePath;
+  VENDOR_DEVICE_PATH *RootDevicePath;
+
+  /* Check if the media type criteria (for removable/not) satisfies */
+  if (BlkIo->Media->RemovableMedia) {
+    if ((SelectionAttrib & BLK_IO_SEL_MEDIA_TYPE_REMOVABLE) == 0)
+      return FALSE;
+  } else {
+    if ((SelectionAttrib & BLK_IO_SEL_MEDIA_TYPE_NON_REMOVABLE) == 0)
+      return FALSE;
+  }
+
+  /* Clear the pointer, we can get it if the filter is set */
+  *PartitionOut = NULL;
+
+  /* Check if partition related criteria satisfies */
+  if ((SelectionAttrib & FILTERS_NEEDING_DEVICEPATH) != 0) {
+    /* If we didn't get the DevicePath Protocol then this handle
+     * cannot be used */
+    if (DevPathInst == NULL)
+      return FALSE;
+
+    DevicePathDepth = 0;
+
+    /* Get the device path */
+    TempDevicePath = DevPathInst;
+    RootDevicePath = (VENDOR_DEVICE_PATH *)DevPathInst;
+    Partition = (HARDDRIVE_DEVICE_PATH *)TempDevicePath;
+
+    if ((SelectionAttrib & (BLK_IO_SEL_SELECT_ROOT_DEVICE_ONLY |
+                            BLK_IO_SEL_MATCH_ROOT_DEVICE)) != 0) {
+      /* If this is not the root device that we are looking for, ignore this
+       * handle */
+      if (RootDevicePath->Header.Type != HARDWARE_DEVICE_PATH ||
+          RootDevicePath->Header.SubType != HW_VENDOR_DP ||
+          (RootDevicePath->Header.Length[0] |
+           (RootDevicePath->Header.Length[1] << 8)) !=
+              sizeof (VENDOR_DEVICE_PATH) ||
+          CompareGuid (FilterData->RootDeviceType, &RootDevicePath->Guid) ==
+              FALSE)
+        return FALSE;
+    }
+
+    /* Locate the last Device Path Node */
+    while (!IsDevicePathEnd (TempDevicePath)) {
+      DevicePathDepth++;
+      Partition = (HARDDRIVE_DEVICE_PATH *)TempDevicePath;
+      TempDevicePath = NextDevicePathNode (TempDevicePath);
+    }
+
+    /* If we need the handle for root device only and if this is representing
+     * a sub partition in the root device then ignore this handle */
+    if (SelectionAttrib & BLK_IO_SEL_SELECT_ROOT_DEVICE_ONLY)
+      if (DevicePathDepth > 1)
+        return FALSE;
+
+    /* Check if the last node is Harddrive Device path that contains the
+     * Partition information */
+    if (Partition->Header.Type == MEDIA_DEVICE_PATH &&
+        Partition->Header.SubType == MEDIA_HARDDRIVE_DP &&
+        (Partition->Header.Length[0] | (Partition->Header.Length[1] << 8)) ==
+            sizeof (*Partition)) {
+      *PartitionOut = Partition;
+
+      if ((SelectionAttrib & BLK_IO_SEL_PARTITIONED_GPT) == 0)
+        if (Partition->MBRType == PARTITIONED_TYPE_GPT)
+          return FALSE;
+
+      if ((SelectionAttrib & BLK_IO_SEL_PARTITIONED_MBR) == 0)
+        if (Partition->MBRType == PARTITIONED_TYPE_MBR)
+          return FALSE;
+
+      /* PartitionDxe implementation should return partition type also */
+      if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID) != 0) {
+        if (PartiType == NULL)
+          return FALSE;
+
+        if (CompareGuid (PartiType, FilterData->PartitionType) == FALSE)
+          return FALSE;
+      }
+    }
+    /* If we wanted a particular partition and didn't get the HDD DP,
+       then this handle is probably not the interested ones */
+    else if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID) != 0)
+      return FALSE;
+  }
+  /* Check if the Partition name related criteria satisfies */
+  if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_LABEL) != 0) {
+    if (PartEntry == NULL)
+      return FALSE;
+    if (StrnCmp (PartEntry->PartitionName, FilterData->PartitionLabel,
+                 MAX (StrLen (PartEntry->PartitionName),
+                      StrLen (FilterData->PartitionLabel))))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 /**
   Returns a list of BlkIo handles based on required criteria
 SelectionAttrib : Bitmask representing the conditions that need
@@ -73,14 +340,15 @@ GetBlkIOHandles (IN UINT32 SelectionAttrib,
   EFI_HANDLE *BlkIoHandles;
   UINTN BlkIoHandleCount;
   UINTN i;
-  UINTN DevicePathDepth;
-  HARDDRIVE_DEVICE_PATH *Partition, *PartitionOut;
+  HARDDRIVE_DEVICE_PATH *PartitionOut;
   EFI_STATUS Status;
   EFI_DEVICE_PATH_PROTOCOL *DevPathInst;
-  EFI_DEVICE_PATH_PROTOCOL *TempDevicePath;
-  VENDOR_DEVICE_PATH *RootDevicePath;
+  GUID *PartiType;
   UINT32 BlkIoCnt = 0;
   EFI_PARTITION_ENTRY *PartEntry;
+  PartitionIndexEntry *Entry;
+  UINT32 Next;
+  BOOLEAN ByName;
 
   if ((MaxBlkIopCnt == NULL) || (HandleInfoPtr == NULL))
     return EFI_INVALID_PARAMETER;
@@ -96,18 +364,70 @@ GetBlkIOHandles (IN UINT32 SelectionAttrib,
     SelectionAttrib |=
         (BLK_IO_SEL_PARTITIONED_GPT | BLK_IO_SEL_PARTITIONED_MBR);
 
-  /* If we need Filesystem handle then search based on that its narrower search
-   * than BlkIo */
-  if (SelectionAttrib & (BLK_IO_SEL_SELECT_MOUNTED_FILESYSTEM |
-                         BLK_IO_SEL_SELECT_BY_VOLUME_NAME)) {
-    Status =
-        gBS->LocateHandleBuffer (ByProtocol, &gEfiSimpleFileSystemProtocolGuid,
-                                 NULL, &BlkIoHandleCount, &BlkIoHandles);
-  } else {
-    Status = gBS->LocateHandleBuffer (ByProtocol, &gEfiBlockIoProtocolGuid,
-                                      NULL, &BlkIoHandleCount, &BlkIoHandles);
+  if ((SelectionAttrib & (BLK_IO_SEL_SELECT_ROOT_DEVICE_ONLY |
+                          BLK_IO_SEL_MATCH_ROOT_DEVICE)) &&
+      (!FilterData || (FilterData->RootDeviceType == NULL)))
+    return EFI_INVALID_PARAMETER;
+
+  if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID) &&
+      (!FilterData || (FilterData->PartitionType == NULL)))
+    return EFI_INVALID_PARAMETER;
+
+  if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_LABEL) &&
+      (!FilterData || (FilterData->PartitionLabel == NULL)))
+    return EFI_INVALID_PARAMETER;
+
+  /* Block devices are looked up in the partition index */
+  if ((SelectionAttrib & (BLK_IO_SEL_SELECT_MOUNTED_FILESYSTEM |
+                          BLK_IO_SEL_SELECT_BY_VOLUME_NAME)) == 0) {
+    if (!PartIndexValid) {
+      Status = BuildPartitionIndex ();
+      if (Status != EFI_SUCCESS) {
+        DEBUG (
+            (EFI_D_ERROR, "Unable to get BlkIo Handle buffer %r\n", Status));
+        return Status;
+      }
+    }
+
+    ByName = (SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_LABEL) != 0;
+    if (ByName)
+      Next = PartIndexByName[PartitionNameHash (FilterData->PartitionLabel)];
+    else if (SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID)
+      Next = PartIndexByType[PartitionTypeHash (FilterData->PartitionType)];
+    else
+      Next = PartIndexCount ? 0 : PARTITION_INDEX_END;
+
+    while (Next != PARTITION_INDEX_END) {
+      Entry = &PartIndex[Next];
+      if (ByName)
+        Next = Entry->NameNext;
+      else if (SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID)
+        Next = Entry->TypeNext;
+      else
+        Next = (Next + 1 < PartIndexCount) ? Next + 1 : PARTITION_INDEX_END;
+
+      if (!BlkIoHandleMatches (SelectionAttrib, FilterData, Entry->BlkIo,
+                               Entry->DevPath, Entry->PartiType,
+                               Entry->PartEntry, &PartitionOut))
+        continue;
+
+      HandleInfoPtr[BlkIoCnt].Handle = Entry->Handle;
+      HandleInfoPtr[BlkIoCnt].BlkIo = Entry->BlkIo;
+      HandleInfoPtr[BlkIoCnt].PartitionInfo = PartitionOut;
+      BlkIoCnt++;
+      if (BlkIoCnt >= *MaxBlkIopCnt)
+        break;
+    }
+
+    *MaxBlkIopCnt = BlkIoCnt;
+    return EFI_SUCCESS;
   }
 
+  /* If we need Filesystem handle then search based on that its narrower search
+   * than BlkIo */
+  Status =
+      gBS->LocateHandleBuffer (ByProtocol, &gEfiSimpleFileSystemProtocolGuid,
+                               NULL, &BlkIoHandleCount, &BlkIoHandles);
   if (Status != EFI_SUCCESS) {
     DEBUG (
         (EFI_D_ERROR, "Unable to get Filesystem Handle buffer %r\n", Status));
@@ -122,121 +442,24 @@ GetBlkIOHandles (IN UINT32 SelectionAttrib,
 
     if (Status != EFI_SUCCESS) {
       DEBUG ((EFI_D_ERROR, "Unable to get Filesystem Handle %r\n", Status));
+      FreePool (BlkIoHandles);
       return Status;
     }
 
-    /* Check if the media type criteria (for removable/not) satisfies */
-    if (BlkIo->Media->RemovableMedia) {
-      if ((SelectionAttrib & BLK_IO_SEL_MEDIA_TYPE_REMOVABLE) == 0)
-        continue;
-    } else {
-      if ((SelectionAttrib & BLK_IO_SEL_MEDIA_TYPE_NON_REMOVABLE) == 0)
-        continue;
-    }
-
-    /* Clear the pointer, we can get it if the filter is set */
-    PartitionOut = NULL;
-
-    /* Check if partition related criteria satisfies */
-    if ((SelectionAttrib & FILTERS_NEEDING_DEVICEPATH) != 0) {
-      Status = gBS->HandleProtocol (
-          BlkIoHandles[i], &gEfiDevicePathProtocolGuid, (VOID **)&DevPathInst);
-
-      /* If we didn't get the DevicePath Protocol then this handle
-       * cannot be used */
-      if (EFI_ERROR (Status))
-        continue;
+    DevPathInst = NULL;
+    PartiType = NULL;
+    PartEntry = NULL;
+    gBS->HandleProtocol (BlkIoHandles[i], &gEfiDevicePathProtocolGuid,
+                         (VOID **)&DevPathInst);
+    gBS->HandleProtocol (BlkIoHandles[i], &gEfiPartitionTypeGuid,
+                         (VOID **)&PartiType);
+    gBS->HandleProtocol (BlkIoHandles[i], &gEfiPartitionRecordGuid,
+                         (VOID **)&PartEntry);
 
-      DevicePathDepth = 0;
-
-      /* Get the device path */
-      TempDevicePath = DevPathInst;
-      RootDevicePath = (VENDOR_DEVICE_PATH *)DevPathInst;
-      Partition = (HARDDRIVE_DEVICE_PATH *)TempDevicePath;
-
-      if ((SelectionAttrib & (BLK_IO_SEL_SELECT_ROOT_DEVICE_ONLY |
-                              BLK_IO_SEL_MATCH_ROOT_DEVICE)) != 0) {
-        if (!FilterData || (FilterData->RootDeviceType == NULL)) {
-          FreePool (BlkIoHandles);
-          BlkIoHandles = NULL;
-          return EFI_INVALID_PARAMETER;
-        }
-
-        /* If this is not the root device that we are looking for, ignore this
-         * handle */
-        if (RootDevicePath->Header.Type != HARDWARE_DEVICE_PATH ||
-            RootDevicePath->Header.SubType != HW_VENDOR_DP ||
-            (RootDevicePath->Header.Length[0] |
-             (RootDevicePath->Header.Length[1] << 8)) !=
-                sizeof (VENDOR_DEVICE_PATH) ||
-            CompareGuid (FilterData->RootDeviceType, &RootDevicePath->Guid) ==
-                FALSE)
-          continue;
-      }
-
-      /* Locate the last Device Path Node */
-      while (!IsDevicePathEnd (TempDevicePath)) {
-        DevicePathDepth++;
-        Partition = (HARDDRIVE_DEVICE_PATH *)TempDevicePath;
-        TempDevicePath = NextDevicePathNode (TempDevicePath);
-      }
+    if (!BlkIoHandleMatches (SelectionAttrib, FilterData, BlkIo, DevPathInst,
+                             PartiType, PartEntry, &PartitionOut))
+      continue;
 
-      /* If we need the handle for root device only and if this is representing
-       * a sub partition in the root device then ignore this handle */
-      if (SelectionAttrib & BLK_IO_SEL_SELECT_ROOT_DEVICE_ONLY)
-        if (DevicePathDepth > 1)
-          continue;
-
-      /* Check if the last node is Harddrive Device path that contains the
-       * Partition information */
-      if (Partition->Header.Type == MEDIA_DEVICE_PATH &&
-          Partition->Header.SubType == MEDIA_HARDDRIVE_DP &&
-          (Partition->Header.Length[0] | (Partition->Header.Length[1] << 8)) ==
-              sizeof (*Partition)) {
-        PartitionOut = Partition;
-
-        if ((SelectionAttrib & BLK_IO_SEL_PARTITIONED_GPT) == 0)
-          if (Partition->MBRType == PARTITIONED_TYPE_GPT)
-            continue;
-
-        if ((SelectionAttrib & BLK_IO_SEL_PARTITIONED_MBR) == 0)
-          if (Partition->MBRType == PARTITIONED_TYPE_MBR)
-            continue;
-
-        /* PartitionDxe implementation should return partition type also */
-        if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID) != 0) {
-          GUID *PartiType;
-          if (!FilterData || (FilterData->PartitionType == NULL)) {
-            FreePool (BlkIoHandles);
-            BlkIoHandles = NULL;
-            return EFI_INVALID_PARAMETER;
-          }
-
-          Status = gBS->HandleProtocol (BlkIoHandles[i], &gEfiPartitionTypeGuid,
-                                        (VOID **)&PartiType);
-          if (Status != EFI_SUCCESS)
-            continue;
-
-          if (CompareGuid (PartiType, FilterData->PartitionType) == FALSE)
-            continue;
-        }
-      }
-      /* If we wanted a particular partition and didn't get the HDD DP,
-         then this handle is probably not the interested ones */
-      else if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_TYPE_GUID) != 0)
-        continue;
-    }
-    /* Check if the Partition name related criteria satisfies */
-    if ((SelectionAttrib & BLK_IO_SEL_MATCH_PARTITION_LABEL) != 0) {
-      Status = gBS->HandleProtocol (BlkIoHandles[i], &gEfiPartitionRecordGuid,
-                                    (VOID **)&PartEntry);
-      if (Status != EFI_SUCCESS)
-        continue;
-      if (StrnCmp (PartEntry->PartitionName, FilterData->PartitionLabel,
-                   MAX (StrLen (PartEntry->PartitionName),
-                        StrLen (FilterData->PartitionLabel))))
-        continue;
-    }
     /* We came here means, this handle satisfies all the conditions needed,
      * Add it into the list */
     HandleInfoPtr[BlkIoCnt].Handle = BlkIoHandles[i];
@@ -444,6 +667,17 @@ UINT64 GetTimerCountms (VOID)
   return Ms;
 }
 
+UINT64 GetTimerCountUs (VOID)
+{
+  /* Sets up TimerFreq and FactormS on first use */
+  if (!FactormS &&
+      !GetTimerCountms ()) {
+    return 0;
+  }
+
+  return (GetPerformanceCounter () * 1000) / FactormS;
+}
+
 EFI_STATUS
 ReadWriteDeviceInfo (vb_device_state_op_t Mode, void *DevInfo, UINT32 Sz)
 {
@@ -490,6 +724,126 @@ GetNandMiscPartiGuid (EFI_GUID *Ptype)
   return Status;
 }
 
+STATIC WriteBlockStats WriteStats;
+
+VOID
+WriteStatsAddCall (IN UINT64 Size, IN UINT64 BlockedUs)
+{
+  UINT32 Bucket = 0;
+
+  while ((Bucket < WRITE_STATS_HIST_BUCKETS - 1) &&
+         (Size >= (SIZE_4KB << (2 * Bucket)))) {
+    Bucket++;
+  }
+
+  WriteStats.Calls++;
+  WriteStats.Bytes += Size;
+  WriteStats.BlockedUs += BlockedUs;
+  WriteStats.SizeHist[Bucket]++;
+}
+
+VOID
+WriteStatsGet (OUT WriteBlockStats *Stats)
+{
+  gBS->CopyMem (Stats, &WriteStats, sizeof (WriteStats));
+}
+
+/* Write Size bytes in units of WriteUnitSize with up to WRITE_QUEUE_DEPTH
+ * requests outstanding. Returns EFI_UNSUPPORTED without writing anything if
+ * the handle has no BlockIo2, the caller then uses the blocking path.
+ */
+STATIC EFI_STATUS
+WriteBlocksQueued (IN EFI_HANDLE *Handle,
+                   IN UINT64 Offset,
+                   IN UINT64 Size,
+                   IN UINT64 WriteUnitSize,
+                   IN CHAR8 *Image)
+{
+  EFI_STATUS Status;
+  EFI_STATUS WriteStatus = EFI_SUCCESS;
+  EFI_BLOCK_IO2_PROTOCOL *BlockIo2 = NULL;
+  EFI_BLOCK_IO2_TOKEN Tokens[WRITE_QUEUE_DEPTH];
+  UINT32 Head = 0;
+  UINT32 InFlight = 0;
+  UINT32 Index;
+  UINT64 Written = 0;
+  UINT64 WriteSize;
+  UINT64 StartUs;
+
+  if ((WRITE_QUEUE_DEPTH < 2) ||
+      (Handle == NULL)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = gBS->HandleProtocol (Handle, &gEfiBlockIo2ProtocolGuid,
+                                (VOID **)&BlockIo2);
+  if ((Status != EFI_SUCCESS) ||
+      (BlockIo2 == NULL)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  for (Index = 0; Index < WRITE_QUEUE_DEPTH; Index++) {
+    Status = gBS->CreateEvent (0, 0, NULL, NULL, &Tokens[Index].Event);
+    if (Status != EFI_SUCCESS) {
+      while (Index--) {
+        gBS->CloseEvent (Tokens[Index].Event);
+      }
+      return EFI_UNSUPPORTED;
+    }
+  }
+
+  while ((Written < Size) ||
+         InFlight) {
+    /* Keep the queue full while there is data left */
+    if ((Written < Size) &&
+        (InFlight < WRITE_QUEUE_DEPTH) &&
+        !EFI_ERROR (WriteStatus)) {
+      Index = (Head + InFlight) % WRITE_QUEUE_DEPTH;
+      WriteSize = (Size - Written) > WriteUnitSize ?
+                   WriteUnitSize : (Size - Written);
+      Tokens[Index].TransactionStatus = EFI_NOT_READY;
+      Status = BlockIo2->WriteBlocksEx (BlockIo2,
+                                        BlockIo2->Media->MediaId,
+                                        Offset,
+                                        &Tokens[Index],
+                                        WriteSize,
+                                        Image + Written);
+      if (Status != EFI_SUCCESS) {
+        DEBUG ((EFI_D_ERROR, "Queue the Image write failed :%r\n", Status));
+        WriteStatus = Status;
+        continue;
+      }
+      WriteStatsAddCall (WriteSize, 0);
+      Offset += WriteSize / BlockIo2->Media->BlockSize;
+      Written += WriteSize;
+      InFlight++;
+      continue;
+    }
+
+    if (!InFlight) {
+      break;
+    }
+
+    /* Reap the oldest request, usb is serviced by its timer meanwhile */
+    StartUs = GetTimerCountUs ();
+    while (gBS->CheckEvent (Tokens[Head].Event) == EFI_NOT_READY);
+    WriteStats.BlockedUs += GetTimerCountUs () - StartUs;
+    if (Tokens[Head].TransactionStatus != EFI_SUCCESS) {
+      DEBUG ((EFI_D_ERROR, "Write the divisible Image failed :%r\n",
+              Tokens[Head].TransactionStatus));
+      WriteStatus = Tokens[Head].TransactionStatus;
+    }
+    Head = (Head + 1) % WRITE_QUEUE_DEPTH;
+    InFlight--;
+  }
+
+  for (Index = 0; Index < WRITE_QUEUE_DEPTH; Index++) {
+    gBS->CloseEvent (Tokens[Index].Event);
+  }
+
+  return WriteStatus;
+}
+
 EFI_STATUS
 WriteBlockToPartition (EFI_BLOCK_IO_PROTOCOL *BlockIo,
                    IN EFI_HANDLE *Handle,
@@ -504,6 +858,7 @@ WriteBlockToPartition (EFI_BLOCK_IO_PROTOCOL *BlockIo,
   UINT64 WriteUnitSize = MAX_WRITE_SIZE;
   INT64 LeftSize = 0;
   UINT32 WriteSize = 0;
+  UINT64 StartUs;
 
   if ((BlockIo == NULL) ||
     (Image == NULL)) {
@@ -551,14 +906,24 @@ WriteBlockToPartition (EFI_BLOCK_IO_PROTOCOL *BlockIo,
       WriteUnitSize = DivMsgBufSize;
     }
 
-    LeftSize = DivMsgBufSize;
+    Status = WriteBlocksQueued (Handle, Offset, DivMsgBufSize, WriteUnitSize,
+                                Image);
+    if (Status == EFI_SUCCESS) {
+      Offset += DivMsgBufSize / BlockIo->Media->BlockSize;
+    } else if (Status != EFI_UNSUPPORTED) {
+      return Status;
+    }
+
+    LeftSize = (Status == EFI_SUCCESS) ? 0 : DivMsgBufSize;
     while (LeftSize > 0) {
       WriteSize = LeftSize > WriteUnitSize? WriteUnitSize : LeftSize;
+      StartUs = GetTimerCountUs ();
       Status = BlockIo->WriteBlocks (BlockIo,
                                      BlockIo->Media->MediaId,
                                      Offset,
                                      WriteSize,
                                      Image + DivMsgBufSize - LeftSize);
+      WriteStatsAddCall (WriteSize, GetTimerCountUs () - StartUs);
 
       if (Status != EFI_SUCCESS) {
         DEBUG ((EFI_D_ERROR, "Write the divisible Image failed :%r\n", Status));
@@ -593,11 +958,13 @@ WriteBlockToPartition (EFI_BLOCK_IO_PROTOCOL *BlockIo,
     }
 
     gBS->CopyMem (ImageBuffer, Image + DivMsgBufSize, Size - DivMsgBufSize);
+    StartUs = GetTimerCountUs ();
     Status = BlockIo->WriteBlocks (BlockIo,
                                  BlockIo->Media->MediaId,
                                  Offset,
                                  WriteBlockSize,
                                  ImageBuffer);
+    WriteStatsAddCall (WriteBlockSize, GetTimerCountUs () - StartUs);
 
     if (Status != EFI_SUCCESS) {
       DEBUG ((EFI_D_ERROR, "Writing single block failed :%r\n", Status));
@@ -716,15 +1083,21 @@ ResetDeviceState (VOID)
 }
 
 EFI_STATUS
-ErasePartition (EFI_BLOCK_IO_PROTOCOL *BlockIo, EFI_HANDLE *Handle)
+EraseBlockRangeAsync (EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                      EFI_HANDLE *Handle,
+                      UINT64 Lba,
+                      UINT64 Size,
+                      EFI_ERASE_BLOCK_TOKEN *Token)
 {
   EFI_STATUS Status;
-  EFI_ERASE_BLOCK_TOKEN EraseToken;
   EFI_ERASE_BLOCK_PROTOCOL *EraseProt = NULL;
-  UINTN PartitionSize;
-  UINTN TokenIndex;
 
-  PartitionSize = (BlockIo->Media->LastBlock + 1) * BlockIo->Media->BlockSize;
+  if ((BlockIo == NULL) ||
+      (Handle == NULL) ||
+      (Token == NULL)) {
+    DEBUG ((EFI_D_ERROR, "NUll BlockIo, Handle or Token\n"));
+    return EFI_INVALID_PARAMETER;
+  }
 
   Status = gBS->HandleProtocol (Handle, &gEfiEraseBlockProtocolGuid,
                                 (VOID **)&EraseProt);
@@ -734,11 +1107,33 @@ ErasePartition (EFI_BLOCK_IO_PROTOCOL *BlockIo, EFI_HANDLE *Handle)
     return Status;
   }
 
-  gBS->SetMem ((VOID *)&EraseToken, sizeof (EraseToken), 0);
-  Status = EraseProt->EraseBlocks (BlockIo, BlockIo->Media->MediaId, 0,
-                                   &EraseToken, PartitionSize);
+  Token->TransactionStatus = EFI_NOT_READY;
+  Status = EraseProt->EraseBlocks (BlockIo, BlockIo->Media->MediaId, Lba,
+                                   Token, Size);
   if (Status != EFI_SUCCESS) {
     DEBUG ((EFI_D_ERROR, "Unable to Erase Block: %r\n", Status));
+  }
+
+  return Status;
+}
+
+/* Erase Size bytes starting at Lba on the BlockIo of Handle and wait for
+ * the erase to complete. Lba and Size must be aligned to the erase length
+ * granularity of the device.
+ */
+EFI_STATUS
+EraseBlockRange (EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                 EFI_HANDLE *Handle,
+                 UINT64 Lba,
+                 UINT64 Size)
+{
+  EFI_STATUS Status;
+  EFI_ERASE_BLOCK_TOKEN EraseToken;
+  UINTN TokenIndex;
+
+  gBS->SetMem ((VOID *)&EraseToken, sizeof (EraseToken), 0);
+  Status = EraseBlockRangeAsync (BlockIo, Handle, Lba, Size, &EraseToken);
+  if (Status != EFI_SUCCESS) {
     return Status;
   } else {
     /* handle the event */
@@ -752,6 +1147,16 @@ ErasePartition (EFI_BLOCK_IO_PROTOCOL *BlockIo, EFI_HANDLE *Handle)
   return EFI_SUCCESS;
 }
 
+EFI_STATUS
+ErasePartition (EFI_BLOCK_IO_PROTOCOL *BlockIo, EFI_HANDLE *Handle)
+{
+  UINTN PartitionSize;
+
+  PartitionSize = (BlockIo->Media->LastBlock + 1) * BlockIo->Media->BlockSize;
+
+  return EraseBlockRange (BlockIo, Handle, 0, PartitionSize);
+}
+
 EFI_STATUS
 GetBootDevice (CHAR8 *BootDevBuf, UINT32 Len)
 {
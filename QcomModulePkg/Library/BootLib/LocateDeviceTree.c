@@ -52,6 +52,124 @@ BOOLEAN GetDtboNeeded (VOID)
 {
   return DtboNeed;
 }
+
+STATIC DtbSelKey SelKey;
+STATIC BOOLEAN SelKeyValid;
+STATIC DtbSelCache SelCache;
+STATIC BOOLEAN SelCacheLoaded;
+
+/* The PMIC info is read from the PMIC driver, read it once per boot
+ * rather than for every DTB that is matched.
+ */
+STATIC CONST DtbSelKey *
+DtbSelGetKey (VOID)
+{
+  UINT32 Idx;
+
+  if (SelKeyValid) {
+    return &SelKey;
+  }
+
+  SelKey.ChipId = BoardPlatformRawChipId ();
+  SelKey.ChipVersion = BoardPlatformChipVersion ();
+  SelKey.FoundryId = BoardPlatformFoundryId ();
+  SelKey.PlatformType = BoardPlatformType ();
+  SelKey.TargetId = BoardTargetId ();
+  SelKey.PlatformSubType = BoardPlatformSubType ();
+  for (Idx = 0; Idx < MAX_PMIC_IDX; Idx++) {
+    SelKey.PmicModel[Idx] = BoardPmicModel (Idx);
+    SelKey.PmicTarget[Idx] = BoardPmicTarget (Idx);
+  }
+  SelKeyValid = TRUE;
+
+  return &SelKey;
+}
+
+STATIC VOID
+DtbSelCacheLoad (VOID)
+{
+  EFI_STATUS Status;
+  UINTN Size = sizeof (SelCache);
+  CONST DtbSelKey *Key = DtbSelGetKey ();
+
+  if (SelCacheLoaded) {
+    return;
+  }
+  SelCacheLoaded = TRUE;
+
+  Status = gRT->GetVariable ((CHAR16 *)L"DtbSelectionCache",
+                             &gQcomTokenSpaceGuid, NULL, &Size, &SelCache);
+  if ((Status == EFI_SUCCESS) &&
+      (Size == sizeof (SelCache)) &&
+      (SelCache.Version == DTB_SEL_CACHE_VERSION) &&
+      !CompareMem (&SelCache.Key, Key, sizeof (SelCache.Key))) {
+    return;
+  }
+
+  gBS->SetMem (&SelCache, sizeof (SelCache), 0);
+  SelCache.Version = DTB_SEL_CACHE_VERSION;
+  gBS->CopyMem (&SelCache.Key, (VOID *)Key, sizeof (SelCache.Key));
+  SelCache.SocIdx = DTB_SEL_NONE;
+  SelCache.RticIdx = DTB_SEL_NONE;
+  SelCache.DtboIdx = DTB_SEL_NONE;
+}
+
+STATIC VOID
+DtbSelCacheSave (VOID)
+{
+  EFI_STATUS Status;
+
+  Status = gRT->SetVariable ((CHAR16 *)L"DtbSelectionCache",
+                             &gQcomTokenSpaceGuid,
+                             EFI_VARIABLE_NON_VOLATILE |
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS,
+                             sizeof (SelCache), &SelCache);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_VERBOSE, "Unable to save the DTB selection: %r\n", Status));
+  }
+}
+
+/* FNV-1a */
+STATIC UINT64
+DtbSelHash (UINT64 Hash, CONST VOID *Data, UINT32 Len)
+{
+  CONST UINT8 *Byte = Data;
+
+  while (Len--) {
+    Hash ^= *Byte++;
+    Hash *= 0x100000001b3ULL;
+  }
+
+  return Hash;
+}
+
+/* Hash the size and the properties of Dtb the selection looks at */
+STATIC UINT64
+DtbSelHashDtb (UINT64 Hash, VOID *Dtb, UINT32 DtbSize)
+{
+  STATIC CONST CHAR8 *Props[] = {"qcom,msm-id", "qcom,board-id",
+                                 "qcom,pmic-id", "qcom,rtic-id"};
+  CONST VOID *Prop;
+  INT32 RootOffset;
+  INT32 Len;
+  UINT32 Idx;
+
+  Hash = DtbSelHash (Hash, &DtbSize, sizeof (DtbSize));
+  RootOffset = fdt_path_offset (Dtb, "/");
+  for (Idx = 0; Idx < ARRAY_SIZE (Props); Idx++) {
+    Len = 0;
+    Prop = RootOffset < 0 ? NULL : fdt_getprop (Dtb, RootOffset, Props[Idx],
+                                                &Len);
+    if (!Prop ||
+        Len < 0) {
+      Len = 0;
+    }
+    Hash = DtbSelHash (Hash, &Len, sizeof (Len));
+    Hash = DtbSelHash (Hash, Prop, Len);
+  }
+
+  return Hash;
+}
 /* Add function to allocate dt entry list, used for recording
  *  the entry which conform to platform_dt_absolute_match()
  */
@@ -550,7 +668,7 @@ ReadBestPmicMatch (CONST CHAR8 *PmicProp, UINT32 PmicEntCount,
           CurPmicInfo.DtPmicModel[Idx] & PMIC_MODEL_MASK;
 
       if ((CurPmicInfo.DtPmicModel[Idx]) ==
-          BoardPmicModel (Idx)) {
+          DtbSelGetKey ()->PmicModel[Idx]) {
         CurPmicInfo.DtMatchVal |=
           BIT ((PMIC_MATCH_EXACT_MODEL_IDX0 + Idx * PMIC_SHIFT_IDX));
       } else if (CurPmicInfo.DtPmicModel[Idx] == 0) {
@@ -562,12 +680,12 @@ ReadBestPmicMatch (CONST CHAR8 *PmicProp, UINT32 PmicEntCount,
         break;
       }
 
-      if (CurPmicInfo.DtPmicRev[Idx] == (BoardPmicTarget (Idx)
+      if (CurPmicInfo.DtPmicRev[Idx] == (DtbSelGetKey ()->PmicTarget[Idx]
           & PMIC_REV_MASK)) {
         CurPmicInfo.DtMatchVal |=
           BIT ((PMIC_MATCH_EXACT_REV_IDX0 + Idx * PMIC_SHIFT_IDX));
       } else if (CurPmicInfo.DtPmicRev[Idx] <
-            (BoardPmicTarget (Idx) & PMIC_REV_MASK)) {
+            (DtbSelGetKey ()->PmicTarget[Idx] & PMIC_REV_MASK)) {
         CurPmicInfo.DtMatchVal |= BIT ((PMIC_MATCH_BEST_REV_IDX0 +
             Idx * PMIC_SHIFT_IDX));
       } else {
@@ -898,13 +1016,42 @@ cleanup:
   return FindBestMatch;
 }
 
+/* Returns the size of the DTB at Dtb, 0 if there is no valid DTB */
+STATIC UINT32
+SocDtbSize (VOID *Dtb, uintptr_t KernelEnd)
+{
+  struct fdt_header DtbHdr;
+  UINT32 DtbSize;
+
+  if (((uintptr_t)Dtb + sizeof (struct fdt_header)) >= KernelEnd) {
+    return 0;
+  }
+
+  /* the DTB could be unaligned, so extract the header,
+   * and operate on it separately */
+  gBS->CopyMem (&DtbHdr, Dtb, sizeof (struct fdt_header));
+  DtbSize = fdt_totalsize ((const VOID *)&DtbHdr);
+  if (fdt_check_header ((const VOID *)&DtbHdr) != 0 ||
+      fdt_check_header_ext ((VOID *)&DtbHdr) != 0 ||
+      ((uintptr_t)Dtb + DtbSize < (uintptr_t)Dtb) ||
+      ((uintptr_t)Dtb + DtbSize > KernelEnd))
+    return 0;
+
+  return DtbSize;
+}
+
 VOID *
 GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
 {
   uintptr_t KernelEnd = (uintptr_t)Kernel + KernelSize;
   VOID *Dtb = NULL;
-  struct fdt_header DtbHdr;
+  VOID *CachedDtb = NULL;
+  VOID *CachedRticDtb = NULL;
   UINT32 DtbSize = 0;
+  UINT32 Idx;
+  UINT32 BestIdx = DTB_SEL_NONE;
+  UINT32 RticIdx = DTB_SEL_NONE;
+  UINT64 Hash = 0xcbf29ce484222325ULL;
   DtInfo CurDtbInfo = {0};
   DtInfo BestDtbInfo = {0};
   if (!DtbOffset) {
@@ -915,20 +1062,38 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
   if (((uintptr_t)Kernel + (uintptr_t)DtbOffset) < (uintptr_t)Kernel) {
     return NULL;
   }
+
+  /* Hash what the selection depends on and reuse the previous choice if it
+   * did not change.
+   */
+  DtbSelCacheLoad ();
   Dtb = Kernel + DtbOffset;
-  while (((uintptr_t)Dtb + sizeof (struct fdt_header)) < (uintptr_t)KernelEnd) {
-    /* the DTB could be unaligned, so extract the header,
-     * and operate on it separately */
-    gBS->CopyMem (&DtbHdr, Dtb, sizeof (struct fdt_header));
-    DtbSize = fdt_totalsize ((const VOID *)&DtbHdr);
-    if (fdt_check_header ((const VOID *)&DtbHdr) != 0 ||
-        fdt_check_header_ext ((VOID *)&DtbHdr) != 0 ||
-        ((uintptr_t)Dtb + DtbSize < (uintptr_t)Dtb) ||
-        ((uintptr_t)Dtb + DtbSize > (uintptr_t)KernelEnd))
-      break;
+  for (Idx = 0; (DtbSize = SocDtbSize (Dtb, KernelEnd)); Idx++) {
+    Hash = DtbSelHash (Hash, &Idx, sizeof (Idx));
+    Hash = DtbSelHashDtb (Hash, Dtb, DtbSize);
+    if (Idx == SelCache.SocIdx)
+      CachedDtb = Dtb;
+    if (Idx == SelCache.RticIdx)
+      CachedRticDtb = Dtb;
+    Dtb += DtbSize;
+  }
+
+  if (CachedDtb &&
+      (Idx == SelCache.SocCount) &&
+      (Hash == SelCache.SocHash)) {
+    DEBUG ((EFI_D_VERBOSE, "Using cached Soc Dtb %u\n", SelCache.SocIdx));
+    DtboNeed = SelCache.DtboNeeded;
+    if (CachedRticDtb)
+      GetRticDtb (CachedRticDtb);
+    return CachedDtb;
+  }
 
+  Dtb = Kernel + DtbOffset;
+  for (Idx = 0; (DtbSize = SocDtbSize (Dtb, KernelEnd)); Idx++) {
     CurDtbInfo.Dtb = Dtb;
     ReadDtbFindMatch (&CurDtbInfo, &BestDtbInfo, SOC_MATCH);
+    if (BestDtbInfo.Dtb == Dtb)
+      BestIdx = Idx;
     if (CurDtbInfo.DtMatchVal) {
       if (CurDtbInfo.DtMatchVal & BIT (SOC_MATCH)) {
         if (CheckAllBitsSet (CurDtbInfo.DtMatchVal)) {
@@ -942,6 +1107,8 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
       if (!GetRticDtb (Dtb)) {
         DEBUG ((EFI_D_VERBOSE, "Error while DTB parsing"
                                " RTIC prop continue with next DTB\n"));
+      } else {
+        RticIdx = Idx;
       }
     }
 
@@ -954,9 +1121,39 @@ GetSocDtb (VOID *Kernel, UINT32 KernelSize, UINT32 DtbOffset, VOID *DtbLoadAddr)
     return NULL;
   }
 
+  SelCache.SocHash = Hash;
+  SelCache.SocCount = Idx;
+  SelCache.SocIdx = BestIdx;
+  SelCache.RticIdx = RticIdx;
+  SelCache.DtboNeeded = DtboNeed;
+  DtbSelCacheSave ();
+
   return BestDtbInfo.Dtb;
 }
 
+/* Finds the DTB of a DTBO table entry. Returns EFI_VOLUME_CORRUPTED if the
+ * table itself is broken, *BoardDtb is NULL if the DTB is not valid.
+ */
+STATIC EFI_STATUS
+DtboEntryDtb (VOID *DtboImgBuffer,
+              struct DtboTableEntry *DtboTableEntry,
+              VOID **BoardDtb)
+{
+  *BoardDtb = NULL;
+  if (CHECK_ADD64 ((UINT64)DtboImgBuffer,
+                   fdt32_to_cpu (DtboTableEntry->DtOffset))) {
+    DEBUG ((EFI_D_ERROR, "Integer overflow detected with Dtbo address\n"));
+    return EFI_VOLUME_CORRUPTED;
+  }
+  *BoardDtb = DtboImgBuffer + fdt32_to_cpu (DtboTableEntry->DtOffset);
+  if (fdt_check_header (*BoardDtb) || fdt_check_header_ext (*BoardDtb)) {
+    DEBUG ((EFI_D_ERROR, "No Valid Dtb\n"));
+    *BoardDtb = NULL;
+  }
+
+  return EFI_SUCCESS;
+}
+
 VOID *
 GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
 {
@@ -964,8 +1161,10 @@ GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
   struct DtboTableEntry *DtboTableEntry = NULL;
   UINT32 DtboCount = 0;
   VOID *BoardDtb = NULL;
+  VOID *CachedDtb = NULL;
   UINT32 DtboTableEntriesCount = 0;
   UINT32 FirstDtboTableEntryOffset = 0;
+  UINT64 Hash = 0xcbf29ce484222325ULL;
   DtInfo CurDtbInfo = {0};
   DtInfo BestDtbInfo = {0};
   BOOLEAN FindBestDtb = FALSE;
@@ -989,15 +1188,36 @@ GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
   }
 
   DtboTableEntriesCount = fdt32_to_cpu (DtboTableHdr->DtEntryCount);
+
+  DtbSelCacheLoad ();
   for (DtboCount = 0; DtboCount < DtboTableEntriesCount; DtboCount++) {
-    if (CHECK_ADD64 ((UINT64)DtboImgBuffer,
-                     fdt32_to_cpu (DtboTableEntry->DtOffset))) {
-      DEBUG ((EFI_D_ERROR, "Integer overflow detected with Dtbo address\n"));
+    if (DtboEntryDtb (DtboImgBuffer, &DtboTableEntry[DtboCount],
+                      &BoardDtb) != EFI_SUCCESS) {
       return NULL;
     }
-    BoardDtb = DtboImgBuffer + fdt32_to_cpu (DtboTableEntry->DtOffset);
-    if (fdt_check_header (BoardDtb) || fdt_check_header_ext (BoardDtb)) {
-      DEBUG ((EFI_D_ERROR, "No Valid Dtb\n"));
+    if (!BoardDtb) {
+      break;
+    }
+    Hash = DtbSelHash (Hash, &DtboCount, sizeof (DtboCount));
+    Hash = DtbSelHashDtb (Hash, BoardDtb, fdt_totalsize (BoardDtb));
+    if (DtboCount == SelCache.DtboIdx)
+      CachedDtb = BoardDtb;
+  }
+
+  if (CachedDtb &&
+      (DtboCount == SelCache.DtboCount) &&
+      (Hash == SelCache.DtboHash)) {
+    DEBUG ((EFI_D_VERBOSE, "Using cached Dtbo %u\n", SelCache.DtboIdx));
+    DtboIdx = SelCache.DtboIdx;
+    return CachedDtb;
+  }
+
+  for (DtboCount = 0; DtboCount < DtboTableEntriesCount; DtboCount++) {
+    if (DtboEntryDtb (DtboImgBuffer, DtboTableEntry, &BoardDtb) !=
+        EFI_SUCCESS) {
+      return NULL;
+    }
+    if (!BoardDtb) {
       break;
     }
 
@@ -1019,6 +1239,11 @@ GetBoardDtb (BootInfo *Info, VOID *DtboImgBuffer)
     return NULL;
   }
 
+  SelCache.DtboHash = Hash;
+  SelCache.DtboCount = DtboCount;
+  SelCache.DtboIdx = DtboIdx;
+  DtbSelCacheSave ();
+
   return BestDtbInfo.Dtb;
 }
 
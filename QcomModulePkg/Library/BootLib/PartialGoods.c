@@ -166,11 +166,12 @@ static struct PartialGoods PartialGoodsMmType[] = {
 };
 
 STATIC VOID
-FindNodeAndUpdateProperty (VOID *fdt,
+FindNodeAndUpdateProperty (FDT_FIXUPS *Fixups,
                            UINT32 TableSz,
                            struct PartialGoods *Table,
                            UINT32 Value)
 {
+  VOID *fdt = Fixups->Fdt;
   struct SubNodeListNew *SNode = NULL;
   CONST struct fdt_property *Prop = NULL;
   INT32 PropLen = 0;
@@ -184,7 +185,7 @@ FindNodeAndUpdateProperty (VOID *fdt,
       continue;
 
     /* Find the parent node */
-    ParentOffset = fdt_path_offset (fdt, Table->ParentNode);
+    ParentOffset = FdtFixupPathOffset (Fixups, Table->ParentNode);
     if (ParentOffset < 0) {
       DEBUG ((EFI_D_ERROR, "Failed to Get parent node: %a\terror: %d\n",
               Table->ParentNode, ParentOffset));
@@ -218,8 +219,8 @@ FindNodeAndUpdateProperty (VOID *fdt,
     }
 
     /* Replace the property with Replace string value */
-    Ret = fdt_setprop_inplace (fdt, SubNodeOffset, SNode->PropertyName,
-                               (CONST VOID *)SNode->ReplaceStr, PropLen);
+    Ret = FdtFixupSetProp (Fixups, SubNodeOffset, SNode->PropertyName,
+                           (CONST VOID *)SNode->ReplaceStr, PropLen);
     if (!Ret) {
       DEBUG ((EFI_D_INFO, "Partial goods (%a) status property disabled\n",
               SNode->SubNodeName));
@@ -289,7 +290,7 @@ ReadMMPartialGoods (EFI_CHIPINFO_PROTOCOL *pChipInfoProtocol, UINT32 *Value)
 }
 
 EFI_STATUS
-UpdatePartialGoodsNode (VOID *fdt)
+UpdatePartialGoodsNode (FDT_FIXUPS *Fixups)
 {
   UINT32 i;
   UINT32 PartialGoodsMMValue = 0;
@@ -314,7 +315,7 @@ UpdatePartialGoodsNode (VOID *fdt)
     DEBUG ((EFI_D_INFO, "PartialGoods for Multimedia: 0x%x\n",
             PartialGoodsMMValue));
 
-  FindNodeAndUpdateProperty (fdt, ARRAY_SIZE (PartialGoodsMmType),
+  FindNodeAndUpdateProperty (Fixups, ARRAY_SIZE (PartialGoodsMmType),
                              &PartialGoodsMmType[0], PartialGoodsMMValue);
 
   /* Read and update CPU Partial Goods nodes */
@@ -326,7 +327,7 @@ UpdatePartialGoodsNode (VOID *fdt)
     if (PartialGoodsCpuValue[i]) {
       DEBUG ((EFI_D_INFO, "PartialGoods for Cluster[%d]: 0x%x\n", i,
               PartialGoodsCpuValue[i]));
-      FindNodeAndUpdateProperty (fdt, ARRAY_SIZE (&PartialGoodsCpuType[i]),
+      FindNodeAndUpdateProperty (Fixups, ARRAY_SIZE (&PartialGoodsCpuType[i]),
                                  &PartialGoodsCpuType[i][0],
                                  PartialGoodsCpuValue[i]);
     }
@@ -33,6 +33,9 @@
 
 #include "UpdateDeviceTree.h"
 #include "AutoGen.h"
+#include "BootStats.h"
+#include <Library/FdtFixup.h>
+#include <Library/PartialGoods.h>
 #include <Library/UpdateDeviceTree.h>
 #include <Protocol/EFIChipInfoTypes.h>
 #include <Protocol/EFIRng.h>
@@ -92,14 +95,15 @@ GetKaslrSeed (UINT64 *KaslrSeed)
 }
 
 STATIC EFI_STATUS
-UpdateSplashMemInfo (VOID *fdt)
+UpdateSplashMemInfo (FDT_FIXUPS *Fixups)
 {
   EFI_STATUS Status;
+  VOID *fdt = Fixups->Fdt;
   CONST struct fdt_property *Prop = NULL;
   INT32 PropLen = 0;
   INT32 ret = 0;
   UINT32 offset;
-  CHAR8 *tmp = NULL;
+  UINT32 Reg[NUM_SPLASHMEM_PROP_ELEM];
   UINT32 CONST SplashMemPropSize = NUM_SPLASHMEM_PROP_ELEM * sizeof (UINT32);
 
   Status =
@@ -114,7 +118,7 @@ UpdateSplashMemInfo (VOID *fdt)
           splashBuf.uVersion, splashBuf.uFrameAddr, splashBuf.uFrameSize));
 
   /* Get offset of the splash memory reservation node */
-  ret = fdt_path_offset (fdt, "/reserved-memory/splash_region");
+  ret = FdtFixupPathOffset (Fixups, "/reserved-memory/splash_region");
   if (ret < 0) {
     DEBUG ((EFI_D_ERROR, "ERROR: Could not get splash memory region node\n"));
     return EFI_NOT_FOUND;
@@ -146,33 +150,19 @@ UpdateSplashMemInfo (VOID *fdt)
   DEBUG ((EFI_D_VERBOSE, "Splash memory region before updating:\n"));
   PrintSplashMemInfo (Prop->data, PropLen);
 
-  /* First, update the FBAddress */
-  if (CHECK_ADD64 ((UINT64)Prop->data, sizeof (UINT32))) {
-    DEBUG ((EFI_D_ERROR, "ERROR: integer Overflow while updating FBAddress"));
-    return EFI_BAD_BUFFER_SIZE;
-  }
-  tmp = (CHAR8 *)Prop->data + sizeof (UINT32);
-  splashBuf.uFrameAddr = cpu_to_fdt32 (splashBuf.uFrameAddr);
-  memcpy (tmp, &splashBuf.uFrameAddr, sizeof (UINT32));
+  /* Update the FBAddress and the FBSize */
+  memcpy (Reg, Prop->data, sizeof (Reg));
+  Reg[1] = cpu_to_fdt32 (splashBuf.uFrameAddr);
+  Reg[3] = cpu_to_fdt32 (splashBuf.uFrameSize);
 
-  /* Next, update the FBSize */
-  if (CHECK_ADD64 ((UINT64)tmp, (2 * sizeof (UINT32)))) {
-    DEBUG ((EFI_D_ERROR, "ERROR: integer Overflow while updating FBSize"));
-    return EFI_BAD_BUFFER_SIZE;
-  }
-  tmp += (2 * sizeof (UINT32));
-  splashBuf.uFrameSize = cpu_to_fdt32 (splashBuf.uFrameSize);
-  memcpy (tmp, &splashBuf.uFrameSize, sizeof (UINT32));
-
-  /* Update the property value in place */
-  ret = fdt_setprop_inplace (fdt, offset, "reg", Prop->data, PropLen);
+  ret = FdtFixupSetProp (Fixups, offset, "reg", Reg, sizeof (Reg));
   if (ret < 0) {
     DEBUG ((EFI_D_ERROR, "ERROR: Could not update splash mem info\n"));
     return EFI_NO_MAPPING;
   }
 
   DEBUG ((EFI_D_VERBOSE, "Splash memory region after updating:\n"));
-  PrintSplashMemInfo (Prop->data, PropLen);
+  PrintSplashMemInfo ((CONST CHAR8 *)Reg, sizeof (Reg));
 error:
   return Status;
 }
@@ -212,14 +202,14 @@ fdt_check_header_ext (VOID *fdt)
 
 STATIC
 VOID
-UpdateGranuleInfo (VOID *fdt)
+UpdateGranuleInfo (FDT_FIXUPS *Fixups)
 {
   EFI_STATUS Status = EFI_SUCCESS;
   INT32 GranuleNodeOffset;
   UINT32 GranuleSize;
   INT32 Ret;
 
-  GranuleNodeOffset = fdt_path_offset (fdt, "/mem-offline");
+  GranuleNodeOffset = FdtFixupPathOffset (Fixups, "/mem-offline");
   if (GranuleNodeOffset < 0) {
     DEBUG ((EFI_D_ERROR, "WARNING: Could not find mem-offline node.\n"));
     return;
@@ -233,7 +223,8 @@ UpdateGranuleInfo (VOID *fdt)
     return;
   }
 
-  Ret = fdt_setprop_u32 (fdt, GranuleNodeOffset, "granule", GranuleSize);
+  Ret = FdtFixupSetPropU32 (Fixups, GranuleNodeOffset, "granule",
+                            GranuleSize);
   if (Ret) {
     DEBUG ((EFI_D_ERROR, "WARNING: Granule size update failed.\n"));
   }
@@ -297,7 +288,7 @@ QueryMemoryCellSize (IN VOID *Fdt, OUT UINT32 *MemoryCellLen)
 
 STATIC
 EFI_STATUS
-AddMemMap (VOID *Fdt, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
+AddMemMap (FDT_FIXUPS *Fixups, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
 {
   EFI_STATUS Status = EFI_NOT_FOUND;
   INT32 ret = 0;
@@ -306,7 +297,7 @@ AddMemMap (VOID *Fdt, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
   UINT32 i = 0;
   UINT32 MemoryCellLen = 0;
 
-  Status = QueryMemoryCellSize (Fdt, &MemoryCellLen);
+  Status = QueryMemoryCellSize (Fixups->Fdt, &MemoryCellLen);
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "ERROR: Not a valid memory node found!\n"));
     return Status;
@@ -328,10 +319,11 @@ AddMemMap (VOID *Fdt, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
             RamPartitions[i].Base, RamPartitions[i].AvailableLength));
 
     if (MemoryCellLen == 1) {
-      ret = dev_tree_add_mem_info (Fdt, MemNodeOffset, RamPartitions[i].Base,
-                                    RamPartitions[i].AvailableLength);
+      ret = dev_tree_add_mem_info (Fixups, MemNodeOffset,
+                                   RamPartitions[i].Base,
+                                   RamPartitions[i].AvailableLength);
     } else {
-      ret = dev_tree_add_mem_infoV64 (Fdt, MemNodeOffset,
+      ret = dev_tree_add_mem_infoV64 (Fixups, MemNodeOffset,
                                         RamPartitions[i].Base,
                                         RamPartitions[i].AvailableLength);
     }
@@ -353,12 +345,14 @@ AddMemMap (VOID *Fdt, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
  * AddMemMap() */
 STATIC
 EFI_STATUS
-target_dev_tree_mem (VOID *fdt, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
+target_dev_tree_mem (FDT_FIXUPS *Fixups,
+                     UINT32 MemNodeOffset,
+                     BOOLEAN BootWith32Bit)
 {
   EFI_STATUS Status;
 
   /* Get Available memory from partition table */
-  Status = AddMemMap (fdt, MemNodeOffset, BootWith32Bit);
+  Status = AddMemMap (Fixups, MemNodeOffset, BootWith32Bit);
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR,
             "Invalid memory configuration, check memory partition table: %r\n",
@@ -366,7 +360,7 @@ target_dev_tree_mem (VOID *fdt, UINT32 MemNodeOffset, BOOLEAN BootWith32Bit)
     goto out;
   }
 
-  UpdateGranuleInfo (fdt);
+  UpdateGranuleInfo (Fixups);
 
 out:
   return Status;
@@ -375,18 +369,21 @@ out:
 /* Supporting function of target_dev_tree_mem()
  * Function to add the subsequent RAM partition info to the device tree */
 INT32
-dev_tree_add_mem_info (VOID *fdt, UINT32 offset, UINT32 addr, UINT32 size)
+dev_tree_add_mem_info (FDT_FIXUPS *Fixups,
+                       UINT32 offset,
+                       UINT32 addr,
+                       UINT32 size)
 {
   STATIC INT32 mem_info_cnt = 0;
   INT32 ret = 0;
 
   if (!mem_info_cnt) {
     /* Replace any other reg prop in the memory node. */
-    ret = fdt_setprop_u32 (fdt, offset, "reg", addr);
+    ret = FdtFixupSetPropU32 (Fixups, offset, "reg", addr);
     mem_info_cnt = 1;
   } else {
     /* Append the mem info to the reg prop for subsequent nodes.  */
-    ret = fdt_appendprop_u32 (fdt, offset, "reg", addr);
+    ret = FdtFixupAppendPropU32 (Fixups, offset, "reg", addr);
   }
 
   if (ret) {
@@ -394,7 +391,7 @@ dev_tree_add_mem_info (VOID *fdt, UINT32 offset, UINT32 addr, UINT32 size)
         (EFI_D_ERROR, "Failed to add the memory information addr: %d\n", ret));
   }
 
-  ret = fdt_appendprop_u32 (fdt, offset, "reg", size);
+  ret = FdtFixupAppendPropU32 (Fixups, offset, "reg", size);
 
   if (ret) {
     DEBUG (
@@ -405,18 +402,21 @@ dev_tree_add_mem_info (VOID *fdt, UINT32 offset, UINT32 addr, UINT32 size)
 }
 
 INT32
-dev_tree_add_mem_infoV64 (VOID *fdt, UINT32 offset, UINT64 addr, UINT64 size)
+dev_tree_add_mem_infoV64 (FDT_FIXUPS *Fixups,
+                          UINT32 offset,
+                          UINT64 addr,
+                          UINT64 size)
 {
   STATIC INT32 mem_info_cnt = 0;
   INT32 ret = 0;
 
   if (!mem_info_cnt) {
     /* Replace any other reg prop in the memory node. */
-    ret = fdt_setprop_u64 (fdt, offset, "reg", addr);
+    ret = FdtFixupSetPropU64 (Fixups, offset, "reg", addr);
     mem_info_cnt = 1;
   } else {
     /* Append the mem info to the reg prop for subsequent nodes.  */
-    ret = fdt_appendprop_u64 (fdt, offset, "reg", addr);
+    ret = FdtFixupAppendPropU64 (Fixups, offset, "reg", addr);
   }
 
   if (ret) {
@@ -424,7 +424,7 @@ dev_tree_add_mem_infoV64 (VOID *fdt, UINT32 offset, UINT64 addr, UINT64 size)
         (EFI_D_ERROR, "Failed to add the memory information addr: %d\n", ret));
   }
 
-  ret = fdt_appendprop_u64 (fdt, offset, "reg", size);
+  ret = FdtFixupAppendPropU64 (Fixups, offset, "reg", size);
 
   if (ret) {
     DEBUG (
@@ -434,7 +434,9 @@ dev_tree_add_mem_infoV64 (VOID *fdt, UINT32 offset, UINT64 addr, UINT64 size)
   return ret;
 }
 
-/* Top level function that updates the device tree. */
+/* Top level function that updates the device tree. The edits are collected
+ * in a batch and written with a single rewrite of the tree.
+ */
 EFI_STATUS
 UpdateDeviceTree (VOID *fdt,
                   CONST CHAR8 *cmdline,
@@ -447,6 +449,7 @@ UpdateDeviceTree (VOID *fdt,
   UINT32 PaddSize = 0;
   UINT64 KaslrSeed = 0;
   EFI_STATUS Status;
+  FDT_FIXUPS *Fixups;
 
   /* Check the device tree header */
   ret = fdt_check_header (fdt) || fdt_check_header_ext (fdt);
@@ -455,7 +458,7 @@ UpdateDeviceTree (VOID *fdt,
     return EFI_NOT_FOUND;
   }
 
-  /* Add padding to make space for new nodes and properties. */
+  /* Room for the new nodes and properties */
   PaddSize = ADD_OF (fdt_totalsize (fdt),
                     DTB_PAD_SIZE + AsciiStrLen (cmdline));
   if (!PaddSize) {
@@ -463,52 +466,60 @@ UpdateDeviceTree (VOID *fdt,
             fdt_totalsize (fdt)));
     return EFI_BAD_BUFFER_SIZE;
   }
-  ret = fdt_open_into (fdt, fdt, PaddSize);
-  if (ret != 0) {
-    DEBUG ((EFI_D_ERROR, "ERROR: Failed to move/resize dtb buffer ...\n"));
-    return EFI_BAD_BUFFER_SIZE;
+
+  Fixups = AllocatePool (sizeof (*Fixups));
+  if (!Fixups) {
+    DEBUG ((EFI_D_ERROR, "ERROR: Failed to allocate the dtb fixups\n"));
+    return EFI_OUT_OF_RESOURCES;
   }
+  FdtFixupInit (Fixups, fdt);
 
   /* Get offset of the memory node */
-  ret = fdt_path_offset (fdt, "/memory");
+  ret = FdtFixupPathOffset (Fixups, "/memory");
   if (ret < 0) {
     DEBUG ((EFI_D_ERROR, "ERROR: Could not find memory node ...\n"));
-    return EFI_NOT_FOUND;
+    Status = EFI_NOT_FOUND;
+    goto out;
   }
 
   offset = ret;
-  Status = target_dev_tree_mem (fdt, offset, BootWith32Bit);
+  Status = target_dev_tree_mem (Fixups, offset, BootWith32Bit);
   if (Status != EFI_SUCCESS) {
     DEBUG ((EFI_D_ERROR, "ERROR: Cannot update memory node\n"));
-    return Status;
+    goto out;
   }
 
-  UpdateSplashMemInfo (fdt);
+  UpdateSplashMemInfo (Fixups);
+
+  /* Hand the boot trace over to the kernel */
+  BootTraceUpdateDt (Fixups);
 
   /* Get offset of the chosen node */
-  ret = fdt_path_offset (fdt, "/chosen");
+  ret = FdtFixupPathOffset (Fixups, "/chosen");
   if (ret < 0) {
     DEBUG ((EFI_D_ERROR, "ERROR: Could not find chosen node ...\n"));
-    return EFI_NOT_FOUND;
+    Status = EFI_NOT_FOUND;
+    goto out;
   }
 
   offset = ret;
   if (cmdline) {
     /* Adding the cmdline to the chosen node */
-    ret = fdt_appendprop_string (fdt, offset, (CONST char *)"bootargs",
-                                 (CONST VOID *)cmdline);
+    ret = FdtFixupAppendPropString (Fixups, offset, (CONST char *)"bootargs",
+                                    cmdline);
     if (ret) {
       DEBUG ((EFI_D_ERROR,
               "ERROR: Cannot update chosen node [bootargs] - 0x%x\n", ret));
-      return EFI_LOAD_ERROR;
+      Status = EFI_LOAD_ERROR;
+      goto out;
     }
   }
 
   Status = GetKaslrSeed (&KaslrSeed);
   if (Status == EFI_SUCCESS) {
     /* Adding Kaslr Seed to the chosen node */
-    ret = fdt_appendprop_u64 (fdt, offset, (CONST char *)"kaslr-seed",
-                              (UINT64)KaslrSeed);
+    ret = FdtFixupAppendPropU64 (Fixups, offset, (CONST char *)"kaslr-seed",
+                                 (UINT64)KaslrSeed);
     if (ret) {
       DEBUG ((EFI_D_INFO,
               "ERROR: Cannot update chosen node [kaslr-seed] - 0x%x\n", ret));
@@ -521,25 +532,46 @@ UpdateDeviceTree (VOID *fdt,
 
   if (RamDiskSize) {
     /* Adding the initrd-start to the chosen node */
-    ret = fdt_setprop_u64 (fdt, offset, "linux,initrd-start", (UINT64)ramdisk);
+    ret = FdtFixupSetPropU64 (Fixups, offset, "linux,initrd-start",
+                              (UINT64)ramdisk);
     if (ret) {
       DEBUG ((EFI_D_ERROR,
               "ERROR: Cannot update chosen node [linux,initrd-start] - 0x%x\n",
               ret));
-      return EFI_NOT_FOUND;
+      Status = EFI_NOT_FOUND;
+      goto out;
     }
 
     /* Adding the initrd-end to the chosen node */
-    ret = fdt_setprop_u64 (fdt, offset, "linux,initrd-end",
-                           ((UINT64)ramdisk + RamDiskSize));
+    ret = FdtFixupSetPropU64 (Fixups, offset, "linux,initrd-end",
+                              ((UINT64)ramdisk + RamDiskSize));
     if (ret) {
       DEBUG ((EFI_D_ERROR,
               "ERROR: Cannot update chosen node [linux,initrd-end] - 0x%x\n",
               ret));
-      return EFI_NOT_FOUND;
+      Status = EFI_NOT_FOUND;
+      goto out;
     }
   }
 
+  if (FixedPcdGetBool (EnablePartialGoods)) {
+    Status = UpdatePartialGoodsNode (Fixups);
+    if (Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_ERROR,
+              "Failed to update device tree for partial goods, Status=%r\n",
+              Status));
+      goto out;
+    }
+  }
+
+  /* Write all of the above, the result is packed */
+  ret = FdtFixupApply (Fixups, PaddSize);
+  if (ret) {
+    DEBUG ((EFI_D_ERROR, "ERROR: Failed to update the dtb - %d\n", ret));
+    Status = EFI_BAD_BUFFER_SIZE;
+    goto out;
+  }
+
   /* Update fstab node */
   DEBUG ((EFI_D_VERBOSE, "Start DT fstab node update: %lu ms\n",
           GetTimerCountms ()));
@@ -547,9 +579,12 @@ UpdateDeviceTree (VOID *fdt,
   DEBUG ((EFI_D_VERBOSE, "End DT fstab node update: %lu ms\n",
           GetTimerCountms ()));
 
-  fdt_pack (fdt);
+  Status = EFI_SUCCESS;
 
-  return ret;
+out:
+  FdtFixupFree (Fixups);
+  FreePool (Fixups);
+  return Status;
 }
 
 /* Update device tree for fstab node */
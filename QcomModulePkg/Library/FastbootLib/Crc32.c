@@ -0,0 +1,125 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <Library/BaseLib.h>
+#ifdef FASTBOOT_CRC32_ARMV8
+#include <Library/Crc32Armv8Lib.h>
+#endif
+
+#include "Crc32.h"
+
+/* Reflected CRC-32 polynomial, x^32 + x^26 + ... + x + 1 */
+#define CRC32_POLY 0xedb88320
+
+#ifdef FASTBOOT_CRC32_ARMV8
+STATIC INT32 Crc32Armv8Enabled = -1;
+#endif
+
+STATIC UINT32 Crc32Table[256];
+STATIC BOOLEAN Crc32TableDone;
+
+STATIC VOID
+Crc32MakeTable (VOID)
+{
+  UINT32 Index;
+  UINT32 Bit;
+  UINT32 Crc;
+
+  for (Index = 0; Index < 256; Index++) {
+    Crc = Index;
+    for (Bit = 0; Bit < 8; Bit++) {
+      Crc = (Crc & 1) ? (Crc >> 1) ^ CRC32_POLY : Crc >> 1;
+    }
+    Crc32Table[Index] = Crc;
+  }
+  Crc32TableDone = TRUE;
+}
+
+UINT32
+FastbootCrc32 (IN UINT32 Crc, IN CONST VOID *Buffer, IN UINTN Size)
+{
+  CONST UINT8 *Data = Buffer;
+
+  Crc = ~Crc;
+
+#ifdef FASTBOOT_CRC32_ARMV8
+  if (Crc32Armv8Enabled < 0) {
+    Crc32Armv8Enabled = Crc32Armv8Supported ();
+  }
+  if (Crc32Armv8Enabled > 0) {
+    return ~Crc32Armv8 (Crc, Data, Size);
+  }
+#endif
+
+  if (!Crc32TableDone) {
+    Crc32MakeTable ();
+  }
+
+  while (Size--) {
+    Crc = Crc32Table[(Crc ^ *Data++) & 0xff] ^ (Crc >> 8);
+  }
+
+  return ~Crc;
+}
+
+/* Multiply A and B modulo the polynomial, both in reflected order */
+STATIC UINT32
+Crc32MultModP (UINT32 A, UINT32 B)
+{
+  UINT32 Mask = 1U << 31;
+  UINT32 Product = 0;
+
+  while (Mask) {
+    if (A & Mask) {
+      Product ^= B;
+    }
+    Mask >>= 1;
+    B = (B & 1) ? (B >> 1) ^ CRC32_POLY : B >> 1;
+  }
+
+  return Product;
+}
+
+UINT32
+FastbootCrc32Zeros (IN UINT32 Crc, IN UINT64 Size)
+{
+  /* x^8, one zero byte */
+  UINT32 Power = 1U << 23;
+  UINT32 Register = ~Crc;
+
+  /* Zero bytes only shift the register, multiply it by x^(8 * Size) */
+  while (Size) {
+    if (Size & 1) {
+      Register = Crc32MultModP (Power, Register);
+    }
+    Power = Crc32MultModP (Power, Power);
+    Size >>= 1;
+  }
+
+  return ~Register;
+}
@@ -76,6 +76,7 @@ found at
 #include "BootImage.h"
 #include "BootLinux.h"
 #include "BootStats.h"
+#include "Crc32.h"
 #include "FastbootCmds.h"
 #include "FastbootMain.h"
 #include "LinuxLoaderLib.h"
@@ -99,6 +100,7 @@ STATIC CONST CHAR16 *CriticalPartitions[] = {
 #endif
 
 STATIC FASTBOOT_VAR *Varlist;
+STATIC FASTBOOT_VAR *VarHash[FASTBOOT_VAR_HASH_SIZE];
 STATIC BOOLEAN Finished = FALSE;
 STATIC CHAR8 StrSerialNum[MAX_RSP_SIZE];
 STATIC CHAR8 FullProduct[MAX_RSP_SIZE];
@@ -157,6 +159,10 @@ STATIC UINT8 *mDataBuffer = NULL;
 /*  and the offset for usb to save data into */
 STATIC UINT8 *mFlashDataBuffer = NULL;
 STATIC UINT8 *mUsbDataBuffer = NULL;
+/* Ring of download buffers, mUsbSlot is the one usb is saving data into */
+STATIC UINT8 *mDownloadSlots[DOWNLOAD_BUFFER_SLOTS];
+STATIC UINT32 mDownloadSlotCount;
+STATIC UINT32 mUsbSlot;
 
 STATIC BOOLEAN IsFlashComplete = TRUE;
 STATIC EFI_STATUS FlashResult = EFI_SUCCESS;
@@ -168,6 +174,7 @@ STATIC INT32 Lun = NO_LUN;
 STATIC BOOLEAN LunSet;
 
 STATIC FASTBOOT_CMD *cmdlist;
+STATIC FASTBOOT_CMD_NODE CmdTrie;
 STATIC UINT32 IsAllowUnlock;
 
 STATIC EFI_STATUS
@@ -176,6 +183,8 @@ STATIC VOID
 AcceptCmd (IN UINT64 Size, IN CHAR8 *Data);
 STATIC VOID
 AcceptCmdHandler (IN EFI_EVENT Event, IN VOID *Context);
+STATIC VOID
+WaitForTransferComplete (VOID);
 
 #define NAND_PAGES_PER_BLOCK 64
 
@@ -227,22 +236,91 @@ STATIC EFI_STATUS FastbootUnInit (VOID)
     Var = NULL;
   }
 
+  Varlist = NULL;
+  gBS->SetMem ((VOID *)VarHash, sizeof (VarHash), 0);
   return EFI_SUCCESS;
 }
 
-/* Publish a variable readable by the built-in getvar command
- * These Variables must not be temporary, shallow copies are used.
+STATIC UINT32
+FastbootVarHash (IN CONST CHAR8 *Name)
+{
+  UINT32 Hash = 5381;
+
+  while (*Name) {
+    Hash = (Hash * 33) ^ (UINT8)*Name++;
+  }
+
+  return Hash % FASTBOOT_VAR_HASH_SIZE;
+}
+
+STATIC FASTBOOT_VAR *
+FastbootFindVar (IN CONST CHAR8 *Name)
+{
+  FASTBOOT_VAR *Var;
+
+  for (Var = VarHash[FastbootVarHash (Name)]; Var; Var = Var->hash_next) {
+    if (!AsciiStrCmp (Var->name, Name)) {
+      return Var;
+    }
+  }
+
+  return NULL;
+}
+
+STATIC VOID
+FastbootUnhashVar (IN FASTBOOT_VAR *Var)
+{
+  FASTBOOT_VAR **Link = &VarHash[FastbootVarHash (Var->name)];
+
+  while (*Link) {
+    if (*Link == Var) {
+      *Link = Var->hash_next;
+      return;
+    }
+    Link = &(*Link)->hash_next;
+  }
+}
+
+/* Bring the value of Var up to date, EFI_NOT_FOUND if it has none */
+STATIC EFI_STATUS
+FastbootRefreshVar (IN FASTBOOT_VAR *Var)
+{
+  if (!Var->refresh ||
+      (Var->refresh_once && Var->refreshed)) {
+    return Var->refresh ? Var->refresh_status : EFI_SUCCESS;
+  }
+
+  Var->refresh_status = Var->refresh (Var);
+  Var->refreshed = TRUE;
+  return Var->refresh_status;
+}
+
+/* Publish a variable whose value is computed by Refresh when it is read.
+ * With RefreshOnce the first value is kept, otherwise it is recomputed on
+ * every read. Value must not be temporary, a shallow copy is used.
  */
 STATIC VOID
-FastbootPublishVar (IN CONST CHAR8 *Name, IN CONST CHAR8 *Value)
+FastbootPublishLazyVar (IN CONST CHAR8 *Name,
+                        IN CONST CHAR8 *Value,
+                        IN FASTBOOT_VAR_REFRESH Refresh,
+                        IN VOID *Context,
+                        IN BOOLEAN RefreshOnce)
 {
   FASTBOOT_VAR *Var;
+  UINT32 Hash;
+
   Var = AllocateZeroPool (sizeof (*Var));
   if (Var) {
     Var->next = Varlist;
     Varlist = Var;
     Var->name = Name;
     Var->value = Value;
+    Var->refresh = Refresh;
+    Var->context = Context;
+    Var->refresh_once = RefreshOnce;
+    Hash = FastbootVarHash (Name);
+    Var->hash_next = VarHash[Hash];
+    VarHash[Hash] = Var;
   } else {
     DEBUG ((EFI_D_VERBOSE,
             "Failed to publish a variable readable(%a): malloc error!\n",
@@ -250,6 +328,15 @@ FastbootPublishVar (IN CONST CHAR8 *Name, IN CONST CHAR8 *Value)
   }
 }
 
+/* Publish a variable readable by the built-in getvar command
+ * These Variables must not be temporary, shallow copies are used.
+ */
+STATIC VOID
+FastbootPublishVar (IN CONST CHAR8 *Name, IN CONST CHAR8 *Value)
+{
+  FastbootPublishLazyVar (Name, Value, NULL, NULL, FALSE);
+}
+
 /* Returns the Remaining amount of bytes expected
  * This lets us bypass ZLT issues
  */
@@ -297,6 +384,83 @@ FastbootOkay (IN CONST CHAR8 *info)
   FastbootAck ("OKAY", info);
 }
 
+STATIC FASTBOOT_PERF PerfDownload;
+STATIC FASTBOOT_PERF PerfFlash;
+STATIC FASTBOOT_PERF PerfErase;
+STATIC WriteBlockStats PerfWritesBase;
+STATIC UINT64 PerfDownloadBusyUs;
+STATIC UINT64 PerfFlashWaitStartUs;
+STATIC CHAR8 PerfVar[MAX_RSP_SIZE];
+STATIC CHAR8 PerfDownloadVar[MAX_RSP_SIZE];
+STATIC CHAR8 PerfFlashVar[MAX_RSP_SIZE];
+STATIC CHAR8 PerfEraseVar[MAX_RSP_SIZE];
+STATIC CHAR8 PerfWritesVar[MAX_RSP_SIZE];
+
+STATIC VOID
+PerfWritesBegin (IN FASTBOOT_PERF *Perf)
+{
+  WriteStatsGet (&Perf->WritesStart);
+}
+
+/* Add the storage writes issued since PerfWritesBegin */
+STATIC VOID
+PerfWritesEnd (IN FASTBOOT_PERF *Perf)
+{
+  WriteBlockStats Writes;
+  UINT32 i;
+
+  WriteStatsGet (&Writes);
+  Perf->Writes.Calls += Writes.Calls - Perf->WritesStart.Calls;
+  Perf->Writes.Bytes += Writes.Bytes - Perf->WritesStart.Bytes;
+  Perf->Writes.BlockedUs += Writes.BlockedUs - Perf->WritesStart.BlockedUs;
+  for (i = 0; i < WRITE_STATS_HIST_BUCKETS; i++) {
+    Perf->Writes.SizeHist[i] +=
+        Writes.SizeHist[i] - Perf->WritesStart.SizeHist[i];
+  }
+}
+
+STATIC VOID
+PerfStart (IN FASTBOOT_PERF *Perf)
+{
+  Perf->StartUs = GetTimerCountUs ();
+}
+
+/* Account the command started by PerfStart, BusyUs is the part of a
+ * download that was not spent waiting for usb.
+ */
+STATIC VOID
+PerfEnd (IN FASTBOOT_PERF *Perf, IN UINT64 Bytes, IN UINT64 BusyUs)
+{
+  UINT64 TimeUs = GetTimerCountUs () - Perf->StartUs;
+
+  Perf->Count++;
+  Perf->Bytes += Bytes;
+  Perf->TimeUs += TimeUs;
+  if (Perf == &PerfDownload) {
+    Perf->WaitUs += TimeUs > BusyUs ? TimeUs - BusyUs : 0;
+  }
+}
+
+/* The host is held back by a flash that is still in progress */
+STATIC VOID
+PerfFlashWait (IN BOOLEAN Waiting)
+{
+  if (Waiting) {
+    if (!PerfFlashWaitStartUs)
+      PerfFlashWaitStartUs = GetTimerCountUs ();
+  } else if (PerfFlashWaitStartUs) {
+    PerfFlash.WaitUs += GetTimerCountUs () - PerfFlashWaitStartUs;
+    PerfFlashWaitStartUs = 0;
+  }
+}
+
+/* Bytes per microsecond is MB/s, returned in tenths */
+STATIC UINT64
+PerfRate (IN UINT64 Bytes, IN UINT64 TimeUs)
+{
+  return TimeUs ? (Bytes * 10) / TimeUs : 0;
+}
+
 VOID PartitionDump (VOID)
 {
   EFI_STATUS Status;
@@ -510,6 +674,242 @@ STATIC VOID PopulateMultislotMetadata (VOID)
 }
 
 #ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+/* Delta flash mode, toggled by "oem flash-delta" */
+STATIC BOOLEAN DeltaFlash;
+STATIC CHAR8 DeltaFlashVar[MAX_RSP_SIZE] = "no";
+STATIC UINT8 *DeltaReadBuf;
+STATIC UINT64 DeltaBytesChecked;
+STATIC UINT64 DeltaBytesWritten;
+
+/* Read back the block aligned part of the range in MAX_WRITE_SIZE batches
+ * and write only the DELTA_EXTENT_SIZE extents which differ from Image.
+ * Neighbouring differing extents are merged into a single write. A batch
+ * which can not be read back is written as a whole.
+ */
+STATIC EFI_STATUS
+WriteToDiskDelta (IN EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                  IN EFI_HANDLE *Handle,
+                  IN UINT8 *Image,
+                  IN UINT64 Size,
+                  IN UINT64 Lba)
+{
+  EFI_STATUS Status;
+  UINT32 BlockSize = BlockIo->Media->BlockSize;
+  UINT64 AlignedSize = (Size / BlockSize) * BlockSize;
+  UINT64 Done = 0;
+  UINT64 BatchSize;
+  UINT64 Extent;
+  UINT64 ExtentSize;
+  UINT64 RunStart;
+  BOOLEAN InRun;
+
+  while (Done < AlignedSize) {
+    BatchSize = (AlignedSize - Done) > MAX_WRITE_SIZE ?
+                 MAX_WRITE_SIZE : (AlignedSize - Done);
+
+    Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId,
+                                  Lba + Done / BlockSize, BatchSize,
+                                  DeltaReadBuf);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((EFI_D_VERBOSE, "Delta read back failed: %r\n", Status));
+      Status = WriteBlockToPartition (BlockIo, Handle, Lba + Done / BlockSize,
+                                      BatchSize, Image + Done);
+      if (EFI_ERROR (Status)) {
+        return Status;
+      }
+      DeltaBytesWritten += BatchSize;
+      DeltaBytesChecked += BatchSize;
+      Done += BatchSize;
+      continue;
+    }
+
+    InRun = FALSE;
+    RunStart = 0;
+    for (Extent = 0; Extent <= BatchSize; Extent += ExtentSize) {
+      ExtentSize = (BatchSize - Extent) > DELTA_EXTENT_SIZE ?
+                    DELTA_EXTENT_SIZE : (BatchSize - Extent);
+
+      if (ExtentSize &&
+          CompareMem (DeltaReadBuf + Extent, Image + Done + Extent,
+                      ExtentSize)) {
+        if (!InRun) {
+          RunStart = Extent;
+          InRun = TRUE;
+        }
+        continue;
+      }
+
+      /* Flush the run of differing extents ending here */
+      if (InRun) {
+        Status = WriteBlockToPartition (BlockIo, Handle,
+                                        Lba + (Done + RunStart) / BlockSize,
+                                        Extent - RunStart,
+                                        Image + Done + RunStart);
+        if (EFI_ERROR (Status)) {
+          return Status;
+        }
+        DeltaBytesWritten += Extent - RunStart;
+        InRun = FALSE;
+      }
+
+      if (!ExtentSize) {
+        break;
+      }
+    }
+
+    DeltaBytesChecked += BatchSize;
+    Done += BatchSize;
+  }
+
+  if (Size == AlignedSize) {
+    return EFI_SUCCESS;
+  }
+
+  /* The partial last block is padded by WriteBlockToPartition, write it */
+  DeltaBytesWritten += Size - AlignedSize;
+  DeltaBytesChecked += Size - AlignedSize;
+  return WriteBlockToPartition (BlockIo, Handle, Lba + AlignedSize / BlockSize,
+                                Size - AlignedSize, Image + AlignedSize);
+}
+
+/* Flash verification, toggled by "oem flash-verify" */
+STATIC BOOLEAN FlashVerify;
+STATIC CHAR8 FlashVerifyVar[MAX_RSP_SIZE] = "no";
+STATIC UINT8 *VerifyBufs[2];
+
+/* Start reading Size bytes at Lba into Buffer. With BlockIo2 the read is
+ * queued on Token and VerifyReadWait collects it, otherwise it is done here.
+ */
+STATIC EFI_STATUS
+VerifyReadStart (IN EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                 IN EFI_BLOCK_IO2_PROTOCOL *BlockIo2,
+                 IN EFI_BLOCK_IO2_TOKEN *Token,
+                 IN UINT64 Lba,
+                 IN UINT64 Size,
+                 OUT VOID *Buffer)
+{
+  if (!BlockIo2) {
+    return BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId, Lba, Size,
+                                Buffer);
+  }
+
+  Token->TransactionStatus = EFI_NOT_READY;
+  return BlockIo2->ReadBlocksEx (BlockIo2, BlockIo2->Media->MediaId, Lba,
+                                 Token, Size, Buffer);
+}
+
+STATIC EFI_STATUS
+VerifyReadWait (IN EFI_BLOCK_IO2_PROTOCOL *BlockIo2,
+                IN EFI_BLOCK_IO2_TOKEN *Token)
+{
+  if (!BlockIo2) {
+    return EFI_SUCCESS;
+  }
+
+  while (gBS->CheckEvent (Token->Event) == EFI_NOT_READY);
+  return Token->TransactionStatus;
+}
+
+/* Read back Size bytes written at Lba and compare their CRC32 with the one
+ * of Image. The range is read in MAX_WRITE_SIZE parts through two buffers,
+ * with BlockIo2 the next part is read while the current one is summed.
+ */
+STATIC EFI_STATUS
+VerifyWrittenRange (IN EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                    IN EFI_HANDLE *Handle,
+                    IN UINT8 *Image,
+                    IN UINT64 Size,
+                    IN UINT64 Lba)
+{
+  EFI_STATUS Status;
+  EFI_STATUS ReadStatus;
+  EFI_BLOCK_IO2_PROTOCOL *BlockIo2 = NULL;
+  EFI_BLOCK_IO2_TOKEN Tokens[2];
+  UINT32 BlockSize = BlockIo->Media->BlockSize;
+  UINT32 ImageCrc = 0;
+  UINT32 ReadCrc = 0;
+  UINT32 Current = 0;
+  UINT32 Index;
+  UINT64 Done = 0;
+  UINT64 PartSize;
+  UINT64 NextSize;
+
+  if (!Size) {
+    return EFI_SUCCESS;
+  }
+
+  if (Handle &&
+      (gBS->HandleProtocol (Handle, &gEfiBlockIo2ProtocolGuid,
+                            (VOID **)&BlockIo2) != EFI_SUCCESS)) {
+    BlockIo2 = NULL;
+  }
+
+  for (Index = 0; BlockIo2 && Index < ARRAY_SIZE (Tokens); Index++) {
+    Status = gBS->CreateEvent (0, 0, NULL, NULL, &Tokens[Index].Event);
+    if (Status != EFI_SUCCESS) {
+      while (Index--) {
+        gBS->CloseEvent (Tokens[Index].Event);
+      }
+      BlockIo2 = NULL;
+    }
+  }
+
+  PartSize = (Size > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : Size;
+  Status = VerifyReadStart (BlockIo, BlockIo2, &Tokens[Current], Lba,
+                            ROUND_TO_PAGE (PartSize, BlockSize - 1),
+                            VerifyBufs[Current]);
+
+  while (!EFI_ERROR (Status)) {
+    /* Sum the source while the read back is in flight */
+    ImageCrc = FastbootCrc32 (ImageCrc, Image + Done, PartSize);
+
+    ReadStatus = VerifyReadWait (BlockIo2, &Tokens[Current]);
+    if (EFI_ERROR (ReadStatus)) {
+      Status = ReadStatus;
+      break;
+    }
+
+    NextSize = Size - Done - PartSize;
+    NextSize = (NextSize > MAX_WRITE_SIZE) ? MAX_WRITE_SIZE : NextSize;
+    if (NextSize) {
+      Status = VerifyReadStart (BlockIo, BlockIo2, &Tokens[Current ^ 1],
+                                Lba + (Done + PartSize) / BlockSize,
+                                ROUND_TO_PAGE (NextSize, BlockSize - 1),
+                                VerifyBufs[Current ^ 1]);
+    }
+
+    ReadCrc = FastbootCrc32 (ReadCrc, VerifyBufs[Current], PartSize);
+    Done += PartSize;
+    if (EFI_ERROR (Status) ||
+        !NextSize) {
+      break;
+    }
+    PartSize = NextSize;
+    Current ^= 1;
+  }
+
+  /* A read that failed to queue leaves nothing in flight */
+  if (BlockIo2) {
+    for (Index = 0; Index < ARRAY_SIZE (Tokens); Index++) {
+      gBS->CloseEvent (Tokens[Index].Event);
+    }
+  }
+
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Verify read back at lba %llu failed: %r\n",
+            Lba + Done / BlockSize, Status));
+    return Status;
+  }
+
+  if (ImageCrc != ReadCrc) {
+    DEBUG ((EFI_D_ERROR, "Verify failed at lba %llu, crc %x read back %x\n",
+            Lba, ImageCrc, ReadCrc));
+    return EFI_CRC_ERROR;
+  }
+
+  return EFI_SUCCESS;
+}
+
 /* Helper function to write data to disk */
 STATIC EFI_STATUS
 WriteToDisk (IN EFI_BLOCK_IO_PROTOCOL *BlockIo,
@@ -518,7 +918,27 @@ WriteToDisk (IN EFI_BLOCK_IO_PROTOCOL *BlockIo,
              IN UINT64 Size,
              IN UINT64 offset)
 {
-  return WriteBlockToPartition (BlockIo, Handle, offset, Size, Image);
+  EFI_STATUS Status;
+
+  /* NAND blocks have to be erased before they are written again */
+  if (DeltaFlash &&
+      DeltaReadBuf &&
+      (BlockIo != NULL) &&
+      (Image != NULL) &&
+      (CheckRootDeviceType () != NAND)) {
+    Status = WriteToDiskDelta (BlockIo, Handle, Image, Size, offset);
+  } else {
+    Status = WriteBlockToPartition (BlockIo, Handle, offset, Size, Image);
+  }
+
+  if (EFI_ERROR (Status) ||
+      !FlashVerify ||
+      !VerifyBufs[0] ||
+      !VerifyBufs[1]) {
+    return Status;
+  }
+
+  return VerifyWrittenRange (BlockIo, Handle, Image, Size, offset);
 }
 
 STATIC BOOLEAN
@@ -606,11 +1026,132 @@ HandleChunkTypeRaw (sparse_header_t *sparse_header,
   }
 
   SparseImgData->TotalBlocks += chunk_header->chunk_sz;
+  SparseImgData->Crc = FastbootCrc32 (SparseImgData->Crc, *Image,
+                                      SparseImgData->ChunkDataSz);
   *Image += SparseImgData->ChunkDataSz;
 
   return EFI_SUCCESS;
 }
 
+/* Write Size bytes of the fill pattern held in FillBuf starting at Lba.
+ * FillBuf holds FillBufSize bytes of the pattern, so every call to
+ * WriteToDisk covers as many sparse blocks as the buffer can hold.
+ */
+STATIC EFI_STATUS
+WriteFillRun (SparseImgParam *SparseImgData,
+        VOID *FillBuf,
+        UINT64 FillBufSize,
+        UINT64 Lba,
+        UINT64 Size)
+{
+  EFI_STATUS Status = EFI_SUCCESS;
+  UINT64 WriteSize;
+
+  while (Size > 0) {
+    WriteSize = (Size > FillBufSize) ? FillBufSize : Size;
+    Status = WriteToDisk (SparseImgData->BlockIo,
+                          SparseImgData->Handle,
+                          FillBuf,
+                          WriteSize,
+                          Lba);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((EFI_D_ERROR, "Flash write failure for FILL Chunk\n"));
+      return Status;
+    }
+
+    Lba += WriteSize / SparseImgData->BlockIo->Media->BlockSize;
+    Size -= WriteSize;
+  }
+
+  return Status;
+}
+
+/* Discard the part of a zero fill run that is aligned to the erase length
+ * granularity instead of writing zeroes to it. The head and tail of the
+ * run which are not aligned are written with the zero pattern in FillBuf.
+ * The first discarded block is read back so devices that do not return
+ * zeroes for erased blocks fall back to writing the pattern.
+ */
+STATIC EFI_STATUS
+DiscardZeroFillRun (SparseImgParam *SparseImgData,
+        VOID *FillBuf,
+        UINT64 FillBufSize,
+        UINT64 Lba,
+        UINT64 Size)
+{
+  EFI_STATUS Status;
+  EFI_ERASE_BLOCK_PROTOCOL *EraseProt = NULL;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = SparseImgData->BlockIo;
+  UINT32 BlockSize = BlockIo->Media->BlockSize;
+  UINT64 Granularity;
+  UINT64 Start = Lba * BlockSize;
+  UINT64 End = Start + Size;
+  UINT64 EraseStart;
+  UINT64 EraseEnd;
+  VOID *ReadBuf = NULL;
+
+  if (CheckRootDeviceType () == NAND) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Status = gBS->HandleProtocol (SparseImgData->Handle,
+                                &gEfiEraseBlockProtocolGuid,
+                                (VOID **)&EraseProt);
+  if (EFI_ERROR (Status) ||
+      !EraseProt->EraseLengthGranularity) {
+    return EFI_UNSUPPORTED;
+  }
+
+  Granularity = EraseProt->EraseLengthGranularity;
+  if (Granularity % BlockSize) {
+    return EFI_UNSUPPORTED;
+  }
+
+  EraseStart = ((Start + Granularity - 1) / Granularity) * Granularity;
+  EraseEnd = (End / Granularity) * Granularity;
+  if ((EraseEnd <= EraseStart) ||
+      ((EraseEnd - EraseStart) < FILL_DISCARD_MIN_SIZE)) {
+    return EFI_UNSUPPORTED;
+  }
+
+  ReadBuf = AllocateZeroPool (BlockSize);
+  if (!ReadBuf) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  Status = EraseBlockRange (BlockIo, SparseImgData->Handle,
+                            EraseStart / BlockSize, EraseEnd - EraseStart);
+  if (EFI_ERROR (Status)) {
+    goto out;
+  }
+
+  Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId,
+                                EraseStart / BlockSize, BlockSize, ReadBuf);
+  if (EFI_ERROR (Status)) {
+    goto out;
+  }
+
+  if (CompareMem (ReadBuf, FillBuf, BlockSize)) {
+    DEBUG ((EFI_D_VERBOSE, "Erased blocks are not zero, write FILL chunk\n"));
+    Status = EFI_UNSUPPORTED;
+    goto out;
+  }
+
+  Status = WriteFillRun (SparseImgData, FillBuf, FillBufSize, Lba,
+                         EraseStart - Start);
+  if (EFI_ERROR (Status)) {
+    goto out;
+  }
+
+  Status = WriteFillRun (SparseImgData, FillBuf, FillBufSize,
+                         EraseEnd / BlockSize, End - EraseEnd);
+
+out:
+  FreePool (ReadBuf);
+  ReadBuf = NULL;
+  return Status;
+}
+
 STATIC EFI_STATUS
 HandleChunkTypeFill (sparse_header_t *sparse_header,
         chunk_header_t *chunk_header,
@@ -621,6 +1162,10 @@ HandleChunkTypeFill (sparse_header_t *sparse_header,
   UINT32 FillVal;
   EFI_STATUS Status = EFI_SUCCESS;
   UINT32 Temp;
+  UINT64 FillBufSize;
+  UINT64 Lba;
+  UINT64 Temp64;
+  UINT64 CrcSize;
 
   if (sparse_header == NULL ||
       chunk_header == NULL ||
@@ -636,86 +1181,121 @@ HandleChunkTypeFill (sparse_header_t *sparse_header,
     return EFI_INVALID_PARAMETER;
   }
 
-  FillBuf = AllocateZeroPool (sparse_header->blk_sz);
-  if (!FillBuf) {
-    DEBUG ((EFI_D_ERROR, "Malloc failed for: CHUNK_TYPE_FILL\n"));
-    return EFI_OUT_OF_RESOURCES;
-  }
-
   if (CHECK_ADD64 ((UINT64)*Image, sizeof (UINT32))) {
     DEBUG ((EFI_D_ERROR,
               "Integer overflow while adding Image and uint32\n"));
-    Status = EFI_INVALID_PARAMETER;
-    goto out;
+    return EFI_INVALID_PARAMETER;
   }
 
   if (SparseImgData->ImageEnd < (UINT64)*Image + sizeof (UINT32)) {
     DEBUG ((EFI_D_ERROR,
             "Buffer overread occured due to invalid sparse header\n"));
-   Status = EFI_INVALID_PARAMETER;
-   goto out;
+    return EFI_INVALID_PARAMETER;
   }
 
   FillVal = *(UINT32 *)*Image;
   *Image = (CHAR8 *)*Image + sizeof (UINT32);
 
-  for (Temp = 0;
-       Temp < (sparse_header->blk_sz / sizeof (FillVal));
-       Temp++) {
-    FillBuf[Temp] = FillVal;
-  }
-
-  for (Temp = 0; Temp < chunk_header->chunk_sz; Temp++) {
-    /* Make sure the data does not exceed the partition size */
-    if ((UINT64)SparseImgData->TotalBlocks *
-         (UINT64)sparse_header->blk_sz +
-         sparse_header->blk_sz >
-         SparseImgData->PartitionSize) {
-      DEBUG ((EFI_D_ERROR, "Chunk data size for fill type "
-                            "exceeds partition size\n"));
-      Status = EFI_VOLUME_FULL;
-      goto out;
-    }
+  /* Make sure the data does not exceed the partition size */
+  if ((UINT64)SparseImgData->TotalBlocks *
+       (UINT64)sparse_header->blk_sz +
+       SparseImgData->ChunkDataSz >
+       SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Chunk data size for fill type "
+                          "exceeds partition size\n"));
+    return EFI_VOLUME_FULL;
+  }
 
-    SparseImgData->WrittenBlockCount =
-      SparseImgData->TotalBlocks *
-        SparseImgData->BlockCountFactor;
-    Status = WriteToDisk (SparseImgData->BlockIo,
-                          SparseImgData->Handle,
-                          (VOID *)FillBuf,
-                          sparse_header->blk_sz,
-                          SparseImgData->WrittenBlockCount);
-    if (EFI_ERROR (Status)) {
-      DEBUG ((EFI_D_ERROR, "Flash write failure for FILL Chunk\n"));
+  if (SparseImgData->TotalBlocks >
+       (MAX_UINT32 - chunk_header->chunk_sz)) {
+    DEBUG ((EFI_D_ERROR, "Bogus size for FILL chunk Type\n"));
+    return EFI_INVALID_PARAMETER;
+  }
 
-    goto out;
-    }
+  if (!SparseImgData->ChunkDataSz) {
+    return EFI_SUCCESS;
+  }
+
+  /* Build a pattern buffer of up to MAX_WRITE_SIZE, so that the whole run
+   * is written with as few WriteBlocks calls as possible.
+   */
+  FillBufSize = (SparseImgData->ChunkDataSz > MAX_WRITE_SIZE) ?
+                 MAX_WRITE_SIZE : SparseImgData->ChunkDataSz;
+  FillBufSize = (FillBufSize / sparse_header->blk_sz) * sparse_header->blk_sz;
+  if (!FillBufSize) {
+    FillBufSize = sparse_header->blk_sz;
+  }
 
-    SparseImgData->TotalBlocks++;
+  FillBuf = AllocateZeroPool (FillBufSize);
+  if (!FillBuf) {
+    DEBUG ((EFI_D_ERROR, "Malloc failed for: CHUNK_TYPE_FILL\n"));
+    return EFI_OUT_OF_RESOURCES;
   }
 
-  out:
-    if (FillBuf) {
-    FreePool (FillBuf);
-    FillBuf = NULL;
+  if (FillVal) {
+    for (Temp = 0; Temp < (FillBufSize / sizeof (FillVal)); Temp++) {
+      FillBuf[Temp] = FillVal;
     }
-    return Status;
-}
+  }
 
-STATIC EFI_STATUS
-ValidateChunkDataAndFlash (sparse_header_t *sparse_header,
-             chunk_header_t *chunk_header,
-             VOID **Image,
-             SparseImgParam *SparseImgData)
-{
-  EFI_STATUS Status;
+  Lba = SparseImgData->TotalBlocks * SparseImgData->BlockCountFactor;
+  SparseImgData->WrittenBlockCount = Lba;
 
-  if (sparse_header == NULL ||
-      chunk_header == NULL ||
-      *Image == NULL ||
-      SparseImgData == NULL) {
-    DEBUG ((EFI_D_ERROR, "Invalid input Parameters\n"));
-    return EFI_INVALID_PARAMETER;
+  /* Discarding would erase blocks which delta flashing leaves untouched,
+   * and bypass the read back of flash verification.
+   */
+  Status = EFI_UNSUPPORTED;
+  if (!FillVal &&
+      !DeltaFlash &&
+      !FlashVerify) {
+    Status = DiscardZeroFillRun (SparseImgData, FillBuf, FillBufSize, Lba,
+                                 SparseImgData->ChunkDataSz);
+  }
+
+  if (EFI_ERROR (Status)) {
+    Status = WriteFillRun (SparseImgData, FillBuf, FillBufSize, Lba,
+                           SparseImgData->ChunkDataSz);
+    if (EFI_ERROR (Status)) {
+      goto out;
+    }
+  }
+
+  SparseImgData->TotalBlocks += chunk_header->chunk_sz;
+
+  /* The pattern repeats every FillBufSize bytes */
+  if (!FillVal) {
+    SparseImgData->Crc = FastbootCrc32Zeros (SparseImgData->Crc,
+                                             SparseImgData->ChunkDataSz);
+    goto out;
+  }
+  for (Temp64 = SparseImgData->ChunkDataSz; Temp64; Temp64 -= CrcSize) {
+    CrcSize = (Temp64 > FillBufSize) ? FillBufSize : Temp64;
+    SparseImgData->Crc = FastbootCrc32 (SparseImgData->Crc, FillBuf,
+                                        CrcSize);
+  }
+
+out:
+  if (FillBuf) {
+    FreePool (FillBuf);
+    FillBuf = NULL;
+  }
+  return Status;
+}
+
+STATIC EFI_STATUS
+ValidateChunkDataAndFlash (sparse_header_t *sparse_header,
+             chunk_header_t *chunk_header,
+             VOID **Image,
+             SparseImgParam *SparseImgData)
+{
+  EFI_STATUS Status;
+
+  if (sparse_header == NULL ||
+      chunk_header == NULL ||
+      *Image == NULL ||
+      SparseImgData == NULL) {
+    DEBUG ((EFI_D_ERROR, "Invalid input Parameters\n"));
+    return EFI_INVALID_PARAMETER;
   }
 
   switch (chunk_header->chunk_type) {
@@ -749,10 +1329,15 @@ ValidateChunkDataAndFlash (sparse_header_t *sparse_header,
         return EFI_INVALID_PARAMETER;
       }
       SparseImgData->TotalBlocks += chunk_header->chunk_sz;
+      /* Skipped blocks count as zeroes */
+      SparseImgData->Crc = FastbootCrc32Zeros (SparseImgData->Crc,
+                                               SparseImgData->ChunkDataSz);
     break;
 
     case CHUNK_TYPE_CRC:
-      if (chunk_header->total_sz != sparse_header->chunk_hdr_sz) {
+      /* The chunk holds the CRC32 of the output image up to this point */
+      if (chunk_header->total_sz !=
+          (sparse_header->chunk_hdr_sz + sizeof (UINT32))) {
         DEBUG ((EFI_D_ERROR, "Bogus chunk size for chunk type CRC\n"));
         return EFI_INVALID_PARAMETER;
       }
@@ -765,19 +1350,25 @@ ValidateChunkDataAndFlash (sparse_header_t *sparse_header,
 
       SparseImgData->TotalBlocks += chunk_header->chunk_sz;
 
-
-      if (CHECK_ADD64 ((UINT64)*Image, SparseImgData->ChunkDataSz)) {
+      if (CHECK_ADD64 ((UINT64)*Image, sizeof (UINT32))) {
         DEBUG ((EFI_D_ERROR,
-                "Integer overflow while adding Image and chunk data sz\n"));
+                "Integer overflow while adding Image and uint32\n"));
         return EFI_INVALID_PARAMETER;
       }
 
-      *Image += (UINT32)SparseImgData->ChunkDataSz;
-      if (SparseImgData->ImageEnd < (UINT64)*Image) {
+      if (SparseImgData->ImageEnd < (UINT64)*Image + sizeof (UINT32)) {
         DEBUG ((EFI_D_ERROR, "buffer overreads occured due to "
                               "invalid sparse header\n"));
         return EFI_INVALID_PARAMETER;
       }
+
+      if (*(UINT32 *)*Image != SparseImgData->Crc) {
+        DEBUG ((EFI_D_ERROR, "Sparse image crc %x, computed %x\n",
+                *(UINT32 *)*Image, SparseImgData->Crc));
+        return EFI_CRC_ERROR;
+      }
+
+      *Image = (CHAR8 *)*Image + sizeof (UINT32);
     break;
 
     default:
@@ -788,60 +1379,40 @@ ValidateChunkDataAndFlash (sparse_header_t *sparse_header,
   return EFI_SUCCESS;
 }
 
-/* Handle Sparse Image Flashing */
-STATIC
-EFI_STATUS
-HandleSparseImgFlash (IN CHAR16 *PartitionName,
-                      IN UINT32 PartitionMaxSize,
-                      IN VOID *Image,
-                      IN UINT64 sz)
+/* Look up the partition and validate the sparse header against it */
+STATIC EFI_STATUS
+SparseHeaderCheck (IN CHAR16 *PartitionName,
+                   IN sparse_header_t *sparse_header,
+                   OUT SparseImgParam *SparseImgData)
 {
-  sparse_header_t *sparse_header;
-  chunk_header_t *chunk_header;
   EFI_STATUS Status;
 
-  SparseImgParam SparseImgData = {0};
-
-  if (CHECK_ADD64 ((UINT64)Image, sz)) {
-    DEBUG ((EFI_D_ERROR, "Integer overflow while adding Image and sz\n"));
-    return EFI_INVALID_PARAMETER;
-  }
-
-  SparseImgData.ImageEnd = (UINT64)Image + sz;
   /* Caller to ensure that the partition is present in the Partition Table*/
   Status = PartitionGetInfo (PartitionName,
-                             &(SparseImgData.BlockIo),
-                             &(SparseImgData.Handle));
+                             &(SparseImgData->BlockIo),
+                             &(SparseImgData->Handle));
 
   if (Status != EFI_SUCCESS)
     return Status;
-  if (!SparseImgData.BlockIo) {
+  if (!SparseImgData->BlockIo) {
     DEBUG ((EFI_D_ERROR, "BlockIo for %a is corrupted\n", PartitionName));
     return EFI_VOLUME_CORRUPTED;
   }
-  if (!SparseImgData.Handle) {
+  if (!SparseImgData->Handle) {
     DEBUG ((EFI_D_ERROR, "EFI handle for %a is corrupted\n", PartitionName));
     return EFI_VOLUME_CORRUPTED;
   }
   // Check image will fit on device
-  SparseImgData.PartitionSize =
-                              (SparseImgData.BlockIo->Media->LastBlock + 1)
-                               * SparseImgData.BlockIo->Media->BlockSize;
+  SparseImgData->PartitionSize =
+                              (SparseImgData->BlockIo->Media->LastBlock + 1)
+                               * SparseImgData->BlockIo->Media->BlockSize;
 
-  if (sz < sizeof (sparse_header_t)) {
-    DEBUG ((EFI_D_ERROR, "Input image is invalid\n"));
-    return EFI_INVALID_PARAMETER;
-  }
-
-  sparse_header = (sparse_header_t *)Image;
   if (((UINT64)sparse_header->total_blks * (UINT64)sparse_header->blk_sz) >
-      SparseImgData.PartitionSize) {
+      SparseImgData->PartitionSize) {
     DEBUG ((EFI_D_ERROR, "Image is too large for the partition\n"));
     return EFI_VOLUME_FULL;
   }
 
-  Image += sizeof (sparse_header_t);
-
   if (sparse_header->file_hdr_sz != sizeof (sparse_header_t)) {
     DEBUG ((EFI_D_ERROR, "Sparse header size mismatch\n"));
     return EFI_BAD_BUFFER_SIZE;
@@ -852,14 +1423,14 @@ HandleSparseImgFlash (IN CHAR16 *PartitionName,
     return EFI_INVALID_PARAMETER;
   }
 
-  if ((sparse_header->blk_sz) % (SparseImgData.BlockIo->Media->BlockSize)) {
+  if ((sparse_header->blk_sz) % (SparseImgData->BlockIo->Media->BlockSize)) {
     DEBUG ((EFI_D_ERROR, "Unsupported sparse block size %x\n",
             sparse_header->blk_sz));
     return EFI_INVALID_PARAMETER;
   }
 
-  SparseImgData.BlockCountFactor = (sparse_header->blk_sz) /
-                                   (SparseImgData.BlockIo->Media->BlockSize);
+  SparseImgData->BlockCountFactor = (sparse_header->blk_sz) /
+                                   (SparseImgData->BlockIo->Media->BlockSize);
 
   DEBUG ((EFI_D_VERBOSE, "=== Sparse Image Header ===\n"));
   DEBUG ((EFI_D_VERBOSE, "magic: 0x%x\n", sparse_header->magic));
@@ -873,17 +1444,85 @@ HandleSparseImgFlash (IN CHAR16 *PartitionName,
   DEBUG ((EFI_D_VERBOSE, "total_blks: %d\n", sparse_header->total_blks));
   DEBUG ((EFI_D_VERBOSE, "total_chunks: %d\n", sparse_header->total_chunks));
 
+  return EFI_SUCCESS;
+}
+
+/* Validate a chunk header and compute the size of its data */
+STATIC EFI_STATUS
+SparseChunkHeaderCheck (IN sparse_header_t *sparse_header,
+                        IN chunk_header_t *chunk_header,
+                        IN OUT SparseImgParam *SparseImgData)
+{
+  if (((UINT64)SparseImgData->TotalBlocks * (UINT64)sparse_header->blk_sz) >=
+      SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Size of image is too large for the partition\n"));
+    return EFI_VOLUME_FULL;
+  }
+
+  DEBUG ((EFI_D_VERBOSE, "=== Chunk Header ===\n"));
+  DEBUG ((EFI_D_VERBOSE, "chunk_type: 0x%x\n", chunk_header->chunk_type));
+  DEBUG ((EFI_D_VERBOSE, "chunk_data_sz: 0x%x\n", chunk_header->chunk_sz));
+  DEBUG ((EFI_D_VERBOSE, "total_size: 0x%x\n", chunk_header->total_sz));
+
+  if (sparse_header->chunk_hdr_sz != sizeof (chunk_header_t)) {
+    DEBUG ((EFI_D_ERROR, "chunk header size mismatch\n"));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  SparseImgData->ChunkDataSz = (UINT64)sparse_header->blk_sz *
+                                chunk_header->chunk_sz;
+  /* Make sure that chunk size calculate from sparse image does not exceed the
+   * partition size
+   */
+  if ((UINT64)SparseImgData->TotalBlocks *
+      (UINT64)sparse_header->blk_sz +
+      SparseImgData->ChunkDataSz >
+      SparseImgData->PartitionSize) {
+    DEBUG ((EFI_D_ERROR, "Chunk data size exceeds partition size\n"));
+    return EFI_VOLUME_FULL;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Handle Sparse Image Flashing */
+STATIC
+EFI_STATUS
+HandleSparseImgFlash (IN CHAR16 *PartitionName,
+                      IN UINT32 PartitionMaxSize,
+                      IN VOID *Image,
+                      IN UINT64 sz)
+{
+  sparse_header_t *sparse_header;
+  chunk_header_t *chunk_header;
+  EFI_STATUS Status;
+
+  SparseImgParam SparseImgData = {0};
+
+  if (CHECK_ADD64 ((UINT64)Image, sz)) {
+    DEBUG ((EFI_D_ERROR, "Integer overflow while adding Image and sz\n"));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  SparseImgData.ImageEnd = (UINT64)Image + sz;
+
+  if (sz < sizeof (sparse_header_t)) {
+    DEBUG ((EFI_D_ERROR, "Input image is invalid\n"));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  sparse_header = (sparse_header_t *)Image;
+  Status = SparseHeaderCheck (PartitionName, sparse_header, &SparseImgData);
+  if (Status != EFI_SUCCESS)
+    return Status;
+
+  Image += sizeof (sparse_header_t);
+
   /* Start processing the chunks */
   for (SparseImgData.Chunk = 0;
        SparseImgData.Chunk < sparse_header->total_chunks;
        SparseImgData.Chunk++) {
 
-    if (((UINT64)SparseImgData.TotalBlocks * (UINT64)sparse_header->blk_sz) >=
-        SparseImgData.PartitionSize) {
-      DEBUG ((EFI_D_ERROR, "Size of image is too large for the partition\n"));
-      return EFI_VOLUME_FULL;
-    }
-
     /* Read and skip over chunk header */
     chunk_header = (chunk_header_t *)Image;
 
@@ -900,27 +1539,10 @@ HandleSparseImgFlash (IN CHAR16 *PartitionName,
       return EFI_BAD_BUFFER_SIZE;
     }
 
-    DEBUG ((EFI_D_VERBOSE, "=== Chunk Header ===\n"));
-    DEBUG ((EFI_D_VERBOSE, "chunk_type: 0x%x\n", chunk_header->chunk_type));
-    DEBUG ((EFI_D_VERBOSE, "chunk_data_sz: 0x%x\n", chunk_header->chunk_sz));
-    DEBUG ((EFI_D_VERBOSE, "total_size: 0x%x\n", chunk_header->total_sz));
-
-    if (sparse_header->chunk_hdr_sz != sizeof (chunk_header_t)) {
-      DEBUG ((EFI_D_ERROR, "chunk header size mismatch\n"));
-      return EFI_INVALID_PARAMETER;
-    }
-
-    SparseImgData.ChunkDataSz = (UINT64)sparse_header->blk_sz *
-                                 chunk_header->chunk_sz;
-    /* Make sure that chunk size calculate from sparse image does not exceed the
-     * partition size
-     */
-    if ((UINT64)SparseImgData.TotalBlocks *
-        (UINT64)sparse_header->blk_sz +
-        SparseImgData.ChunkDataSz >
-        SparseImgData.PartitionSize) {
-      DEBUG ((EFI_D_ERROR, "Chunk data size exceeds partition size\n"));
-      return EFI_VOLUME_FULL;
+    Status = SparseChunkHeaderCheck (sparse_header, chunk_header,
+                                     &SparseImgData);
+    if (EFI_ERROR (Status)) {
+      return Status;
     }
 
     Status = ValidateChunkDataAndFlash (sparse_header,
@@ -944,6 +1566,276 @@ HandleSparseImgFlash (IN CHAR16 *PartitionName,
   return Status;
 }
 
+/* Streaming sparse flash: the partition is armed with
+ * "oem stream-flash <partition>" and the chunks of the next sparse download
+ * are written while the rest of the download is still being received. The
+ * flash command for that partition then only reports the result of the
+ * stream. The stream is disarmed once that image is done or has failed,
+ * or when a flash names another partition.
+ * The download still lands in a full MAX_BUFFER_SIZE slot: the chunks are
+ * parsed in place at their offset in the image, and the slots are
+ * allocated once in FastbootCmdsInit for downloads that are not streamed.
+ */
+STATIC SparseStreamParam SparseStream;
+STATIC BOOLEAN SparseStreamArmed;
+STATIC CHAR8 SparseStreamArg[MAX_GPT_NAME_SIZE];
+STATIC CHAR16 SparseStreamPartition[MAX_GPT_NAME_SIZE];
+
+/* Prepare the stream for a new download of Size bytes */
+STATIC VOID
+SparseStreamStart (IN UINT64 Size)
+{
+  gBS->SetMem ((VOID *)&SparseStream, sizeof (SparseStream), 0);
+  if (!SparseStreamArmed) {
+    return;
+  }
+
+  SparseStream.Active = TRUE;
+  SparseStream.DownloadSize = Size;
+  StrnCpyS (SparseStream.PartitionName, MAX_GPT_NAME_SIZE,
+            SparseStreamPartition, StrLen (SparseStreamPartition));
+}
+
+/* Write the RAW data of the current chunk that has been received so far.
+ * Partial blocks are left in the buffer until the rest of them arrives.
+ */
+STATIC EFI_STATUS
+SparseStreamWriteRaw (IN UINT8 *Buffer, IN UINT64 Received, IN BOOLEAN Last)
+{
+  EFI_STATUS Status;
+  SparseImgParam *SparseImgData = &SparseStream.ImgData;
+  UINT32 BlkSz = SparseStream.Header.blk_sz;
+  UINT64 Avail = Received - SparseStream.Consumed;
+  UINT64 WriteSize;
+
+  WriteSize = (Avail > SparseStream.ChunkDataLeft) ?
+               SparseStream.ChunkDataLeft : Avail;
+  WriteSize = (WriteSize / BlkSz) * BlkSz;
+
+  /* Wait for a reasonably large run unless the chunk is complete */
+  if (!WriteSize ||
+      ((WriteSize < MAX_WRITE_SIZE) &&
+       (WriteSize != SparseStream.ChunkDataLeft) && !Last)) {
+    return EFI_SUCCESS;
+  }
+
+  SparseImgData->WrittenBlockCount =
+    SparseImgData->TotalBlocks * SparseImgData->BlockCountFactor;
+  Status = WriteToDisk (SparseImgData->BlockIo, SparseImgData->Handle,
+                        Buffer + SparseStream.Consumed, WriteSize,
+                        SparseImgData->WrittenBlockCount);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Flash Write Failure\n"));
+    return Status;
+  }
+
+  SparseImgData->TotalBlocks += WriteSize / BlkSz;
+  SparseImgData->Crc = FastbootCrc32 (SparseImgData->Crc,
+                                      Buffer + SparseStream.Consumed,
+                                      WriteSize);
+  SparseStream.Consumed += WriteSize;
+  SparseStream.ChunkDataLeft -= WriteSize;
+  if (!SparseStream.ChunkDataLeft) {
+    SparseStream.InChunk = FALSE;
+    SparseImgData->Chunk++;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Consume the bytes of the download received so far. Buffer is the start
+ * of the download and Received the number of bytes landed in it, Last is
+ * set once the whole download has been received.
+ */
+STATIC EFI_STATUS
+SparseStreamProcess (IN UINT8 *Buffer, IN UINT64 Received, IN BOOLEAN Last)
+{
+  EFI_STATUS Status = EFI_SUCCESS;
+  sparse_header_t *sparse_header = &SparseStream.Header;
+  SparseImgParam *SparseImgData = &SparseStream.ImgData;
+  chunk_header_t *chunk_header;
+  VOID *Image;
+  UINT64 ChunkEnd;
+
+  SparseImgData->ImageEnd = (UINT64)Buffer + Received;
+
+  if (!SparseStream.HeaderDone) {
+    if (Received < sizeof (sparse_header_t)) {
+      SparseStream.Bypass = Last;
+      return EFI_SUCCESS;
+    }
+
+    gBS->CopyMem (sparse_header, Buffer, sizeof (sparse_header_t));
+    if (sparse_header->magic != SPARSE_HEADER_MAGIC) {
+      /* Not a sparse image, leave it to the flash command */
+      SparseStream.Bypass = TRUE;
+      return EFI_SUCCESS;
+    }
+
+    Status = SparseHeaderCheck (SparseStream.PartitionName, sparse_header,
+                                SparseImgData);
+    if (Status != EFI_SUCCESS) {
+      return Status;
+    }
+
+    SparseStream.Consumed = sizeof (sparse_header_t);
+    SparseStream.HeaderDone = TRUE;
+  }
+
+  while (SparseImgData->Chunk < sparse_header->total_chunks) {
+    if (SparseStream.InChunk) {
+      Status = SparseStreamWriteRaw (Buffer, Received, Last);
+      if (EFI_ERROR (Status) ||
+          SparseStream.InChunk) {
+        break;
+      }
+      continue;
+    }
+
+    if ((Received - SparseStream.Consumed) < sizeof (chunk_header_t)) {
+      break;
+    }
+
+    chunk_header = (chunk_header_t *)(Buffer + SparseStream.Consumed);
+    Status = SparseChunkHeaderCheck (sparse_header, chunk_header,
+                                     SparseImgData);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    if (chunk_header->chunk_type == CHUNK_TYPE_RAW) {
+      if ((UINT64)chunk_header->total_sz !=
+          ((UINT64)sparse_header->chunk_hdr_sz +
+           SparseImgData->ChunkDataSz)) {
+        DEBUG ((EFI_D_ERROR, "Bogus chunk size for chunk type Raw\n"));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      if (SparseImgData->TotalBlocks >
+           (MAX_UINT32 - chunk_header->chunk_sz)) {
+        DEBUG ((EFI_D_ERROR, "Bogus size for RAW chunk Type\n"));
+        return EFI_INVALID_PARAMETER;
+      }
+
+      SparseStream.Consumed += sizeof (chunk_header_t);
+      SparseStream.ChunkDataLeft = SparseImgData->ChunkDataSz;
+      SparseStream.InChunk = TRUE;
+      if (!SparseStream.ChunkDataLeft) {
+        SparseStream.InChunk = FALSE;
+        SparseImgData->Chunk++;
+      }
+      continue;
+    }
+
+    /* Other chunk types are handled once the whole chunk has arrived */
+    ChunkEnd = SparseStream.Consumed + chunk_header->total_sz;
+    if ((chunk_header->total_sz < sizeof (chunk_header_t)) ||
+        (ChunkEnd > SparseStream.DownloadSize)) {
+      DEBUG ((EFI_D_ERROR, "Bogus chunk size %d\n", chunk_header->total_sz));
+      return EFI_INVALID_PARAMETER;
+    }
+    if (ChunkEnd > Received) {
+      break;
+    }
+
+    Image = Buffer + SparseStream.Consumed + sizeof (chunk_header_t);
+    Status = ValidateChunkDataAndFlash (sparse_header, chunk_header,
+                                        &Image, SparseImgData);
+    if (EFI_ERROR (Status)) {
+      return Status;
+    }
+
+    SparseStream.Consumed = ChunkEnd;
+    SparseImgData->Chunk++;
+  }
+
+  if (EFI_ERROR (Status)) {
+    return Status;
+  }
+
+  if (!Last) {
+    return EFI_SUCCESS;
+  }
+
+  DEBUG ((EFI_D_INFO, "Wrote %d blocks, expected to write %d blocks\n",
+          SparseImgData->TotalBlocks, sparse_header->total_blks));
+
+  if ((SparseImgData->Chunk != sparse_header->total_chunks) ||
+      (SparseImgData->TotalBlocks != sparse_header->total_blks)) {
+    DEBUG ((EFI_D_ERROR, "Sparse Image Write Failure\n"));
+    return EFI_VOLUME_CORRUPTED;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Called from AcceptData after every usb transfer of the download. While
+ * a previous image is still being flashed the data is left in the buffer
+ * and written on the next call.
+ */
+STATIC VOID
+SparseStreamAcceptData (IN UINT8 *Buffer, IN UINT64 Received, IN BOOLEAN Last)
+{
+  if (!SparseStream.Active ||
+      SparseStream.Bypass ||
+      SparseStream.Finished ||
+      EFI_ERROR (SparseStream.Status)) {
+    return;
+  }
+
+  if (!IsFlashComplete) {
+    return;
+  }
+
+  SparseStream.Status = SparseStreamProcess (Buffer, Received, Last);
+  if (EFI_ERROR (SparseStream.Status)) {
+    DEBUG ((EFI_D_ERROR, "Streaming flash of %s failed: %r\n",
+            SparseStream.PartitionName, SparseStream.Status));
+    SparseStreamArmed = FALSE;
+  }
+  SparseStream.Finished = Last;
+}
+
+/* Answer the flash command for a download that was streamed to storage.
+ * Returns FALSE if the download was not streamed and has to be flashed.
+ */
+STATIC BOOLEAN
+SparseStreamFlash (IN CONST CHAR8 *Arg, IN UINT8 *Buffer, IN UINT64 Size)
+{
+  CHAR8 FlashResultStr[MAX_RSP_SIZE] = "";
+
+  if (!SparseStream.Active) {
+    return FALSE;
+  }
+
+  /* Write whatever was left behind by a parallel flash */
+  SparseStreamAcceptData (Buffer, Size, TRUE);
+  SparseStream.Active = FALSE;
+  SparseStreamArmed = FALSE;
+
+  if (SparseStream.Bypass) {
+    return FALSE;
+  }
+
+  if (AsciiStrCmp (Arg, SparseStreamArg)) {
+    AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "Download was streamed to %a",
+                 SparseStreamArg);
+    FastbootFail (FlashResultStr);
+    return TRUE;
+  }
+
+  if (EFI_ERROR (SparseStream.Status)) {
+    AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
+                 "Error flashing partition", SparseStream.Status);
+    DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
+    FastbootFail (FlashResultStr);
+  } else {
+    FastbootOkay ("");
+  }
+
+  return TRUE;
+}
+
 STATIC VOID
 FastbootUpdateAttr (CONST CHAR16 *SlotSuffix)
 {
@@ -1043,7 +1935,7 @@ HandleRawImgFlash (IN CHAR16 *PartitionName,
     return EFI_VOLUME_FULL;
   }
 
-  Status = WriteBlockToPartition (BlockIo, Handle, 0, Size, Image);
+  Status = WriteToDisk (BlockIo, Handle, Image, Size, 0);
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "Writing Block to partition Failure\n"));
   }
@@ -1121,19 +2013,317 @@ HandleUbiImgFlash (
     return Status;
   }
 
-  /* UBI_NUM_IMAGES can replace with number of sparse images being flashed. */
-  Status = Ubi->UbiFlasherWrite (UbiFlasherHandle, UBI_NUM_IMAGES, Image, Size);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((EFI_D_ERROR, "Unable to open UBI Protocol.\n"));
-    return Status;
+  /* UBI_NUM_IMAGES can replace with number of sparse images being flashed. */
+  Status = Ubi->UbiFlasherWrite (UbiFlasherHandle, UBI_NUM_IMAGES, Image, Size);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Unable to open UBI Protocol.\n"));
+    return Status;
+  }
+
+  Status = Ubi->UbiFlasherClose (UbiFlasherHandle);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Unable to close UBI Protocol.\n"));
+    return Status;
+  }
+
+  return Status;
+}
+
+/* A sub-image of a meta image and the progress of its write */
+typedef struct {
+  CHAR16 Name[MAX_GPT_NAME_SIZE];
+  CHAR8 *Data;
+  UINT64 Size;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo;
+  EFI_BLOCK_IO2_PROTOCOL *BlockIo2;
+  EFI_HANDLE *Handle;
+  UINT32 Lun;
+  BOOLEAN Parallel;
+  UINT64 Submitted;
+  UINT64 Completed;
+  UINT64 StartMs;
+  UINT64 TimeMs;
+} MetaFlashImage;
+
+/* Writes queued on one LUN, the images of a LUN are written in order */
+typedef struct {
+  EFI_BLOCK_IO2_TOKEN Tokens[WRITE_QUEUE_DEPTH];
+  UINT32 TokenImage[WRITE_QUEUE_DEPTH];
+  UINT64 TokenSize[WRITE_QUEUE_DEPTH];
+  UINT32 Head;
+  UINT32 InFlight;
+  UINT32 Next;
+  BOOLEAN Used;
+} MetaFlashLane;
+
+/* Decide whether the image can be written on its LUN lane. NAND, the delta
+ * and verify modes, the boot partition of a slot and partial writes of
+ * images without BlockIo2 keep the HandleRawImgFlash path.
+ */
+STATIC VOID
+MetaFlashPrepare (IN OUT MetaFlashImage *Img)
+{
+  EFI_STATUS Status;
+  CHAR16 Name[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  INT32 Index;
+
+  Img->Parallel = FALSE;
+  if ((CheckRootDeviceType () == NAND) ||
+      DeltaFlash ||
+      FlashVerify ||
+      (WRITE_QUEUE_DEPTH < 2) ||
+      !StrnCmp (Img->Name, (CONST CHAR16 *)L"boot",
+                StrLen ((CONST CHAR16 *)L"boot"))) {
+    return;
+  }
+
+  StrnCpyS (Name, ARRAY_SIZE (Name), Img->Name, StrLen (Img->Name));
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (Name, ARRAY_SIZE (Name), SlotSuffix,
+                         MAX_SLOT_SUFFIX_SZ);
+  }
+
+  Index = GetPartitionIndex (Name);
+  if (Index == INVALID_PTN) {
+    return;
+  }
+
+  Status = PartitionGetInfo (Name, &Img->BlockIo, &Img->Handle);
+  if (EFI_ERROR (Status) ||
+      !Img->BlockIo ||
+      !Img->Handle) {
+    return;
+  }
+
+  if ((Img->BlockIo->Media->LastBlock + 1) * Img->BlockIo->Media->BlockSize <
+      Img->Size) {
+    return;
+  }
+
+  Status = gBS->HandleProtocol (Img->Handle, &gEfiBlockIo2ProtocolGuid,
+                                (VOID **)&Img->BlockIo2);
+  if (EFI_ERROR (Status) ||
+      !Img->BlockIo2 ||
+      (PtnEntries[Index].lun >= MAX_LUNS)) {
+    return;
+  }
+
+  Img->Lun = PtnEntries[Index].lun;
+  Img->Parallel = TRUE;
+}
+
+/* Queue the next writes of the lane and reap the oldest one if it is done.
+ * Returns the first error seen on the lane.
+ */
+STATIC EFI_STATUS
+MetaFlashLaneStep (IN OUT MetaFlashLane *Lane,
+                   IN UINT32 LaneLun,
+                   IN OUT MetaFlashImage *Images,
+                   IN UINT32 Count,
+                   IN BOOLEAN Submit)
+{
+  EFI_STATUS Status;
+  MetaFlashImage *Img;
+  UINT32 Slot;
+  UINT64 Aligned;
+  UINT64 WriteSize;
+
+  while (Submit &&
+         (Lane->InFlight < WRITE_QUEUE_DEPTH) &&
+         (Lane->Next < Count)) {
+    Img = &Images[Lane->Next];
+    Aligned = (Img->Size / Img->BlockIo->Media->BlockSize) *
+               Img->BlockIo->Media->BlockSize;
+    if (!Img->Parallel ||
+        (Img->Lun != LaneLun) ||
+        (Img->Submitted >= Aligned)) {
+      Lane->Next++;
+      continue;
+    }
+
+    if (!Img->Submitted) {
+      Img->StartMs = GetTimerCountms ();
+    }
+
+    Slot = (Lane->Head + Lane->InFlight) % WRITE_QUEUE_DEPTH;
+    WriteSize = (Aligned - Img->Submitted) > MAX_WRITE_SIZE ?
+                 MAX_WRITE_SIZE : (Aligned - Img->Submitted);
+    Lane->Tokens[Slot].TransactionStatus = EFI_NOT_READY;
+    Status = Img->BlockIo2->WriteBlocksEx (
+                 Img->BlockIo2, Img->BlockIo2->Media->MediaId,
+                 Img->Submitted / Img->BlockIo->Media->BlockSize,
+                 &Lane->Tokens[Slot], WriteSize, Img->Data + Img->Submitted);
+    if (Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_ERROR, "Queue write of %s failed: %r\n", Img->Name,
+              Status));
+      return Status;
+    }
+
+    WriteStatsAddCall (WriteSize, 0);
+    Lane->TokenImage[Slot] = Lane->Next;
+    Lane->TokenSize[Slot] = WriteSize;
+    Img->Submitted += WriteSize;
+    Lane->InFlight++;
+  }
+
+  if (!Lane->InFlight ||
+      (gBS->CheckEvent (Lane->Tokens[Lane->Head].Event) == EFI_NOT_READY)) {
+    return EFI_SUCCESS;
+  }
+
+  Slot = Lane->Head;
+  Lane->Head = (Lane->Head + 1) % WRITE_QUEUE_DEPTH;
+  Lane->InFlight--;
+  Img = &Images[Lane->TokenImage[Slot]];
+  if (Lane->Tokens[Slot].TransactionStatus != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "Write of %s failed: %r\n", Img->Name,
+            Lane->Tokens[Slot].TransactionStatus));
+    return Lane->Tokens[Slot].TransactionStatus;
+  }
+
+  Img->Completed += Lane->TokenSize[Slot];
+  if (Img->Completed ==
+      (Img->Size - (Img->Size % Img->BlockIo->Media->BlockSize))) {
+    Img->TimeMs = GetTimerCountms () - Img->StartMs;
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Write the sub-images of a meta image. Images on different UFS LUNs are
+ * written concurrently, one lane of queued BlockIo2 writes per LUN. The
+ * time taken by every image is reported to the host.
+ */
+STATIC EFI_STATUS
+MetaFlashImages (IN OUT MetaFlashImage *Images, IN UINT32 Count)
+{
+  EFI_STATUS Status = EFI_SUCCESS;
+  EFI_STATUS LaneStatus;
+  MetaFlashLane *Lanes;
+  MetaFlashImage *Img;
+  CHAR8 Info[MAX_RSP_SIZE];
+  UINT64 Aligned;
+  UINT64 StartMs;
+  UINT32 Busy;
+  UINT32 Index;
+  UINT32 Lun;
+
+  Lanes = AllocateZeroPool (sizeof (*Lanes) * MAX_LUNS);
+  if (!Lanes) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+
+  for (Index = 0; Index < Count; Index++) {
+    MetaFlashPrepare (&Images[Index]);
+    if (!Images[Index].Parallel ||
+        Lanes[Images[Index].Lun].Used) {
+      continue;
+    }
+
+    Lun = Images[Index].Lun;
+    for (Busy = 0; Busy < WRITE_QUEUE_DEPTH; Busy++) {
+      Status = gBS->CreateEvent (0, 0, NULL, NULL,
+                                 &Lanes[Lun].Tokens[Busy].Event);
+      if (EFI_ERROR (Status)) {
+        break;
+      }
+    }
+    if (EFI_ERROR (Status)) {
+      while (Busy--) {
+        gBS->CloseEvent (Lanes[Lun].Tokens[Busy].Event);
+      }
+      goto out;
+    }
+    Lanes[Lun].Used = TRUE;
+  }
+
+  /* Images left on the serial path go first */
+  for (Index = 0; Index < Count; Index++) {
+    Img = &Images[Index];
+    if (Img->Parallel) {
+      continue;
+    }
+
+    StartMs = GetTimerCountms ();
+    Status = HandleRawImgFlash (Img->Name, ARRAY_SIZE (Img->Name), Img->Data,
+                                Img->Size);
+    if (Status != EFI_SUCCESS) {
+      goto out;
+    }
+    Img->TimeMs = GetTimerCountms () - StartMs;
+  }
+
+  /* Keep every lane busy until all of them have drained */
+  do {
+    Busy = 0;
+    for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+      if (!Lanes[Lun].Used) {
+        continue;
+      }
+
+      LaneStatus = MetaFlashLaneStep (&Lanes[Lun], Lun, Images, Count,
+                                      !EFI_ERROR (Status));
+      if (EFI_ERROR (LaneStatus) &&
+          !EFI_ERROR (Status)) {
+        Status = LaneStatus;
+      }
+
+      if (Lanes[Lun].InFlight ||
+          (!EFI_ERROR (Status) && (Lanes[Lun].Next < Count))) {
+        Busy++;
+      }
+    }
+  } while (Busy);
+
+  if (EFI_ERROR (Status)) {
+    goto out;
+  }
+
+  /* Partial last blocks are written through the padding path */
+  for (Index = 0; Index < Count; Index++) {
+    Img = &Images[Index];
+    if (!Img->Parallel) {
+      continue;
+    }
+
+    Aligned = (Img->Size / Img->BlockIo->Media->BlockSize) *
+               Img->BlockIo->Media->BlockSize;
+    if (Aligned == Img->Size) {
+      continue;
+    }
+
+    if (!Aligned) {
+      Img->StartMs = GetTimerCountms ();
+    }
+    Status = WriteBlockToPartition (Img->BlockIo, Img->Handle,
+                                    Aligned / Img->BlockIo->Media->BlockSize,
+                                    Img->Size - Aligned, Img->Data + Aligned);
+    if (Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_ERROR, "Write of %s failed: %r\n", Img->Name, Status));
+      goto out;
+    }
+    Img->TimeMs = GetTimerCountms () - Img->StartMs;
   }
 
-  Status = Ubi->UbiFlasherClose (UbiFlasherHandle);
-  if (EFI_ERROR (Status)) {
-    DEBUG ((EFI_D_ERROR, "Unable to close UBI Protocol.\n"));
-    return Status;
+  for (Index = 0; Index < Count; Index++) {
+    Img = &Images[Index];
+    AsciiSPrint (Info, sizeof (Info), "%s: %lu KB in %lu ms%a", Img->Name,
+                 Img->Size / 1024, Img->TimeMs,
+                 Img->Parallel ? "" : " (serial)");
+    DEBUG ((EFI_D_INFO, "Meta image %a\n", Info));
+    FastbootInfo (Info);
+    WaitForTransferComplete ();
   }
 
+out:
+  for (Lun = 0; Lun < MAX_LUNS; Lun++) {
+    for (Index = 0; Lanes[Lun].Used && Index < WRITE_QUEUE_DEPTH; Index++) {
+      gBS->CloseEvent (Lanes[Lun].Tokens[Index].Event);
+    }
+  }
+  FreePool (Lanes);
+  Lanes = NULL;
   return Status;
 }
 
@@ -1154,6 +2344,9 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
   UINT64 ImageEnd = 0;
   BOOLEAN PnameTerminated = FALSE;
   UINT32 j;
+  MetaFlashImage Images[MAX_IMAGES_IN_METAIMG];
+
+  gBS->SetMem ((VOID *)Images, sizeof (Images), 0);
 
   if (Size < sizeof (meta_header_t)) {
     DEBUG ((EFI_D_ERROR,
@@ -1221,14 +2414,16 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
       return EFI_INVALID_PARAMETER;
     }
     AsciiStrToUnicodeStr (img_header_entry[i].ptn_name, PartitionNameFromMeta);
-    Status = HandleRawImgFlash (
-        PartitionNameFromMeta, ARRAY_SIZE (PartitionNameFromMeta),
-        (void *)Image + img_header_entry[i].start_offset,
-        img_header_entry[i].size);
-    if (Status != EFI_SUCCESS) {
-      DEBUG ((EFI_D_ERROR, "Meta Image Write Failure\n"));
-      return Status;
-    }
+    StrnCpyS (Images[i].Name, ARRAY_SIZE (Images[i].Name),
+              PartitionNameFromMeta, StrLen (PartitionNameFromMeta));
+    Images[i].Data = (CHAR8 *)Image + img_header_entry[i].start_offset;
+    Images[i].Size = img_header_entry[i].size;
+  }
+
+  Status = MetaFlashImages (Images, i);
+  if (Status != EFI_SUCCESS) {
+    DEBUG ((EFI_D_ERROR, "Meta Image Write Failure\n"));
+    return Status;
   }
 
   Status = UpdateDevInfo (PartitionName, meta_header->img_version);
@@ -1238,13 +2433,69 @@ HandleMetaImgFlash (IN CHAR16 *PartitionName,
   return Status;
 }
 
-/* Erase partition */
+/* Erase running in the background, see FastbootEraseFence */
+STATIC EFI_ERASE_BLOCK_TOKEN EraseToken;
+STATIC BOOLEAN ErasePending;
+STATIC EFI_STATUS EraseResult = EFI_SUCCESS;
+STATIC CHAR8 ErasePendingVar[MAX_RSP_SIZE] = "no";
+STATIC CHAR16 ErasePendingPartition[MAX_GPT_NAME_SIZE];
+
+STATIC BOOLEAN
+FastbootEraseDone (VOID)
+{
+  return (EraseToken.TransactionStatus != EFI_NOT_READY) ||
+         (gBS->CheckEvent (EraseToken.Event) == EFI_SUCCESS);
+}
+
+/* Wait for the background erase, its result is kept in EraseResult until
+ * the next command collects it.
+ */
+STATIC VOID
+FastbootEraseFence (VOID)
+{
+  if (!ErasePending) {
+    return;
+  }
+
+  while (!FastbootEraseDone ());
+  EraseResult = EraseToken.TransactionStatus;
+  if (EraseResult == EFI_NOT_READY) {
+    EraseResult = EFI_SUCCESS;
+  }
+  if (EFI_ERROR (EraseResult)) {
+    DEBUG ((EFI_D_ERROR, "Background erase failed: %r\n", EraseResult));
+  }
+
+  gBS->CloseEvent (EraseToken.Event);
+  EraseToken.Event = NULL;
+  ErasePending = FALSE;
+}
+
+STATIC EFI_STATUS
+RefreshErasePendingVar (IN FASTBOOT_VAR *Var)
+{
+  if (ErasePending &&
+      FastbootEraseDone ()) {
+    FastbootEraseFence ();
+  }
+
+  AsciiStrnCpyS (ErasePendingVar, sizeof (ErasePendingVar),
+                 ErasePending ? "yes" : "no", AsciiStrLen ("yes") + 1);
+  return EFI_SUCCESS;
+}
+
+/* Erase Size bytes at Offset of the partition, the whole partition if Size
+ * is 0. Big erases are queued and complete in the background.
+ */
 STATIC EFI_STATUS
-FastbootErasePartition (IN CHAR16 *PartitionName)
+FastbootErasePartition (IN CHAR16 *PartitionName,
+                        IN UINT64 Offset,
+                        IN UINT64 Size)
 {
   EFI_STATUS Status;
   EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
   EFI_HANDLE *Handle = NULL;
+  UINT64 PartitionSize;
 
   Status = PartitionGetInfo (PartitionName, &BlockIo, &Handle);
   if (Status != EFI_SUCCESS)
@@ -1258,13 +2509,55 @@ FastbootErasePartition (IN CHAR16 *PartitionName)
     return EFI_VOLUME_CORRUPTED;
   }
 
-  Status = ErasePartition (BlockIo, Handle);
+  PartitionSize = (BlockIo->Media->LastBlock + 1) * BlockIo->Media->BlockSize;
+  if (!Size) {
+    Offset = 0;
+    Size = PartitionSize;
+  }
+
+  if ((Offset % BlockIo->Media->BlockSize) ||
+      (Size % BlockIo->Media->BlockSize) ||
+      (Offset > PartitionSize) ||
+      (Size > PartitionSize - Offset)) {
+    DEBUG ((EFI_D_ERROR, "Invalid erase range 0x%llx/0x%llx of %s\n", Offset,
+            Size, PartitionName));
+    return EFI_INVALID_PARAMETER;
+  }
+
+  /* One erase at a time */
+  FastbootEraseFence ();
+
+  if ((Size >= ERASE_BACKGROUND_MIN_SIZE) &&
+      (CheckRootDeviceType () != NAND)) {
+    gBS->SetMem ((VOID *)&EraseToken, sizeof (EraseToken), 0);
+    Status = gBS->CreateEvent (0, 0, NULL, NULL, &EraseToken.Event);
+    if (Status == EFI_SUCCESS) {
+      Status = EraseBlockRangeAsync (BlockIo, Handle,
+                                     Offset / BlockIo->Media->BlockSize, Size,
+                                     &EraseToken);
+      if (Status == EFI_SUCCESS) {
+        ErasePending = TRUE;
+        StrnCpyS (ErasePendingPartition, MAX_GPT_NAME_SIZE, PartitionName,
+                  StrLen (PartitionName));
+      } else {
+        gBS->CloseEvent (EraseToken.Event);
+        EraseToken.Event = NULL;
+      }
+    }
+  } else {
+    Status = EraseBlockRange (BlockIo, Handle,
+                              Offset / BlockIo->Media->BlockSize, Size);
+  }
+
   if (Status != EFI_SUCCESS) {
     DEBUG ((EFI_D_ERROR, "Partition Erase failed: %r\n", Status));
     return Status;
   }
 
-  if (!(StrCmp (L"userdata", PartitionName)))
+  /* Only an erase of the whole userdata partition resets the device */
+  if (!(StrCmp (L"userdata", PartitionName)) &&
+      (Offset == 0) &&
+      (Size == PartitionSize))
     Status = ResetDeviceState ();
 
   return Status;
@@ -1316,6 +2609,19 @@ CmdDownload (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
                 sizeof (Response));
   mState = ExpectDataState;
   mBytesReceivedSoFar = 0;
+  PerfStart (&PerfDownload);
+  PerfDownloadBusyUs = 0;
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  SparseStreamStart (mNumDataBytes);
+  /* Never stream into a partition that is still being erased */
+  if (SparseStream.Active && ErasePending &&
+      !StrCmp (SparseStream.PartitionName, ErasePendingPartition)) {
+    DEBUG ((EFI_D_ERROR, "Streaming flash of %s during its erase\n",
+            SparseStream.PartitionName));
+    SparseStream.Status = EFI_ACCESS_DENIED;
+    SparseStreamArmed = FALSE;
+  }
+#endif
   GetFastbootDeviceData ().UsbDeviceProtocol->Send (
       ENDPOINT_OUT, sizeof (Response), GetFastbootDeviceData ().gTxBuffer);
   DEBUG ((EFI_D_VERBOSE, "CmdDownload: Send 12 %a\n",
@@ -1410,6 +2716,7 @@ STATIC VOID ClearFastbootVarsofAB (VOID)
     else
       PrevList->next = CurrentList->next;
 
+    FastbootUnhashVar (CurrentList);
     FreePool (CurrentList);
     CurrentList = NULL;
   }
@@ -1464,14 +2771,92 @@ IsCriticalPartition (CHAR16 *PartitionName)
   return FALSE;
 }
 
+/* Hand the last downloaded slot over to flashing and move usb on to the
+ * next slot of the ring, so the next image can be downloaded while this
+ * one is being written.
+ */
 STATIC VOID ExchangeFlashAndUsbDataBuf (VOID)
 {
-  VOID *mTmpbuff;
-
-  mTmpbuff = mUsbDataBuffer;
-  mUsbDataBuffer = mFlashDataBuffer;
-  mFlashDataBuffer = mTmpbuff;
+  mFlashDataBuffer = mUsbDataBuffer;
   mFlashNumDataBytes = mNumDataBytes;
+
+  mUsbSlot = (mUsbSlot + 1) % mDownloadSlotCount;
+  mUsbDataBuffer = mDownloadSlots[mUsbSlot];
+}
+
+/* fastboot splits a sparse image bigger than the max download size into
+ * several sparse images and flashes them one after the other. Every piece
+ * but the last is padded to the full image length with a trailing
+ * DONT_CARE chunk, so another download is known to follow it.
+ */
+STATIC BOOLEAN
+SparseImageHasMore (IN UINT8 *Image, IN UINT64 Size)
+{
+  sparse_header_t *sparse_header = (sparse_header_t *)Image;
+  chunk_header_t *chunk_header;
+  UINT16 LastChunkType = 0;
+  UINT64 Offset;
+  UINT32 Chunk;
+
+  if ((Size < sizeof (sparse_header_t)) ||
+      (sparse_header->magic != SPARSE_HEADER_MAGIC) ||
+      (sparse_header->file_hdr_sz < sizeof (sparse_header_t)) ||
+      (sparse_header->chunk_hdr_sz < sizeof (chunk_header_t)) ||
+      (((UINT64)sparse_header->total_blks * sparse_header->blk_sz) <=
+       MAX_DOWNLOAD_SIZE)) {
+    return FALSE;
+  }
+
+  Offset = sparse_header->file_hdr_sz;
+  for (Chunk = 0; Chunk < sparse_header->total_chunks; Chunk++) {
+    if ((Offset > Size) ||
+        ((Size - Offset) < sparse_header->chunk_hdr_sz)) {
+      return FALSE;
+    }
+
+    chunk_header = (chunk_header_t *)(Image + Offset);
+    if ((chunk_header->total_sz < sparse_header->chunk_hdr_sz) ||
+        (chunk_header->total_sz > (Size - Offset))) {
+      return FALSE;
+    }
+
+    if (chunk_header->chunk_type != CHUNK_TYPE_CRC) {
+      LastChunkType = chunk_header->chunk_type;
+    }
+    Offset += chunk_header->total_sz;
+  }
+
+  return LastChunkType == CHUNK_TYPE_DONT_CARE;
+}
+
+/* Start servicing usb while a piece of a split sparse image is being
+ * flashed. The flash command is acknowledged up front so the host can
+ * download the next piece into the next slot, the flash result is reported
+ * on the command that follows. Every other image is answered only after it
+ * has been written.
+ */
+STATIC BOOLEAN StartParallelFlash (VOID)
+{
+  EFI_STATUS Status;
+
+  if (IsDisableParallelDownloadFlash () ||
+      mDownloadSlotCount < 2 ||
+      !SparseImageHasMore (mFlashDataBuffer, mFlashNumDataBytes)) {
+    return FALSE;
+  }
+
+  IsFlashComplete = FALSE;
+  Status = HandleUsbEventsInTimer ();
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Failed to handle usb event: %r\n", Status));
+    IsFlashComplete = TRUE;
+    StopUsbTimer ();
+    return FALSE;
+  }
+
+  UsbTimerStarted = TRUE;
+  FastbootOkay ("");
+  return TRUE;
 }
 
 STATIC EFI_STATUS
@@ -1498,6 +2883,9 @@ ReenumeratePartTable (VOID)
             Status));
     return Status;
   }
+
+  /* The partition handles were reinstalled by the refresh */
+  InvalidatePartitionIndex ();
   Status = EnumeratePartitions ();
   if (EFI_ERROR (Status)) {
     DEBUG ((EFI_D_ERROR, "Enumeration of partitions failed\n"));
@@ -1539,6 +2927,78 @@ ReenumeratePartTable (VOID)
 extern CHAR8 g_SSN[];
 extern CHAR8 g_PSN[];
 extern CHAR8 ssn_cmdline[];
+/* Handle "oem stream-flash <partition>": the next sparse image downloaded
+ * after it is written to the partition while it is received. The following
+ * "flash:<partition>" only reports the result. Every streamed image needs
+ * its own "oem stream-flash". Without an argument the streaming is turned
+ * off again.
+ */
+STATIC VOID
+CmdOemStreamFlash (CONST CHAR8 *arg, VOID *data, UINT32 sz)
+{
+  EFI_STATUS Status;
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+
+  while (*arg == ' ') {
+    arg++;
+  }
+
+  SparseStreamArmed = FALSE;
+  if (*arg == '\0') {
+    FastbootOkay ("");
+    return;
+  }
+
+  if (AsciiStrLen (arg) >= MAX_GPT_NAME_SIZE) {
+    FastbootFail ("Invalid partition name");
+    return;
+  }
+  AsciiStrToUnicodeStr (arg, PartitionName);
+
+  if ((GetAVBVersion () == AVB_LE) ||
+      ((GetAVBVersion () != AVB_LE) &&
+      (TargetBuildVariantUser ()))) {
+    if (!IsUnlocked ()) {
+      FastbootFail ("Flashing is not allowed in Lock State");
+      return;
+    }
+
+    if (!IsUnlockCritical () && IsCriticalPartition (PartitionName)) {
+      FastbootFail ("Flashing is not allowed for Critical Partitions\n");
+      return;
+    }
+  }
+
+  /* Virtual partitions and lun addressing go through the flash command */
+  if (StrStr (PartitionName, L":") ||
+      !StrCmp (PartitionName, L"partition") ||
+      !StrnCmp (PartitionName, L"avb_custom_key",
+                StrLen (L"avb_custom_key"))) {
+    FastbootFail ("Streaming is not supported for this partition");
+    return;
+  }
+
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (PartitionName, ARRAY_SIZE (PartitionName),
+                         SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+  }
+
+  Status = PartitionGetInfo (PartitionName, &BlockIo, &Handle);
+  if (EFI_ERROR (Status)) {
+    FastbootFail ("Partition not found");
+    return;
+  }
+
+  AsciiStrnCpyS (SparseStreamArg, MAX_GPT_NAME_SIZE, arg, AsciiStrLen (arg));
+  StrnCpyS (SparseStreamPartition, MAX_GPT_NAME_SIZE, PartitionName,
+            StrLen (PartitionName));
+  SparseStreamArmed = TRUE;
+  FastbootOkay ("");
+}
+
 /* Handle Flash Command */
 STATIC VOID
 CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
@@ -1559,7 +3019,7 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
   BOOLEAN HasSlot = FALSE;
   CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
   CHAR8 FlashResultStr[MAX_RSP_SIZE] = "";
-  UINT64 PartitionSize = 0;
+  BOOLEAN Pipelined = FALSE;
 
   ExchangeFlashAndUsbDataBuf ();
   if (mFlashDataBuffer == NULL) {
@@ -1588,6 +3048,17 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
     }
   }
 
+  /* A stream armed for another partition is never carried over */
+  if (SparseStreamArmed &&
+      AsciiStrCmp (arg, SparseStreamArg)) {
+    SparseStreamArmed = FALSE;
+  }
+
+  /* The download may already have been written by oem stream-flash */
+  if (SparseStreamFlash (arg, mFlashDataBuffer, mFlashNumDataBytes)) {
+    goto out;
+  }
+
   /* Handle virtual partition avb_custom_key */
   if (!StrnCmp (PartitionName, L"avb_custom_key", StrLen (L"avb_custom_key"))) {
     DEBUG ((EFI_D_INFO, "flashing avb_custom_key\n"));
@@ -1649,9 +3120,18 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
   meta_header = (meta_header_t *)mFlashDataBuffer;
   UbiHeader = (UbiHeader_t *)mFlashDataBuffer;
 
-  /* Send okay for next data sending */
-  if (sparse_header->magic == SPARSE_HEADER_MAGIC) {
+  if (!AsciiStrnCmp (UbiHeader->HdrMagic, UBI_HEADER_MAGIC, 4)) {
+    FlashResult = HandleUbiImgFlash (PartitionName,
+                                     ARRAY_SIZE (PartitionName),
+                                     mFlashDataBuffer,
+                                     mFlashNumDataBytes);
+  } else if (meta_header->magic == META_HEADER_MAGIC) {
 
+    FlashResult = HandleMetaImgFlash (PartitionName,
+                                      ARRAY_SIZE (PartitionName),
+                                      mFlashDataBuffer, mFlashNumDataBytes);
+  } else {
+    /* Split sparse images are written while usb downloads the next piece */
     MultiSlotBoot = PartitionHasMultiSlot ((CONST CHAR16 *)L"boot");
     if (MultiSlotBoot) {
       HasSlot = GetPartitionHasSlot (PartitionName,
@@ -1668,79 +3148,44 @@ CmdFlash (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
       goto out;
     }
 
-    IsFlashComplete = FALSE;
-    PartitionSize = (BlockIo->Media->LastBlock + 1)
-                        * (BlockIo->Media->BlockSize);
+    Pipelined = StartParallelFlash ();
 
-    if ((PartitionSize > MAX_DOWNLOAD_SIZE) &&
-         !IsDisableParallelDownloadFlash ()) {
-      Status = HandleUsbEventsInTimer ();
-      if (EFI_ERROR (Status)) {
-        DEBUG ((EFI_D_ERROR, "Failed to handle usb event: %r\n", Status));
-        IsFlashComplete = TRUE;
-        StopUsbTimer ();
-      } else {
-        UsbTimerStarted = TRUE;
-    //+ExtB878360,liulai@wingtech.com.wt,MODIFY,20190218, always stuck in Writing 'cache'...
-        //FastbootOkay ("");
-      }
+    if (sparse_header->magic == SPARSE_HEADER_MAGIC) {
+      FlashResult = HandleSparseImgFlash (PartitionName,
+                                          ARRAY_SIZE (PartitionName),
+                                          mFlashDataBuffer, mFlashNumDataBytes);
+    } else {
+      FlashResult = HandleRawImgFlash (PartitionName,
+                                       ARRAY_SIZE (PartitionName),
+                                       mFlashDataBuffer, mFlashNumDataBytes);
     }
 
-    FlashResult = HandleSparseImgFlash (PartitionName,
-                                        ARRAY_SIZE (PartitionName),
-                                        mFlashDataBuffer, mFlashNumDataBytes);
-
-    IsFlashComplete = TRUE;
-    FastbootOkay ("");
-    //-ExtB878360,liulai@wingtech.com.wt,MODIFY,20190218, always stuck in Writing 'cache'...
-    StopUsbTimer ();
-  } else if (!AsciiStrnCmp (UbiHeader->HdrMagic, UBI_HEADER_MAGIC, 4)) {
-    FlashResult = HandleUbiImgFlash (PartitionName,
-                                     ARRAY_SIZE (PartitionName),
-                                     mFlashDataBuffer,
-                                     mFlashNumDataBytes);
-  } else if (meta_header->magic == META_HEADER_MAGIC) {
-
-    FlashResult = HandleMetaImgFlash (PartitionName,
-                                      ARRAY_SIZE (PartitionName),
-                                      mFlashDataBuffer, mFlashNumDataBytes);
-  } else {
-
-    FlashResult = HandleRawImgFlash (PartitionName,
-                                     ARRAY_SIZE (PartitionName),
-                                     mFlashDataBuffer, mFlashNumDataBytes);
+    if (Pipelined) {
+      /* Okay was already sent, FlashResult is checked by the next command */
+      IsFlashComplete = TRUE;
+      StopUsbTimer ();
+      goto out;
+    }
   }
 
-
-  /*
-   * For Non-sparse image: Check flash result and update the result
-   * Also, Handle if there is Failure in handling USB events especially for
-   * sparse images.
-   */
-  if ((sparse_header->magic != SPARSE_HEADER_MAGIC) ||
-        (PartitionSize < MAX_DOWNLOAD_SIZE) ||
-        ((PartitionSize > MAX_DOWNLOAD_SIZE) &&
-        (IsDisableParallelDownloadFlash () ||
-        (Status != EFI_SUCCESS)))) {
-    if (EFI_ERROR (FlashResult)) {
-      if (FlashResult == EFI_NOT_FOUND) {
-        AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "(%s) No such partition",
-                     PartitionName);
-      } else {
-        AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
-                     "Error flashing partition", FlashResult);
-      }
-
-      DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
-      FastbootFail (FlashResultStr);
-
-      /* Reset the Flash Result for next flash command */
-      FlashResult = EFI_SUCCESS;
-      goto out;
+  if (EFI_ERROR (FlashResult)) {
+    if (FlashResult == EFI_NOT_FOUND) {
+      AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "(%s) No such partition",
+                   PartitionName);
     } else {
-      DEBUG ((EFI_D_INFO, "flash image status:  %r\n", FlashResult));
-      FastbootOkay ("");
+      AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
+                   "Error flashing partition", FlashResult);
     }
+
+    DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
+    FastbootFail (FlashResultStr);
+
+    /* Reset the Flash Result for next flash command */
+    FlashResult = EFI_SUCCESS;
+    goto out;
+  } else {
+    DEBUG ((EFI_D_INFO, "flash image status:  %r\n", FlashResult));
+    FastbootOkay ("");
   }
 
 out:
@@ -1766,12 +3211,32 @@ CmdErase (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
   CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
   BOOLEAN MultiSlotBoot = PartitionHasMultiSlot (L"boot");
   CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
-
-  if (AsciiStrLen (arg) >= MAX_GPT_NAME_SIZE) {
+  CHAR8 PartitionAscii[MAX_GPT_NAME_SIZE];
+  CONST CHAR8 *Token;
+  UINTN Len;
+  UINT64 Offset = 0;
+  UINT64 Size = 0;
+
+  /* erase:<partition>[:<offset>:<size>], offset and size in hex */
+  Token = AsciiStrStr (arg, ":");
+  Len = Token ? (UINTN)(Token - arg) : AsciiStrLen (arg);
+  if (Len >= MAX_GPT_NAME_SIZE) {
     FastbootFail ("Invalid partition name");
     return;
   }
-  AsciiStrToUnicodeStr (arg, PartitionName);
+  AsciiStrnCpyS (PartitionAscii, sizeof (PartitionAscii), arg, Len);
+  AsciiStrToUnicodeStr (PartitionAscii, PartitionName);
+
+  if (Token) {
+    Offset = AsciiStrHexToUint64 (Token + 1);
+    Token = AsciiStrStr (Token + 1, ":");
+    if (Token)
+      Size = AsciiStrHexToUint64 (Token + 1);
+    if (!Size) {
+      FastbootFail ("Usage: erase:<partition>[:<offset>:<size>]");
+      return;
+    }
+  }
 
 
   if ((GetAVBVersion () == AVB_LE) ||
@@ -1814,7 +3279,7 @@ CmdErase (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
   // Build output string
   UnicodeSPrint (OutputString, sizeof (OutputString),
                  L"Erasing partition %s\r\n", PartitionName);
-  Status = FastbootErasePartition (PartitionName);
+  Status = FastbootErasePartition (PartitionName, Offset, Size);
   if (EFI_ERROR (Status)) {
     FastbootFail ("Check device console.");
     DEBUG ((EFI_D_ERROR, "Couldn't erase image:  %r\n", Status));
@@ -1936,6 +3401,7 @@ FlashCompleteHandler (IN EFI_EVENT Event, IN VOID *Context)
 
   /* Wait for flash completely before sending okay */
   if (!IsFlashComplete) {
+    PerfFlashWait (TRUE);
     Status = gBS->SetTimer (Event, TimerRelative, 100000);
     if (EFI_ERROR (Status)) {
       FastbootFail ("Failed to set timer for waiting flash completely");
@@ -1944,6 +3410,7 @@ FlashCompleteHandler (IN EFI_EVENT Event, IN VOID *Context)
     return;
   }
 
+  PerfFlashWait (FALSE);
   FastbootOkay ("");
 Out:
   gBS->CloseEvent (Event);
@@ -1982,6 +3449,7 @@ AcceptData (IN UINT64 Size, IN VOID *Data)
   UINT64 RemainingBytes = mNumDataBytes - mBytesReceivedSoFar;
   UINT32 PageSize = 0;
   UINT32 RoundSize = 0;
+  UINT64 StartUs;
 
   /* Protocol doesn't say anything about sending extra data so just ignore it.*/
   if (Size > RemainingBytes) {
@@ -2005,6 +3473,14 @@ AcceptData (IN UINT64 Size, IN VOID *Data)
       gBS->SetMem ((VOID *)(Data + mNumDataBytes), RoundSize - mNumDataBytes,
                    0);
     }
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+    StartUs = GetTimerCountUs ();
+    PerfWritesBegin (&PerfDownload);
+    SparseStreamAcceptData (Data, mBytesReceivedSoFar, TRUE);
+    PerfWritesEnd (&PerfDownload);
+    PerfDownloadBusyUs += GetTimerCountUs () - StartUs;
+#endif
+    PerfEnd (&PerfDownload, mNumDataBytes, PerfDownloadBusyUs);
     /* Stop usb timer after data transfer completed */
     StopUsbTimer ();
     /* Postpone Fastboot Okay until flash completed */
@@ -2014,6 +3490,14 @@ AcceptData (IN UINT64 Size, IN VOID *Data)
     GetFastbootDeviceData ().UsbDeviceProtocol->Send (
         ENDPOINT_IN, GetXfrSize (), (Data + mBytesReceivedSoFar));
     DEBUG ((EFI_D_VERBOSE, "AcceptData: Send %d\n", GetXfrSize ()));
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+    /* The next transfer is queued, flash what has landed meanwhile */
+    StartUs = GetTimerCountUs ();
+    PerfWritesBegin (&PerfDownload);
+    SparseStreamAcceptData (Data, mBytesReceivedSoFar, FALSE);
+    PerfWritesEnd (&PerfDownload);
+    PerfDownloadBusyUs += GetTimerCountUs () - StartUs;
+#endif
   }
 }
 
@@ -2096,11 +3580,14 @@ FastbootCmdsInit (VOID)
     return Status;
   }
 
+  /* NAND targets do not download and flash in parallel */
+  mDownloadSlotCount = (CheckRootDeviceType () == NAND) ?
+                              1 : DOWNLOAD_BUFFER_SLOTS;
+
   /* Allocate buffer used to store images passed by the download command */
   Status =
         GetFastbootDeviceData ().UsbDeviceProtocol->AllocateTransferBuffer (
-               (CheckRootDeviceType () == NAND) ?
-                      MAX_BUFFER_SIZE : (MAX_BUFFER_SIZE * 2),
+               MAX_BUFFER_SIZE * mDownloadSlotCount,
                (VOID **)&FastBootBuffer);
 
   if (Status != EFI_SUCCESS) {
@@ -2109,13 +3596,77 @@ FastbootCmdsInit (VOID)
   }
 
   /* Clear allocated buffer */
-  gBS->SetMem ((VOID *)FastBootBuffer, (CheckRootDeviceType () == NAND) ?
-                              MAX_BUFFER_SIZE : (MAX_BUFFER_SIZE * 2), 0x0);
+  gBS->SetMem ((VOID *)FastBootBuffer, MAX_BUFFER_SIZE * mDownloadSlotCount,
+               0x0);
 
   FastbootCommandSetup ((void *)FastBootBuffer, MAX_BUFFER_SIZE);
   return EFI_SUCCESS;
 }
 
+STATIC FASTBOOT_CMD_CLASS
+FastbootCmdClass (IN CONST CHAR8 *Prefix)
+{
+  if (!AsciiStrnCmp (Prefix, "download", AsciiStrLen ("download")))
+    return FastbootCmdClassDownload;
+  if (!AsciiStrnCmp (Prefix, "flash", AsciiStrLen ("flash")))
+    return FastbootCmdClassFlash;
+  if (!AsciiStrnCmp (Prefix, "erase", AsciiStrLen ("erase")))
+    return FastbootCmdClassErase;
+  if (!AsciiStrnCmp (Prefix, "getvar", AsciiStrLen ("getvar")))
+    return FastbootCmdClassGetVar;
+  return FastbootCmdClassOther;
+}
+
+STATIC EFI_STATUS
+FastbootCmdTrieInsert (IN FASTBOOT_CMD *Cmd)
+{
+  FASTBOOT_CMD_NODE *Node = &CmdTrie;
+  FASTBOOT_CMD_NODE *Child;
+  UINT32 i;
+
+  for (i = 0; i < Cmd->prefix_len; i++) {
+    for (Child = Node->child; Child; Child = Child->sibling) {
+      if (Child->c == Cmd->prefix[i])
+        break;
+    }
+
+    if (!Child) {
+      Child = AllocateZeroPool (sizeof (*Child));
+      if (!Child)
+        return EFI_OUT_OF_RESOURCES;
+      Child->c = Cmd->prefix[i];
+      Child->sibling = Node->child;
+      Node->child = Child;
+    }
+    Node = Child;
+  }
+
+  Node->cmd = Cmd;
+  return EFI_SUCCESS;
+}
+
+/* Longest registered prefix of Data, NULL if there is none */
+STATIC FASTBOOT_CMD *
+FastbootCmdLookup (IN CONST CHAR8 *Data)
+{
+  FASTBOOT_CMD_NODE *Node = &CmdTrie;
+  FASTBOOT_CMD *Match = NULL;
+
+  for (; *Data; Data++) {
+    for (Node = Node->child; Node; Node = Node->sibling) {
+      if (Node->c == *Data)
+        break;
+    }
+
+    if (!Node)
+      break;
+    if (Node->cmd)
+      Match = Node->cmd;
+  }
+
+  return Match;
+}
+
 /* See header for documentation */
 VOID
 FastbootRegister (IN CONST CHAR8 *prefix,
@@ -2128,6 +3679,16 @@ FastbootRegister (IN CONST CHAR8 *prefix,
     cmd->prefix = prefix;
     cmd->prefix_len = AsciiStrLen (prefix);
     cmd->handle = handle;
+    cmd->cmd_class = FastbootCmdClass (prefix);
+    if (!AsciiStrCmp (prefix, "flash:"))
+      cmd->perf = &PerfFlash;
+    else if (!AsciiStrCmp (prefix, "erase:"))
+      cmd->perf = &PerfErase;
+    if (FastbootCmdTrieInsert (cmd) != EFI_SUCCESS) {
+      DEBUG ((EFI_D_VERBOSE, "Failed to allocate memory to cmd\n"));
+      FreePool (cmd);
+      return;
+    }
     cmd->next = cmdlist;
     cmdlist = cmd;
   } else {
@@ -2136,6 +3697,42 @@ FastbootRegister (IN CONST CHAR8 *prefix,
   }
 }
 
+STATIC EFI_STATUS
+RefreshCmdLatencyVar (IN FASTBOOT_VAR *Var)
+{
+  FASTBOOT_CMD *Cmd = Var->context;
+
+  AsciiSPrint (Cmd->latency_value, sizeof (Cmd->latency_value),
+               "count %lu avg %lu us max %lu us", Cmd->count,
+               Cmd->count ? Cmd->total_us / Cmd->count : 0, Cmd->max_us);
+  return EFI_SUCCESS;
+}
+
+/* Publish cmd-latency:<prefix> for every registered command, spaces and
+ * a trailing ':' of the prefix are dropped from the name.
+ */
+STATIC VOID
+PublishCmdLatencyVars (VOID)
+{
+  FASTBOOT_CMD *Cmd;
+  CHAR8 *Ch;
+  UINTN Len;
+
+  for (Cmd = cmdlist; Cmd; Cmd = Cmd->next) {
+    AsciiSPrint (Cmd->latency_name, sizeof (Cmd->latency_name),
+                 "cmd-latency:%a", Cmd->prefix);
+    Len = AsciiStrLen (Cmd->latency_name);
+    if (Cmd->latency_name[Len - 1] == ':')
+      Cmd->latency_name[Len - 1] = '\0';
+    for (Ch = Cmd->latency_name; *Ch; Ch++) {
+      if (*Ch == ' ')
+        *Ch = '_';
+    }
+    FastbootPublishLazyVar (Cmd->latency_name, Cmd->latency_value,
+                            RefreshCmdLatencyVar, Cmd, FALSE);
+  }
+}
+
 STATIC VOID
 CmdReboot (IN CONST CHAR8 *arg, IN VOID *data, IN UINT32 sz)
 {
@@ -2176,20 +3773,32 @@ CmdContinue (IN CONST CHAR8 *Arg, IN VOID *Data, IN UINT32 Size)
 
 
 
-STATIC VOID UpdateGetVarVariable (VOID)
+/* Battery and charger variables change while fastboot is running, they are
+ * read from the hardware each time they are asked for.
+ */
+STATIC EFI_STATUS
+RefreshBatteryVar (IN FASTBOOT_VAR *Var)
 {
   BOOLEAN BatterySocOk = FALSE;
   UINT32 BatteryVoltage = 0;
 
   BatterySocOk = TargetBatterySocOk (&BatteryVoltage);
-  AsciiSPrint (StrBatteryVoltage, sizeof (StrBatteryVoltage), "%d",
-               BatteryVoltage);
-  AsciiSPrint (StrBatterySocOk, sizeof (StrBatterySocOk), "%a",
-               BatterySocOk ? "yes" : "no");
-  AsciiSPrint (ChargeScreenEnable, sizeof (ChargeScreenEnable), "%d",
-               IsChargingScreenEnable ());
-  AsciiSPrint (OffModeCharge, sizeof (OffModeCharge), "%d",
+  if (Var->context == StrBatteryVoltage) {
+    AsciiSPrint (StrBatteryVoltage, sizeof (StrBatteryVoltage), "%d",
+                 BatteryVoltage);
+  } else {
+    AsciiSPrint (StrBatterySocOk, sizeof (StrBatterySocOk), "%a",
+                 BatterySocOk ? "yes" : "no");
+  }
+  return EFI_SUCCESS;
+}
+
+STATIC EFI_STATUS
+RefreshChargerVar (IN FASTBOOT_VAR *Var)
+{
+  AsciiSPrint ((CHAR8 *)Var->context, MAX_RSP_SIZE, "%d",
                IsChargingScreenEnable ());
+  return EFI_SUCCESS;
 }
 
 STATIC VOID WaitForTransferComplete (VOID)
@@ -2212,22 +3821,42 @@ STATIC VOID WaitForTransferComplete (VOID)
   }
 }
 
+/* Each response has to go out as its own USB transfer, so "getvar all"
+ * alternates between two slots of the TX buffer: the next variable is
+ * refreshed and formatted while the previous one is on the wire.
+ */
+#define GETVAR_ALL_SLOT_SIZE 4096
+
 STATIC VOID CmdGetVarAll (VOID)
 {
   FASTBOOT_VAR *Var;
-  CHAR8 GetVarAll[MAX_RSP_SIZE];
+  CHAR8 *Slot;
+  UINTN SlotIndex = 0;
+  UINTN Len;
+  BOOLEAN InFlight = FALSE;
 
   for (Var = Varlist; Var; Var = Var->next) {
-    AsciiStrnCpyS (GetVarAll, sizeof (GetVarAll), Var->name, MAX_RSP_SIZE);
-    AsciiStrnCatS (GetVarAll, sizeof (GetVarAll), ":", AsciiStrLen (":"));
-    AsciiStrnCatS (GetVarAll, sizeof (GetVarAll), Var->value, MAX_RSP_SIZE);
-    FastbootInfo (GetVarAll);
-    /* Wait for the transfer to complete */
-    WaitForTransferComplete ();
-    ZeroMem (GetVarAll, sizeof (GetVarAll));
+    if (FastbootRefreshVar (Var) != EFI_SUCCESS) {
+      continue;
+    }
+
+    Slot = (CHAR8 *)GetFastbootDeviceData ().gTxBuffer +
+           SlotIndex * GETVAR_ALL_SLOT_SIZE;
+    Len = AsciiSPrint (Slot, MAX_RSP_SIZE, "INFO%a:%a", Var->name, Var->value);
+
+    /* The other slot may still be queued */
+    if (InFlight) {
+      WaitForTransferComplete ();
+    }
+    GetFastbootDeviceData ().UsbDeviceProtocol->Send (ENDPOINT_OUT, Len, Slot);
+    InFlight = TRUE;
+    SlotIndex ^= 1;
   }
 
-  FastbootOkay (GetVarAll);
+  if (InFlight) {
+    WaitForTransferComplete ();
+  }
+  FastbootOkay ("");
 }
 
 STATIC VOID
@@ -2239,8 +3868,6 @@ CmdGetVar (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
   CHAR8 *Token = AsciiStrStr (Arg, "partition-");
   CHAR8 CurrentSlotAsc[MAX_SLOT_SUFFIX_SZ];
 
-  UpdateGetVarVariable ();
-
   if (!(AsciiStrCmp ("all", Arg))) {
     CmdGetVarAll ();
     return;
@@ -2266,11 +3893,11 @@ CmdGetVar (CONST CHAR8 *Arg, VOID *Data, UINT32 Size)
     }
   }
 
-  for (Var = Varlist; Var; Var = Var->next) {
-    if (!AsciiStrCmp (Var->name, Arg)) {
-      FastbootOkay (Var->value);
-      return;
-    }
+  Var = FastbootFindVar (Arg);
+  if (Var &&
+      FastbootRefreshVar (Var) == EFI_SUCCESS) {
+    FastbootOkay (Var->value);
+    return;
   }
 
   FastbootFail ("GetVar Variable Not found");
@@ -2629,6 +4256,260 @@ CmdFlashingGetUnlockAbility (CONST CHAR8 *arg, VOID *data, UINT32 sz)
   WaitForTransferComplete ();
   FastbootOkay ("");
 }
+
+/* Handle "oem flash-delta [on|off]": in delta mode the flashed ranges are
+ * read back first and only the extents which differ are written. Without an
+ * argument the bytes checked and written since it was turned on are shown.
+ */
+STATIC VOID
+CmdOemFlashDelta (CONST CHAR8 *arg, VOID *data, UINT32 sz)
+{
+  CHAR8 DeltaInfo[MAX_RSP_SIZE];
+
+  while (*arg == ' ') {
+    arg++;
+  }
+
+  if (!AsciiStrCmp (arg, "on")) {
+    if (!DeltaReadBuf) {
+      DeltaReadBuf = AllocatePool (MAX_WRITE_SIZE);
+      if (!DeltaReadBuf) {
+        FastbootFail ("Failed to allocate the read back buffer");
+        return;
+      }
+    }
+    DeltaBytesChecked = 0;
+    DeltaBytesWritten = 0;
+    DeltaFlash = TRUE;
+  } else if (!AsciiStrCmp (arg, "off")) {
+    DeltaFlash = FALSE;
+    if (DeltaReadBuf) {
+      FreePool (DeltaReadBuf);
+      DeltaReadBuf = NULL;
+    }
+  } else if (*arg != '\0') {
+    FastbootFail ("Usage: oem flash-delta [on|off]");
+    return;
+  }
+
+  AsciiStrnCpyS (DeltaFlashVar, sizeof (DeltaFlashVar),
+                 DeltaFlash ? "yes" : "no", AsciiStrLen ("yes") + 1);
+  AsciiSPrint (DeltaInfo, sizeof (DeltaInfo), "delta %a: %lu/%lu KB written",
+               DeltaFlashVar, DeltaBytesWritten / 1024,
+               DeltaBytesChecked / 1024);
+  FastbootInfo (DeltaInfo);
+  WaitForTransferComplete ();
+  FastbootOkay ("");
+}
+
+/* Handle "oem flash-verify [on|off]": when on, every range written by flash
+ * is read back and its CRC32 compared with the one of the image, a mismatch
+ * fails the flash.
+ */
+STATIC VOID
+CmdOemFlashVerify (CONST CHAR8 *arg, VOID *data, UINT32 sz)
+{
+  UINT32 Index;
+
+  while (*arg == ' ') {
+    arg++;
+  }
+
+  if (!AsciiStrCmp (arg, "on")) {
+    for (Index = 0; Index < ARRAY_SIZE (VerifyBufs); Index++) {
+      if (!VerifyBufs[Index]) {
+        VerifyBufs[Index] = AllocatePool (MAX_WRITE_SIZE);
+      }
+      if (!VerifyBufs[Index]) {
+        FastbootFail ("Failed to allocate the read back buffer");
+        return;
+      }
+    }
+    FlashVerify = TRUE;
+  } else if (!AsciiStrCmp (arg, "off")) {
+    FlashVerify = FALSE;
+    for (Index = 0; Index < ARRAY_SIZE (VerifyBufs); Index++) {
+      if (VerifyBufs[Index]) {
+        FreePool (VerifyBufs[Index]);
+        VerifyBufs[Index] = NULL;
+      }
+    }
+  } else if (*arg != '\0') {
+    FastbootFail ("Usage: oem flash-verify [on|off]");
+    return;
+  }
+
+  AsciiStrnCpyS (FlashVerifyVar, sizeof (FlashVerifyVar),
+                 FlashVerify ? "yes" : "no", AsciiStrLen ("yes") + 1);
+  FastbootOkay ("");
+}
+
+/* Read Size bytes at byte Offset of the partition into Buffer. The covering
+ * blocks are read and the data is moved to the start of Buffer, which must
+ * be large enough for the block aligned span.
+ */
+STATIC EFI_STATUS
+FetchRead (IN EFI_BLOCK_IO_PROTOCOL *BlockIo,
+           IN UINT8 *Buffer,
+           IN UINT64 Offset,
+           IN UINT64 Size)
+{
+  EFI_STATUS Status;
+  UINT32 BlockSize = BlockIo->Media->BlockSize;
+  UINT64 Head = Offset % BlockSize;
+  UINT64 ReadSize = ROUND_TO_PAGE (Head + Size, BlockSize - 1);
+
+  Status = BlockIo->ReadBlocks (BlockIo, BlockIo->Media->MediaId,
+                                Offset / BlockSize, ReadSize, Buffer);
+  if (EFI_ERROR (Status)) {
+    DEBUG ((EFI_D_ERROR, "Fetch read at 0x%llx failed: %r\n", Offset,
+            Status));
+    return Status;
+  }
+
+  if (Head) {
+    CopyMem (Buffer, Buffer + Head, Size);
+  }
+
+  return EFI_SUCCESS;
+}
+
+/* Handle "fetch:<partition>[:<offset>:<size>]": send the partition, or the
+ * given byte range of it, back to the host. The data phase alternates
+ * between two transfer buffers so the storage read of the next part runs
+ * while usb is sending the previous one.
+ */
+STATIC VOID
+CmdFetch (CONST CHAR8 *arg, VOID *data, UINT32 sz)
+{
+  EFI_STATUS Status;
+  CHAR8 PartitionAscii[MAX_GPT_NAME_SIZE];
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  CHAR16 SlotSuffix[MAX_SLOT_SUFFIX_SZ];
+  CHAR8 Response[MAX_RSP_SIZE];
+  CONST CHAR8 *Token;
+  EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
+  EFI_HANDLE *Handle = NULL;
+  UINT8 *Buffers[2] = {NULL, NULL};
+  UINT32 Current = 0;
+  UINT64 PartitionSize;
+  UINT64 Offset = 0;
+  UINT64 Size;
+  UINT64 Sent = 0;
+  UINT64 ChunkSize;
+  UINT64 NextSize;
+  UINTN Index;
+
+  if (!IsUnlocked ()) {
+    FastbootFail ("Fetching is not allowed in Lock State");
+    return;
+  }
+
+  Token = AsciiStrStr (arg, ":");
+  Index = Token ? (UINTN)(Token - arg) : AsciiStrLen (arg);
+  if (!Index ||
+      (Index >= MAX_GPT_NAME_SIZE)) {
+    FastbootFail ("Invalid partition name");
+    return;
+  }
+  AsciiStrnCpyS (PartitionAscii, sizeof (PartitionAscii), arg, Index);
+  AsciiStrToUnicodeStr (PartitionAscii, PartitionName);
+
+  if (PartitionHasMultiSlot ((CONST CHAR16 *)L"boot")) {
+    GetPartitionHasSlot (PartitionName, ARRAY_SIZE (PartitionName),
+                         SlotSuffix, MAX_SLOT_SUFFIX_SZ);
+  }
+
+  Status = PartitionGetInfo (PartitionName, &BlockIo, &Handle);
+  if (EFI_ERROR (Status) ||
+      !BlockIo) {
+    FastbootFail ("Partition not found");
+    return;
+  }
+
+  PartitionSize = (BlockIo->Media->LastBlock + 1) * BlockIo->Media->BlockSize;
+  Size = PartitionSize;
+  if (Token) {
+    Offset = AsciiStrHexToUint64 (Token + 1);
+    Token = AsciiStrStr (Token + 1, ":");
+    if (!Token) {
+      FastbootFail ("Usage: fetch:<partition>[:<offset>:<size>]");
+      return;
+    }
+    Size = AsciiStrHexToUint64 (Token + 1);
+  }
+
+  if ((Offset > PartitionSize) ||
+      (Size > PartitionSize - Offset)) {
+    FastbootFail ("Requested range is outside of the partition");
+    return;
+  }
+
+  if (!Size ||
+      (Size > MAX_FETCH_SIZE)) {
+    FastbootFail ("Requested size is more than max allowed");
+    return;
+  }
+
+  for (Index = 0; Index < ARRAY_SIZE (Buffers); Index++) {
+    Status =
+        GetFastbootDeviceData ().UsbDeviceProtocol->AllocateTransferBuffer (
+               FETCH_BUFFER_SIZE, (VOID **)&Buffers[Index]);
+    if (EFI_ERROR (Status)) {
+      DEBUG ((EFI_D_ERROR, "Failed to allocate the fetch buffer\n"));
+      FastbootFail ("Not enough memory to fetch");
+      goto out;
+    }
+  }
+
+  /* The first read leaves the remaining ones block aligned */
+  ChunkSize = FETCH_BUFFER_SIZE - (Offset % BlockIo->Media->BlockSize);
+  ChunkSize = (Size > ChunkSize) ? ChunkSize : Size;
+  Status = FetchRead (BlockIo, Buffers[Current], Offset, ChunkSize);
+  if (EFI_ERROR (Status)) {
+    FastbootFail ("Failed to read the partition");
+    goto out;
+  }
+
+  AsciiSPrint (Response, sizeof (Response), "DATA%08x", (UINT32)Size);
+  FastbootAck ("", Response);
+  WaitForTransferComplete ();
+
+  while (Sent < Size) {
+    GetFastbootDeviceData ().UsbDeviceProtocol->Send (
+        ENDPOINT_OUT, ChunkSize, Buffers[Current]);
+    Sent += ChunkSize;
+
+    /* Read the next part while this one is on the wire */
+    NextSize = ((Size - Sent) > FETCH_BUFFER_SIZE) ?
+                FETCH_BUFFER_SIZE : (Size - Sent);
+    Status = EFI_SUCCESS;
+    if (NextSize) {
+      Status = FetchRead (BlockIo, Buffers[Current ^ 1], Offset + Sent,
+                          NextSize);
+    }
+
+    WaitForTransferComplete ();
+    if (EFI_ERROR (Status)) {
+      FastbootFail ("Failed to read the partition");
+      goto out;
+    }
+
+    ChunkSize = NextSize;
+    Current ^= 1;
+  }
+
+  FastbootOkay ("");
+
+out:
+  for (Index = 0; Index < ARRAY_SIZE (Buffers); Index++) {
+    if (Buffers[Index]) {
+      GetFastbootDeviceData ().UsbDeviceProtocol->FreeTransferBuffer (
+          Buffers[Index]);
+      Buffers[Index] = NULL;
+    }
+  }
+}
 #endif
 
 STATIC VOID
@@ -2655,6 +4536,157 @@ CmdOemDevinfo (CONST CHAR8 *arg, VOID *data, UINT32 sz)
   FastbootOkay ("");
 }
 
+STATIC EFI_STATUS
+RefreshPerfVar (IN FASTBOOT_VAR *Var)
+{
+  FASTBOOT_PERF *Perf = NULL;
+  WriteBlockStats Writes;
+  UINT64 Rate;
+  UINT64 FlashRate;
+
+  if (Var->context == PerfVar) {
+    Rate = PerfRate (PerfDownload.Bytes, PerfDownload.TimeUs);
+    FlashRate = PerfRate (PerfFlash.Bytes, PerfFlash.TimeUs);
+    AsciiSPrint (PerfVar, sizeof (PerfVar),
+                 "dl %lu.%lu MB/s flash %lu.%lu MB/s writes %lu",
+                 Rate / 10, Rate % 10, FlashRate / 10, FlashRate % 10,
+                 PerfDownload.Writes.Calls + PerfFlash.Writes.Calls);
+    return EFI_SUCCESS;
+  }
+
+  if (Var->context == PerfWritesVar) {
+    WriteStatsGet (&Writes);
+    AsciiSPrint (PerfWritesVar, sizeof (PerfWritesVar),
+                 "%lu calls %lu KB blocked %lu ms",
+                 Writes.Calls - PerfWritesBase.Calls,
+                 (Writes.Bytes - PerfWritesBase.Bytes) / 1024,
+                 (Writes.BlockedUs - PerfWritesBase.BlockedUs) / 1000);
+    return EFI_SUCCESS;
+  }
+
+  if (Var->context == PerfDownloadVar)
+    Perf = &PerfDownload;
+  else if (Var->context == PerfFlashVar)
+    Perf = &PerfFlash;
+  else
+    Perf = &PerfErase;
+
+  Rate = PerfRate (Perf->Bytes, Perf->TimeUs);
+  AsciiSPrint ((CHAR8 *)Var->context, MAX_RSP_SIZE,
+               "%lu KB %lu ms %lu.%lu MB/s wait %lu ms", Perf->Bytes / 1024,
+               Perf->TimeUs / 1000, Rate / 10, Rate % 10, Perf->WaitUs / 1000);
+  return EFI_SUCCESS;
+}
+
+STATIC VOID
+PerfInfo (IN CONST CHAR8 *Name, IN FASTBOOT_PERF *Perf)
+{
+  CHAR8 Info[MAX_RSP_SIZE];
+  UINT64 Rate = PerfRate (Perf->Bytes, Perf->TimeUs);
+  UINT64 CpuUs = Perf->TimeUs;
+
+  /* What is neither waiting nor blocked on storage is parsing and copying,
+   * the flash wait overlaps the flash itself.
+   */
+  if (Perf == &PerfDownload)
+    CpuUs -= Perf->WaitUs;
+  CpuUs = CpuUs > Perf->Writes.BlockedUs ? CpuUs - Perf->Writes.BlockedUs : 0;
+
+  AsciiSPrint (Info, sizeof (Info), "%a: %lu cmds %lu KB %lu ms %lu.%lu MB/s",
+               Name, Perf->Count, Perf->Bytes / 1024, Perf->TimeUs / 1000,
+               Rate / 10, Rate % 10);
+  FastbootInfo (Info);
+  WaitForTransferComplete ();
+  AsciiSPrint (Info, sizeof (Info), "%a: %a %lu ms cpu %lu ms", Name,
+               Perf == &PerfDownload ? "usb wait" : "flash wait",
+               Perf->WaitUs / 1000, CpuUs / 1000);
+  FastbootInfo (Info);
+  WaitForTransferComplete ();
+  AsciiSPrint (Info, sizeof (Info), "%a: %lu writes %lu KB blocked %lu ms",
+               Name, Perf->Writes.Calls, Perf->Writes.Bytes / 1024,
+               Perf->Writes.BlockedUs / 1000);
+  FastbootInfo (Info);
+  WaitForTransferComplete ();
+  AsciiSPrint (Info, sizeof (Info), "%a: <4K %lu <16K %lu <64K %lu <256K %lu",
+               Name, Perf->Writes.SizeHist[0], Perf->Writes.SizeHist[1],
+               Perf->Writes.SizeHist[2], Perf->Writes.SizeHist[3]);
+  FastbootInfo (Info);
+  WaitForTransferComplete ();
+  AsciiSPrint (Info, sizeof (Info), "%a: <1M %lu <4M %lu >=4M %lu", Name,
+               Perf->Writes.SizeHist[4], Perf->Writes.SizeHist[5],
+               Perf->Writes.SizeHist[6]);
+  FastbootInfo (Info);
+  WaitForTransferComplete ();
+}
+
+/* Handle "oem perf [reset]" */
+STATIC VOID
+CmdOemPerf (CONST CHAR8 *arg, VOID *data, UINT32 sz)
+{
+  while (*arg == ' ')
+    arg++;
+
+  if (!AsciiStrCmp (arg, "reset")) {
+    gBS->SetMem ((VOID *)&PerfDownload, sizeof (PerfDownload), 0);
+    gBS->SetMem ((VOID *)&PerfFlash, sizeof (PerfFlash), 0);
+    gBS->SetMem ((VOID *)&PerfErase, sizeof (PerfErase), 0);
+    WriteStatsGet (&PerfWritesBase);
+    FastbootOkay ("");
+    return;
+  }
+
+  if (*arg) {
+    FastbootFail ("usage: oem perf [reset]");
+    return;
+  }
+
+  PerfInfo ("download", &PerfDownload);
+  PerfInfo ("flash", &PerfFlash);
+  PerfInfo ("erase", &PerfErase);
+  FastbootOkay ("");
+}
+
+/* Lists the spans of the boot trace, nested spans are indented */
+STATIC VOID
+CmdOemBootTrace (CONST CHAR8 *arg, VOID *data, UINT32 sz)
+{
+  BootTraceBuffer *Trace = BootTraceGet ();
+  BootTraceEntry *Entry;
+  CHAR8 Info[MAX_RSP_SIZE];
+  UINT32 Span = 0;
+  UINT32 Indent;
+
+  if (!Trace) {
+    FastbootFail ("No boot trace");
+    return;
+  }
+
+  if (Trace->Count > BOOT_TRACE_ENTRIES) {
+    Span = Trace->Count - BOOT_TRACE_ENTRIES;
+    AsciiSPrint (Info, sizeof (Info), "%u older spans dropped", Span);
+    FastbootInfo (Info);
+    WaitForTransferComplete ();
+  }
+
+  for (; Span < Trace->Count; Span++) {
+    Entry = &Trace->Entries[Span % BOOT_TRACE_ENTRIES];
+    Indent = MIN (Entry->Depth, 4) * 2;
+    gBS->SetMem (Info, Indent, ' ');
+    if (Entry->EndUs) {
+      AsciiSPrint (Info + Indent, sizeof (Info) - Indent, "%a %lu +%lu us",
+                   Entry->Name, Entry->StartUs,
+                   Entry->EndUs - Entry->StartUs);
+    } else {
+      AsciiSPrint (Info + Indent, sizeof (Info) - Indent, "%a %lu open",
+                   Entry->Name, Entry->StartUs);
+    }
+    FastbootInfo (Info);
+    WaitForTransferComplete ();
+  }
+
+  FastbootOkay ("");
+}
+
 STATIC EFI_STATUS
 AcceptCmdTimerInit (IN UINT64 Size, IN CHAR8 *Data)
 {
@@ -2704,9 +4736,12 @@ AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
 {
   EFI_STATUS Status = EFI_SUCCESS;
   FASTBOOT_CMD *cmd;
+  FASTBOOT_CMD_CLASS CmdClass = FastbootCmdClassOther;
   UINT32 BatteryVoltage = 0;
   STATIC BOOLEAN IsFirstEraseFlash;
   CHAR8 FlashResultStr[MAX_RSP_SIZE] = "\0";
+  UINT64 StartUs;
+  UINT64 TimeUs;
 
   if (!Data) {
     FastbootFail ("Invalid input command");
@@ -2718,16 +4753,22 @@ AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
 
   DEBUG ((EFI_D_INFO, "Handling Cmd: %a\n", Data));
 
+  cmd = FastbootCmdLookup (Data);
+  if (cmd)
+    CmdClass = cmd->cmd_class;
+
   if (!IsDisableParallelDownloadFlash ()) {
     /* Wait for flash finished before next command */
-    if (AsciiStrnCmp (Data, "download", AsciiStrLen ("download"))) {
+    if (CmdClass != FastbootCmdClassDownload) {
       StopUsbTimer ();
       if (!IsFlashComplete) {
         Status = AcceptCmdTimerInit (Size, Data);
         if (Status == EFI_SUCCESS) {
+          PerfFlashWait (TRUE);
           return;
         }
       }
+      PerfFlashWait (FALSE);
     }
 
     /* Check last flash result */
@@ -2735,15 +4776,30 @@ AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
       AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
                  "Error: Last flash failed", FlashResult);
 
+      /* The flash was already acknowledged, whatever comes next fails */
       DEBUG ((EFI_D_ERROR, "%a\n", FlashResultStr));
-      if (!AsciiStrnCmp (Data, "flash", AsciiStrLen ("flash")) ||
-          !AsciiStrnCmp (Data, "download", AsciiStrLen ("download"))) {
-        FastbootFail (FlashResultStr);
-        FlashResult = EFI_SUCCESS;
-        return;
-      }
+      FastbootFail (FlashResultStr);
+      FlashResult = EFI_SUCCESS;
+      return;
+    }
+  }
+
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  /* Only downloads to memory and getvar run next to a background erase,
+   * a download streamed to storage waits for it like a flash.
+   */
+  if ((CmdClass != FastbootCmdClassDownload || SparseStreamArmed) &&
+      CmdClass != FastbootCmdClassGetVar) {
+    FastbootEraseFence ();
+    if (EFI_ERROR (EraseResult)) {
+      AsciiSPrint (FlashResultStr, MAX_RSP_SIZE, "%a : %r",
+                   "Error: Last erase failed", EraseResult);
+      EraseResult = EFI_SUCCESS;
+      FastbootFail (FlashResultStr);
+      return;
     }
   }
+#endif
 
   if (FixedPcdGetBool (EnableBatteryVoltageCheck)) {
     /* Check battery voltage before erase or flash image
@@ -2753,8 +4809,8 @@ AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
      * to stop the update when the image is half-flashed.
      */
     if (IsFirstEraseFlash) {
-      if (!AsciiStrnCmp (Data, "erase", AsciiStrLen ("erase")) ||
-          !AsciiStrnCmp (Data, "flash", AsciiStrLen ("flash"))) {
+      if (CmdClass == FastbootCmdClassErase ||
+          CmdClass == FastbootCmdClassFlash) {
         if (!TargetBatterySocOk (&BatteryVoltage)) {
           DEBUG ((EFI_D_VERBOSE, "fastboot: battery voltage: %d\n",
                   BatteryVoltage));
@@ -2763,18 +4819,32 @@ AcceptCmd (IN UINT64 Size, IN CHAR8 *Data)
         }
         IsFirstEraseFlash = FALSE;
       }
-    } else if (!AsciiStrnCmp (Data, "getvar:partition-type",
-                              AsciiStrLen ("getvar:partition-type"))) {
+    } else if (CmdClass == FastbootCmdClassGetVar &&
+               !AsciiStrnCmp (Data + cmd->prefix_len, "partition-type",
+                              AsciiStrLen ("partition-type"))) {
       IsFirstEraseFlash = TRUE;
     }
   }
 
-  for (cmd = cmdlist; cmd; cmd = cmd->next) {
-    if (AsciiStrnCmp (Data, cmd->prefix, cmd->prefix_len))
-      continue;
-
+  if (cmd) {
+    if (cmd->perf) {
+      PerfStart (cmd->perf);
+      PerfWritesBegin (cmd->perf);
+    }
+    StartUs = GetTimerCountUs ();
     cmd->handle ((CONST CHAR8 *)Data + cmd->prefix_len, (VOID *)mUsbDataBuffer,
                  (UINT32)mBytesReceivedSoFar);
+    TimeUs = GetTimerCountUs () - StartUs;
+    if (cmd->perf) {
+      PerfWritesEnd (cmd->perf);
+      /* A pipelined flash lets the next download reuse the usb counter */
+      PerfEnd (cmd->perf,
+               cmd->perf == &PerfFlash ? mFlashNumDataBytes : 0, TimeUs);
+    }
+    cmd->count++;
+    cmd->total_us += TimeUs;
+    if (TimeUs > cmd->max_us)
+      cmd->max_us = TimeUs;
     return;
   }
   DEBUG ((EFI_D_ERROR, "\nFastboot Send Fail\n"));
@@ -2909,6 +4979,26 @@ GetPartitionSize (IN CHAR16 *PartName, OUT CHAR8 * PartSize)
 
 }
 
+STATIC EFI_STATUS
+RefreshPartitionSizeVar (IN FASTBOOT_VAR *Var)
+{
+  struct GetVarPartitionInfo *Info = Var->context;
+  CHAR16 PartName[MAX_GPT_NAME_SIZE];
+
+  AsciiStrToUnicodeStr (Info->part_name, PartName);
+  return GetPartitionSize (PartName, Info->size_response);
+}
+
+STATIC EFI_STATUS
+RefreshPartitionTypeVar (IN FASTBOOT_VAR *Var)
+{
+  struct GetVarPartitionInfo *Info = Var->context;
+  CHAR16 PartName[MAX_GPT_NAME_SIZE];
+
+  AsciiStrToUnicodeStr (Info->part_name, PartName);
+  return GetPartitionType (PartName, Info->type_response);
+}
+
 STATIC EFI_STATUS
 PublishGetVarPartitionInfo (
                             IN struct GetVarPartitionInfo *PublishedPartInfo,
@@ -2918,8 +5008,6 @@ PublishGetVarPartitionInfo (
   EFI_STATUS Status = EFI_INVALID_PARAMETER;
   EFI_STATUS RetStatus = EFI_SUCCESS;
   CHAR16 *PartitionNameUniCode = NULL;
-  BOOLEAN PublishType;
-  BOOLEAN PublishSize;
 
   /* Clear Published Partition Buffer */
   gBS->SetMem (PublishedPartInfo,
@@ -2928,8 +5016,6 @@ PublishGetVarPartitionInfo (
   /* Loop will go through each partition entry
      and publish info for all partitions.*/
   for (PtnLoopCount = 1; PtnLoopCount <= NumParts; PtnLoopCount++) {
-    PublishType = FALSE;
-    PublishSize = FALSE;
     PartitionNameUniCode = PtnEntries[PtnLoopCount].PartEntry.PartitionName;
     /* Skip Null/last partition */
     if (PartitionNameUniCode[0] == '\0') {
@@ -2938,7 +5024,9 @@ PublishGetVarPartitionInfo (
     UnicodeStrToAsciiStr (PtnEntries[PtnLoopCount].PartEntry.PartitionName,
                           (CHAR8 *)PublishedPartInfo[PtnLoopCount].part_name);
 
-    /* Fill partition size variable and response string */
+    /* Size and type are read from the device the first time they are
+     * asked for, a failure reports the variable as not found.
+     */
     AsciiStrnCpyS (PublishedPartInfo[PtnLoopCount].getvar_size_str,
                       MAX_GET_VAR_NAME_SIZE, "partition-size:",
                       AsciiStrLen ("partition-size:"));
@@ -2948,15 +5036,16 @@ PublishGetVarPartitionInfo (
                             AsciiStrLen (
                               PublishedPartInfo[PtnLoopCount].part_name));
     if (!EFI_ERROR (Status)) {
-      Status = GetPartitionSize (
-                            PartitionNameUniCode,
-                            PublishedPartInfo[PtnLoopCount].size_response);
-      if (Status == EFI_SUCCESS) {
-        PublishSize = TRUE;
-      }
+      FastbootPublishLazyVar (PublishedPartInfo[PtnLoopCount].getvar_size_str,
+                              PublishedPartInfo[PtnLoopCount].size_response,
+                              RefreshPartitionSizeVar,
+                              &PublishedPartInfo[PtnLoopCount], TRUE);
+    } else {
+        DEBUG ((EFI_D_ERROR, "Error Publishing size info for %s partition\n",
+                                                        PartitionNameUniCode));
+        RetStatus = EFI_INVALID_PARAMETER;
     }
 
-    /* Fill partition type variable and response string */
     AsciiStrnCpyS (PublishedPartInfo[PtnLoopCount].getvar_type_str,
                     MAX_GET_VAR_NAME_SIZE, "partition-type:",
                     AsciiStrLen ("partition-type:"));
@@ -2966,26 +5055,10 @@ PublishGetVarPartitionInfo (
                               AsciiStrLen (
                                 PublishedPartInfo[PtnLoopCount].part_name));
     if (!EFI_ERROR (Status)) {
-      Status = GetPartitionType (
-                            PartitionNameUniCode,
-                            PublishedPartInfo[PtnLoopCount].type_response);
-      if (Status == EFI_SUCCESS) {
-        PublishType = TRUE;
-      }
-    }
-
-    if (PublishSize) {
-      FastbootPublishVar (PublishedPartInfo[PtnLoopCount].getvar_size_str,
-                              PublishedPartInfo[PtnLoopCount].size_response);
-    } else {
-        DEBUG ((EFI_D_ERROR, "Error Publishing size info for %s partition\n",
-                                                        PartitionNameUniCode));
-        RetStatus = EFI_INVALID_PARAMETER;
-    }
-
-    if (PublishType) {
-      FastbootPublishVar (PublishedPartInfo[PtnLoopCount].getvar_type_str,
-                              PublishedPartInfo[PtnLoopCount].type_response);
+      FastbootPublishLazyVar (PublishedPartInfo[PtnLoopCount].getvar_type_str,
+                              PublishedPartInfo[PtnLoopCount].type_response,
+                              RefreshPartitionTypeVar,
+                              &PublishedPartInfo[PtnLoopCount], TRUE);
     } else {
         DEBUG ((EFI_D_ERROR, "Error Publishing type info for %s partition\n",
                                                         PartitionNameUniCode));
@@ -3153,22 +5226,26 @@ FastbootCommandSetup (IN VOID *base, IN UINT32 size)
   EFI_STATUS Status;
   CHAR8 HWPlatformBuf[MAX_RSP_SIZE] = "\0";
   CHAR8 DeviceType[MAX_RSP_SIZE] = "\0";
-  BOOLEAN BatterySocOk = FALSE;
-  UINT32 BatteryVoltage = 0;
   UINT32 PartitionCount = 0;
   BOOLEAN MultiSlotBoot = PartitionHasMultiSlot ((CONST CHAR16 *)L"boot");
   MemCardType Type = UNKNOWN;
+  UINT32 i;
 
   mDataBuffer = base;
   mNumDataBytes = size;
   mFlashNumDataBytes = size;
-  mUsbDataBuffer = base;
 
-  mFlashDataBuffer = (CheckRootDeviceType () == NAND) ?
-                           base : (base + MAX_BUFFER_SIZE);
+  if (!mDownloadSlotCount) {
+    mDownloadSlotCount = 1;
+  }
+  for (i = 0; i < mDownloadSlotCount; i++) {
+    mDownloadSlots[i] = (UINT8 *)base + (UINT64)i * size;
+  }
+  mUsbSlot = 0;
+  mUsbDataBuffer = mDownloadSlots[mUsbSlot];
+  mFlashDataBuffer = mDownloadSlots[mDownloadSlotCount - 1];
 
   /* Find all Software Partitions in the User Partition */
-  UINT32 i;
   UINT32 BlkSize = 0;
   DeviceInfo *DevInfoPtr = NULL;
 
@@ -3190,6 +5267,10 @@ FastbootCommandSetup (IN VOID *base, IN UINT32 size)
       {"flashing unlock", CmdFlashingUnlock},
       {"flashing lock", CmdFlashingLock},
       {"oem lock", CmdFlashingLock},
+      {"oem stream-flash", CmdOemStreamFlash},
+      {"oem flash-delta", CmdOemFlashDelta},
+      {"oem flash-verify", CmdOemFlashVerify},
+      {"fetch:", CmdFetch},
 #endif
 /*
  *CAUTION(CRITICAL): Enabling these commands will allow changes to bootimage.
@@ -3210,6 +5291,8 @@ FastbootCommandSetup (IN VOID *base, IN UINT32 size)
       {"oem off-mode-charge", CmdOemOffModeCharger},
       {"oem select-display-panel", CmdOemSelectDisplayPanel},
       {"oem device-info", CmdOemDevinfo},
+      {"oem perf", CmdOemPerf},
+      {"oem boot-trace", CmdOemBootTrace},
       {"oem poweroff", CmdOemPoweroff},
       {"oem read_psn", CmdOemReadPSN},
       { "oem get_bk_log", CmdOemGetBKLog },
@@ -3264,23 +5347,34 @@ FastbootCommandSetup (IN VOID *base, IN UINT32 size)
 
   AsciiSPrint (EraseBlkSizeStr, sizeof (EraseBlkSizeStr), " 0x%x", BlkSize);
   FastbootPublishVar ("erase-block-size", EraseBlkSizeStr);
+#ifdef ENABLE_UPDATE_PARTITIONS_CMDS
+  FastbootPublishVar ("flash-delta", DeltaFlashVar);
+  FastbootPublishVar ("flash-verify", FlashVerifyVar);
+  FastbootPublishVar ("max-fetch-size", MAX_FETCH_SIZE_STR);
+  FastbootPublishLazyVar ("erase-pending", ErasePendingVar,
+                          RefreshErasePendingVar, NULL, FALSE);
+#endif
   GetDevInfo (&DevInfoPtr);
   FastbootPublishVar ("version-bootloader", DevInfoPtr->bootloader_version);
   FastbootPublishVar ("version-baseband", DevInfoPtr->radio_version);
-  BatterySocOk = TargetBatterySocOk (&BatteryVoltage);
-  AsciiSPrint (StrBatteryVoltage, sizeof (StrBatteryVoltage), "%d",
-               BatteryVoltage);
-  FastbootPublishVar ("battery-voltage", StrBatteryVoltage);
-  AsciiSPrint (StrBatterySocOk, sizeof (StrBatterySocOk), "%a",
-               BatterySocOk ? "yes" : "no");
-  FastbootPublishVar ("battery-soc-ok", StrBatterySocOk);
-  AsciiSPrint (ChargeScreenEnable, sizeof (ChargeScreenEnable), "%d",
-               IsChargingScreenEnable ());
-  FastbootPublishVar ("charger-screen-enabled", ChargeScreenEnable);
-  AsciiSPrint (OffModeCharge, sizeof (OffModeCharge), "%d",
-               IsChargingScreenEnable ());
-  FastbootPublishVar ("off-mode-charge", ChargeScreenEnable);
+  FastbootPublishLazyVar ("battery-voltage", StrBatteryVoltage,
+                          RefreshBatteryVar, StrBatteryVoltage, FALSE);
+  FastbootPublishLazyVar ("battery-soc-ok", StrBatterySocOk,
+                          RefreshBatteryVar, StrBatterySocOk, FALSE);
+  FastbootPublishLazyVar ("charger-screen-enabled", ChargeScreenEnable,
+                          RefreshChargerVar, ChargeScreenEnable, FALSE);
+  FastbootPublishLazyVar ("off-mode-charge", OffModeCharge,
+                          RefreshChargerVar, OffModeCharge, FALSE);
   FastbootPublishVar ("unlocked", IsUnlocked () ? "yes" : "no");
+  FastbootPublishLazyVar ("perf", PerfVar, RefreshPerfVar, PerfVar, FALSE);
+  FastbootPublishLazyVar ("perf:download", PerfDownloadVar, RefreshPerfVar,
+                          PerfDownloadVar, FALSE);
+  FastbootPublishLazyVar ("perf:flash", PerfFlashVar, RefreshPerfVar,
+                          PerfFlashVar, FALSE);
+  FastbootPublishLazyVar ("perf:erase", PerfEraseVar, RefreshPerfVar,
+                          PerfEraseVar, FALSE);
+  FastbootPublishLazyVar ("perf:writes", PerfWritesVar, RefreshPerfVar,
+                          PerfWritesVar, FALSE);
 
   AsciiSPrint (StrSocVersion, sizeof (StrSocVersion), "%x",
                 BoardPlatformChipVersion ());
@@ -3294,6 +5388,7 @@ FastbootCommandSetup (IN VOID *base, IN UINT32 size)
   UINT32 FastbootCmdCnt = sizeof (cmd_list) / sizeof (cmd_list[0]);
   for (i = 1; i < FastbootCmdCnt; i++)
     FastbootRegister (cmd_list[i].name, cmd_list[i].cb);
+  PublishCmdLatencyVars ();
 
   // Read Allow Ulock Flag
   Status = ReadAllowUnlockValue (&IsAllowUnlock);
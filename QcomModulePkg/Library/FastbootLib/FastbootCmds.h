@@ -51,7 +51,36 @@
 #endif
 
 #define MAX_WRITE_SIZE (1024 * 1024)
+/* Number of MAX_WRITE_SIZE writes kept outstanding on storage that
+ * supports BlockIo2. A depth of 1 keeps the synchronous write path.
+ */
+#ifndef WRITE_QUEUE_DEPTH
+#define WRITE_QUEUE_DEPTH 4
+#endif
+/* Zero FILL runs smaller than this are written rather than discarded */
+#define FILL_DISCARD_MIN_SIZE (1024 * 1024 * 4)
+/* Unit compared against the partition content in delta flash mode, only the
+ * extents which differ are written.
+ */
+#define DELTA_EXTENT_SIZE (64 * 1024)
+/* Erases of at least this size are discarded in the background, the next
+ * command that touches the storage waits for them.
+ */
+#define ERASE_BACKGROUND_MIN_SIZE (1024 * 1024 * 64)
 #define MAX_BUFFER_SIZE MAX_DOWNLOAD_SIZE
+/* Number of download buffers in the receive ring. The usb downloads the next
+ * image into the following slot while the previous one is being flashed.
+ * A single slot disables parallel download and flash.
+ */
+#ifndef DOWNLOAD_BUFFER_SLOTS
+#define DOWNLOAD_BUFFER_SLOTS 2
+#endif
+/* "fetch" streams the partition through two buffers of this size, the next
+ * one is read from storage while the previous one is sent.
+ */
+#define FETCH_BUFFER_SIZE (1024 * 1024 * 4)
+#define MAX_FETCH_SIZE (1024 * 1024 * 1024)
+#define MAX_FETCH_SIZE_STR "1073741824"
 #define MAX_RSP_SIZE 64
 #define ERASE_BUFF_SIZE 256 * 1024
 #define ERASE_BUFF_BLOCKS 256 * 2
@@ -92,11 +121,27 @@ struct FastbootCmdDesc {
   fastboot_cmd_fn cb;
 };
 
+/* Number of buckets of the fastboot variable hash table */
+#define FASTBOOT_VAR_HASH_SIZE 128
+
+struct _FASTBOOT_VAR;
+
+/* Brings the value of a variable up to date before it is read. A variable
+ * whose refresh fails is treated as not published.
+ */
+typedef EFI_STATUS (*FASTBOOT_VAR_REFRESH) (struct _FASTBOOT_VAR *Var);
+
 /* Fastboot Variable list */
 typedef struct _FASTBOOT_VAR {
   struct _FASTBOOT_VAR *next;
+  struct _FASTBOOT_VAR *hash_next;
   CONST CHAR8 *name;
   CONST CHAR8 *value;
+  FASTBOOT_VAR_REFRESH refresh;
+  VOID *context;
+  BOOLEAN refresh_once; /* keep the first refreshed value */
+  BOOLEAN refreshed;
+  EFI_STATUS refresh_status;
 } FASTBOOT_VAR;
 
 /* Partition info fastboot variable */
@@ -115,14 +160,56 @@ typedef enum {
   FastbootStateMax
 } ANDROID_FASTBOOT_STATE;
 
+/* Commands AcceptCmd has to gate before dispatching them */
+typedef enum {
+  FastbootCmdClassOther = 0,
+  FastbootCmdClassDownload,
+  FastbootCmdClassFlash,
+  FastbootCmdClassErase,
+  FastbootCmdClassGetVar,
+} FASTBOOT_CMD_CLASS;
+
+/* Throughput counters of a command, see getvar perf and oem perf. WaitUs
+ * is the time the download waited for usb, or for flash the time the host
+ * was held back until the previous flash completed.
+ */
+typedef struct {
+  UINT64 Count;
+  UINT64 Bytes;
+  UINT64 TimeUs;
+  UINT64 WaitUs;
+  WriteBlockStats Writes;
+  /* Command in progress */
+  UINT64 StartUs;
+  WriteBlockStats WritesStart;
+} FASTBOOT_PERF;
+
 /* Data structure to store the command list */
 typedef struct _FASTBOOT_CMD {
   struct _FASTBOOT_CMD *next;
   CONST CHAR8 *prefix;
   UINT32 prefix_len;
   VOID (*handle) (CONST CHAR8 *arg, VOID *data, UINT32 sz);
+  FASTBOOT_CMD_CLASS cmd_class;
+  FASTBOOT_PERF *perf;
+  /* Latency of the handler, published as getvar cmd-latency:<prefix> */
+  UINT64 count;
+  UINT64 total_us;
+  UINT64 max_us;
+  CHAR8 latency_name[MAX_RSP_SIZE];
+  CHAR8 latency_value[MAX_RSP_SIZE];
 } FASTBOOT_CMD;
 
+/* Prefix trie of the registered commands, children of a node are kept as
+ * a sibling list.
+ */
+typedef struct _FASTBOOT_CMD_NODE {
+  struct _FASTBOOT_CMD_NODE *child;
+  struct _FASTBOOT_CMD_NODE *sibling;
+  FASTBOOT_CMD *cmd;
+  CHAR8 c;
+} FASTBOOT_CMD_NODE;
+
 /* Returns the number of bytes left in the
  * download. You must be expecting a download to
  * call this  function
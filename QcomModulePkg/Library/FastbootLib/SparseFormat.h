@@ -62,4 +62,21 @@ typedef struct SparseImgParams {
   UINT64 PartitionSize;
   EFI_BLOCK_IO_PROTOCOL *BlockIo;
   EFI_HANDLE *Handle;
+  UINT32 Crc; /* CRC32 of the output image so far, for CHUNK_TYPE_CRC */
 } SparseImgParam;
+
+/* State of a sparse image that is flashed while it is being downloaded */
+typedef struct SparseStreamParams {
+  BOOLEAN Active;
+  BOOLEAN Bypass;
+  BOOLEAN Finished;
+  BOOLEAN HeaderDone;
+  BOOLEAN InChunk;
+  EFI_STATUS Status;
+  UINT64 DownloadSize;
+  UINT64 Consumed;
+  UINT64 ChunkDataLeft;
+  CHAR16 PartitionName[MAX_GPT_NAME_SIZE];
+  sparse_header_t Header;
+  SparseImgParam ImgData;
+} SparseStreamParam;
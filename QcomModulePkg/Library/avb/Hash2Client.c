@@ -35,6 +35,14 @@
 #include <Protocol/Hash2.h>
 #include <Uefi.h>
 
+/* Located once and shared by all contexts, hash partitions are hashed in
+ * chunks interleaved with their reads. Without the protocol the software
+ * SHA-256 in avb_sha256.c is used, with the ARMv8 Crypto Extensions where
+ * the cpu has them.
+ */
+STATIC EFI_HASH2_PROTOCOL *mHash2Protocol;
+STATIC BOOLEAN mHash2Absent;
+
 /*
   Initializes the SHA-256 context.
   Ctx cannot be NULL here, it is caller's responsibility
@@ -44,10 +52,23 @@ void
 avb_sha256_init (AvbSHA256Ctx *Ctx)
 {
   EFI_STATUS Status = EFI_SUCCESS;
-  EFI_HASH2_PROTOCOL *pEfiHash2Protocol = NULL;
+  EFI_HASH2_PROTOCOL *pEfiHash2Protocol = mHash2Protocol;
 
-  GUARD_OUT (gBS->LocateProtocol (&gEfiHash2ProtocolGuid, NULL,
-                                  (VOID **)&pEfiHash2Protocol));
+  if (mHash2Absent) {
+    Status = EFI_NOT_FOUND;
+    goto out;
+  }
+
+  if (pEfiHash2Protocol == NULL) {
+    Status = gBS->LocateProtocol (&gEfiHash2ProtocolGuid, NULL,
+                                  (VOID **)&pEfiHash2Protocol);
+    if (Status != EFI_SUCCESS) {
+      DEBUG ((EFI_D_INFO, "Hash2 protocol not found, using software hash\n"));
+      mHash2Absent = TRUE;
+      goto out;
+    }
+    mHash2Protocol = pEfiHash2Protocol;
+  }
 
   Ctx->user_data = (VOID *)pEfiHash2Protocol;
 
@@ -57,6 +78,7 @@ avb_sha256_init (AvbSHA256Ctx *Ctx)
 out:
   if (Status != EFI_SUCCESS) {
     Ctx->user_data = NULL;
+    avb_sha256_sw_init (Ctx);
   }
 }
 
@@ -78,7 +100,11 @@ avb_sha256_update (AvbSHA256Ctx *Ctx, const uint8_t *Data, uint32_t Len)
 
   pEfiHash2Protocol = Ctx->user_data;
   if (pEfiHash2Protocol == NULL) {
-    DEBUG ((EFI_D_ERROR, "avb_sha256_update failed, Ctx->user_data is NULL\n"));
+    avb_sha256_sw_update (Ctx, Data, Len);
+    return;
+  }
+
+  if (Len == 0) {
     return;
   }
 
@@ -102,9 +128,7 @@ avb_sha256_final (AvbSHA256Ctx *Ctx)
 
   pEfiHash2Protocol = Ctx->user_data;
   if (pEfiHash2Protocol == NULL) {
-    DEBUG ((EFI_D_ERROR, "avb_sha256_final failed, Ctx->user_data is NULL\n"));
-    Status = EFI_INVALID_PARAMETER;
-    goto out;
+    return avb_sha256_sw_final (Ctx);
   }
 
   GUARD_OUT (pEfiHash2Protocol->HashFinal (pEfiHash2Protocol, &Hash2Output));
@@ -28,6 +28,7 @@
 
 #include "VerifiedBoot.h"
 #include "BootLinux.h"
+#include "BootStats.h"
 #include "KeymasterClient.h"
 #include "libavb/libavb.h"
 #include <Library/MenuKeysDetection.h>
@@ -484,6 +485,21 @@ ResultShouldContinue (AvbSlotVerifyResult Result)
   return FALSE;
 }
 
+/* Every avb_slot_verify call loads the kernel and ramdisk again, a retry
+ * must not pick up the addresses or the inflate state of an earlier attempt.
+ */
+STATIC VOID
+ResetImagesInPlace (AvbOpsUserData *UserData)
+{
+  UserData->KernelLoadAddr = 0;
+  UserData->KernelSize = 0;
+  UserData->KernelOutLen = 0;
+  UserData->KernelDtbOffset = 0;
+  UserData->RamdiskLoadAddr = 0;
+  UserData->RamdiskOffset = 0;
+  UserData->RamdiskSize = 0;
+}
+
 STATIC EFI_STATUS
 LEGetImageHash (QcomAsn1x509Protocol *pEfiQcomASN1X509Protocol,
         VB_HASH HashAlgorithm,
@@ -803,6 +819,7 @@ LoadImageAndAuthVB2 (BootInfo *Info)
   UINTN ImageSize = 0;
   KMRotAndBootState Data = {0};
   CONST boot_img_hdr *BootImgHdr = NULL;
+  UINT32 TraceSpan;
   AvbSlotVerifyFlags VerifyFlags =
       AllowVerificationError ? AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR
                              : AVB_SLOT_VERIFY_FLAGS_NONE;
@@ -827,6 +844,9 @@ LoadImageAndAuthVB2 (BootInfo *Info)
     goto out;
   }
   UserData->IsMultiSlot = Info->MultiSlotBoot;
+  /* The VM load addresses are only known to BootLinux */
+  UserData->LoadRamdiskInPlace = !IsVmEnabled ();
+  UserData->InflateKernel = !IsVmEnabled ();
 
   if (Info->MultiSlotBoot) {
     UnicodeStrToAsciiStr (Info->Pname, PnameAscii);
@@ -855,8 +875,11 @@ LoadImageAndAuthVB2 (BootInfo *Info)
            Info->BootIntoRecovery) {
     AddRequestedPartition (RequestedPartitionAll, IMG_RECOVERY);
     NumRequestedPartition += 1;
+    ResetImagesInPlace (UserData);
+    TraceSpan = BootTraceBegin ("avb-verify", NULL);
     Result = avb_slot_verify (Ops, (CONST CHAR8 *CONST *)RequestedPartition,
                SlotSuffix, VerifyFlags, VerityFlags, &SlotData);
+    BootTraceEnd (TraceSpan);
 
     if (AllowVerificationError &&
                ResultShouldContinue (Result)) {
@@ -884,8 +907,11 @@ LoadImageAndAuthVB2 (BootInfo *Info)
        if (SlotData != NULL) {
           avb_slot_verify_data_free (SlotData);
        }
+       ResetImagesInPlace (UserData);
+       TraceSpan = BootTraceBegin ("avb-verify", NULL);
        Result = avb_slot_verify (Ops, (CONST CHAR8 *CONST *)RequestedPartition,
                   SlotSuffix, VerifyFlags, VerityFlags, &SlotData);
+       BootTraceEnd (TraceSpan);
     }
   } else {
     if (!Info->NumLoadedImages) {
@@ -916,8 +942,11 @@ LoadImageAndAuthVB2 (BootInfo *Info)
       AddRequestedPartition (RequestedPartitionAll, IMG_VMLINUX);
       NumRequestedPartition += 1;
     }
+    ResetImagesInPlace (UserData);
+    TraceSpan = BootTraceBegin ("avb-verify", NULL);
     Result = avb_slot_verify (Ops, (CONST CHAR8 *CONST *)RequestedPartition,
                 SlotSuffix, VerifyFlags, VerityFlags, &SlotData);
+    BootTraceEnd (TraceSpan);
   }
 
   if (SlotData == NULL) {
@@ -982,6 +1011,16 @@ LoadImageAndAuthVB2 (BootInfo *Info)
 
   DEBUG ((EFI_D_VERBOSE, "Total loaded partition %d\n", Info->NumLoadedImages));
 
+  Info->RamdiskLoadAddr = UserData->RamdiskLoadAddr;
+  Info->RamdiskOffset = UserData->RamdiskOffset;
+  Info->RamdiskSize = UserData->RamdiskSize;
+  if (UserData->KernelStream == NULL) {
+    Info->KernelLoadAddr = UserData->KernelLoadAddr;
+    Info->KernelSize = UserData->KernelSize;
+    Info->KernelOutLen = UserData->KernelOutLen;
+    Info->KernelDtbOffset = UserData->KernelDtbOffset;
+  }
+
   VBData = (VB2Data *)avb_calloc (sizeof (VB2Data));
   if (VBData == NULL) {
     DEBUG ((EFI_D_ERROR, "ERROR: Failed to allocate VB2Data\n"));
@@ -52,6 +52,7 @@
 
 #include "Board.h"
 #include "BootLinux.h"
+#include "Decompress.h"
 #include "LinuxLoaderLib.h"
 #include "OEMPublicKey.h"
 #include "PartitionTableUpdate.h"
@@ -126,21 +127,14 @@ static AvbPartitionDetails SupportedPartitions[] =
   { "recovery", &gEfiRecoveryImgPartitionGuid} ,
 };
 
-AvbIOResult AvbReadFromPartition(AvbOps *Ops, const char *Partition, int64_t ReadOffset,
-                     size_t NumBytes, void *Buffer, size_t *OutNumRead)
+/* Looks up the handle of |Partition|, by type guid for the partitions
+ * AVB knows about and by label for the others.
+ */
+STATIC AvbIOResult GetPartitionHandleInfo(const char *Partition,
+                                          HandleInfo *InfoList)
 {
 	AvbIOResult Result = AVB_IO_RESULT_OK;
 	EFI_STATUS Status = EFI_SUCCESS;
-	VOID *Page = NULL;
-        UINTN Offset = 0;
-	HandleInfo InfoList[1];
-	EFI_BLOCK_IO_PROTOCOL *BlockIo = NULL;
-	UINTN PartitionSize = 0;
-	UINT32 PageSize = 0;
-	UINT32 StartBlock = 0;
-	UINT32 LastBlock = 0;
-	UINT32 FullBlock = 0;
-	UINTN StartPageReadSize = 0;
         UINT32 BlkIOAttrib = 0;
         PartiSelectFilter HandleFilter;
         UINT32 MaxHandles = 0;
@@ -148,17 +142,8 @@ AvbIOResult AvbReadFromPartition(AvbOps *Ops, const char *Partition, int64_t Rea
         UINT32 Count = ARRAY_SIZE (SupportedPartitions);
         EFI_GUID *PType = NULL;
 
-	if (Partition == NULL || Buffer == NULL || OutNumRead == NULL || NumBytes <= 0) {
-		DEBUG((EFI_D_ERROR, "bad input paramaters\n"));
-		Result = AVB_IO_RESULT_ERROR_IO;
-		goto out;
-	}
-	*OutNumRead = 0;
-
         for (size_t Index = 0; Index < Count; Index++) {
                 if (!AsciiStrCmp (List[Index].Name, Partition)) {
-                             DEBUG ((EFI_D_INFO,
-                                  "Partition found: %a\n", Partition));
                              PType = List[Index].Guid;
                  }
         }
@@ -172,7 +157,8 @@ AvbIOResult AvbReadFromPartition(AvbOps *Ops, const char *Partition, int64_t Rea
                 HandleFilter.PartitionType = PType;
                 HandleFilter.VolumeName = NULL;
 
-                MaxHandles = ARRAY_SIZE (InfoList);
+                /* The caller provides room for a single handle */
+                MaxHandles = 1;
 
                 Status = GetBlkIOHandles (BlkIOAttrib, &HandleFilter,
                            InfoList, &MaxHandles);
@@ -181,7 +167,7 @@ AvbIOResult AvbReadFromPartition(AvbOps *Ops, const char *Partition, int64_t Rea
                             DEBUG ((EFI_D_INFO,
                             "Partition Not found: %s\n", Partition));
                             Result = AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
-                            goto out;
+                            return Result;
                 }
 
                 if (MaxHandles != 1) {
@@ -189,24 +175,46 @@ AvbIOResult AvbReadFromPartition(AvbOps *Ops, const char *Partition, int64_t Rea
                              DEBUG ((EFI_D_INFO,
                              "multiple partitions found: %s\n", Partition));
                               Result = AVB_IO_RESULT_ERROR_IO;
-                              goto out;
+                              return Result;
                      }
                  } else {
                       DEBUG ((EFI_D_INFO,
                        "GetBlkIOHandles failed with error: %d\n", Status));
                         Result = AVB_IO_RESULT_ERROR_IO;
-                        goto out;
+                        return Result;
                }
           } else {
                 Result = GetHandleInfo (Partition, InfoList);
                 if (Result != AVB_IO_RESULT_OK) {
                       DEBUG ((EFI_D_ERROR,
                        "AvbGetSizeOfPartition: GetHandleInfo failed"));
-                      goto out;
+                      return Result;
            }
        }
 
-	BlockIo = InfoList[0].BlkIo;
+	return Result;
+}
+
+/* Reads |NumBytes| at |ReadOffset| of the partition behind |BlockIo|,
+ * neither of them has to be block aligned.
+ */
+STATIC AvbIOResult ReadFromBlockIo(EFI_BLOCK_IO_PROTOCOL *BlockIo,
+                                   const char *Partition, int64_t ReadOffset,
+                                   size_t NumBytes, void *Buffer,
+                                   size_t *OutNumRead)
+{
+	AvbIOResult Result = AVB_IO_RESULT_OK;
+	EFI_STATUS Status = EFI_SUCCESS;
+	VOID *Page = NULL;
+        UINTN Offset = 0;
+	UINTN PartitionSize = 0;
+	UINT32 PageSize = 0;
+	UINT32 StartBlock = 0;
+	UINT32 LastBlock = 0;
+	UINT32 FullBlock = 0;
+	UINTN StartPageReadSize = 0;
+
+	*OutNumRead = 0;
 	PartitionSize = (BlockIo->Media->LastBlock + 1) * BlockIo->Media->BlockSize;
 
 	if (ReadOffset < 0) {
@@ -361,6 +369,373 @@ out:
 	return Result;
 }
 
+AvbIOResult AvbReadFromPartition(AvbOps *Ops, const char *Partition, int64_t ReadOffset,
+                     size_t NumBytes, void *Buffer, size_t *OutNumRead)
+{
+	AvbIOResult Result = AVB_IO_RESULT_OK;
+	HandleInfo InfoList[1];
+
+	if (Partition == NULL || Buffer == NULL || OutNumRead == NULL || NumBytes <= 0) {
+		DEBUG((EFI_D_ERROR, "bad input paramaters\n"));
+		return AVB_IO_RESULT_ERROR_IO;
+	}
+	*OutNumRead = 0;
+
+	Result = GetPartitionHandleInfo(Partition, InfoList);
+	if (Result != AVB_IO_RESULT_OK) {
+		return Result;
+	}
+
+	return ReadFromBlockIo(InfoList[0].BlkIo, Partition, ReadOffset,
+	                       NumBytes, Buffer, OutNumRead);
+}
+
+/* State of the read started by AvbStartReadFromPartition. Block aligned
+ * reads on BlockIo2 capable storage run in the background, the others are
+ * completed synchronously at start. The chunks of an image all come from
+ * the same partition, its handle is looked up once and kept in |Info|
+ * until another partition is read or the ops are freed.
+ */
+typedef struct {
+	BOOLEAN Pending;
+	BOOLEAN Async;
+	AvbIOResult Result;
+	size_t NumRead;
+	EFI_BLOCK_IO2_TOKEN Token;
+	CHAR8 Partition[MAX_GPT_NAME_SIZE];
+	HandleInfo Info;
+	EFI_BLOCK_IO2_PROTOCOL *BlockIo2;
+} AvbPendingRead;
+
+STATIC AvbPendingRead PendingRead;
+
+STATIC AvbIOResult GetPendingReadHandle(const char *Partition)
+{
+	AvbIOResult Result;
+	EFI_STATUS Status;
+
+	if (PendingRead.Partition[0] != '\0' &&
+	    !AsciiStrCmp(PendingRead.Partition, Partition)) {
+		return AVB_IO_RESULT_OK;
+	}
+
+	PendingRead.Partition[0] = '\0';
+	if (AsciiStrLen(Partition) >= sizeof(PendingRead.Partition)) {
+		return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+	}
+
+	Result = GetPartitionHandleInfo(Partition, &PendingRead.Info);
+	if (Result != AVB_IO_RESULT_OK) {
+		return Result;
+	}
+
+	Status = gBS->HandleProtocol(PendingRead.Info.Handle,
+	                             &gEfiBlockIo2ProtocolGuid,
+	                             (VOID **)&PendingRead.BlockIo2);
+	if (Status != EFI_SUCCESS) {
+		PendingRead.BlockIo2 = NULL;
+	}
+
+	AsciiStrnCpyS(PendingRead.Partition, sizeof(PendingRead.Partition),
+	              Partition, AsciiStrLen(Partition));
+	return AVB_IO_RESULT_OK;
+}
+
+AvbIOResult AvbStartReadFromPartition(AvbOps *Ops, const char *Partition,
+                                      int64_t ReadOffset, size_t NumBytes,
+                                      void *Buffer)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	EFI_BLOCK_IO2_PROTOCOL *BlockIo2 = NULL;
+	UINT32 BlockSize;
+	UINT64 PartitionSize;
+
+	if (PendingRead.Pending) {
+		DEBUG((EFI_D_ERROR, "A partition read is already pending\n"));
+		return AVB_IO_RESULT_ERROR_IO;
+	}
+
+	PendingRead.Async = FALSE;
+	PendingRead.NumRead = 0;
+	if (Partition == NULL || Buffer == NULL || ReadOffset < 0 ||
+	    NumBytes == 0) {
+		goto sync;
+	}
+
+	if (GetPendingReadHandle(Partition) != AVB_IO_RESULT_OK) {
+		goto sync;
+	}
+
+	BlockIo2 = PendingRead.BlockIo2;
+	if (BlockIo2 == NULL) {
+		goto sync;
+	}
+
+	BlockSize = BlockIo2->Media->BlockSize;
+	PartitionSize = (BlockIo2->Media->LastBlock + 1) * BlockSize;
+	if ((ReadOffset % BlockSize) != 0 || (NumBytes % BlockSize) != 0 ||
+	    ReadOffset > PartitionSize || NumBytes > PartitionSize - ReadOffset) {
+		goto sync;
+	}
+
+	if (PendingRead.Token.Event == NULL) {
+		Status = gBS->CreateEvent(0, 0, NULL, NULL, &PendingRead.Token.Event);
+		if (Status != EFI_SUCCESS) {
+			PendingRead.Token.Event = NULL;
+			goto sync;
+		}
+	}
+
+	PendingRead.Token.TransactionStatus = EFI_NOT_READY;
+	Status = BlockIo2->ReadBlocksEx(BlockIo2, BlockIo2->Media->MediaId,
+	                                ReadOffset / BlockSize, &PendingRead.Token,
+	                                NumBytes, Buffer);
+	if (Status == EFI_SUCCESS) {
+		PendingRead.Async = TRUE;
+		PendingRead.NumRead = NumBytes;
+		PendingRead.Pending = TRUE;
+		return AVB_IO_RESULT_OK;
+	}
+
+sync:
+	if (Partition != NULL && Buffer != NULL && NumBytes != 0 &&
+	    PendingRead.Partition[0] != '\0' &&
+	    !AsciiStrCmp(PendingRead.Partition, Partition)) {
+		PendingRead.Result = ReadFromBlockIo(PendingRead.Info.BlkIo,
+		                                     Partition, ReadOffset,
+		                                     NumBytes, Buffer,
+		                                     &PendingRead.NumRead);
+	} else {
+		PendingRead.Result = AvbReadFromPartition(Ops, Partition,
+		                                          ReadOffset, NumBytes,
+		                                          Buffer,
+		                                          &PendingRead.NumRead);
+	}
+	PendingRead.Pending = TRUE;
+	return AVB_IO_RESULT_OK;
+}
+
+AvbIOResult AvbFinishReadFromPartition(AvbOps *Ops, size_t *OutNumRead)
+{
+	AvbIOResult Result;
+
+	if (!PendingRead.Pending || OutNumRead == NULL) {
+		DEBUG((EFI_D_ERROR, "No partition read is pending\n"));
+		return AVB_IO_RESULT_ERROR_IO;
+	}
+
+	if (PendingRead.Async) {
+		while (gBS->CheckEvent(PendingRead.Token.Event) == EFI_NOT_READY);
+		PendingRead.Result = AVB_IO_RESULT_OK;
+		if (PendingRead.Token.TransactionStatus != EFI_SUCCESS) {
+			DEBUG((EFI_D_ERROR, "ReadBlocksEx failed %r\n",
+			       PendingRead.Token.TransactionStatus));
+			PendingRead.Result = AVB_IO_RESULT_ERROR_IO;
+			PendingRead.NumRead = 0;
+		}
+	}
+
+	*OutNumRead = PendingRead.NumRead;
+	Result = PendingRead.Result;
+	PendingRead.Pending = FALSE;
+
+	return Result;
+}
+
+/* Only the boot and recovery images, with or without a slot suffix */
+STATIC BOOLEAN IsBootImagePartition(const char *Partition)
+{
+	UINTN Len;
+
+	if (!AsciiStrnCmp(Partition, "boot", AsciiStrLen("boot"))) {
+		Len = AsciiStrLen("boot");
+	} else if (!AsciiStrnCmp(Partition, "recovery",
+	                         AsciiStrLen("recovery"))) {
+		Len = AsciiStrLen("recovery");
+	} else {
+		return FALSE;
+	}
+
+	return Partition[Len] == '\0' || Partition[Len] == '_';
+}
+
+AvbIOResult AvbGetLoadSegments(AvbOps *Ops, const char *Partition,
+                               uint64_t ImageSize, AvbLoadSegment *Segments,
+                               size_t MaxSegments, size_t *OutNumSegments)
+{
+	AvbOpsUserData *UserData = NULL;
+	AvbIOResult Result;
+	boot_img_hdr Hdr;
+	size_t NumRead = 0;
+	UINT64 BaseMemory = 0;
+	UINT64 RamdiskOffset;
+	UINT64 RamdiskLoadAddr;
+	UINT64 RamdiskEndAddr;
+
+	if (Ops == NULL || Partition == NULL || Segments == NULL ||
+	    OutNumSegments == NULL) {
+		DEBUG((EFI_D_ERROR, "AvbGetLoadSegments invalid parameter\n"));
+		return AVB_IO_RESULT_ERROR_IO;
+	}
+
+	*OutNumSegments = 0;
+	UserData = (AvbOpsUserData *)Ops->user_data;
+	if (UserData == NULL || !UserData->LoadRamdiskInPlace ||
+	    MaxSegments == 0 || !IsBootImagePartition(Partition)) {
+		return AVB_IO_RESULT_OK;
+	}
+
+	Result = AvbReadFromPartition(Ops, Partition, 0, sizeof(Hdr), &Hdr,
+	                              &NumRead);
+	if (Result != AVB_IO_RESULT_OK || NumRead != sizeof(Hdr)) {
+		return Result == AVB_IO_RESULT_OK ? AVB_IO_RESULT_ERROR_IO : Result;
+	}
+
+	/* Anything unexpected is left to the checks in BootLinux */
+	if (CompareMem(Hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) ||
+	    Hdr.page_size == 0 || (Hdr.page_size & (Hdr.page_size - 1)) ||
+	    Hdr.ramdisk_size == 0) {
+		return AVB_IO_RESULT_OK;
+	}
+
+	RamdiskOffset = (UINT64)Hdr.page_size +
+	                LOCAL_ROUND_TO_PAGE((UINT64)Hdr.kernel_size,
+	                                    Hdr.page_size);
+	if (RamdiskOffset > MAX_UINT32 ||
+	    RamdiskOffset + Hdr.ramdisk_size > ImageSize) {
+		return AVB_IO_RESULT_OK;
+	}
+
+	if (BaseMem(&BaseMemory) != EFI_SUCCESS) {
+		return AVB_IO_RESULT_OK;
+	}
+	RamdiskLoadAddr = BaseMemory | PcdGet32(RamdiskLoadAddress);
+	RamdiskEndAddr = BaseMemory | PcdGet32(RamdiskEndAddress);
+	if (RamdiskEndAddr - RamdiskLoadAddr < Hdr.ramdisk_size) {
+		return AVB_IO_RESULT_OK;
+	}
+
+	Segments[0].offset = RamdiskOffset;
+	Segments[0].num_bytes = Hdr.ramdisk_size;
+	Segments[0].buffer = (uint8_t *)RamdiskLoadAddr;
+	*OutNumSegments = 1;
+
+	UserData->RamdiskLoadAddr = RamdiskLoadAddr;
+	UserData->RamdiskOffset = (UINT32)RamdiskOffset;
+	UserData->RamdiskSize = Hdr.ramdisk_size;
+
+	return AVB_IO_RESULT_OK;
+}
+
+/* Drops the kernel inflate in progress, if any */
+STATIC VOID AvbKernelStreamStop(AvbOpsUserData *UserData)
+{
+	if (UserData->KernelStream != NULL) {
+		decompress_stream_finish(UserData->KernelStream, NULL, NULL);
+		UserData->KernelStream = NULL;
+	}
+}
+
+/* Inflates a gzip kernel to its load address while the rest of the boot
+ * image is still being read. BootLinux skips its own decompress when the
+ * result matches the image, anything unexpected leaves it to BootLinux.
+ */
+VOID AvbChunkLoaded(AvbOps *Ops, const char *Partition, uint64_t Offset,
+                    const uint8_t *Buffer, size_t NumBytes)
+{
+	AvbOpsUserData *UserData = NULL;
+	boot_img_hdr *Hdr;
+	UINT64 BaseMemory = 0;
+	UINT64 OutAvailLen;
+	UINT64 KernelEnd;
+	UINT64 Start;
+	UINT64 End;
+	UINT32 DtbOffset = 0;
+	UINT32 OutLen = 0;
+
+	if (Ops == NULL || Partition == NULL || Buffer == NULL) {
+		return;
+	}
+
+	UserData = (AvbOpsUserData *)Ops->user_data;
+	if (UserData == NULL || !UserData->InflateKernel ||
+	    !IsBootImagePartition(Partition)) {
+		return;
+	}
+
+	if (Offset == 0) {
+		/* The image is read again, forget the previous one */
+		AvbKernelStreamStop(UserData);
+		UserData->KernelLoadAddr = 0;
+
+		Hdr = (boot_img_hdr *)Buffer;
+		if (NumBytes < sizeof(*Hdr) ||
+		    CompareMem(Hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE) ||
+		    Hdr->page_size == 0 ||
+		    (Hdr->page_size & (Hdr->page_size - 1)) ||
+		    Hdr->kernel_size == 0 ||
+		    Hdr->page_size >= NumBytes) {
+			return;
+		}
+
+		if (BaseMem(&BaseMemory) != EFI_SUCCESS) {
+			return;
+		}
+		UserData->KernelLoadAddr = BaseMemory | PcdGet32(KernelLoadAddress);
+		OutAvailLen = (BaseMemory | PcdGet32(TagsAddress)) -
+		              UserData->KernelLoadAddr;
+		if (OutAvailLen > MAX_UINT32) {
+			UserData->KernelLoadAddr = 0;
+			return;
+		}
+
+		UserData->KernelOffset = Hdr->page_size;
+		UserData->KernelSize = Hdr->kernel_size;
+		UserData->KernelFed = MIN(Hdr->kernel_size,
+		                          NumBytes - Hdr->page_size);
+		UserData->KernelStream = decompress_stream_start(
+		        (UINT8 *)Buffer + Hdr->page_size, UserData->KernelFed,
+		        (UINT8 *)UserData->KernelLoadAddr, (UINT32)OutAvailLen);
+		if (UserData->KernelStream == NULL) {
+			UserData->KernelLoadAddr = 0;
+			return;
+		}
+	} else if (UserData->KernelStream != NULL) {
+		/* The kernel has to arrive in order, without holes */
+		KernelEnd = (UINT64)UserData->KernelOffset + UserData->KernelSize;
+		Start = MAX(Offset, UserData->KernelOffset);
+		End = MIN(Offset + NumBytes, KernelEnd);
+		if (End <= Start) {
+			return;
+		}
+		if (Start != UserData->KernelOffset + UserData->KernelFed) {
+			AvbKernelStreamStop(UserData);
+			UserData->KernelLoadAddr = 0;
+			return;
+		}
+
+		decompress_stream_feed(UserData->KernelStream,
+		                       (UINT8 *)Buffer + (Start - Offset),
+		                       (UINT32)(End - Start));
+		UserData->KernelFed += (UINT32)(End - Start);
+	} else {
+		return;
+	}
+
+	if (UserData->KernelFed < UserData->KernelSize) {
+		return;
+	}
+
+	if (decompress_stream_finish(UserData->KernelStream, &DtbOffset,
+	                             &OutLen)) {
+		UserData->KernelLoadAddr = 0;
+	} else {
+		UserData->KernelOutLen = OutLen;
+		UserData->KernelDtbOffset = DtbOffset;
+	}
+	UserData->KernelStream = NULL;
+}
+
 AvbIOResult AvbWriteToPartition(AvbOps *Ops, const char *Partition, int64_t Offset,
                                 size_t NumBytes, const void *Buffer)
 {
@@ -611,6 +986,10 @@ AvbOps *AvbOpsNew(VOID *UserData)
 
 	Ops->user_data = UserData;
 	Ops->read_from_partition = AvbReadFromPartition;
+	Ops->start_read_from_partition = AvbStartReadFromPartition;
+	Ops->finish_read_from_partition = AvbFinishReadFromPartition;
+	Ops->get_load_segments = AvbGetLoadSegments;
+	Ops->chunk_loaded = AvbChunkLoaded;
 	Ops->write_to_partition = AvbWriteToPartition;
 	Ops->validate_vbmeta_public_key = AvbValidateVbmetaPublicKey;
 	Ops->read_rollback_index = AvbReadRollbackIndex;
@@ -626,6 +1005,11 @@ out:
 VOID AvbOpsFree(AvbOps *Ops)
 {
 	if (Ops != NULL) {
+		if (Ops->user_data != NULL) {
+			AvbKernelStreamStop((AvbOpsUserData *)Ops->user_data);
+		}
+		/* The handles may change before the next verification */
+		PendingRead.Partition[0] = '\0';
 		avb_free(Ops);
 	}
 }
@@ -64,6 +64,15 @@ typedef enum {
 struct AvbOps;
 typedef struct AvbOps AvbOps;
 
+/* A byte range of a partition that is loaded at |buffer| instead of
+ * at the same offset in the image buffer.
+ */
+typedef struct AvbLoadSegment {
+  uint64_t offset;
+  size_t num_bytes;
+  uint8_t* buffer;
+} AvbLoadSegment;
+
 /* Forward-declaration of operations in libavb_ab. */
 struct AvbABOps;
 
@@ -118,6 +127,48 @@ struct AvbOps {
                                      void* buffer,
                                      size_t* out_num_read);
 
+  /* Starts reading |num_bytes| from offset |offset| of partition
+   * |partition| into |buffer| and returns without waiting for the
+   * data. Only one read can be outstanding at a time, it is completed
+   * by finish_read_from_partition() which returns the same results as
+   * read_from_partition(). Both may be NULL, callers then use
+   * read_from_partition().
+   */
+  AvbIOResult (*start_read_from_partition)(AvbOps* ops,
+                                           const char* partition,
+                                           int64_t offset,
+                                           size_t num_bytes,
+                                           void* buffer);
+
+  /* Waits for the read started by start_read_from_partition(). */
+  AvbIOResult (*finish_read_from_partition)(AvbOps* ops,
+                                            size_t* out_num_read);
+
+  /* Gets the ranges of |partition| that should be loaded straight to
+   * their final location rather than into the image buffer of
+   * |image_size| bytes. At most |max_segments| ranges are returned in
+   * |segments| and their number in |out_num_segments|. The ranges are
+   * hashed where they land, the image buffer holds no copy of them.
+   * May be NULL, everything is then loaded into the image buffer.
+   */
+  AvbIOResult (*get_load_segments)(AvbOps* ops,
+                                   const char* partition,
+                                   uint64_t image_size,
+                                   AvbLoadSegment* segments,
+                                   size_t max_segments,
+                                   size_t* out_num_segments);
+
+  /* Called with each chunk of a hashed |partition| once it is read to
+   * |buffer|, |offset| being its position in the image. The chunks come
+   * in order, the read of the next one is in flight while this runs.
+   * The data is not verified yet. May be NULL.
+   */
+  void (*chunk_loaded)(AvbOps* ops,
+                       const char* partition,
+                       uint64_t offset,
+                       const uint8_t* buffer,
+                       size_t num_bytes);
+
   /* Writes |num_bytes| from |bffer| at offset |offset| to partition
    * with name |partition| (NUL-terminated UTF-8 string). If |offset|
    * is negative, its absolute value should be interpreted as the
@@ -227,6 +278,23 @@ typedef struct {
     BOOLEAN IsMultiSlot;
     UINTN PublicKeyLen;
     CHAR8 PublicKey[MAX_USER_KEY_SIZE];
+    /* Set by the caller to load the boot image ramdisk in place */
+    BOOLEAN LoadRamdiskInPlace;
+    /* Ramdisk loaded at its load address, LoadAddr is 0 if none was */
+    UINT64 RamdiskLoadAddr;
+    UINT32 RamdiskOffset;
+    UINT32 RamdiskSize;
+    /* Set by the caller to inflate a gzip kernel while the image loads */
+    BOOLEAN InflateKernel;
+    /* Kernel inflated at its load address, LoadAddr is 0 if none was */
+    UINT64 KernelLoadAddr;
+    UINT32 KernelSize;
+    UINT32 KernelOutLen;
+    UINT32 KernelDtbOffset;
+    /* Inflate in progress */
+    VOID *KernelStream;
+    UINT32 KernelOffset;
+    UINT32 KernelFed;
 } AvbOpsUserData;
 
 AvbOps *AvbOpsNew(VOID *UserData);
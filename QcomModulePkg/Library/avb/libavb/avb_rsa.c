@@ -37,13 +37,62 @@
 #include "avb_util.h"
 #include "avb_vbmeta_image.h"
 
+/* Where the compiler has a 128 bit type, as on AArch64, the Montgomery
+ * arithmetic works on 64 bit limbs, whose products compile to mul/umulh
+ * pairs. It halves the number of limb multiplications of the 32 bit code.
+ */
+#if defined(__SIZEOF_INT128__) && !defined(AVB_RSA_LIMB32)
+typedef uint64_t limb_t;
+typedef unsigned __int128 dlimb_t;
+#define LIMB_BITS 64
+#else
+typedef uint32_t limb_t;
+typedef uint64_t dlimb_t;
+#define LIMB_BITS 32
+#endif
+#define LIMB_BYTES (LIMB_BITS / 8)
+
+/* Number of parsed keys kept for the rest of the boot. The OEM key and the
+ * keys of chained partitions are verified against again and again.
+ */
+#define KEY_CACHE_SIZE 8
+
 typedef struct Key {
-  unsigned int len; /* Length of n[] in number of uint32_t */
-  uint32_t n0inv;   /* -1 / n[0] mod 2^32 */
-  uint32_t* n;      /* modulus as array (host-byte order) */
-  uint32_t* rr;     /* R^2 as array (host-byte order) */
+  unsigned int len; /* Length of n[] in number of limb_t */
+  limb_t n0inv;     /* -1 / n[0] mod 2^LIMB_BITS */
+  limb_t* n;        /* modulus as array (host-byte order) */
+  limb_t* rr;       /* R^2 as array (host-byte order) */
+  limb_t* scratch;  /* 3 * len limbs for modpowF4() */
 } Key;
 
+typedef struct KeyCacheEntry {
+  const uint8_t* data; /* copy of the serialized key */
+  size_t length;
+  Key* key;
+} KeyCacheEntry;
+
+static KeyCacheEntry key_cache[KEY_CACHE_SIZE];
+
+/* Reads the big-endian limb at |p|. */
+static limb_t load_be_limb(const uint8_t* p) {
+  limb_t v = 0;
+  unsigned int i;
+  for (i = 0; i < LIMB_BYTES; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+/* Writes |v| big-endian to |p|. */
+static void store_be_limb(uint8_t* p, limb_t v) {
+  unsigned int i;
+  for (i = LIMB_BYTES; i;) {
+    --i;
+    p[i] = (uint8_t)v;
+    v >>= 8;
+  }
+}
+
 Key* parse_key_data(const uint8_t* data, size_t length) {
   AvbRSAPublicKeyHeader h;
   Key* key = NULL;
@@ -51,6 +100,9 @@ Key* parse_key_data(const uint8_t* data, size_t length) {
   unsigned int i;
   const uint8_t* n;
   const uint8_t* rr;
+#if LIMB_BITS == 64
+  limb_t inv;
+#endif
 
   if (!avb_rsa_public_key_header_validate_and_byteswap(
           (const AvbRSAPublicKeyHeader*)data, &h)) {
@@ -73,27 +125,44 @@ Key* parse_key_data(const uint8_t* data, size_t length) {
   n = data + sizeof(AvbRSAPublicKeyHeader);
   rr = data + sizeof(AvbRSAPublicKeyHeader) + h.key_num_bits / 8;
 
-  /* Store n and rr following the key header so we only have to do one
-   * allocation.
+  /* Store n, rr and the scratch space following the key header so we only
+   * have to do one allocation.
    */
-  key = (Key*)(avb_malloc(sizeof(Key) + 2 * h.key_num_bits / 8));
+  key = (Key*)(avb_malloc(sizeof(Key) + 5 * h.key_num_bits / 8));
   if (key == NULL) {
     goto fail;
   }
 
-  key->len = h.key_num_bits / 32;
-  key->n0inv = h.n0inv;
-  key->n = (uint32_t*)(key + 1); /* Skip ahead sizeof(Key) bytes. */
+  key->len = h.key_num_bits / LIMB_BITS;
+  key->n = (limb_t*)(key + 1); /* Skip ahead sizeof(Key) bytes. */
   key->rr = key->n + key->len;
+  key->scratch = key->rr + key->len;
 
   /* Crypto-code below (modpowF4() and friends) expects the key in
    * little-endian format (rather than the format we're storing the
    * key in), so convert it.
    */
   for (i = 0; i < key->len; i++) {
-    key->n[i] = avb_be32toh(((uint32_t*)n)[key->len - i - 1]);
-    key->rr[i] = avb_be32toh(((uint32_t*)rr)[key->len - i - 1]);
+    key->n[i] = load_be_limb(n + (key->len - i - 1) * LIMB_BYTES);
+    key->rr[i] = load_be_limb(rr + (key->len - i - 1) * LIMB_BYTES);
+  }
+
+#if LIMB_BITS == 64
+  /* The header only has -1 / n[0] mod 2^32. Each Newton step doubles the
+   * number of correct low bits of 1 / n[0], the odd n[0] itself has three.
+   */
+  inv = key->n[0];
+  for (i = 0; i < 5; i++) {
+    inv *= 2 - key->n[0] * inv;
+  }
+  key->n0inv = 0 - inv;
+  if ((uint32_t)key->n0inv != h.n0inv) {
+    avb_error("Key has invalid n0inv.\n");
+    goto fail;
   }
+#else
+  key->n0inv = h.n0inv;
+#endif
   return key;
 
 fail:
@@ -107,19 +176,59 @@ void free_parsed_key(Key* key) {
   avb_free(key);
 }
 
+/* Returns the parsed |data|, from the cache if it was parsed before. The
+ * key is owned by the cache if |*cached| is set on return, otherwise it
+ * has to be freed with free_parsed_key().
+ */
+static Key* get_parsed_key(const uint8_t* data, size_t length, bool* cached) {
+  KeyCacheEntry* entry;
+  uint8_t* copy;
+  Key* key;
+  size_t i;
+
+  *cached = false;
+  for (i = 0; i < KEY_CACHE_SIZE; i++) {
+    entry = &key_cache[i];
+    if (entry->key == NULL) {
+      break;
+    }
+    if (entry->length == length && avb_memcmp(entry->data, data, length) == 0) {
+      *cached = true;
+      return entry->key;
+    }
+  }
+
+  key = parse_key_data(data, length);
+  if (key == NULL || i == KEY_CACHE_SIZE) {
+    return key;
+  }
+
+  copy = (uint8_t*)avb_malloc(length);
+  if (copy == NULL) {
+    return key;
+  }
+  avb_memcpy(copy, data, length);
+  entry->data = copy;
+  entry->length = length;
+  entry->key = key;
+  *cached = true;
+  return key;
+}
+
 /* a[] -= mod */
-static void subM(const Key* key, uint32_t* a) {
-  int64_t A = 0;
+static void subM(const Key* key, limb_t* a) {
+  dlimb_t A;
+  limb_t borrow = 0;
   uint32_t i;
   for (i = 0; i < key->len; ++i) {
-    A += (uint64_t)a[i] - key->n[i];
-    a[i] = (uint32_t)A;
-    A >>= 32;
+    A = (dlimb_t)a[i] - key->n[i] - borrow;
+    a[i] = (limb_t)A;
+    borrow = (limb_t)(A >> LIMB_BITS) & 1;
   }
 }
 
 /* return a[] >= mod */
-static int geM(const Key* key, uint32_t* a) {
+static int geM(const Key* key, limb_t* a) {
   uint32_t i;
   for (i = key->len; i;) {
     --i;
@@ -135,31 +244,31 @@ static int geM(const Key* key, uint32_t* a) {
 
 /* montgomery c[] += a * b[] / R % mod */
 static void montMulAdd(const Key* key,
-                       uint32_t* c,
-                       const uint32_t a,
-                       const uint32_t* b) {
-  uint64_t A = (uint64_t)a * b[0] + c[0];
-  uint32_t d0 = (uint32_t)A * key->n0inv;
-  uint64_t B = (uint64_t)d0 * key->n[0] + (uint32_t)A;
+                       limb_t* c,
+                       const limb_t a,
+                       const limb_t* b) {
+  dlimb_t A = (dlimb_t)a * b[0] + c[0];
+  limb_t d0 = (limb_t)A * key->n0inv;
+  dlimb_t B = (dlimb_t)d0 * key->n[0] + (limb_t)A;
   uint32_t i;
 
   for (i = 1; i < key->len; ++i) {
-    A = (A >> 32) + (uint64_t)a * b[i] + c[i];
-    B = (B >> 32) + (uint64_t)d0 * key->n[i] + (uint32_t)A;
-    c[i - 1] = (uint32_t)B;
+    A = (A >> LIMB_BITS) + (dlimb_t)a * b[i] + c[i];
+    B = (B >> LIMB_BITS) + (dlimb_t)d0 * key->n[i] + (limb_t)A;
+    c[i - 1] = (limb_t)B;
   }
 
-  A = (A >> 32) + (B >> 32);
+  A = (A >> LIMB_BITS) + (B >> LIMB_BITS);
 
-  c[i - 1] = (uint32_t)A;
+  c[i - 1] = (limb_t)A;
 
-  if (A >> 32) {
+  if (A >> LIMB_BITS) {
     subM(key, c);
   }
 }
 
 /* montgomery c[] = a[] * b[] / R % mod */
-static void montMul(const Key* key, uint32_t* c, uint32_t* a, uint32_t* b) {
+static void montMul(const Key* key, limb_t* c, limb_t* a, limb_t* b) {
   uint32_t i;
   for (i = 0; i < key->len; ++i) {
     c[i] = 0;
@@ -173,23 +282,15 @@ static void montMul(const Key* key, uint32_t* c, uint32_t* a, uint32_t* b) {
  * Input and output big-endian byte array in inout.
  */
 static void modpowF4(const Key* key, uint8_t* inout) {
-  uint32_t* a = (uint32_t*)avb_malloc(key->len * sizeof(uint32_t));
-  uint32_t* aR = (uint32_t*)avb_malloc(key->len * sizeof(uint32_t));
-  uint32_t* aaR = (uint32_t*)avb_malloc(key->len * sizeof(uint32_t));
-  if (a == NULL || aR == NULL || aaR == NULL) {
-    goto out;
-  }
-
-  uint32_t* aaa = aaR; /* Re-use location. */
+  limb_t* a = key->scratch;
+  limb_t* aR = a + key->len;
+  limb_t* aaR = aR + key->len;
+  limb_t* aaa = aaR; /* Re-use location. */
   int i;
 
-  /* Convert from big endian byte array to little endian word array. */
+  /* Convert from big endian byte array to little endian limb array. */
   for (i = 0; i < (int)key->len; ++i) {
-    uint32_t tmp = (inout[((key->len - 1 - i) * 4) + 0] << 24) |
-                   (inout[((key->len - 1 - i) * 4) + 1] << 16) |
-                   (inout[((key->len - 1 - i) * 4) + 2] << 8) |
-                   (inout[((key->len - 1 - i) * 4) + 3] << 0);
-    a[i] = tmp;
+    a[i] = load_be_limb(inout + (key->len - 1 - i) * LIMB_BYTES);
   }
 
   montMul(key, aR, a, key->rr); /* aR = a * RR / R mod M   */
@@ -206,22 +307,8 @@ static void modpowF4(const Key* key, uint8_t* inout) {
 
   /* Convert to bigendian byte array */
   for (i = (int)key->len - 1; i >= 0; --i) {
-    uint32_t tmp = aaa[i];
-    *inout++ = (uint8_t)(tmp >> 24);
-    *inout++ = (uint8_t)(tmp >> 16);
-    *inout++ = (uint8_t)(tmp >> 8);
-    *inout++ = (uint8_t)(tmp >> 0);
-  }
-
-out:
-  if (a != NULL) {
-    avb_free(a);
-  }
-  if (aR != NULL) {
-    avb_free(aR);
-  }
-  if (aaR != NULL) {
-    avb_free(aaR);
+    store_be_limb(inout, aaa[i]);
+    inout += LIMB_BYTES;
   }
 }
 
@@ -238,6 +325,7 @@ bool avb_rsa_verify(const uint8_t* key,
                     size_t padding_num_bytes) {
   uint8_t* buf = NULL;
   Key* parsed_key = NULL;
+  bool cached = false;
   bool success = false;
 
   if (key == NULL || sig == NULL || hash == NULL || padding == NULL) {
@@ -245,13 +333,13 @@ bool avb_rsa_verify(const uint8_t* key,
     goto out;
   }
 
-  parsed_key = parse_key_data(key, key_num_bytes);
+  parsed_key = get_parsed_key(key, key_num_bytes, &cached);
   if (parsed_key == NULL) {
     avb_error("Error parsing key.\n");
     goto out;
   }
 
-  if (sig_num_bytes != (parsed_key->len * sizeof(uint32_t))) {
+  if (sig_num_bytes != (parsed_key->len * sizeof(limb_t))) {
     avb_error("Signature length does not match key length.\n");
     goto out;
   }
@@ -289,7 +377,7 @@ bool avb_rsa_verify(const uint8_t* key,
   success = true;
 
 out:
-  if (parsed_key != NULL) {
+  if (parsed_key != NULL && !cached) {
     free_parsed_key(parsed_key);
   }
   if (buf != NULL) {
@@ -71,6 +71,16 @@ void avb_sha256_update(AvbSHA256Ctx* ctx, const uint8_t* data, uint32_t len);
 /* Returns the SHA-256 digest. */
 uint8_t* avb_sha256_final(AvbSHA256Ctx* ctx) AVB_ATTR_WARN_UNUSED_RESULT;
 
+/* Software SHA-256 in avb_sha256.c. The avb_sha256_*() functions above are
+ * provided by Hash2Client.c and fall back to these when the hash protocol
+ * is not available.
+ */
+void avb_sha256_sw_init(AvbSHA256Ctx* ctx);
+void avb_sha256_sw_update(AvbSHA256Ctx* ctx,
+                          const uint8_t* data,
+                          uint32_t len);
+uint8_t* avb_sha256_sw_final(AvbSHA256Ctx* ctx) AVB_ATTR_WARN_UNUSED_RESULT;
+
 /* Initializes the SHA-512 context. */
 void avb_sha512_init(AvbSHA512Ctx* ctx);
 
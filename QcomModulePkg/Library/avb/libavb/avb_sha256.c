@@ -36,6 +36,9 @@
  */
 
 #include "avb_sha.h"
+#ifdef AVB_SHA2_ARMV8
+#include "avb_sha_armv8.h"
+#endif
 
 #define SHFR(x, n) (x >> n)
 #define ROTR(x, n) ((x >> n) | (x << ((sizeof(x) << 3) - n)))
@@ -100,7 +103,7 @@ static const uint32_t sha256_k[64] = {
     0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
 
 /* SHA-256 implementation */
-void avb_sha256_init(AvbSHA256Ctx* ctx) {
+void avb_sha256_sw_init(AvbSHA256Ctx* ctx) {
 #ifndef UNROLL_LOOPS
   int i;
   for (i = 0; i < 8; i++) {
@@ -121,6 +124,19 @@ void avb_sha256_init(AvbSHA256Ctx* ctx) {
   ctx->tot_len = 0;
 }
 
+#ifdef AVB_SHA2_ARMV8
+int avb_sha256_armv8_enabled = -1;
+
+static bool sha256_armv8_available(void) {
+  if (avb_sha256_armv8_enabled < 0) {
+    avb_sha256_armv8_enabled =
+        ((avb_sha2_armv8_id_aa64isar0() >> AVB_ID_AA64ISAR0_SHA2_SHIFT) &
+         AVB_ID_AA64ISAR0_SHA2_MASK) >= 1;
+  }
+  return avb_sha256_armv8_enabled > 0;
+}
+#endif
+
 static void SHA256_transform(AvbSHA256Ctx* ctx,
                              const uint8_t* message,
                              unsigned int block_nb) {
@@ -134,6 +150,13 @@ static void SHA256_transform(AvbSHA256Ctx* ctx,
   int j;
 #endif
 
+#ifdef AVB_SHA2_ARMV8
+  if (sha256_armv8_available()) {
+    avb_sha256_armv8_transform(ctx->h, message, block_nb, sha256_k);
+    return;
+  }
+#endif
+
   for (i = 0; i < (int)block_nb; i++) {
     sub_block = message + (i << 6);
 
@@ -320,7 +343,9 @@ static void SHA256_transform(AvbSHA256Ctx* ctx,
   }
 }
 
-void avb_sha256_update(AvbSHA256Ctx* ctx, const uint8_t* data, uint32_t len) {
+void avb_sha256_sw_update(AvbSHA256Ctx* ctx,
+                          const uint8_t* data,
+                          uint32_t len) {
   unsigned int block_nb;
   unsigned int new_len, rem_len, tmp_len;
   const uint8_t* shifted_data;
@@ -351,7 +376,7 @@ void avb_sha256_update(AvbSHA256Ctx* ctx, const uint8_t* data, uint32_t len) {
   ctx->tot_len += (block_nb + 1) << 6;
 }
 
-uint8_t* avb_sha256_final(AvbSHA256Ctx* ctx) {
+uint8_t* avb_sha256_sw_final(AvbSHA256Ctx* ctx) {
   unsigned int block_nb;
   unsigned int pm_len;
   unsigned int len_b;
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if !defined(AVB_INSIDE_LIBAVB_H) && !defined(AVB_COMPILATION)
+#error "Never include this file directly, include libavb.h instead."
+#endif
+
+#ifndef AVB_SHA_ARMV8_H_
+#define AVB_SHA_ARMV8_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "avb_sysdeps.h"
+
+/* SHA2 field of ID_AA64ISAR0_EL1, 1 means SHA-256 instructions. */
+#define AVB_ID_AA64ISAR0_SHA2_SHIFT 12
+#define AVB_ID_AA64ISAR0_SHA2_MASK 0xf
+
+/* Whether the SHA-256 transform uses the ARMv8 Crypto Extensions: -1 until
+ * the CPU has been probed, then 0 or 1. Can be set to 0 to force the C
+ * rounds, e.g. for benchmarking.
+ */
+extern int avb_sha256_armv8_enabled;
+
+/* Returns the value of the ID_AA64ISAR0_EL1 register. */
+uint64_t avb_sha2_armv8_id_aa64isar0(void);
+
+/* Runs |block_nb| 64 byte blocks of |data| through the SHA-256 compression
+ * function with the round constants |k|, updating the state |h|.
+ */
+void avb_sha256_armv8_transform(uint32_t* h,
+                                const uint8_t* data,
+                                size_t block_nb,
+                                const uint32_t* k);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AVB_SHA_ARMV8_H_ */
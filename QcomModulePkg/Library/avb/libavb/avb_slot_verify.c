@@ -98,6 +98,170 @@ static inline bool result_should_continue(AvbSlotVerifyResult result) {
   return false;
 }
 
+/* Size of the chunks an image is read and hashed in. */
+#define HASH_READ_CHUNK_SIZE (1024 * 1024)
+
+/* Maximum number of ranges get_load_segments() may place elsewhere. */
+#define MAX_LOAD_SEGMENTS 4
+
+/* Returns where the chunk at |offset| of the image is loaded and trims
+ * |chunk_size| so that the chunk does not cross a segment boundary.
+ */
+static uint8_t* chunk_buffer(uint8_t* image_buf,
+                             const AvbLoadSegment* segments,
+                             size_t num_segments,
+                             uint64_t offset,
+                             size_t* chunk_size) {
+  uint64_t segment_end;
+  size_t n;
+
+  for (n = 0; n < num_segments; n++) {
+    segment_end = segments[n].offset + segments[n].num_bytes;
+    if (offset >= segments[n].offset && offset < segment_end) {
+      if (segment_end - offset < *chunk_size) {
+        *chunk_size = segment_end - offset;
+      }
+      return segments[n].buffer + (offset - segments[n].offset);
+    }
+    if (segments[n].offset > offset &&
+        segments[n].offset - offset < *chunk_size) {
+      *chunk_size = segments[n].offset - offset;
+    }
+  }
+
+  return image_buf + offset;
+}
+
+/* Size of the chunk starting at |offset|, see chunk_buffer(). */
+static size_t next_chunk_size(uint64_t image_size, uint64_t offset) {
+  return image_size - offset < HASH_READ_CHUNK_SIZE ? image_size - offset
+                                                    : HASH_READ_CHUNK_SIZE;
+}
+
+/* Reads |image_size| bytes of |part_name| into |image_buf| and hashes the
+ * salt followed by the first |hash_size| bytes of the image. Ranges the
+ * ops ask to load elsewhere are read and hashed at their destination and
+ * leave a hole in |image_buf|. When the ops can read in the background,
+ * the next chunk is read while the previous one is hashed and handed to
+ * chunk_loaded(). The digest is returned in |digest|, which must hold
+ * AVB_SHA512_DIGEST_SIZE bytes.
+ */
+static AvbSlotVerifyResult read_and_hash_partition(AvbOps* ops,
+                                                   const char* part_name,
+                                                   uint8_t* image_buf,
+                                                   uint64_t image_size,
+                                                   uint64_t hash_size,
+                                                   bool use_sha512,
+                                                   const uint8_t* salt,
+                                                   uint32_t salt_len,
+                                                   uint8_t* digest) {
+  AvbSHA256Ctx sha256_ctx;
+  AvbSHA512Ctx sha512_ctx;
+  AvbIOResult io_ret = AVB_IO_RESULT_OK;
+  AvbLoadSegment segments[MAX_LOAD_SEGMENTS];
+  size_t num_segments = 0;
+  bool overlap = ops->start_read_from_partition != NULL &&
+                 ops->finish_read_from_partition != NULL;
+  uint64_t offset = 0;
+  uint64_t next_offset;
+  uint8_t* chunk_buf = NULL;
+  uint8_t* next_buf = NULL;
+  size_t chunk_size;
+  size_t next_size;
+  size_t num_read;
+  size_t hash_len;
+  size_t n;
+
+  if (ops->get_load_segments != NULL) {
+    io_ret = ops->get_load_segments(
+        ops, part_name, image_size, segments, MAX_LOAD_SEGMENTS, &num_segments);
+    if (io_ret != AVB_IO_RESULT_OK || num_segments > MAX_LOAD_SEGMENTS) {
+      num_segments = 0;
+    }
+    for (n = 0; n < num_segments; n++) {
+      if (segments[n].offset > image_size ||
+          segments[n].num_bytes > image_size - segments[n].offset) {
+        avb_errorv(part_name, ": Load segment outside of image.\n", NULL);
+        num_segments = 0;
+      }
+    }
+    io_ret = AVB_IO_RESULT_OK;
+  }
+
+  if (use_sha512) {
+    avb_sha512_init(&sha512_ctx);
+    avb_sha512_update(&sha512_ctx, salt, salt_len);
+  } else {
+    avb_sha256_init(&sha256_ctx);
+    avb_sha256_update(&sha256_ctx, salt, salt_len);
+  }
+
+  chunk_size = next_chunk_size(image_size, 0);
+  chunk_buf =
+      chunk_buffer(image_buf, segments, num_segments, 0, &chunk_size);
+  if (overlap && chunk_size > 0) {
+    io_ret = ops->start_read_from_partition(
+        ops, part_name, 0 /* offset */, chunk_size, chunk_buf);
+  }
+
+  while (offset < image_size) {
+    if (io_ret == AVB_IO_RESULT_OK) {
+      if (overlap) {
+        io_ret = ops->finish_read_from_partition(ops, &num_read);
+      } else {
+        io_ret = ops->read_from_partition(
+            ops, part_name, offset, chunk_size, chunk_buf, &num_read);
+      }
+    }
+    if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
+      return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+    } else if (io_ret != AVB_IO_RESULT_OK) {
+      avb_errorv(part_name, ": Error loading data from partition.\n", NULL);
+      return AVB_SLOT_VERIFY_RESULT_ERROR_IO;
+    }
+    if (num_read != chunk_size) {
+      avb_errorv(part_name, ": Read fewer than requested bytes.\n", NULL);
+      return AVB_SLOT_VERIFY_RESULT_ERROR_IO;
+    }
+
+    /* Queue the next chunk before hashing this one */
+    next_offset = offset + chunk_size;
+    next_size = next_chunk_size(image_size, next_offset);
+    next_buf = chunk_buffer(
+        image_buf, segments, num_segments, next_offset, &next_size);
+    if (overlap && next_size > 0) {
+      io_ret = ops->start_read_from_partition(
+          ops, part_name, next_offset, next_size, next_buf);
+    }
+
+    if (offset < hash_size) {
+      hash_len = hash_size - offset < chunk_size ? hash_size - offset
+                                                 : chunk_size;
+      if (use_sha512) {
+        avb_sha512_update(&sha512_ctx, chunk_buf, hash_len);
+      } else {
+        avb_sha256_update(&sha256_ctx, chunk_buf, hash_len);
+      }
+    }
+
+    if (ops->chunk_loaded != NULL) {
+      ops->chunk_loaded(ops, part_name, offset, chunk_buf, chunk_size);
+    }
+
+    offset = next_offset;
+    chunk_size = next_size;
+    chunk_buf = next_buf;
+  }
+
+  if (use_sha512) {
+    avb_memcpy(digest, avb_sha512_final(&sha512_ctx), AVB_SHA512_DIGEST_SIZE);
+  } else {
+    avb_memcpy(digest, avb_sha256_final(&sha256_ctx), AVB_SHA256_DIGEST_SIZE);
+  }
+
+  return AVB_SLOT_VERIFY_RESULT_OK;
+}
+
 static AvbSlotVerifyResult load_and_verify_hash_partition(
     AvbOps* ops,
     const char* const* requested_partitions,
@@ -113,11 +277,12 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
   AvbSlotVerifyResult ret;
   AvbIOResult io_ret;
   uint8_t* image_buf = NULL;
-  size_t part_num_read;
-  uint8_t* digest;
+  uint8_t digest[AVB_SHA512_DIGEST_SIZE];
   size_t digest_len;
+  bool use_sha512;
   const char* found;
   uint64_t image_size;
+  uint32_t trace_span;
 
   if (!avb_hash_descriptor_validate_and_byteswap(
           (const AvbHashDescriptor*)descriptor, &hash_desc)) {
@@ -188,43 +353,13 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     }
   }
 
-  image_buf = avb_malloc(image_size);
-  if (image_buf == NULL) {
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
-    goto out;
-  }
-
-  io_ret = ops->read_from_partition(
-      ops, part_name, 0 /* offset */, image_size, image_buf, &part_num_read);
-  if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
-    goto out;
-  } else if (io_ret != AVB_IO_RESULT_OK) {
-    avb_errorv(part_name, ": Error loading data from partition.\n", NULL);
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_IO;
-    goto out;
-  }
-  if (part_num_read != image_size) {
-    avb_errorv(part_name, ": Read fewer than requested bytes.\n", NULL);
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_IO;
-    goto out;
-  }
-
   if (Avb_StrnCmp ( (CONST CHAR8*)hash_desc.hash_algorithm, "sha256",
                  avb_strlen ("sha256")) == 0) {
-    AvbSHA256Ctx sha256_ctx;
-    avb_sha256_init(&sha256_ctx);
-    avb_sha256_update(&sha256_ctx, desc_salt, hash_desc.salt_len);
-    avb_sha256_update(&sha256_ctx, image_buf, hash_desc.image_size);
-    digest = avb_sha256_final(&sha256_ctx);
+    use_sha512 = false;
     digest_len = AVB_SHA256_DIGEST_SIZE;
   } else if (Avb_StrnCmp ( (CONST CHAR8*)hash_desc.hash_algorithm, "sha512",
                   avb_strlen ("sha512")) == 0) {
-    AvbSHA512Ctx sha512_ctx;
-    avb_sha512_init(&sha512_ctx);
-    avb_sha512_update(&sha512_ctx, desc_salt, hash_desc.salt_len);
-    avb_sha512_update(&sha512_ctx, image_buf, hash_desc.image_size);
-    digest = avb_sha512_final(&sha512_ctx);
+    use_sha512 = true;
     digest_len = AVB_SHA512_DIGEST_SIZE;
   } else {
     avb_errorv(part_name, ": Unsupported hash algorithm.\n", NULL);
@@ -232,6 +367,27 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     goto out;
   }
 
+  image_buf = avb_malloc(image_size);
+  if (image_buf == NULL) {
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+    goto out;
+  }
+
+  trace_span = avb_trace_begin("avb-hash", part_name);
+  ret = read_and_hash_partition(ops,
+                                part_name,
+                                image_buf,
+                                image_size,
+                                hash_desc.image_size,
+                                use_sha512,
+                                desc_salt,
+                                hash_desc.salt_len,
+                                digest);
+  avb_trace_end(trace_span);
+  if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+    goto out;
+  }
+
   if (digest_len != hash_desc.digest_len) {
     avb_errorv(
         part_name, ": Digest in descriptor not of expected size.\n", NULL);
@@ -401,6 +557,7 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
   bool is_main_vbmeta;
   bool is_vbmeta_partition;
   AvbVBMetaData* vbmeta_image_data = NULL;
+  uint32_t trace_span;
 
   ret = AVB_SLOT_VERIFY_RESULT_OK;
 
@@ -489,12 +646,14 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
     goto out;
   }
 
+  trace_span = avb_trace_begin("avb-vbmeta", full_partition_name);
   io_ret = ops->read_from_partition(ops,
                                     full_partition_name,
                                     vbmeta_offset,
                                     vbmeta_size,
                                     vbmeta_buf,
                                     &vbmeta_num_read);
+  avb_trace_end(trace_span);
   if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
     ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
     goto out;
@@ -531,8 +690,10 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
   /* Check if the image is properly signed and get the public key used
    * to sign the image.
    */
+  trace_span = avb_trace_begin("avb-sig", full_partition_name);
   vbmeta_ret =
       avb_vbmeta_image_verify(vbmeta_buf, vbmeta_num_read, &pk_data, &pk_len);
+  avb_trace_end(trace_span);
   switch (vbmeta_ret) {
     case AVB_VBMETA_VERIFY_RESULT_OK:
       avb_assert(pk_data != NULL && pk_len > 0);
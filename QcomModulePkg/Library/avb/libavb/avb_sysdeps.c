@@ -56,6 +56,7 @@
 #include <Library/DebugLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/ShutdownServices.h>
+#include <Library/BootStats.h>
 
 int avb_memcmp(const void *src1, const void *src2, size_t n)
 {
@@ -120,3 +121,13 @@ void avb_free(void *ptr)
 {
 	FreePool(ptr);
 }
+
+uint32_t avb_trace_begin(const char *name, const char *arg)
+{
+	return BootTraceBegin(name, arg);
+}
+
+void avb_trace_end(uint32_t span)
+{
+	BootTraceEnd(span);
+}
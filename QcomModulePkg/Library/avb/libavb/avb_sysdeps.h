@@ -122,6 +122,15 @@ void avb_free(void* ptr);
 /* Returns the lenght of |str|, excluding the terminating NUL-byte. */
 size_t avb_strlen(const char* str) AVB_ATTR_WARN_UNUSED_RESULT;
 
+/* Marks the start of a verification step named |name|, for boot time
+ * tracing. |arg|, typically a partition name, is appended to the name
+ * if not NULL. Returns the value to pass to avb_trace_end().
+ */
+uint32_t avb_trace_begin(const char* name, const char* arg);
+
+/* Marks the end of the step started by avb_trace_begin(). */
+void avb_trace_end(uint32_t span);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,298 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Decoder for the LZ4 frame format and for the legacy format that the
+ * Linux build uses for Image.lz4. Block and content checksums are not
+ * checked, the image has been verified before it gets here. Linked blocks
+ * are supported since the whole output stays in one buffer.
+ */
+
+#include "lz4.h"
+
+#define LZ4_LEGACY_BLOCK_SIZE (8 * 1024 * 1024)
+/* LZ4_compressBound () of a legacy block */
+#define LZ4_LEGACY_BLOCK_BOUND (LZ4_LEGACY_BLOCK_SIZE + \
+                                LZ4_LEGACY_BLOCK_SIZE / 255 + 16)
+#define LZ4_MIN_MATCH 4
+
+/* Frame descriptor flags */
+#define LZ4_FLG_VERSION_MASK 0xC0
+#define LZ4_FLG_VERSION 0x40
+#define LZ4_FLG_BLOCK_CHECKSUM 0x10
+#define LZ4_FLG_CONTENT_SIZE 0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID 0x01
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000
+
+static UINT32
+get_le32 (const UINT8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+int
+is_lz4_package (const UINT8 *buf, UINTN len)
+{
+  if (buf == NULL || len < 8) {
+    return 0;
+  }
+
+  return get_le32 (buf) == LZ4_FRAME_MAGIC ||
+         get_le32 (buf) == LZ4_LEGACY_MAGIC;
+}
+
+/* Reads a length continued in 255 steps, returns -1 past "end" */
+static int
+read_length (const UINT8 **in, const UINT8 *end, UINTN *len)
+{
+  UINT8 b;
+
+  do {
+    if (*in >= end) {
+      return -1;
+    }
+    b = *(*in)++;
+    *len += b;
+  } while (b == 255);
+
+  return 0;
+}
+
+/* Decompresses one block to "out", with "out_start" being the start of all
+ * output so that matches may reach into earlier blocks.
+ */
+static int
+lz4_decompress_block (const UINT8 *in,
+                      UINTN in_len,
+                      UINT8 *out_start,
+                      UINT8 *out,
+                      UINT8 *out_end,
+                      UINTN *out_len)
+{
+  const UINT8 *in_end = in + in_len;
+  UINT8 *op = out;
+  const UINT8 *match;
+  UINTN literals;
+  UINTN match_len;
+  UINTN offset;
+  UINT8 token;
+
+  while (in < in_end) {
+    token = *in++;
+
+    literals = token >> 4;
+    if (literals == 15 && read_length (&in, in_end, &literals)) {
+      return -1;
+    }
+    if (literals > (UINTN)(in_end - in) ||
+        literals > (UINTN)(out_end - op)) {
+      return -1;
+    }
+    while (literals--) {
+      *op++ = *in++;
+    }
+
+    /* The last sequence has only literals */
+    if (in == in_end) {
+      break;
+    }
+
+    if (in_end - in < 2) {
+      return -1;
+    }
+    offset = in[0] | (in[1] << 8);
+    in += 2;
+    if (offset == 0 || offset > (UINTN)(op - out_start)) {
+      return -1;
+    }
+
+    match_len = token & 0xF;
+    if (match_len == 15 && read_length (&in, in_end, &match_len)) {
+      return -1;
+    }
+    match_len += LZ4_MIN_MATCH;
+    if (match_len > (UINTN)(out_end - op)) {
+      return -1;
+    }
+
+    /* Byte copy, the match may overlap the output */
+    match = op - offset;
+    while (match_len--) {
+      *op++ = *match++;
+    }
+  }
+
+  *out_len = op - out;
+  return 0;
+}
+
+static int
+lz4_decompress_legacy (const UINT8 *in_buf,
+                       UINTN in_len,
+                       UINT8 *out_buf,
+                       UINTN out_buf_len,
+                       UINTN *in_used,
+                       UINTN *out_len)
+{
+  UINTN pos = 4;
+  UINTN out_pos = 0;
+  UINTN block_len;
+  UINTN block_out;
+
+  /* Legacy streams have no end mark. They end at the end of the input, at
+   * a size no block can have (such as the magic of a following dtb or
+   * frame), at the size trailer of a kernel build, or after a short block.
+   */
+  while (in_len - pos >= 4) {
+    block_len = get_le32 (in_buf + pos);
+    if (block_len == 0 || block_len > LZ4_LEGACY_BLOCK_BOUND ||
+        block_len > in_len - pos - 4 ||
+        (out_pos != 0 && block_len == (UINT32)out_pos)) {
+      break;
+    }
+    if (lz4_decompress_block (in_buf + pos + 4, block_len, out_buf,
+                              out_buf + out_pos, out_buf + out_buf_len,
+                              &block_out)) {
+      return -1;
+    }
+    pos += 4 + block_len;
+    out_pos += block_out;
+    if (block_out < LZ4_LEGACY_BLOCK_SIZE) {
+      break;
+    }
+  }
+
+  if (out_pos == 0) {
+    return -1;
+  }
+
+  /* The kernel's cmd_lz4 appends the decompressed size as a LE32 word */
+  if (in_len - pos >= 4 && get_le32 (in_buf + pos) == (UINT32)out_pos) {
+    pos += 4;
+  }
+
+  *in_used = pos;
+  *out_len = out_pos;
+  return 0;
+}
+
+static int
+lz4_decompress_frame (const UINT8 *in_buf,
+                      UINTN in_len,
+                      UINT8 *out_buf,
+                      UINTN out_buf_len,
+                      UINTN *in_used,
+                      UINTN *out_len)
+{
+  UINTN pos = 4;
+  UINTN out_pos = 0;
+  UINTN block_len;
+  UINTN block_out;
+  UINT32 block_hdr;
+  UINT8 flg;
+
+  if (in_len < 7) {
+    return -1;
+  }
+  flg = in_buf[pos];
+  if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION ||
+      (flg & LZ4_FLG_DICT_ID)) {
+    return -1;
+  }
+  /* FLG, BD, optional content size and the header checksum */
+  pos += 2 + ((flg & LZ4_FLG_CONTENT_SIZE) ? 8 : 0) + 1;
+
+  for (;;) {
+    if (pos > in_len || in_len - pos < 4) {
+      return -1;
+    }
+    block_hdr = get_le32 (in_buf + pos);
+    pos += 4;
+    if (block_hdr == 0) {
+      break;
+    }
+
+    block_len = block_hdr & ~LZ4_BLOCK_UNCOMPRESSED;
+    if (block_len > in_len - pos) {
+      return -1;
+    }
+    if (block_hdr & LZ4_BLOCK_UNCOMPRESSED) {
+      if (block_len > out_buf_len - out_pos) {
+        return -1;
+      }
+      for (block_out = 0; block_out < block_len; block_out++) {
+        out_buf[out_pos + block_out] = in_buf[pos + block_out];
+      }
+    } else if (lz4_decompress_block (in_buf + pos, block_len, out_buf,
+                                     out_buf + out_pos,
+                                     out_buf + out_buf_len, &block_out)) {
+      return -1;
+    }
+    pos += block_len;
+    out_pos += block_out;
+
+    if (flg & LZ4_FLG_BLOCK_CHECKSUM) {
+      pos += 4;
+    }
+  }
+
+  if (flg & LZ4_FLG_CONTENT_CHECKSUM) {
+    pos += 4;
+  }
+  if (pos > in_len) {
+    return -1;
+  }
+
+  *in_used = pos;
+  *out_len = out_pos;
+  return 0;
+}
+
+int
+lz4_decompress (const UINT8 *in_buf,
+                UINTN in_len,
+                UINT8 *out_buf,
+                UINTN out_buf_len,
+                UINTN *in_used,
+                UINTN *out_len)
+{
+  if (!is_lz4_package (in_buf, in_len) ||
+      out_buf == NULL ||
+      in_used == NULL ||
+      out_len == NULL) {
+    return -1;
+  }
+
+  if (get_le32 (in_buf) == LZ4_LEGACY_MAGIC) {
+    return lz4_decompress_legacy (in_buf, in_len, out_buf, out_buf_len,
+                                  in_used, out_len);
+  }
+
+  return lz4_decompress_frame (in_buf, in_len, out_buf, out_buf_len,
+                               in_used, out_len);
+}
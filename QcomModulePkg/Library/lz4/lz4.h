@@ -0,0 +1,56 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+#include <Base.h>
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_LEGACY_MAGIC 0x184C2102
+
+/* Returns true if "buf" starts with an LZ4 frame or legacy stream */
+int
+is_lz4_package (const UINT8 *buf, UINTN len);
+
+/* Decompresses the LZ4 stream at "in_buf" into "out_buf".
+ * in_used - bytes of "in_buf" the stream took, including the size trailer
+ *           a kernel build appends, anything after it (such as an
+ *           appended dtb) is left alone
+ * out_len - length of the decompressed data
+ * Returns 0 on success, -1 if the stream is corrupt or does not fit.
+ */
+int
+lz4_decompress (const UINT8 *in_buf,
+                UINTN in_len,
+                UINT8 *out_buf,
+                UINTN out_buf_len,
+                UINTN *in_used,
+                UINTN *out_len);
+
+#endif /* __LZ4_H__ */
@@ -101,6 +101,34 @@ uLong ZEXPORT adler32(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef ZLIB_ARMV8
+    if (z_armv8_neon) {
+        unsigned long sums[3];
+
+        /* at most 256 blocks at a time, the column sums of the NEON code
+           are 16 bits wide */
+        while (len >= 16) {
+            n = len >> 4;
+            if (n > 256)
+                n = 256;
+            z_adler32_armv8_blocks(buf, n, sums);
+            sum2 += ((unsigned long)n << 4) * adler + (sums[1] << 4) + sums[2];
+            adler += sums[0];
+            MOD(adler);
+            MOD(sum2);
+            buf += n << 4;
+            len -= n << 4;
+        }
+        while (len--) {
+            adler += *buf++;
+            sum2 += adler;
+        }
+        MOD(adler);
+        MOD(sum2);
+        return adler | (sum2 << 16);
+    }
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
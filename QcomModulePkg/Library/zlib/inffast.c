@@ -29,6 +29,57 @@
 #  define PUP(a) *++(a)
 #endif
 
+#ifdef ZLIB_ARMV8
+/* Copies len bytes from "from" to "out" in 16 or 8 byte NEON chunks,
+   storing up to 15 bytes past out + len.  The copy runs forward, so a
+   source "step" or more bytes behind out reads what is already written.
+   ld1/st1 of bytes need no alignment. */
+local void chunk_copy(out, from, len, step)
+unsigned char FAR *out;
+const unsigned char FAR *from;
+unsigned len;
+unsigned step;
+{
+    if (step == 16)
+        __asm__ __volatile__(
+            "1:\n\t"
+            "ld1    {v16.16b}, [%1], #16\n\t"
+            "st1    {v16.16b}, [%0], #16\n\t"
+            "subs   %w2, %w2, #16\n\t"
+            "b.hi   1b"
+            : "+r" (out), "+r" (from), "+r" (len)
+            :
+            : "v16", "cc", "memory");
+    else
+        __asm__ __volatile__(
+            "1:\n\t"
+            "ld1    {v16.8b}, [%1], #8\n\t"
+            "st1    {v16.8b}, [%0], #8\n\t"
+            "subs   %w2, %w2, #8\n\t"
+            "b.hi   1b"
+            : "+r" (out), "+r" (from), "+r" (len)
+            :
+            : "v16", "cc", "memory");
+}
+
+/* Stores len copies of c at out, and up to 15 bytes more */
+local void chunk_fill(out, c, len)
+unsigned char FAR *out;
+unsigned c;
+unsigned len;
+{
+    __asm__ __volatile__(
+        "dup    v16.16b, %w2\n\t"
+        "1:\n\t"
+        "st1    {v16.16b}, [%0], #16\n\t"
+        "subs   %w1, %w1, #16\n\t"
+        "b.hi   1b"
+        : "+r" (out), "+r" (len)
+        : "r" (c)
+        : "v16", "cc", "memory");
+}
+#endif
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -267,6 +318,23 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+#ifdef ZLIB_ARMV8
+                    /* whole chunks when the overrun stays in the output */
+                    if (z_armv8_neon &&
+                        (unsigned)(end - out) + 257 >= len + 15) {
+                        if (dist >= 8) {
+                            chunk_copy(out + OFF, from + OFF, len,
+                                       dist >= 16 ? 16 : 8);
+                            out += len;
+                            continue;
+                        }
+                        if (dist == 1) {
+                            chunk_fill(out + OFF, from[OFF], len);
+                            out += len;
+                            continue;
+                        }
+                    }
+#endif
                     do {                        /* minimum length is three */
                         PUP(out) = PUP(from);
                         PUP(out) = PUP(from);
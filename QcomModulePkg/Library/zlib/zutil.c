@@ -15,6 +15,11 @@
 struct internal_state      {int dummy;}; /* for buggy compilers */
 #endif
 
+#ifdef ZLIB_ARMV8
+int z_armv8_neon = 1;
+int z_armv8_crc32 = -1;
+#endif
+
 z_const char * const z_errmsg[10] = {
 "need dictionary",     /* Z_NEED_DICT       2  */
 "stream end",          /* Z_STREAM_END      1  */
@@ -251,4 +251,25 @@ extern z_const char * const z_errmsg[10]; /* indexed by 2-zlib_error */
 #define ZSWAP32(q) ((((q) >> 24) & 0xff) + (((q) >> 8) & 0xff00) + \
                     (((q) & 0xff00) << 8) + (((q) & 0xff) << 24))
 
+#ifdef ZLIB_ARMV8
+/* AArch64 code paths, see AArch64/zlib_armv8.S and Crc32Armv8Lib.
+   z_armv8_neon enables the NEON match copies and adler32, z_armv8_crc32
+   the CRC32 instructions and is -1 until the cpu has been probed.  Either
+   can be set to 0 to run the C code instead, e.g. for benchmarking. */
+extern int z_armv8_neon;
+extern int z_armv8_crc32;
+
+/* From Crc32Armv8Lib, see Include/Library/Crc32Armv8Lib.h.  Crc32Armv8()
+   takes the raw register, the caller does the pre and post inversion. */
+unsigned Crc32Armv8Supported OF((void));
+unsigned Crc32Armv8 OF((unsigned crc, const unsigned char FAR *buf,
+                        unsigned long len));
+/* Sums "blocks" (1 to 256) blocks of 16 bytes for adler32(): the sum of
+   the bytes, the sum over the blocks of the bytes in front of each block,
+   and the sum of the bytes weighted 16 to 1 by their position in a block. */
+void ZLIB_INTERNAL z_adler32_armv8_blocks OF((const unsigned char FAR *buf,
+                                              unsigned blocks,
+                                              unsigned long *sums));
+#endif
+
 #endif /* ZUTIL_H */
@@ -0,0 +1,1082 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of The Linux Foundation, Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Small zstd decoder (RFC 8878) for compressed kernels. The whole output
+ * is kept in one buffer, which serves as the window. Dictionaries are not
+ * supported and the content checksum is not checked, the image has been
+ * verified before it gets here.
+ */
+
+#include "zstd.h"
+
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A50
+#define ZSTD_SKIPPABLE_MASK 0xFFFFFFF0
+#define ZSTD_BLOCK_SIZE_MAX (128 * 1024)
+
+#define BLOCK_TYPE_RAW 0
+#define BLOCK_TYPE_RLE 1
+#define BLOCK_TYPE_COMPRESSED 2
+
+#define LITERALS_RAW 0
+#define LITERALS_RLE 1
+#define LITERALS_COMPRESSED 2
+#define LITERALS_TREELESS 3
+
+#define MODE_PREDEFINED 0
+#define MODE_RLE 1
+#define MODE_FSE 2
+#define MODE_REPEAT 3
+
+#define HUF_MAX_BITS 11
+#define HUF_MAX_SYMBOLS 256
+#define HUF_WEIGHT_LOG_MAX 6
+
+#define LL_MAX_SYMBOL 35
+#define ML_MAX_SYMBOL 52
+#define OF_MAX_SYMBOL 31
+#define LL_LOG_MAX 9
+#define ML_LOG_MAX 9
+#define OF_LOG_MAX 8
+#define FSE_MAX_SYMBOLS (ML_MAX_SYMBOL + 1)
+
+typedef struct {
+  UINT8 symbol;
+  UINT8 nb_bits;
+  UINT16 baseline;
+} fse_entry;
+
+typedef struct {
+  fse_entry *table;
+  UINT32 log;
+} fse_table;
+
+typedef struct {
+  UINT8 symbol;
+  UINT8 nb_bits;
+} huf_entry;
+
+/* Bitstream read backwards, from its last bit towards the first one */
+typedef struct {
+  const UINT8 *src;
+  INT64 bits;
+} bit_reader;
+
+typedef struct {
+  UINT8 *out_start;
+  UINT8 *out_end;
+  UINT32 rep[3];
+  UINT32 huf_bits;
+  BOOLEAN have_huf;
+  fse_table ll;
+  fse_table of;
+  fse_table ml;
+} frame_state;
+
+static fse_entry ll_table[1 << LL_LOG_MAX];
+static fse_entry of_table[1 << OF_LOG_MAX];
+static fse_entry ml_table[1 << ML_LOG_MAX];
+static fse_entry ll_predefined[1 << 6];
+static fse_entry of_predefined[1 << 5];
+static fse_entry ml_predefined[1 << 6];
+static fse_entry ll_rle;
+static fse_entry of_rle;
+static fse_entry ml_rle;
+static huf_entry huf_table[1 << HUF_MAX_BITS];
+static UINT8 literals[ZSTD_BLOCK_SIZE_MAX];
+
+static const INT32 ll_default_norm[LL_MAX_SYMBOL + 1] = {
+  4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1, 2, 2,
+  2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1, -1, -1, -1, -1
+};
+
+static const INT32 ml_default_norm[ML_MAX_SYMBOL + 1] = {
+  1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static const INT32 of_default_norm[29] = {
+  1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static const UINT32 ll_base[LL_MAX_SYMBOL + 1] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+  8192, 16384, 32768, 65536
+};
+
+static const UINT8 ll_bits[LL_MAX_SYMBOL + 1] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+  13, 14, 15, 16
+};
+
+static const UINT32 ml_base[ML_MAX_SYMBOL + 1] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+  19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+  35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+  4099, 8195, 16387, 32771, 65539
+};
+
+static const UINT8 ml_bits[ML_MAX_SYMBOL + 1] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+  12, 13, 14, 15, 16
+};
+
+static UINT32
+get_le16 (const UINT8 *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static UINT32
+get_le24 (const UINT8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static UINT32
+get_le32 (const UINT8 *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static INT32
+highbit (UINT32 v)
+{
+  INT32 n = -1;
+
+  while (v) {
+    v >>= 1;
+    n++;
+  }
+  return n;
+}
+
+/* Reads "n" (at most 32) bits starting at bit "pos" of "src" */
+static UINT32
+read_bits_le (const UINT8 *src, UINT64 pos, UINT32 n)
+{
+  const UINT8 *p = src + (pos >> 3);
+  UINT32 shift = pos & 7;
+  UINT32 bytes = (shift + n + 7) >> 3;
+  UINT64 v = 0;
+  UINT32 i;
+
+  if (n == 0) {
+    return 0;
+  }
+  for (i = 0; i < bytes; i++) {
+    v |= (UINT64)p[i] << (8 * i);
+  }
+  return (v >> shift) & ((1ULL << n) - 1);
+}
+
+static int
+bit_reader_init (bit_reader *br, const UINT8 *src, UINTN len)
+{
+  if (len == 0 || src[len - 1] == 0) {
+    return -1;
+  }
+  br->src = src;
+  /* Skip the padding down to and including the final 1 bit */
+  br->bits = (INT64)(len - 1) * 8 + highbit (src[len - 1]);
+  return 0;
+}
+
+/* Bits before the start of the stream read as zero, the caller checks
+ * br->bits for overflow. */
+static UINT32
+bit_reader_peek (const bit_reader *br, UINT32 n)
+{
+  INT64 pos = br->bits - n;
+
+  if (pos >= 0) {
+    return read_bits_le (br->src, pos, n);
+  }
+  if (pos <= -(INT64)n) {
+    return 0;
+  }
+  return read_bits_le (br->src, 0, n + pos) << (-pos);
+}
+
+static UINT32
+bit_reader_read (bit_reader *br, UINT32 n)
+{
+  UINT32 v = bit_reader_peek (br, n);
+
+  br->bits -= n;
+  return v;
+}
+
+/* Builds the decoding table for the normalized distribution "norm" */
+static int
+fse_build_table (fse_entry *table,
+                 UINT32 log,
+                 const INT32 *norm,
+                 UINT32 num_symbols)
+{
+  UINT32 size = 1U << log;
+  UINT32 high = size - 1;
+  UINT32 step = (size >> 1) + (size >> 3) + 3;
+  UINT32 mask = size - 1;
+  UINT32 pos = 0;
+  UINT16 next[FSE_MAX_SYMBOLS];
+  UINT32 s;
+  INT32 i;
+  UINT32 n;
+
+  if (num_symbols > FSE_MAX_SYMBOLS) {
+    return -1;
+  }
+
+  for (s = 0; s < num_symbols; s++) {
+    if (norm[s] == -1) {
+      table[high--].symbol = s;
+      next[s] = 1;
+    } else {
+      next[s] = norm[s];
+    }
+  }
+
+  for (s = 0; s < num_symbols; s++) {
+    for (i = 0; i < norm[s]; i++) {
+      table[pos].symbol = s;
+      do {
+        pos = (pos + step) & mask;
+      } while (pos > high);
+    }
+  }
+  if (pos != 0) {
+    return -1;
+  }
+
+  for (n = 0; n < size; n++) {
+    UINT32 state = next[table[n].symbol]++;
+
+    table[n].nb_bits = log - highbit (state);
+    table[n].baseline = (state << table[n].nb_bits) - size;
+  }
+
+  return 0;
+}
+
+/* Reads an FSE table description, returns the bytes it took or -1 */
+static INTN
+fse_read_table (fse_entry *table,
+                UINT32 max_log,
+                UINT32 max_symbol,
+                const UINT8 *src,
+                UINTN len,
+                UINT32 *out_log)
+{
+  INT32 norm[FSE_MAX_SYMBOLS];
+  UINT64 pos = 4;
+  UINT32 log;
+  INT32 remaining;
+  INT32 threshold;
+  UINT32 nb_bits;
+  UINT32 symbol = 0;
+  UINT32 repeat;
+  INT32 max;
+  INT32 count;
+  UINT32 v;
+
+  if (len < 1) {
+    return -1;
+  }
+  log = (src[0] & 0xF) + 5;
+  if (log > max_log) {
+    return -1;
+  }
+
+  remaining = (1 << log) + 1;
+  threshold = 1 << log;
+  nb_bits = log + 1;
+
+  while (remaining > 1 && symbol <= max_symbol) {
+    if (((pos + nb_bits + 7) >> 3) > len) {
+      return -1;
+    }
+    v = read_bits_le (src, pos, nb_bits);
+    max = 2 * threshold - 1 - remaining;
+    if ((INT32)(v & (threshold - 1)) < max) {
+      count = v & (threshold - 1);
+      pos += nb_bits - 1;
+    } else {
+      count = v & (2 * threshold - 1);
+      if (count >= threshold) {
+        count -= max;
+      }
+      pos += nb_bits;
+    }
+    count--;
+    remaining -= count < 0 ? -count : count;
+    norm[symbol++] = count;
+
+    if (count == 0) {
+      do {
+        if (((pos + 2 + 7) >> 3) > len) {
+          return -1;
+        }
+        repeat = read_bits_le (src, pos, 2);
+        pos += 2;
+        while (repeat-- && symbol <= max_symbol) {
+          norm[symbol++] = 0;
+        }
+      } while (read_bits_le (src, pos - 2, 2) == 3);
+    }
+
+    while (remaining < threshold) {
+      nb_bits--;
+      threshold >>= 1;
+    }
+  }
+
+  if (remaining != 1 || symbol > max_symbol + 1) {
+    return -1;
+  }
+  if (fse_build_table (table, log, norm, symbol)) {
+    return -1;
+  }
+
+  *out_log = log;
+  return (pos + 7) >> 3;
+}
+
+static VOID
+fse_rle_table (fse_entry *entry, UINT8 symbol)
+{
+  entry->symbol = symbol;
+  entry->nb_bits = 0;
+  entry->baseline = 0;
+}
+
+/* Decodes the FSE compressed Huffman weights, returns their number */
+static INTN
+huf_read_fse_weights (UINT8 *weights, const UINT8 *src, UINTN len)
+{
+  static fse_entry table[1 << HUF_WEIGHT_LOG_MAX];
+  bit_reader br;
+  UINT32 log;
+  UINT32 state1;
+  UINT32 state2;
+  INTN hdr;
+  INTN n = 0;
+
+  hdr = fse_read_table (table, HUF_WEIGHT_LOG_MAX, HUF_MAX_BITS, src, len,
+                        &log);
+  if (hdr < 0 || bit_reader_init (&br, src + hdr, len - hdr)) {
+    return -1;
+  }
+
+  state1 = bit_reader_read (&br, log);
+  state2 = bit_reader_read (&br, log);
+  if (br.bits < 0) {
+    return -1;
+  }
+
+  /* Two interleaved states, the stream ends when one of them overflows */
+  for (;;) {
+    if (n > HUF_MAX_SYMBOLS - 2) {
+      return -1;
+    }
+    weights[n++] = table[state1].symbol;
+    state1 = table[state1].baseline +
+             bit_reader_read (&br, table[state1].nb_bits);
+    if (br.bits < 0) {
+      weights[n++] = table[state2].symbol;
+      break;
+    }
+
+    weights[n++] = table[state2].symbol;
+    state2 = table[state2].baseline +
+             bit_reader_read (&br, table[state2].nb_bits);
+    if (br.bits < 0) {
+      weights[n++] = table[state1].symbol;
+      break;
+    }
+  }
+
+  return n;
+}
+
+/* Reads a Huffman tree description, returns the bytes it took or -1 */
+static INTN
+huf_read_table (frame_state *fs, const UINT8 *src, UINTN len)
+{
+  UINT8 weights[HUF_MAX_SYMBOLS];
+  UINT32 total = 0;
+  UINT32 max_bits;
+  UINT32 rest;
+  UINT32 pos = 0;
+  INTN num;
+  INTN used;
+  UINT32 w;
+  INTN s;
+  UINT32 i;
+
+  if (len < 1) {
+    return -1;
+  }
+
+  if (src[0] < 128) {
+    used = 1 + src[0];
+    if ((UINTN)used > len) {
+      return -1;
+    }
+    num = huf_read_fse_weights (weights, src + 1, src[0]);
+    if (num < 0) {
+      return -1;
+    }
+  } else {
+    num = src[0] - 127;
+    used = 1 + (num + 1) / 2;
+    if ((UINTN)used > len) {
+      return -1;
+    }
+    for (s = 0; s < num; s++) {
+      weights[s] = (s & 1) ? (src[1 + s / 2] & 0xF) : (src[1 + s / 2] >> 4);
+    }
+  }
+
+  for (s = 0; s < num; s++) {
+    if (weights[s] > HUF_MAX_BITS) {
+      return -1;
+    }
+    if (weights[s]) {
+      total += 1U << (weights[s] - 1);
+    }
+  }
+  if (total == 0 || num >= HUF_MAX_SYMBOLS) {
+    return -1;
+  }
+
+  /* The weight of the last symbol completes the total to a power of 2 */
+  max_bits = highbit (total) + 1;
+  rest = (1U << max_bits) - total;
+  if (max_bits > HUF_MAX_BITS || (rest & (rest - 1))) {
+    return -1;
+  }
+  weights[num++] = highbit (rest) + 1;
+
+  /* Longest codes first, each symbol filling 2^(weight-1) entries */
+  for (w = 1; w <= max_bits; w++) {
+    for (s = 0; s < num; s++) {
+      if (weights[s] != w) {
+        continue;
+      }
+      for (i = 0; i < (1U << (w - 1)); i++) {
+        huf_table[pos].symbol = s;
+        huf_table[pos].nb_bits = max_bits + 1 - w;
+        pos++;
+      }
+    }
+  }
+
+  fs->huf_bits = max_bits;
+  fs->have_huf = TRUE;
+  return used;
+}
+
+static int
+huf_decode_stream (const frame_state *fs,
+                   const UINT8 *src,
+                   UINTN len,
+                   UINT8 *out,
+                   UINTN out_len)
+{
+  bit_reader br;
+  UINT32 index;
+  UINTN n;
+
+  if (bit_reader_init (&br, src, len)) {
+    return -1;
+  }
+
+  for (n = 0; n < out_len; n++) {
+    index = bit_reader_peek (&br, fs->huf_bits);
+    out[n] = huf_table[index].symbol;
+    br.bits -= huf_table[index].nb_bits;
+  }
+
+  return br.bits == 0 ? 0 : -1;
+}
+
+/* Decodes the literals section into "literals", returns its size or -1 */
+static INTN
+decode_literals (frame_state *fs,
+                 const UINT8 *src,
+                 UINTN len,
+                 UINTN *num_literals)
+{
+  UINT32 type = src[0] & 3;
+  UINT32 size_format = (src[0] >> 2) & 3;
+  UINT32 regen;
+  UINT32 comp;
+  UINT32 hdr;
+  UINT32 streams = 4;
+  UINT32 hdr_bits;
+  UINT64 h;
+  UINT32 segment;
+  UINT32 sizes[4];
+  UINTN pos;
+  INTN tree;
+  UINT32 i;
+
+  if (type == LITERALS_RAW || type == LITERALS_RLE) {
+    if (size_format == 1) {
+      hdr = 2;
+    } else if (size_format == 3) {
+      hdr = 3;
+    } else {
+      hdr = 1;
+    }
+    if (len < hdr) {
+      return -1;
+    }
+    if (hdr == 1) {
+      regen = src[0] >> 3;
+    } else if (hdr == 2) {
+      regen = get_le16 (src) >> 4;
+    } else {
+      regen = get_le24 (src) >> 4;
+    }
+    if (regen > ZSTD_BLOCK_SIZE_MAX) {
+      return -1;
+    }
+
+    if (type == LITERALS_RAW) {
+      if (len - hdr < regen) {
+        return -1;
+      }
+      for (i = 0; i < regen; i++) {
+        literals[i] = src[hdr + i];
+      }
+      *num_literals = regen;
+      return hdr + regen;
+    }
+
+    if (len - hdr < 1) {
+      return -1;
+    }
+    for (i = 0; i < regen; i++) {
+      literals[i] = src[hdr];
+    }
+    *num_literals = regen;
+    return hdr + 1;
+  }
+
+  if (size_format == 0) {
+    streams = 1;
+  }
+  hdr = size_format < 2 ? 3 : size_format + 2;
+  hdr_bits = size_format < 2 ? 10 : (size_format == 2 ? 14 : 18);
+  if (len < hdr) {
+    return -1;
+  }
+  h = 0;
+  for (i = 0; i < hdr; i++) {
+    h |= (UINT64)src[i] << (8 * i);
+  }
+  regen = (h >> 4) & ((1U << hdr_bits) - 1);
+  comp = (h >> (4 + hdr_bits)) & ((1U << hdr_bits) - 1);
+  if (regen > ZSTD_BLOCK_SIZE_MAX || comp > len - hdr) {
+    return -1;
+  }
+
+  src += hdr;
+  pos = 0;
+  if (type == LITERALS_COMPRESSED) {
+    tree = huf_read_table (fs, src, comp);
+    if (tree < 0) {
+      return -1;
+    }
+    pos = tree;
+  } else if (!fs->have_huf) {
+    return -1;
+  }
+
+  if (streams == 1) {
+    if (huf_decode_stream (fs, src + pos, comp - pos, literals, regen)) {
+      return -1;
+    }
+  } else {
+    if (comp - pos < 6) {
+      return -1;
+    }
+    sizes[0] = get_le16 (src + pos);
+    sizes[1] = get_le16 (src + pos + 2);
+    sizes[2] = get_le16 (src + pos + 4);
+    pos += 6;
+    if ((UINT64)sizes[0] + sizes[1] + sizes[2] > comp - pos) {
+      return -1;
+    }
+    sizes[3] = comp - pos - sizes[0] - sizes[1] - sizes[2];
+
+    segment = (regen + 3) / 4;
+    if (3 * segment > regen) {
+      return -1;
+    }
+    for (i = 0; i < 4; i++) {
+      if (huf_decode_stream (fs, src + pos, sizes[i], literals + i * segment,
+                             i < 3 ? segment : regen - 3 * segment)) {
+        return -1;
+      }
+      pos += sizes[i];
+    }
+  }
+
+  *num_literals = regen;
+  return hdr + comp;
+}
+
+/* Sets up the table for one of the sequence symbol types */
+static INTN
+read_seq_table (fse_table *ft,
+                UINT32 mode,
+                fse_entry *table,
+                fse_entry *predefined,
+                UINT32 predefined_log,
+                fse_entry *rle,
+                UINT32 max_log,
+                UINT32 max_symbol,
+                const UINT8 *src,
+                UINTN len)
+{
+  INTN used;
+
+  switch (mode) {
+  case MODE_PREDEFINED:
+    ft->table = predefined;
+    ft->log = predefined_log;
+    return 0;
+  case MODE_RLE:
+    if (len < 1 || src[0] > max_symbol) {
+      return -1;
+    }
+    fse_rle_table (rle, src[0]);
+    ft->table = rle;
+    ft->log = 0;
+    return 1;
+  case MODE_FSE:
+    used = fse_read_table (table, max_log, max_symbol, src, len, &ft->log);
+    if (used < 0) {
+      return -1;
+    }
+    ft->table = table;
+    return used;
+  default:
+    return ft->table != NULL ? 0 : -1;
+  }
+}
+
+static int
+execute_sequences (frame_state *fs,
+                   const UINT8 *src,
+                   UINTN len,
+                   UINT32 num_sequences,
+                   UINTN num_literals,
+                   UINT8 **op)
+{
+  bit_reader br = {NULL, 0};
+  const UINT8 *lit = literals;
+  const UINT8 *lit_end = literals + num_literals;
+  UINT8 *out = *op;
+  const UINT8 *match;
+  UINT32 ll_state = 0;
+  UINT32 of_state = 0;
+  UINT32 ml_state = 0;
+  UINT32 ll_code;
+  UINT32 of_code;
+  UINT32 ml_code;
+  UINT32 offset;
+  UINT32 ll;
+  UINT32 ml;
+  UINT32 idx;
+  UINT32 n;
+
+  if (num_sequences > 0) {
+    if (bit_reader_init (&br, src, len)) {
+      return -1;
+    }
+    ll_state = bit_reader_read (&br, fs->ll.log);
+    of_state = bit_reader_read (&br, fs->of.log);
+    ml_state = bit_reader_read (&br, fs->ml.log);
+  }
+
+  for (n = 0; n < num_sequences; n++) {
+    ll_code = fs->ll.table[ll_state].symbol;
+    of_code = fs->of.table[of_state].symbol;
+    ml_code = fs->ml.table[ml_state].symbol;
+    if (ll_code > LL_MAX_SYMBOL || ml_code > ML_MAX_SYMBOL ||
+        of_code > OF_MAX_SYMBOL) {
+      return -1;
+    }
+
+    offset = (1U << of_code) + bit_reader_read (&br, of_code);
+    ml = ml_base[ml_code] + bit_reader_read (&br, ml_bits[ml_code]);
+    ll = ll_base[ll_code] + bit_reader_read (&br, ll_bits[ll_code]);
+
+    if (offset > 3) {
+      offset -= 3;
+      fs->rep[2] = fs->rep[1];
+      fs->rep[1] = fs->rep[0];
+      fs->rep[0] = offset;
+    } else {
+      idx = offset - 1 + (ll == 0);
+      if (idx == 0) {
+        offset = fs->rep[0];
+      } else {
+        offset = idx < 3 ? fs->rep[idx] : fs->rep[0] - 1;
+        if (idx != 1) {
+          fs->rep[2] = fs->rep[1];
+        }
+        fs->rep[1] = fs->rep[0];
+        fs->rep[0] = offset;
+      }
+    }
+
+    if (n + 1 < num_sequences) {
+      ll_state = fs->ll.table[ll_state].baseline +
+                 bit_reader_read (&br, fs->ll.table[ll_state].nb_bits);
+      ml_state = fs->ml.table[ml_state].baseline +
+                 bit_reader_read (&br, fs->ml.table[ml_state].nb_bits);
+      of_state = fs->of.table[of_state].baseline +
+                 bit_reader_read (&br, fs->of.table[of_state].nb_bits);
+    }
+    if (br.bits < 0) {
+      return -1;
+    }
+
+    if (ll > (UINTN)(lit_end - lit) ||
+        (UINT64)ll + ml > (UINTN)(fs->out_end - out)) {
+      return -1;
+    }
+    while (ll--) {
+      *out++ = *lit++;
+    }
+
+    if (offset == 0 || offset > (UINTN)(out - fs->out_start)) {
+      return -1;
+    }
+    match = out - offset;
+    while (ml--) {
+      *out++ = *match++;
+    }
+  }
+
+  if (num_sequences > 0 && br.bits != 0) {
+    return -1;
+  }
+
+  if ((UINTN)(lit_end - lit) > (UINTN)(fs->out_end - out)) {
+    return -1;
+  }
+  while (lit < lit_end) {
+    *out++ = *lit++;
+  }
+
+  *op = out;
+  return 0;
+}
+
+static int
+decode_compressed_block (frame_state *fs,
+                         const UINT8 *src,
+                         UINTN len,
+                         UINT8 **op)
+{
+  UINTN num_literals = 0;
+  UINT32 num_sequences;
+  UINTN pos;
+  INTN used;
+  UINT32 modes;
+
+  if (len < 1) {
+    return -1;
+  }
+  used = decode_literals (fs, src, len, &num_literals);
+  if (used < 0) {
+    return -1;
+  }
+  pos = used;
+
+  if (pos >= len) {
+    return -1;
+  }
+  if (src[pos] < 128) {
+    num_sequences = src[pos];
+    pos += 1;
+  } else if (src[pos] < 255) {
+    if (len - pos < 2) {
+      return -1;
+    }
+    num_sequences = ((src[pos] - 128) << 8) + src[pos + 1];
+    pos += 2;
+  } else {
+    if (len - pos < 3) {
+      return -1;
+    }
+    num_sequences = get_le16 (src + pos + 1) + 0x7F00;
+    pos += 3;
+  }
+
+  if (num_sequences > 0) {
+    if (pos >= len) {
+      return -1;
+    }
+    modes = src[pos++];
+    if (modes & 3) {
+      return -1;
+    }
+
+    used = read_seq_table (&fs->ll, modes >> 6, ll_table, ll_predefined, 6,
+                           &ll_rle, LL_LOG_MAX, LL_MAX_SYMBOL, src + pos,
+                           len - pos);
+    if (used < 0) {
+      return -1;
+    }
+    pos += used;
+    used = read_seq_table (&fs->of, (modes >> 4) & 3, of_table,
+                           of_predefined, 5, &of_rle, OF_LOG_MAX,
+                           OF_MAX_SYMBOL, src + pos, len - pos);
+    if (used < 0) {
+      return -1;
+    }
+    pos += used;
+    used = read_seq_table (&fs->ml, (modes >> 2) & 3, ml_table,
+                           ml_predefined, 6, &ml_rle, ML_LOG_MAX,
+                           ML_MAX_SYMBOL, src + pos, len - pos);
+    if (used < 0) {
+      return -1;
+    }
+    pos += used;
+  }
+
+  return execute_sequences (fs, src + pos, len - pos, num_sequences,
+                            num_literals, op);
+}
+
+/* Decodes one frame, returns the input it took or -1 */
+static INTN
+decode_frame (const UINT8 *src,
+              UINTN len,
+              UINT8 *out_end,
+              UINT8 **op)
+{
+  frame_state fs;
+  UINT32 fhd;
+  UINT32 dict_id_size[4] = {0, 1, 2, 4};
+  UINT32 fcs_size[4] = {0, 2, 4, 8};
+  UINT32 block_hdr;
+  UINT32 block_size;
+  UINT32 block_type;
+  BOOLEAN single_segment;
+  BOOLEAN last = FALSE;
+  UINTN pos = 5;
+  UINT32 dict_id = 0;
+  UINT32 i;
+
+  if (len < 5) {
+    return -1;
+  }
+  fhd = src[4];
+  single_segment = (fhd >> 5) & 1;
+  if (fhd & 0x08) {
+    return -1;
+  }
+  if (!single_segment) {
+    pos++;
+  }
+  if (len - pos < dict_id_size[fhd & 3]) {
+    return -1;
+  }
+  for (i = 0; i < dict_id_size[fhd & 3]; i++) {
+    dict_id |= (UINT32)src[pos + i] << (8 * i);
+  }
+  if (dict_id != 0) {
+    return -1;
+  }
+  pos += dict_id_size[fhd & 3];
+  pos += (fhd >> 6) == 0 ? single_segment : fcs_size[fhd >> 6];
+  if (pos > len) {
+    return -1;
+  }
+
+  fs.out_start = *op;
+  fs.out_end = out_end;
+  fs.rep[0] = 1;
+  fs.rep[1] = 4;
+  fs.rep[2] = 8;
+  fs.have_huf = FALSE;
+  fs.huf_bits = 0;
+  fs.ll.table = NULL;
+  fs.of.table = NULL;
+  fs.ml.table = NULL;
+
+  while (!last) {
+    if (len - pos < 3) {
+      return -1;
+    }
+    block_hdr = get_le24 (src + pos);
+    pos += 3;
+    last = block_hdr & 1;
+    block_type = (block_hdr >> 1) & 3;
+    block_size = block_hdr >> 3;
+
+    switch (block_type) {
+    case BLOCK_TYPE_RAW:
+      if (len - pos < block_size ||
+          (UINTN)(out_end - *op) < block_size) {
+        return -1;
+      }
+      for (i = 0; i < block_size; i++) {
+        (*op)[i] = src[pos + i];
+      }
+      *op += block_size;
+      pos += block_size;
+      break;
+    case BLOCK_TYPE_RLE:
+      if (len - pos < 1 ||
+          (UINTN)(out_end - *op) < block_size) {
+        return -1;
+      }
+      for (i = 0; i < block_size; i++) {
+        (*op)[i] = src[pos];
+      }
+      *op += block_size;
+      pos += 1;
+      break;
+    case BLOCK_TYPE_COMPRESSED:
+      if (len - pos < block_size || block_size > ZSTD_BLOCK_SIZE_MAX) {
+        return -1;
+      }
+      if (decode_compressed_block (&fs, src + pos, block_size, op)) {
+        return -1;
+      }
+      pos += block_size;
+      break;
+    default:
+      return -1;
+    }
+  }
+
+  /* Content checksum */
+  if (fhd & 0x04) {
+    pos += 4;
+  }
+  if (pos > len) {
+    return -1;
+  }
+
+  return pos;
+}
+
+static int
+build_predefined_tables (VOID)
+{
+  static BOOLEAN done;
+
+  if (done) {
+    return 0;
+  }
+  if (fse_build_table (ll_predefined, 6, ll_default_norm,
+                       LL_MAX_SYMBOL + 1) ||
+      fse_build_table (of_predefined, 5, of_default_norm, 29) ||
+      fse_build_table (ml_predefined, 6, ml_default_norm,
+                       ML_MAX_SYMBOL + 1)) {
+    return -1;
+  }
+  done = TRUE;
+  return 0;
+}
+
+int
+is_zstd_package (const UINT8 *buf, UINTN len)
+{
+  if (buf == NULL || len < 5) {
+    return 0;
+  }
+
+  return get_le32 (buf) == ZSTD_MAGIC;
+}
+
+int
+zstd_decompress (const UINT8 *in_buf,
+                 UINTN in_len,
+                 UINT8 *out_buf,
+                 UINTN out_buf_len,
+                 UINTN *in_used,
+                 UINTN *out_len)
+{
+  UINT8 *op = out_buf;
+  UINTN pos = 0;
+  UINT32 magic;
+  INTN used;
+
+  if (!is_zstd_package (in_buf, in_len) ||
+      out_buf == NULL ||
+      in_used == NULL ||
+      out_len == NULL ||
+      build_predefined_tables ()) {
+    return -1;
+  }
+
+  while (in_len - pos >= 8) {
+    magic = get_le32 (in_buf + pos);
+    if (magic == ZSTD_MAGIC) {
+      used = decode_frame (in_buf + pos, in_len - pos, out_buf + out_buf_len,
+                           &op);
+      if (used < 0) {
+        return -1;
+      }
+      pos += used;
+    } else if ((magic & ZSTD_SKIPPABLE_MASK) == ZSTD_SKIPPABLE_MAGIC) {
+      if (get_le32 (in_buf + pos + 4) > in_len - pos - 8) {
+        return -1;
+      }
+      pos += 8 + get_le32 (in_buf + pos + 4);
+    } else {
+      break;
+    }
+  }
+
+  /* The kernel's zstd rules append the decompressed size as a LE32 word */
+  if (in_len - pos >= 4 &&
+      get_le32 (in_buf + pos) == (UINT32)(op - out_buf)) {
+    pos += 4;
+  }
+
+  *in_used = pos;
+  *out_len = op - out_buf;
+  return 0;
+}
@@ -0,0 +1,147 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Host benchmark for the libavb software SHA-256 and SHA-512. Reports the
+ * throughput of the C rounds and, on aarch64 hosts built with
+ * AVB_SHA2_ARMV8, of the ARMv8 Crypto Extensions transform, and checks
+ * that both produce the same digest.
+ *
+ * From the top of the tree:
+ *
+ *   gcc -O2 -DAVB_COMPILATION -IQcomModulePkg/Tools/avb_sha_bench \
+ *       -IQcomModulePkg/Library/avb/libavb \
+ *       QcomModulePkg/Tools/avb_sha_bench/avb_sha_bench.c \
+ *       QcomModulePkg/Library/avb/libavb/avb_sha256.c \
+ *       QcomModulePkg/Library/avb/libavb/avb_sha512.c -o avb_sha_bench
+ *
+ * On aarch64 add -DAVB_SHA2_ARMV8 and
+ * QcomModulePkg/Library/avb/libavb/AArch64/avb_sha256_armv8.S.
+ *
+ *   ./avb_sha_bench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "avb_sha.h"
+#ifdef AVB_SHA2_ARMV8
+#include "avb_sha_armv8.h"
+#endif
+
+#define BENCH_DEFAULT_MB 64
+#define BENCH_CHUNK_SIZE (1024 * 1024)
+
+void* avb_memcpy(void* dest, const void* src, size_t n) {
+  return memcpy(dest, src, n);
+}
+
+void* avb_memset(void* dest, const int c, size_t n) {
+  return memset(dest, c, n);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_sha256(const uint8_t* buf, size_t size, uint8_t* digest) {
+  AvbSHA256Ctx ctx;
+  double start = now_seconds();
+  size_t off;
+
+  avb_sha256_sw_init(&ctx);
+  for (off = 0; off < size; off += BENCH_CHUNK_SIZE) {
+    avb_sha256_sw_update(&ctx, buf + off, BENCH_CHUNK_SIZE);
+  }
+  memcpy(digest, avb_sha256_sw_final(&ctx), AVB_SHA256_DIGEST_SIZE);
+
+  return size / (1024.0 * 1024.0) / (now_seconds() - start);
+}
+
+static double bench_sha512(const uint8_t* buf, size_t size, uint8_t* digest) {
+  AvbSHA512Ctx ctx;
+  double start = now_seconds();
+  size_t off;
+
+  avb_sha512_init(&ctx);
+  for (off = 0; off < size; off += BENCH_CHUNK_SIZE) {
+    avb_sha512_update(&ctx, buf + off, BENCH_CHUNK_SIZE);
+  }
+  memcpy(digest, avb_sha512_final(&ctx), AVB_SHA512_DIGEST_SIZE);
+
+  return size / (1024.0 * 1024.0) / (now_seconds() - start);
+}
+
+int main(int argc, char** argv) {
+  size_t mb = argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_DEFAULT_MB;
+  size_t size = mb * BENCH_CHUNK_SIZE;
+  uint8_t ref[AVB_SHA256_DIGEST_SIZE];
+  uint8_t digest[AVB_SHA512_DIGEST_SIZE];
+  uint8_t* buf;
+  size_t i;
+  int ret = 0;
+
+  if (mb == 0) {
+    fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+    return 1;
+  }
+
+  buf = malloc(size);
+  if (buf == NULL) {
+    fprintf(stderr, "cannot allocate %zu MB\n", mb);
+    return 1;
+  }
+  for (i = 0; i < size; i++) {
+    buf[i] = (uint8_t)(i * 2654435761u >> 13);
+  }
+
+#ifdef AVB_SHA2_ARMV8
+  avb_sha256_armv8_enabled = 0;
+#endif
+  printf("sha256 C      %8.1f MB/s\n", bench_sha256(buf, size, ref));
+
+#ifdef AVB_SHA2_ARMV8
+  avb_sha256_armv8_enabled = -1;
+  printf("sha256 armv8  %8.1f MB/s\n", bench_sha256(buf, size, digest));
+  if (!avb_sha256_armv8_enabled) {
+    printf("sha256 armv8  not supported by this cpu\n");
+  } else if (memcmp(ref, digest, AVB_SHA256_DIGEST_SIZE) != 0) {
+    printf("sha256 armv8  digest mismatch\n");
+    ret = 1;
+  }
+#endif
+
+  printf("sha512 C      %8.1f MB/s\n", bench_sha512(buf, size, digest));
+
+  free(buf);
+  return ret;
+}
@@ -0,0 +1,320 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Host test for the kernel decompressors in Library/lz4 and Library/zstd.
+ * Checks that each stream decodes to the expected data and that in_used
+ * ends where an appended dtb starts, with and without the LE32 size
+ * trailer that the kernel's lz4 and zstd rules append (size_append).
+ *
+ * From the top of the tree:
+ *
+ *   gcc -O2 -IQcomModulePkg/Tools/decompress_test \
+ *       -IQcomModulePkg/Library/lz4 -IQcomModulePkg/Library/zstd \
+ *       QcomModulePkg/Tools/decompress_test/decompress_test.c \
+ *       QcomModulePkg/Library/lz4/lz4.c \
+ *       QcomModulePkg/Library/zstd/zstd.c -o decompress_test
+ *
+ *   ./decompress_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "zstd.h"
+
+#define TEST_LINES 200
+#define TEST_PLAIN_SIZE 5690
+#define TEST_LEGACY_BLOCK_SIZE (8 * 1024 * 1024)
+
+typedef int (*decompress_fn)(const UINT8* in_buf,
+                             UINTN in_len,
+                             UINT8* out_buf,
+                             UINTN out_buf_len,
+                             UINTN* in_used,
+                             UINTN* out_len);
+
+/* "plain" compressed with lz4 -l -12 */
+static const unsigned char lz4_legacy_stream[] = {
+    0x02, 0x21, 0x4c, 0x18, 0xeb, 0x03, 0x00, 0x00, 0xf1, 0x0c, 0x6c, 0x69,
+    0x6e, 0x65, 0x20, 0x30, 0x20, 0x6f, 0x66, 0x20, 0x74, 0x68, 0x65, 0x20,
+    0x6b, 0x65, 0x72, 0x6e, 0x65, 0x6c, 0x20, 0x69, 0x6d, 0x61, 0x67, 0x65,
+    0x0a, 0x1b, 0x00, 0x1f, 0x31, 0x1b, 0x00, 0x07, 0x1f, 0x32, 0x1b, 0x00,
+    0x07, 0x1f, 0x33, 0x1b, 0x00, 0x07, 0x1f, 0x34, 0x1b, 0x00, 0x07, 0x1f,
+    0x35, 0x1b, 0x00, 0x07, 0x1f, 0x36, 0x1b, 0x00, 0x07, 0x1f, 0x37, 0x1b,
+    0x00, 0x07, 0x1f, 0x38, 0x1b, 0x00, 0x07, 0x1f, 0x39, 0xf3, 0x00, 0x08,
+    0x0f, 0x0f, 0x01, 0x09, 0x1f, 0x31, 0x1c, 0x00, 0x08, 0x1f, 0x32, 0x1c,
+    0x00, 0x08, 0x1f, 0x33, 0x1c, 0x00, 0x08, 0x1f, 0x34, 0x1c, 0x00, 0x08,
+    0x1f, 0x35, 0x1c, 0x00, 0x08, 0x1f, 0x36, 0x1c, 0x00, 0x08, 0x1f, 0x37,
+    0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c, 0x00, 0x08, 0x1f, 0x39, 0xf0, 0x01,
+    0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08, 0x0f, 0x28, 0x02, 0x09, 0x1f, 0x32,
+    0x1c, 0x00, 0x08, 0x1f, 0x33, 0x1c, 0x00, 0x08, 0x1f, 0x34, 0x1c, 0x00,
+    0x08, 0x1f, 0x35, 0x1c, 0x00, 0x08, 0x1f, 0x36, 0x1c, 0x00, 0x08, 0x1f,
+    0x37, 0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c, 0x00, 0x08, 0x1f, 0x39, 0xed,
+    0x02, 0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08, 0x1f, 0x31, 0x1c, 0x00, 0x08,
+    0x0f, 0x41, 0x03, 0x09, 0x1f, 0x33, 0x1c, 0x00, 0x08, 0x1f, 0x34, 0x1c,
+    0x00, 0x08, 0x1f, 0x35, 0x1c, 0x00, 0x08, 0x1f, 0x36, 0x1c, 0x00, 0x08,
+    0x1f, 0x37, 0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c, 0x00, 0x08, 0x1f, 0x39,
+    0xea, 0x03, 0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08, 0x1f, 0x31, 0x1c, 0x00,
+    0x08, 0x1f, 0x32, 0x1c, 0x00, 0x08, 0x0f, 0x5a, 0x04, 0x09, 0x1f, 0x34,
+    0x1c, 0x00, 0x08, 0x1f, 0x35, 0x1c, 0x00, 0x08, 0x1f, 0x36, 0x1c, 0x00,
+    0x08, 0x1f, 0x37, 0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c, 0x00, 0x08, 0x1f,
+    0x39, 0xe7, 0x04, 0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08, 0x1f, 0x31, 0x1c,
+    0x00, 0x08, 0x1f, 0x32, 0x1c, 0x00, 0x08, 0x1f, 0x33, 0x1c, 0x00, 0x08,
+    0x0f, 0x73, 0x05, 0x09, 0x1f, 0x35, 0x1c, 0x00, 0x08, 0x1f, 0x36, 0x1c,
+    0x00, 0x08, 0x1f, 0x37, 0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c, 0x00, 0x08,
+    0x1f, 0x39, 0xe4, 0x05, 0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08, 0x1f, 0x31,
+    0x1c, 0x00, 0x08, 0x1f, 0x32, 0x1c, 0x00, 0x08, 0x1f, 0x33, 0x1c, 0x00,
+    0x08, 0x1f, 0x34, 0x1c, 0x00, 0x08, 0x0f, 0x8c, 0x06, 0x09, 0x1f, 0x36,
+    0x1c, 0x00, 0x08, 0x1f, 0x37, 0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c, 0x00,
+    0x08, 0x1f, 0x39, 0xe1, 0x06, 0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08, 0x1f,
+    0x31, 0x1c, 0x00, 0x08, 0x1f, 0x32, 0x1c, 0x00, 0x08, 0x1f, 0x33, 0x1c,
+    0x00, 0x08, 0x1f, 0x34, 0x1c, 0x00, 0x08, 0x1f, 0x35, 0x1c, 0x00, 0x08,
+    0x0f, 0xa5, 0x07, 0x09, 0x1f, 0x37, 0x1c, 0x00, 0x08, 0x1f, 0x38, 0x1c,
+    0x00, 0x08, 0x1f, 0x39, 0xde, 0x07, 0x08, 0x1f, 0x30, 0x1c, 0x00, 0x08,
+    0x1f, 0x31, 0x1c, 0x00, 0x08, 0x1f, 0x32, 0x1c, 0x00, 0x08, 0x1f, 0x33,
+    0x1c, 0x00, 0x08, 0x1f, 0x34, 0x1c, 0x00, 0x08, 0x1f, 0x35, 0x1c, 0x00,
+    0x08, 0x1f, 0x36, 0x1c, 0x00, 0x08, 0x0f, 0xbe, 0x08, 0x09, 0x1f, 0x38,
+    0x1c, 0x00, 0x08, 0x1f, 0x39, 0xdb, 0x08, 0x08, 0x1f, 0x30, 0x1c, 0x00,
+    0x08, 0x1f, 0x31, 0x1c, 0x00, 0x08, 0x1f, 0x32, 0x1c, 0x00, 0x08, 0x1f,
+    0x33, 0x1c, 0x00, 0x08, 0x1f, 0x34, 0x1c, 0x00, 0x08, 0x1f, 0x35, 0x1c,
+    0x00, 0x08, 0x1f, 0x36, 0x1c, 0x00, 0x08, 0x1f, 0x37, 0x1c, 0x00, 0x08,
+    0x0f, 0xd7, 0x09, 0x09, 0x0f, 0xd8, 0x09, 0x0a, 0x1f, 0x30, 0x1d, 0x00,
+    0x09, 0x1f, 0x31, 0x1d, 0x00, 0x09, 0x1f, 0x32, 0x1d, 0x00, 0x09, 0x1f,
+    0x33, 0x1d, 0x00, 0x09, 0x1f, 0x34, 0x1d, 0x00, 0x09, 0x1f, 0x35, 0x1d,
+    0x00, 0x09, 0x1f, 0x36, 0x1d, 0x00, 0x09, 0x1f, 0x37, 0x1d, 0x00, 0x09,
+    0x1f, 0x38, 0x1d, 0x00, 0x09, 0x0f, 0x22, 0x01, 0x09, 0x0f, 0xfb, 0x0a,
+    0x0b, 0x0f, 0x22, 0x01, 0x09, 0x0f, 0xfd, 0x0a, 0x0a, 0x0f, 0xfe, 0x0a,
+    0x0a, 0x0f, 0xff, 0x0a, 0x0a, 0x0f, 0x00, 0x0b, 0x0a, 0x0f, 0x01, 0x0b,
+    0x0a, 0x0f, 0x02, 0x0b, 0x0a, 0x0f, 0x03, 0x0b, 0x0a, 0x1f, 0x31, 0x22,
+    0x01, 0x09, 0x0e, 0x05, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x1e, 0x0c, 0x0a,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x08, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x0a, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09,
+    0x0e, 0x0c, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x0e,
+    0x0b, 0x08, 0xea, 0x0c, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x10, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0x41, 0x0d, 0x0a, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x13,
+    0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x15, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x17, 0x0b, 0x08, 0x1d, 0x00,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x19, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x1b, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x64, 0x0e, 0x0a,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x1e, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x20, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09,
+    0x0e, 0x22, 0x0b, 0x08, 0xf6, 0x0e, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x24,
+    0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x26, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0x87, 0x0f, 0x0a, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x29,
+    0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x2b, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x2d, 0x0b, 0x08, 0x1d, 0x00,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x2f, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x31, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0xaa, 0x10, 0x0a,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x34, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x36, 0x0b, 0x08, 0x02, 0x11, 0x0f, 0x22, 0x01, 0x09,
+    0x0e, 0x38, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x3a,
+    0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x3c, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0xcd, 0x11, 0x0a, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x3f,
+    0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x41, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x43, 0x0b, 0x08, 0x1d, 0x00,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x45, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x47, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0xf0, 0x12, 0x0a,
+    0x0f, 0x22, 0x01, 0x09, 0x0e, 0x4a, 0x0b, 0x08, 0x0e, 0x13, 0x0f, 0x22,
+    0x01, 0x09, 0x0e, 0x4c, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09,
+    0x0e, 0x4e, 0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x50,
+    0x0b, 0x08, 0x1d, 0x00, 0x0f, 0x22, 0x01, 0x09, 0x0e, 0x52, 0x0b, 0x08,
+    0x1d, 0x00, 0x0f, 0x13, 0x14, 0x0a, 0x0d, 0x22, 0x01, 0x50, 0x6d, 0x61,
+    0x67, 0x65, 0x0a,
+};
+
+/* "plain" compressed with zstd -19 */
+static const unsigned char zstd_stream[] = {
+    0x28, 0xb5, 0x2f, 0xfd, 0x64, 0x3a, 0x15, 0x35, 0x07, 0x00, 0x52, 0x8f,
+    0x23, 0x14, 0x90, 0xab, 0xd8, 0x6b, 0x5d, 0x5d, 0x51, 0xcc, 0xee, 0x8e,
+    0x5b, 0xd9, 0xbd, 0x53, 0x4a, 0x89, 0xf5, 0xef, 0x83, 0x13, 0x56, 0x34,
+    0x77, 0x29, 0x77, 0x56, 0x34, 0x77, 0x29, 0x76, 0x56, 0x34, 0x77, 0x29,
+    0x75, 0x56, 0x34, 0x77, 0x29, 0x74, 0x56, 0x34, 0x77, 0x29, 0x73, 0x56,
+    0x34, 0x77, 0x29, 0x3f, 0x2b, 0x9a, 0xbb, 0x14, 0x9f, 0x15, 0xcd, 0x5d,
+    0x4a, 0xcf, 0x8a, 0xe6, 0x2e, 0x85, 0x67, 0x45, 0x73, 0x97, 0x22, 0xc2,
+    0xb3, 0xa2, 0xb9, 0x4b, 0xb9, 0xb3, 0xa2, 0xb9, 0x4b, 0xb1, 0xb3, 0xa2,
+    0xb9, 0x4b, 0xa9, 0xb3, 0xa2, 0xb9, 0x4b, 0xa1, 0xb3, 0xa2, 0xb9, 0x4b,
+    0x99, 0xb3, 0xa2, 0xb9, 0x4b, 0xf9, 0x59, 0xd1, 0xdc, 0xa5, 0xf8, 0xac,
+    0x68, 0xee, 0x52, 0x7a, 0x56, 0x34, 0x77, 0xc9, 0xb3, 0xa2, 0xb9, 0x4b,
+    0x80, 0x80, 0x10, 0x48, 0x18, 0x0e, 0x84, 0x40, 0xc1, 0x10, 0x1c, 0x0e,
+    0x41, 0xa1, 0x71, 0x0c, 0x16, 0x87, 0x1c, 0x02, 0x85, 0x01, 0x11, 0x80,
+    0xc8, 0xa8, 0x21, 0xe0, 0x67, 0xff, 0x33, 0xd0, 0x53, 0x96, 0x35, 0x11,
+    0x24, 0x04, 0xff, 0x27, 0x04, 0x1d, 0xdd, 0x07, 0x57, 0x4b, 0x62, 0x6d,
+    0x20, 0xc3, 0xb7, 0x74, 0x7c, 0xcb, 0xc6, 0xab, 0x69, 0xf8, 0x96, 0x8e,
+    0x6f, 0xd9, 0x78, 0x35, 0x0d, 0xdf, 0xd2, 0xf1, 0x2d, 0x9b, 0xe3, 0x27,
+    0x10, 0x90, 0x68, 0x59, 0xc8, 0x3c, 0x3f, 0xaa, 0xb7, 0x31, 0x7b, 0xfc,
+    0x48, 0xde, 0x46, 0xee, 0xf9, 0x29, 0x3d, 0x2b, 0x99, 0xe7, 0x47, 0x65,
+    0x9e, 0x94, 0xe0, 0x1c, 0x73, 0x32, 0x67, 0x59, 0xeb, 0x0e, 0x90, 0x2a,
+    0x44, 0x4e, 0x66, 0x38,
+};
+
+static const unsigned char dtb_magic[] = {0xd0, 0x0d, 0xfe, 0xed};
+
+static void put_le32(unsigned char* p, size_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+/* Decodes "stream" followed by an optional size trailer and dtb magic,
+ * returns 0 if the output matches "plain" and in_used ends right before
+ * the dtb.
+ */
+static int check_layout(const char* name,
+                        decompress_fn decompress,
+                        const unsigned char* stream,
+                        size_t stream_len,
+                        const unsigned char* plain,
+                        size_t plain_len,
+                        int size_trailer,
+                        int dtb) {
+  size_t in_len = stream_len + (size_trailer ? 4 : 0) + (dtb ? 4 : 0);
+  size_t expect_used = stream_len + (size_trailer ? 4 : 0);
+  unsigned char* in = malloc(in_len);
+  unsigned char* out = malloc(plain_len + 1);
+  UINTN in_used = 0;
+  UINTN out_len = 0;
+  int ret = 0;
+
+  if (in == NULL || out == NULL) {
+    fprintf(stderr, "cannot allocate %zu bytes\n", in_len + plain_len);
+    exit(1);
+  }
+  memcpy(in, stream, stream_len);
+  if (size_trailer) {
+    put_le32(in + stream_len, plain_len);
+  }
+  if (dtb) {
+    memcpy(in + expect_used, dtb_magic, sizeof(dtb_magic));
+  }
+
+  if (decompress(in, in_len, out, plain_len + 1, &in_used, &out_len)) {
+    ret = 1;
+  } else if (out_len != plain_len || memcmp(out, plain, plain_len) != 0 ||
+             in_used != expect_used) {
+    ret = 1;
+  }
+  printf("%-14s trailer %d dtb %d: %s (in_used %zu, expected %zu)\n", name,
+         size_trailer, dtb, ret ? "FAIL" : "ok", (size_t)in_used,
+         expect_used);
+
+  free(in);
+  free(out);
+  return ret;
+}
+
+static int check_all_layouts(const char* name,
+                             decompress_fn decompress,
+                             const unsigned char* stream,
+                             size_t stream_len,
+                             const unsigned char* plain,
+                             size_t plain_len) {
+  int ret = 0;
+  int size_trailer;
+  int dtb;
+
+  for (size_trailer = 0; size_trailer <= 1; size_trailer++) {
+    for (dtb = 0; dtb <= 1; dtb++) {
+      ret |= check_layout(name, decompress, stream, stream_len, plain,
+                          plain_len, size_trailer, dtb);
+    }
+  }
+  return ret;
+}
+
+/* Builds a legacy stream of one full block of literals, so that the size
+ * trailer follows a block that does not end the stream by being short.
+ */
+static unsigned char* make_full_legacy_block(const unsigned char* plain,
+                                             size_t* stream_len) {
+  size_t extra = TEST_LEGACY_BLOCK_SIZE - 15;
+  size_t block_len = 1 + extra / 255 + 1 + TEST_LEGACY_BLOCK_SIZE;
+  unsigned char* stream = malloc(8 + block_len);
+  unsigned char* p;
+
+  if (stream == NULL) {
+    fprintf(stderr, "cannot allocate %zu bytes\n", block_len);
+    exit(1);
+  }
+  put_le32(stream, LZ4_LEGACY_MAGIC);
+  put_le32(stream + 4, block_len);
+  p = stream + 8;
+  *p++ = 0xf0;
+  memset(p, 255, extra / 255);
+  p += extra / 255;
+  *p++ = extra % 255;
+  memcpy(p, plain, TEST_LEGACY_BLOCK_SIZE);
+
+  *stream_len = 8 + block_len;
+  return stream;
+}
+
+int main(void) {
+  unsigned char plain[TEST_PLAIN_SIZE + 1];
+  unsigned char* big;
+  unsigned char* stream;
+  size_t stream_len;
+  size_t pos = 0;
+  size_t i;
+  int ret = 0;
+
+  for (i = 0; i < TEST_LINES; i++) {
+    pos += snprintf((char*)plain + pos, sizeof(plain) - pos,
+                    "line %zu of the kernel image\n", i);
+  }
+  if (pos != TEST_PLAIN_SIZE) {
+    fprintf(stderr, "test data is %zu bytes, expected %d\n", pos,
+            TEST_PLAIN_SIZE);
+    return 1;
+  }
+
+  ret |= check_all_layouts("lz4 legacy", lz4_decompress, lz4_legacy_stream,
+                           sizeof(lz4_legacy_stream), plain,
+                           TEST_PLAIN_SIZE);
+  ret |= check_all_layouts("zstd", zstd_decompress, zstd_stream,
+                           sizeof(zstd_stream), plain, TEST_PLAIN_SIZE);
+
+  big = malloc(TEST_LEGACY_BLOCK_SIZE);
+  if (big == NULL) {
+    fprintf(stderr, "cannot allocate %d bytes\n", TEST_LEGACY_BLOCK_SIZE);
+    return 1;
+  }
+  for (i = 0; i < TEST_LEGACY_BLOCK_SIZE; i++) {
+    big[i] = (unsigned char)(i * 2654435761u >> 13);
+  }
+  stream = make_full_legacy_block(big, &stream_len);
+  ret |= check_all_layouts("lz4 full block", lz4_decompress, stream,
+                           stream_len, big, TEST_LEGACY_BLOCK_SIZE);
+  free(stream);
+  free(big);
+
+  printf("%s\n", ret ? "FAILED" : "PASSED");
+  return ret;
+}
@@ -0,0 +1,92 @@
+ # Copyright (c) 2015, The Linux Foundation. All rights reserved.
+ #
+ # Redistribution and use in source and binary forms, with or without
+ # modification, are permitted provided that the following conditions are
+ # met:
+ # * Redistributions of source code must retain the above copyright
+ #  notice, this list of conditions and the following disclaimer.
+ #  * Redistributions in binary form must reproduce the above
+ # copyright notice, this list of conditions and the following
+ # disclaimer in the documentation and/or other materials provided
+ #  with the distribution.
+ #   * Neither the name of The Linux Foundation nor the names of its
+ # contributors may be used to endorse or promote products derived
+ # from this software without specific prior written permission.
+ #
+ # THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ # WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ # MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ # ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ # BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ # CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ # SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ # BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ # WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ # OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ # IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Compresses a kernel Image into a gzip file made of independently
+# inflatable blocks and records the block offsets in a 'QZ' FEXTRA
+# subfield. The result is a normal gzip file, the bootloader uses the
+# index to inflate the blocks on all cores (see BootLib/Decompress.c).
+#
+# usage: gzip_index.py Image Image.gz [block size in KB, default 1024]
+
+import struct
+import sys
+import zlib
+
+INDEX_SI = b'QZ'
+MAX_BLOCKS = 4096
+
+def compress(data, block_size):
+    comp = zlib.compressobj(9, zlib.DEFLATED, -zlib.MAX_WBITS)
+    deflate = []
+    entries = []
+    in_off = 0
+    for out_off in range(0, len(data), block_size):
+        entries.append((in_off, out_off))
+        chunk = comp.compress(data[out_off:out_off + block_size])
+        if out_off + block_size < len(data):
+            chunk += comp.flush(zlib.Z_FULL_FLUSH)
+        else:
+            chunk += comp.flush(zlib.Z_FINISH)
+        deflate.append(chunk)
+        in_off += len(chunk)
+    entries.append((in_off, len(data)))
+    return b''.join(deflate), entries
+
+def main():
+    if len(sys.argv) < 3:
+        print("usage: %s Image Image.gz [block KB]" % sys.argv[0])
+        sys.exit(1)
+
+    data = open(sys.argv[1], 'rb').read()
+    block_size = 1024 * 1024
+    if len(sys.argv) > 3:
+        block_size = int(sys.argv[3]) * 1024
+    if not data or block_size <= 0:
+        print("nothing to compress")
+        sys.exit(1)
+    while (len(data) + block_size - 1) // block_size > MAX_BLOCKS:
+        block_size *= 2
+
+    deflate, entries = compress(data, block_size)
+    index = struct.pack('<I', len(entries) - 1)
+    for in_off, out_off in entries:
+        index += struct.pack('<II', in_off, out_off)
+    extra = INDEX_SI + struct.pack('<H', len(index)) + index
+
+    # FEXTRA set, mtime 0, max compression, unix
+    header = b'\x1f\x8b\x08\x04' + struct.pack('<I', 0) + b'\x02\x03'
+    header += struct.pack('<H', len(extra)) + extra
+    trailer = struct.pack('<II', zlib.crc32(data) & 0xffffffff,
+                          len(data) & 0xffffffff)
+
+    out = open(sys.argv[2], 'wb')
+    out.write(header + deflate + trailer)
+    out.close()
+    print("%d blocks of %d KB" % (len(entries) - 1, block_size // 1024))
+
+if __name__ == "__main__":
+    main()
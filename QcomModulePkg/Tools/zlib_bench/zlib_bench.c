@@ -0,0 +1,285 @@
+/* Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * * Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *   * Neither the name of The Linux Foundation nor the names of its
+ * contributors may be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Host benchmark for the bundled zlib. Inflates a gzip file, typically a
+ * kernel Image.gz, and reports the throughput of inflate, crc32 and
+ * adler32. On aarch64 hosts built with ZLIB_ARMV8 the NEON and CRC32
+ * instruction paths are measured against the C code, and all results are
+ * checked against the C code and the gzip trailer.
+ *
+ * From the top of the tree:
+ *
+ *   gcc -O2 -DZ_SOLO -IQcomModulePkg/Library/zlib \
+ *       QcomModulePkg/Tools/zlib_bench/zlib_bench.c \
+ *       QcomModulePkg/Library/zlib/adler32.c \
+ *       QcomModulePkg/Library/zlib/crc32.c \
+ *       QcomModulePkg/Library/zlib/inffast.c \
+ *       QcomModulePkg/Library/zlib/inflate.c \
+ *       QcomModulePkg/Library/zlib/inftrees.c \
+ *       QcomModulePkg/Library/zlib/zutil.c -o zlib_bench
+ *
+ * On aarch64 add -DZLIB_ARMV8,
+ * QcomModulePkg/Library/zlib/AArch64/zlib_armv8.S and
+ * QcomModulePkg/Library/Crc32Armv8Lib/AArch64/Crc32Armv8.S.
+ *
+ *   ./zlib_bench Image.gz [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "zutil.h"
+
+#define BENCH_DEFAULT_ROUNDS 10
+#define GZIP_HEADER_LEN 10
+#define GZIP_TRAILER_LEN 8
+
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int get_le32(const unsigned char* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static voidpf bench_alloc(voidpf opaque, uInt items, uInt size) {
+  return calloc(items, size);
+}
+
+static void bench_free(voidpf opaque, voidpf addr) {
+  free(addr);
+}
+
+/* Returns the length of the gzip header, 0 if it is not understood. */
+static size_t gzip_header_len(const unsigned char* buf, size_t len) {
+  size_t pos = GZIP_HEADER_LEN;
+
+  if (len < GZIP_HEADER_LEN || buf[0] != 0x1f || buf[1] != 0x8b ||
+      buf[2] != 8) {
+    return 0;
+  }
+  if (buf[3] & 0x04) {
+    if (len - pos < 2) {
+      return 0;
+    }
+    pos += 2 + (buf[pos] | (buf[pos + 1] << 8));
+  }
+  if (buf[3] & 0x08) {
+    while (pos < len && buf[pos]) {
+      pos++;
+    }
+    pos++;
+  }
+  if (buf[3] & 0x10) {
+    while (pos < len && buf[pos]) {
+      pos++;
+    }
+    pos++;
+  }
+  if (buf[3] & 0x02) {
+    pos += 2;
+  }
+
+  return pos < len ? pos : 0;
+}
+
+/* Inflates "rounds" times, returns MB/s of output or 0 on error. */
+static double bench_inflate(const unsigned char* in,
+                            size_t in_len,
+                            unsigned char* out,
+                            size_t out_size,
+                            unsigned rounds,
+                            size_t* out_len,
+                            size_t* in_used) {
+  z_stream stream;
+  double start = now_seconds();
+  unsigned i;
+
+  for (i = 0; i < rounds; i++) {
+    memset(&stream, 0, sizeof(stream));
+    stream.zalloc = bench_alloc;
+    stream.zfree = bench_free;
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+      return 0;
+    }
+    stream.next_in = (unsigned char*)in;
+    stream.avail_in = in_len;
+    stream.next_out = out;
+    stream.avail_out = out_size;
+    if (inflate(&stream, Z_NO_FLUSH) != Z_STREAM_END) {
+      inflateEnd(&stream);
+      return 0;
+    }
+    *out_len = stream.total_out;
+    *in_used = stream.total_in;
+    inflateEnd(&stream);
+  }
+
+  return *out_len * (double)rounds / (1024.0 * 1024.0) /
+         (now_seconds() - start);
+}
+
+static double bench_crc32(const unsigned char* buf,
+                          size_t len,
+                          unsigned rounds,
+                          unsigned long* crc) {
+  double start = now_seconds();
+  unsigned i;
+
+  for (i = 0; i < rounds; i++) {
+    *crc = crc32(0, buf, len);
+  }
+
+  return len * (double)rounds / (1024.0 * 1024.0) / (now_seconds() - start);
+}
+
+static double bench_adler32(const unsigned char* buf,
+                            size_t len,
+                            unsigned rounds,
+                            unsigned long* adler) {
+  double start = now_seconds();
+  unsigned i;
+
+  for (i = 0; i < rounds; i++) {
+    *adler = adler32(1, buf, len);
+  }
+
+  return len * (double)rounds / (1024.0 * 1024.0) / (now_seconds() - start);
+}
+
+int main(int argc, char** argv) {
+  unsigned rounds = argc > 2 ? strtoul(argv[2], NULL, 0) : BENCH_DEFAULT_ROUNDS;
+  unsigned char* in;
+  unsigned char* ref;
+  unsigned char* out;
+  size_t in_len;
+  size_t out_size;
+  size_t hdr_len;
+  size_t out_len = 0;
+  size_t in_used = 0;
+  unsigned long ref_crc;
+  unsigned long ref_adler;
+#ifdef ZLIB_ARMV8
+  unsigned long sum;
+#endif
+  FILE* file;
+  int ret = 0;
+
+  if (argc < 2 || rounds == 0) {
+    fprintf(stderr, "usage: %s file.gz [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  fseek(file, 0, SEEK_END);
+  in_len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  in = malloc(in_len);
+  if (in == NULL || fread(in, 1, in_len, file) != in_len) {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 1;
+  }
+  fclose(file);
+
+  hdr_len = gzip_header_len(in, in_len);
+  if (hdr_len == 0 || in_len - hdr_len < GZIP_TRAILER_LEN) {
+    fprintf(stderr, "%s is not a gzip file\n", argv[1]);
+    return 1;
+  }
+  out_size = get_le32(in + in_len - 4) + 4096;
+  ref = malloc(out_size);
+  out = malloc(out_size);
+  if (ref == NULL || out == NULL) {
+    fprintf(stderr, "cannot allocate %zu bytes\n", out_size);
+    return 1;
+  }
+
+#ifdef ZLIB_ARMV8
+  z_armv8_neon = 0;
+  z_armv8_crc32 = 0;
+#endif
+  printf("inflate C        %8.1f MB/s\n",
+         bench_inflate(in + hdr_len, in_len - hdr_len, ref, out_size, rounds,
+                       &out_len, &in_used));
+  if (out_len == 0 ||
+      hdr_len + in_used + GZIP_TRAILER_LEN > in_len) {
+    fprintf(stderr, "inflate failed\n");
+    return 1;
+  }
+  printf("crc32 C          %8.1f MB/s\n",
+         bench_crc32(ref, out_len, rounds, &ref_crc));
+  printf("adler32 C        %8.1f MB/s\n",
+         bench_adler32(ref, out_len, rounds, &ref_adler));
+  if (ref_crc != get_le32(in + hdr_len + in_used) ||
+      out_len != get_le32(in + hdr_len + in_used + 4)) {
+    printf("gzip trailer     mismatch\n");
+    ret = 1;
+  }
+
+#ifdef ZLIB_ARMV8
+  z_armv8_neon = 1;
+  z_armv8_crc32 = -1;
+  printf("inflate neon     %8.1f MB/s\n",
+         bench_inflate(in + hdr_len, in_len - hdr_len, out, out_size, rounds,
+                       &out_len, &in_used));
+  if (memcmp(ref, out, out_len) != 0) {
+    printf("inflate neon     output mismatch\n");
+    ret = 1;
+  }
+
+  printf("crc32 armv8      %8.1f MB/s\n",
+         bench_crc32(ref, out_len, rounds, &sum));
+  if (!z_armv8_crc32) {
+    printf("crc32 armv8      not supported by this cpu\n");
+  } else if (sum != ref_crc) {
+    printf("crc32 armv8      mismatch\n");
+    ret = 1;
+  }
+
+  printf("adler32 neon     %8.1f MB/s\n",
+         bench_adler32(ref, out_len, rounds, &sum));
+  if (sum != ref_adler) {
+    printf("adler32 neon     mismatch\n");
+    ret = 1;
+  }
+#endif
+
+  free(in);
+  free(ref);
+  free(out);
+  return ret;
+}